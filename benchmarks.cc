@@ -0,0 +1,391 @@
+// Copyright 2024 Google LLC
+// SPDX-License-Identifier: Apache-2.0
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks of the kernels for each weight type and, if a model is given via
+// the usual --tokenizer, --compressed_weights and --model flags, of loading,
+// prefill and decode. Results can be written as JSON or CSV with the standard
+// --benchmark_format=json|csv or --benchmark_out=<file> flags.
+//
+// Kernels use random inputs with the shapes of the 2B model. Decode is
+// measured at several context positions; the prompt leading up to it is
+// prefilled once and then restored from a PrefixCache.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+// copybara:import_next_line:gemma_cpp
+#include "compression/compress.h"
+// copybara:import_next_line:gemma_cpp
+#include "gemma.h"
+// copybara:import_next_line:gemma_cpp
+#include "ops.h"  // static dispatch
+// copybara:import_next_line:gemma_cpp
+#include "util/app.h"
+// copybara:import_next_line:gemma_cpp
+#include "util/args.h"
+#include "hwy/aligned_allocator.h"
+#include "hwy/base.h"
+#include "hwy/contrib/thread_pool/thread_pool.h"
+#include "hwy/highway.h"
+#include "hwy/timer.h"
+
+namespace gcpp {
+namespace {
+
+constexpr size_t kModelDim = 2048;
+constexpr size_t kFFHiddenDim = 16384;
+constexpr size_t kQKVDim = 256;
+constexpr size_t kVocabSize = 256128;
+
+// Set by main before any benchmark runs.
+hwy::ThreadPool* pool = nullptr;
+std::unique_ptr<LoaderArgs> loader;
+std::unique_ptr<InferenceArgs> inference;
+
+hwy::AlignedFreeUniquePtr<float[]> RandomFloats(size_t num, uint32_t seed) {
+  hwy::AlignedFreeUniquePtr<float[]> floats = hwy::AllocateAligned<float>(num);
+  HWY_ASSERT(floats);
+  std::mt19937 gen(seed);
+  std::normal_distribution<float> dist(0.0f, 0.1f);
+  for (size_t i = 0; i < num; ++i) floats[i] = dist(gen);
+  return floats;
+}
+
+template <typename MatT, size_t kCapacity>
+std::unique_ptr<CompressedArray<MatT, kCapacity>> RandomMatrix(uint32_t seed) {
+  auto mat = std::make_unique<CompressedArray<MatT, kCapacity>>();
+  const hwy::AlignedFreeUniquePtr<float[]> weights =
+      RandomFloats(kCapacity, seed);
+  CompressWorkingSet work;
+  HWY_NAMESPACE::Compress(weights.get(), kCapacity, work, kCapacity,
+                          mat->data(), 0, *pool);
+  return mat;
+}
+
+// ------------------------------ Kernels
+
+// The FFW down-projection during decode.
+template <typename MatT>
+void BM_MatVec(benchmark::State& state) {
+  constexpr size_t kOuter = kModelDim;
+  constexpr size_t kInner = kFFHiddenDim;
+  const auto mat = RandomMatrix<MatT, kOuter * kInner>(1);
+  const auto vec = RandomFloats(kInner, 2);
+  auto out = hwy::AllocateAligned<float>(kOuter);
+  for (auto _ : state) {
+    HWY_NAMESPACE::MatVec<kOuter, kInner>(*mat, 0, vec.get(), out.get(),
+                                          *pool);
+    benchmark::DoNotOptimize(out[0]);
+  }
+  state.SetBytesProcessed(state.iterations() * mat->CompressedSize());
+}
+BENCHMARK_TEMPLATE(BM_MatVec, float)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_MatVec, hwy::bfloat16_t)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_MatVec, SfpStream)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_MatVec, NuqStream)->UseRealTime();
+
+// Both halves of the FFW gating projection during decode.
+template <typename MatT>
+void BM_TwoMatVec(benchmark::State& state) {
+  constexpr size_t kOuter = kFFHiddenDim;
+  constexpr size_t kInner = kModelDim;
+  const auto mat0 = RandomMatrix<MatT, kOuter * kInner>(1);
+  const auto mat1 = RandomMatrix<MatT, kOuter * kInner>(2);
+  const auto vec = RandomFloats(kInner, 3);
+  auto out0 = hwy::AllocateAligned<float>(kOuter);
+  auto out1 = hwy::AllocateAligned<float>(kOuter);
+  for (auto _ : state) {
+    HWY_NAMESPACE::TwoMatVec<kOuter, kInner>(*mat0, *mat1, 0, vec.get(),
+                                             out0.get(), out1.get(), *pool);
+    benchmark::DoNotOptimize(out0[0]);
+    benchmark::DoNotOptimize(out1[0]);
+  }
+  state.SetBytesProcessed(state.iterations() * 2 * mat0->CompressedSize());
+}
+BENCHMARK_TEMPLATE(BM_TwoMatVec, float)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_TwoMatVec, hwy::bfloat16_t)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_TwoMatVec, SfpStream)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_TwoMatVec, NuqStream)->UseRealTime();
+
+// The FFW down-projection for a prefill batch of state.range(0) tokens.
+template <typename MatT>
+void BM_MatMul(benchmark::State& state) {
+  constexpr size_t kOuter = kModelDim;
+  constexpr size_t kInner = kFFHiddenDim;
+  const size_t num_vecs = static_cast<size_t>(state.range(0));
+  const auto mat = RandomMatrix<MatT, kOuter * kInner>(1);
+  const auto vecs = RandomFloats(num_vecs * kInner, 2);
+  auto out = hwy::AllocateAligned<float>(num_vecs * kOuter);
+  for (auto _ : state) {
+    HWY_NAMESPACE::MatMul<kOuter, kInner>(*mat, 0, vecs.get(), kInner,
+                                          num_vecs, out.get(), kOuter, *pool);
+    benchmark::DoNotOptimize(out[0]);
+  }
+  state.SetItemsProcessed(state.iterations() * num_vecs);
+}
+BENCHMARK_TEMPLATE(BM_MatMul, float)->Arg(kPrefillBatchSize)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_MatMul, hwy::bfloat16_t)
+    ->Arg(kPrefillBatchSize)
+    ->UseRealTime();
+BENCHMARK_TEMPLATE(BM_MatMul, SfpStream)
+    ->Arg(kPrefillBatchSize)
+    ->UseRealTime();
+BENCHMARK_TEMPLATE(BM_MatMul, NuqStream)
+    ->Arg(kPrefillBatchSize)
+    ->UseRealTime();
+
+// Keys or values of layer 0 and KV head 0 of `num_positions` positions in the
+// layout of KVCache, but of any element type TKV, because a KVCache only holds
+// KVT (see GEMMA_KV_T). Each page is a separate allocation of the size of a
+// KVPage of the 2B model. Positions repeat the same random vectors.
+template <typename TKV>
+class KVPages {
+ public:
+  KVPages(size_t num_positions, uint32_t seed) {
+    const size_t page_size =
+        kKVPagePositions * CreateKVPagePool(Model::GEMMA_2B)->SizeCachePos();
+    const auto floats = RandomFloats(kKVPagePositions * kQKVDim, seed);
+    for (size_t pos = 0; pos < num_positions; pos += kKVPagePositions) {
+      pages_.push_back(hwy::AllocateAligned<TKV>(page_size));
+      HWY_ASSERT(pages_.back());
+      HWY_NAMESPACE::CompressKV(floats.get(), kKVPagePositions * kQKVDim,
+                                pages_.back().get());
+    }
+  }
+
+  const TKV* operator()(size_t pos) const {
+    return pages_[pos / kKVPagePositions].get() +
+           (pos % kKVPagePositions) * kQKVDim;
+  }
+
+ private:
+  std::vector<hwy::AlignedFreeUniquePtr<TKV[]>> pages_;
+};
+
+// One query head attending to state.range(0) positions of a paged KV cache of
+// TKV, one page-sized tile at a time as in AttentionBatch. For KVT, the keys
+// and values are those of a KVCache.
+template <typename TKV>
+void BM_Attention(benchmark::State& state) {
+  const size_t num_positions = static_cast<size_t>(state.range(0));
+  const auto q = RandomFloats(kQKVDim, 3);
+  auto out = hwy::AllocateAligned<float>(kQKVDim);
+  HWY_ALIGN float scores[kKVPagePositions];
+  const auto run = [&](const auto& keys, const auto& values) {
+    for (auto _ : state) {
+      hwy::ZeroBytes(out.get(), kQKVDim * sizeof(float));
+      HWY_NAMESPACE::OnlineSoftmaxState softmax;
+      for (size_t start = 0; start < num_positions;
+           start += kKVPagePositions) {
+        const size_t num = HWY_MIN(kKVPagePositions, num_positions - start);
+        HWY_NAMESPACE::AttendTile<kQKVDim>(
+            q.get(), num, [&](size_t i) { return keys(start + i); },
+            [&](size_t i) { return values(start + i); }, scores, softmax,
+            out.get());
+      }
+      HWY_NAMESPACE::MulByConst(1.0f / softmax.sum, out.get(), kQKVDim);
+      benchmark::DoNotOptimize(out[0]);
+    }
+  };
+
+  if constexpr (hwy::IsSame<TKV, KVT>()) {
+    KVCache kv_cache = CreateKVCache(Model::GEMMA_2B);
+    kv_cache.Reserve(num_positions);
+    const auto keys = RandomFloats(kKVPagePositions * kQKVDim, 1);
+    const auto values = RandomFloats(kKVPagePositions * kQKVDim, 2);
+    for (size_t pos = 0; pos < num_positions; ++pos) {
+      const size_t ofs = (pos % kKVPagePositions) * kQKVDim;
+      HWY_NAMESPACE::CompressKV(keys.get() + ofs, kQKVDim,
+                                kv_cache.Keys(0, 0, pos));
+      HWY_NAMESPACE::CompressKV(values.get() + ofs, kQKVDim,
+                                kv_cache.Values(0, 0, pos));
+    }
+    run([&](size_t pos) { return kv_cache.Keys(0, 0, pos); },
+        [&](size_t pos) { return kv_cache.Values(0, 0, pos); });
+  } else {
+    run(KVPages<TKV>(num_positions, 1), KVPages<TKV>(num_positions, 2));
+  }
+  state.SetItemsProcessed(state.iterations() * num_positions);
+}
+BENCHMARK_TEMPLATE(BM_Attention, float)->Arg(256)->Arg(1024)->Arg(4096);
+BENCHMARK_TEMPLATE(BM_Attention, hwy::bfloat16_t)
+    ->Arg(256)
+    ->Arg(1024)
+    ->Arg(4096);
+
+void BM_Softmax(benchmark::State& state) {
+  auto logits = RandomFloats(kVocabSize, 1);
+  for (auto _ : state) {
+    // Its output is again a valid input.
+    HWY_NAMESPACE::Softmax(logits.get(), kVocabSize);
+    benchmark::DoNotOptimize(logits[0]);
+  }
+  state.SetItemsProcessed(state.iterations() * kVocabSize);
+}
+BENCHMARK(BM_Softmax);
+
+template <size_t k>
+void BM_SampleTopK(benchmark::State& state) {
+  auto probabilities = RandomFloats(kVocabSize, 1);
+  HWY_NAMESPACE::Softmax(probabilities.get(), kVocabSize);
+  std::mt19937 gen(42);
+  const auto accept_token = [](int) { return true; };
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(HWY_NAMESPACE::SampleTopK<k>(
+        probabilities.get(), kVocabSize, gen, /*temperature=*/1.0f,
+        accept_token));
+  }
+  state.SetItemsProcessed(state.iterations() * kVocabSize);
+}
+BENCHMARK_TEMPLATE(BM_SampleTopK, 1);
+BENCHMARK_TEMPLATE(BM_SampleTopK, 40);
+
+// ------------------------------ Model
+
+// Created on first use, i.e. after BM_Load so that it does not have to share
+// memory with a second copy of the weights.
+Gemma& SharedModel() {
+  static Gemma* model = new Gemma(*loader, *pool);
+  return *model;
+}
+
+// Prompt of `num` arbitrary tokens other than BOS/EOS.
+std::vector<int> RandomPrompt(size_t num, uint32_t seed) {
+  std::mt19937 gen(seed);
+  std::uniform_int_distribution<int> dist(3, 20000);
+  std::vector<int> prompt(num);
+  for (int& token : prompt) token = dist(gen);
+  return prompt;
+}
+
+void BM_Load(benchmark::State& state) {
+  for (auto _ : state) {
+    Gemma model(*loader, *pool);
+    benchmark::DoNotOptimize(&model);
+  }
+}
+
+// Prefill of state.range(0) tokens into an empty KV cache.
+void BM_Prefill(benchmark::State& state) {
+  const Gemma& model = SharedModel();
+  const size_t num_tokens = static_cast<size_t>(state.range(0));
+  // +1 because PrefillChunk leaves the last token for generation.
+  const std::vector<int> prompt = RandomPrompt(num_tokens + 1, 1);
+  // Reused so that pages are only allocated in the first iteration.
+  const std::shared_ptr<KVPagePool> kv_pool =
+      CreateKVPagePool(model.model_type);
+  Session session(model, kv_pool);
+  for (auto _ : state) {
+    KVCache kv_cache = CreateKVCache(model.model_type, kv_pool);
+    size_t num_prefilled = 0;
+    PrefillChunk(model, session, prompt, 0, num_prefilled, kv_cache,
+                 num_tokens, *pool);
+    HWY_ASSERT(num_prefilled == num_tokens);
+  }
+  state.counters["tokens_per_sec"] = benchmark::Counter(
+      static_cast<double>(state.iterations() * num_tokens),
+      benchmark::Counter::kIsRate);
+}
+
+// Generates kDecodeTokens tokens after a prompt of state.range(0) tokens.
+// Only the decode steps are timed.
+void BM_Decode(benchmark::State& state) {
+  constexpr size_t kDecodeTokens = 32;
+  Gemma& model = SharedModel();
+  const size_t num_positions = static_cast<size_t>(state.range(0));
+  const std::vector<int> prompt = RandomPrompt(num_positions, 2);
+  PrefixCache prefix_cache;
+  InferenceArgs args = *inference;
+  args.max_tokens = num_positions + kDecodeTokens + 1;
+  args.max_generated_tokens = kDecodeTokens + 1;
+  hwy::ThreadPool inner_pool(0);
+  std::mt19937 gen(42);
+
+  size_t num_generated = 0;
+  for (auto _ : state) {
+    size_t num_streamed = 0;
+    double decode_start = 0.0;
+    double decode_end = 0.0;
+    const auto stream_token = [&](int, float) {
+      // The call for the last prompt token marks the first decode step.
+      if (++num_streamed == prompt.size()) {
+        decode_start = hwy::platform::Now();
+      }
+      decode_end = hwy::platform::Now();
+      return true;
+    };
+    // Excluding EOS ensures that all kDecodeTokens are generated.
+    GenerateGemma(model, args, prompt, 0, *pool, inner_pool, stream_token,
+                  [](int token) { return token != EOS_ID; }, gen,
+                  /*verbosity=*/0, &prefix_cache);
+    HWY_ASSERT(num_streamed > prompt.size());
+    num_generated += num_streamed - prompt.size();
+    state.SetIterationTime(decode_end - decode_start);
+  }
+  state.counters["tokens_per_sec"] = benchmark::Counter(
+      static_cast<double>(num_generated), benchmark::Counter::kIsRate);
+}
+
+void RegisterModelBenchmarks() {
+  benchmark::RegisterBenchmark("BM_Load", BM_Load)
+      ->Iterations(1)
+      ->UseRealTime()
+      ->Unit(benchmark::kMillisecond);
+  benchmark::RegisterBenchmark("BM_Prefill", BM_Prefill)
+      ->Arg(16)
+      ->Arg(64)
+      ->Arg(256)
+      ->Arg(1024)
+      ->UseRealTime()
+      ->Unit(benchmark::kMillisecond);
+  // GenerateGemma only caches prompts that prefill at least one KV page, i.e.
+  // have more than kKVPagePositions tokens.
+  benchmark::RegisterBenchmark("BM_Decode", BM_Decode)
+      ->Arg(kKVPagePositions + 1)
+      ->Arg(1024)
+      ->Arg(4096)
+      ->UseManualTime()
+      ->Unit(benchmark::kMillisecond);
+}
+
+}  // namespace
+}  // namespace gcpp
+
+int main(int argc, char** argv) {
+  // Removes the --benchmark_* flags; ours are ignored by the benchmark library.
+  benchmark::Initialize(&argc, argv);
+
+  gcpp::AppArgs app(argc, argv);
+  hwy::ThreadPool pool(app.num_threads);
+  gcpp::pool = &pool;
+  gcpp::loader = std::make_unique<gcpp::LoaderArgs>(argc, argv);
+  gcpp::inference = std::make_unique<gcpp::InferenceArgs>(argc, argv);
+  if (gcpp::loader->Validate() == nullptr) {
+    gcpp::RegisterModelBenchmarks();
+  } else {
+    fprintf(stderr, "No valid model arguments, only running the kernels.\n");
+  }
+
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
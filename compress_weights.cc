@@ -0,0 +1,134 @@
+// Copyright 2024 Google LLC
+// SPDX-License-Identifier: Apache-2.0
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Converts uncompressed weights to a compressed weights file for
+// --compressed_weights, one layer at a time. Needs far less memory than
+// letting the gemma binary regenerate the file.
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include <string>
+#include <thread>  // NOLINT
+
+// copybara:import_next_line:gemma_cpp
+#include "gemma.h"  // CompressWeights
+// copybara:import_next_line:gemma_cpp
+#include "util/args.h"
+#include "hwy/base.h"
+#include "hwy/contrib/thread_pool/thread_pool.h"
+#include "hwy/timer.h"
+
+namespace gcpp {
+
+class CompressArgs : public ArgsBase<CompressArgs> {
+ public:
+  CompressArgs(int argc, char* argv[]) { InitAndParse(argc, argv); }
+
+  Path weights;
+  Path compressed_weights;
+  std::string model_type;
+  std::string weight_type;
+  bool refine_nuq;
+  size_t num_threads;
+
+  // Returns error string or nullptr if OK.
+  const char* Validate() const {
+    const std::string model_type_lc = LoaderArgs::ToLower(model_type);
+    if (model_type_lc != "2b-pt" && model_type_lc != "7b-pt" &&
+        model_type_lc != "2b-it" && model_type_lc != "7b-it") {
+      return "Model type must be 2b-pt, 7b-pt, 2b-it, or 7b-it.";
+    }
+    gcpp::WeightType type;
+    if (!weight_type.empty() &&
+        !ParseWeightType(LoaderArgs::ToLower(weight_type), type)) {
+      return "Weight type must be f32, bf16, sfp, nuq, bf16-sfp, bf16-nuq or "
+             "i8.";
+    }
+    if (weights.path.empty()) {
+      return "Missing --weights flag, the uncompressed weights to convert.";
+    }
+    if (compressed_weights.path.empty()) {
+      return "Missing --compressed_weights flag, the file to write.";
+    }
+    return nullptr;
+  }
+
+  gcpp::Model ModelType() const {
+    const std::string model_type_lc = LoaderArgs::ToLower(model_type);
+    return model_type_lc.rfind("2b", 0) == 0 ? gcpp::Model::GEMMA_2B
+                                             : gcpp::Model::GEMMA_7B;
+  }
+
+  gcpp::WeightType WeightType() const {
+    gcpp::WeightType type;
+    if (ParseWeightType(LoaderArgs::ToLower(weight_type), type)) return type;
+    return WeightTypeOf<WeightT>();
+  }
+
+  template <class Visitor>
+  void ForEach(const Visitor& visitor) {
+    visitor(weights, "weights", Path(),
+            "Path name of uncompressed model weights (.sbs) file. (required)");
+    visitor(compressed_weights, "compressed_weights", Path(),
+            "Path name of compressed weights file to create or replace. "
+            "(required)");
+    visitor(model_type, "model", std::string(),
+            "Model type - can be 2b-it, 2b-pt, 7b-it or 7b-pt. (required)");
+    visitor(weight_type, "weight_type", std::string(),
+            "Weight type (f32, bf16, sfp, nuq, bf16-sfp, bf16-nuq or i8). "
+            "bf16-* keep attention in bf16 and compress only the FFW. Defaults "
+            "to the type chosen at compile time.");
+    visitor(refine_nuq, "refine_nuq", false,
+            "Reassign NUQ-compressed weights to the nearest rounded cluster "
+            "center. More accurate, but slower.");
+    visitor(num_threads, "num_threads", size_t{0},
+            "Number of threads for compression, or 0 for all cores.");
+  }
+};
+
+}  // namespace gcpp
+
+int main(int argc, char** argv) {
+  gcpp::CompressArgs args(argc, argv);
+  if (gcpp::HasHelp(argc, argv)) {
+    fprintf(stderr, "\ncompress_weights\n----------------\n\n");
+    args.Help();
+    return 0;
+  }
+  if (const char* error = args.Validate()) {
+    args.Help();
+    HWY_ABORT("\nInvalid args: %s", error);
+  }
+
+  const size_t num_threads =
+      args.num_threads != 0
+          ? args.num_threads
+          : HWY_MAX(size_t{1},
+                    static_cast<size_t>(std::thread::hardware_concurrency()));
+  hwy::ThreadPool pool(num_threads);
+
+  const double t0 = hwy::platform::Now();
+  if (!gcpp::CompressWeights(args.ModelType(), args.WeightType(), args.weights,
+                             args.compressed_weights, args.refine_nuq,
+                             pool)) {
+    return 1;
+  }
+  fprintf(stderr, "Wrote %s (%s) in %.1f s\n",
+          args.compressed_weights.path.c_str(),
+          gcpp::WeightTypeName(args.WeightType()),
+          hwy::platform::Now() - t0);
+  return 0;
+}
@@ -19,10 +19,13 @@
 #include <fcntl.h>  // open
 #include <stdint.h>
 #include <stdio.h>     // SEEK_END - unistd isn't enough for IDE.
+#include <sys/mman.h>  // mmap
 #include <sys/stat.h>  // O_RDONLY
 #include <unistd.h>    // read, close
 
+#include <algorithm>
 #include <atomic>
+#include <memory>
 #include <vector>
 
 #include "hwy/aligned_allocator.h"
@@ -119,11 +122,9 @@ static_assert(HWY_IS_LITTLE_ENDIAN, "Assumes little endian");
 class BlobStore {
   static constexpr uint32_t kMagic = 0x0A534253;  // SBS\n
 
-  // Blob offsets on disk and memory addresses are a multiple of this, because
-  // we pad the header and each blob's size. This matches CUDA alignment and the
-  // maximum SVE vector size, and exceeds typical x86 cache line sizes (64 or
-  // 128), which can help performance.
-  static constexpr size_t kAlign = 256;
+  // Minimum alignment of the header size and blob offsets. Writers may choose
+  // a larger multiple, see BlobWriter.
+  static constexpr size_t kAlign = kBlobAlign;
 
  public:
   // NOT including padding, so that we can also use ZeroFillPadding after
@@ -153,15 +154,17 @@ class BlobStore {
     if (num_blobs_ == 0) return __LINE__;
     if (file_size_ != file_size) return __LINE__;
 
-    // Ensure blobs are back to back, and zero-pad.
+    // Zero-pad the header. Ensure blobs are in order, aligned and within the
+    // file. Their padding may exceed kAlign if the writer used a larger
+    // alignment.
     uint64_t offset = ZeroFillPadding(HeaderSize(num_blobs_));
     for (size_t i = 0; i < num_blobs_; ++i) {
       const hwy::uint128_t val = keys_[num_blobs_ + i];
-      if (val.lo != offset) return __LINE__;
-      offset = ZeroFillPadding(offset + val.hi);
+      if (val.lo < offset || val.lo % kAlign != 0) return __LINE__;
+      offset = hwy::RoundUpTo(val.lo + val.hi, kAlign);
     }
 
-    if (offset != file_size_) return __LINE__;
+    if (offset > file_size_) return __LINE__;
 
     return 0;  // all OK
   }
@@ -173,11 +176,21 @@ class BlobStore {
     return BlobStorePtr(new (bytes) BlobStore(), hwy::AlignedFreer());
   }
 
-  static std::vector<BlobIO> PrepareWriteRequests(
-      const hwy::uint128_t keys[], const hwy::Span<uint8_t> blobs[],
-      size_t num_blobs) {
+  // Allocates and fills the header for blobs with the given keys and sizes,
+  // which are stored in this order, each aligned as described at BlobWriter.
+  // Sets `total_size` to that of the file.
+  static BlobStorePtr PrepareHeader(const hwy::uint128_t keys[],
+                                    const uint64_t sizes[], size_t num_blobs,
+                                    size_t alignment, size_t large_alignment,
+                                    uint64_t& total_size) {
     // Sanity check and ensure the cast below is safe.
     HWY_ASSERT(num_blobs < (1ULL << 20));
+    HWY_ASSERT(alignment != 0 && alignment % kAlign == 0);
+    HWY_ASSERT(large_alignment != 0 && large_alignment % kAlign == 0);
+    const auto blob_alignment = [=](uint64_t size) {
+      return size >= large_alignment ? HWY_MAX(alignment, large_alignment)
+                                     : alignment;
+    };
 
     // Allocate var-length header.
     const size_t header_size = HeaderSize(num_blobs);
@@ -186,50 +199,56 @@ class BlobStore {
     const uint64_t padded_header_end = bs->ZeroFillPadding(header_size);
     HWY_ASSERT(padded_header_end == padded_header_size);
 
-    // All-zero buffer used to write padding to the file without copying the
-    // input blobs.
-    static uint8_t zeros[kAlign] = {0};
-
-    // Total file size will be the header plus all padded blobs.
-    uint64_t payload = 0;
-    for (size_t i = 0; i < num_blobs; ++i) {
-      payload += hwy::RoundUpTo(blobs[i].size(), kAlign);
-    }
-    const size_t total_size = padded_header_size + payload;
-
     // Fill header.
     bs->magic_ = kMagic;
     bs->num_blobs_ = static_cast<uint32_t>(num_blobs);
-    bs->file_size_ = total_size;
     hwy::CopyBytes(keys, bs->keys_, num_blobs * sizeof(keys[0]));
 
-    // First IO request is for the header (not yet filled!).
-    std::vector<BlobIO> requests;
-    requests.reserve(1 + 2 * num_blobs);
-    requests.emplace_back(/*offset=*/0, padded_header_size,
-                          reinterpret_cast<uint8_t*>(bs.get()), 0);
-
-    // Fill second half of keys_ with offset/size and prepare IO requests.
+    // Fill second half of keys_ with offset/size. Each blob is padded to the
+    // alignment of the next, and the last to `alignment`.
     uint64_t offset = padded_header_end;
     for (size_t i = 0; i < num_blobs; ++i) {
+      offset = hwy::RoundUpTo(offset, blob_alignment(sizes[i]));
       bs->keys_[num_blobs + i].lo = offset;
-      bs->keys_[num_blobs + i].hi = blobs[i].size();
-
-      EnqueueChunkRequests(offset, blobs[i].size(), blobs[i].data(), requests);
-      offset += blobs[i].size();
-      const size_t padded_size = hwy::RoundUpTo(blobs[i].size(), kAlign);
-      if (padded_size != blobs[i].size()) {
-        const size_t padding = padded_size - blobs[i].size();
-        HWY_ASSERT(padding <= kAlign);
-        requests.emplace_back(offset, padding, zeros, 0);
-        offset += padding;
-      }
+      bs->keys_[num_blobs + i].hi = sizes[i];
+      offset += sizes[i];
+    }
+
+    // Total file size is the header plus all padded blobs.
+    total_size = hwy::RoundUpTo(offset, alignment);
+    bs->file_size_ = total_size;
+    return bs;
+  }
+
+  // Returns write requests for the header, which is allocated into `bs`, and
+  // all blobs. Padding is not written; the caller extends the file to
+  // `total_size`, so that padding reads as zero without occupying disk space.
+  static std::vector<BlobIO> PrepareWriteRequests(
+      const hwy::uint128_t keys[], const hwy::Span<uint8_t> blobs[],
+      size_t num_blobs, size_t alignment, size_t large_alignment,
+      BlobStorePtr& bs, uint64_t& total_size) {
+    std::vector<uint64_t> sizes(num_blobs);
+    for (size_t i = 0; i < num_blobs; ++i) {
+      sizes[i] = blobs[i].size();
     }
+    bs = PrepareHeader(keys, sizes.data(), num_blobs, alignment,
+                       large_alignment, total_size);
 
-    HWY_ASSERT(offset == total_size);
+    // First IO request is for the header.
+    std::vector<BlobIO> requests;
+    requests.reserve(1 + num_blobs);
+    requests.emplace_back(/*offset=*/0, bs->PaddedHeaderSize(),
+                          reinterpret_cast<uint8_t*>(bs.get()), 0);
+    for (size_t i = 0; i < num_blobs; ++i) {
+      EnqueueChunkRequests(bs->BlobOffset(i), blobs[i].size(), blobs[i].data(),
+                           requests);
+    }
     return requests;
   }
 
+  // Offset within the file of the i-th blob.
+  uint64_t BlobOffset(size_t i) const { return keys_[num_blobs_ + i].lo; }
+
   bool FindKey(const hwy::uint128_t key, uint64_t& offset, size_t& size) const {
     for (size_t i = 0; i < num_blobs_; ++i) {
       if (keys_[i] == key) {
@@ -251,7 +270,13 @@ class BlobStore {
 };
 #pragma pack(pop)
 
-BlobError BlobReader::Open(const char* filename) {
+MappedFile::~MappedFile() {
+  if (data_ != nullptr) {
+    HWY_ASSERT(munmap(data_, size_) == 0);
+  }
+}
+
+BlobError BlobReader::Open(const char* filename, bool map) {
   fd_ = open(filename, O_RDONLY);
   if (fd_ < 0) return __LINE__;
 
@@ -279,7 +304,23 @@ BlobError BlobReader::Open(const char* filename) {
     return __LINE__;
   }
 
-  return blob_store_->CheckValidity(IO::FileSize(filename));
+  const uint64_t file_size = IO::FileSize(filename);
+  const BlobError err = blob_store_->CheckValidity(file_size);
+  if (err != 0 || !map) return err;
+
+  // Private, so that the pointers can be non-const, but pages are only
+  // copied if written, which the weights never are.
+  void* mapped = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                      fd_, 0);
+  if (mapped == MAP_FAILED) return __LINE__;
+  mapping_ = std::make_unique<MappedFile>(static_cast<uint8_t*>(mapped),
+                                          file_size);
+#ifdef MADV_HUGEPAGE
+  // Best effort: only has an effect if the kernel supports huge pages for
+  // file mappings.
+  (void)madvise(mapped, file_size, MADV_HUGEPAGE);
+#endif
+  return 0;
 }
 
 BlobReader::~BlobReader() {
@@ -299,18 +340,40 @@ BlobError BlobReader::Enqueue(hwy::uint128_t key, void* data, size_t size) {
   return 0;
 }
 
+BlobError BlobReader::BlobSize(hwy::uint128_t key, size_t& size) const {
+  uint64_t offset;
+  if (!blob_store_->FindKey(key, offset, size)) return __LINE__;
+  return 0;
+}
+
+BlobError BlobReader::Map(hwy::uint128_t key, size_t size,
+                          uint8_t*& data) const {
+  if (!mapping_) return __LINE__;
+  uint64_t offset;
+  size_t actual_size;
+  if (!blob_store_->FindKey(key, offset, actual_size)) return __LINE__;
+  if (actual_size != size) return __LINE__;
+  if (offset + size > mapping_->size()) return __LINE__;
+
+  data = mapping_->data() + offset;
+  return 0;
+}
+
 // Parallel synchronous I/O. Alternatives considered:
 // - readv is limited to 0x7FFFF000 bytes on Linux (even 64-bit). Note that
 //   pread calls preadv with a single iovec.
 // - O_DIRECT seems undesirable because we do want to use the OS cache
 //   between consecutive runs.
-// - memory-mapped I/O is less predictable and adds noise to measurements.
-BlobError BlobReader::ReadAll(hwy::ThreadPool& pool) {
+// - memory-mapped I/O is less predictable and adds noise to measurements, so
+//   it is only used if requested via Open (see Map).
+BlobError BlobReader::ReadRange(hwy::ThreadPool& pool, size_t begin,
+                                size_t end) {
+  HWY_ASSERT(begin <= end && end <= requests_.size());
   const int fd = fd_;
   const auto& requests = requests_;
   std::atomic_flag err = ATOMIC_FLAG_INIT;
   // >5x speedup from parallel reads when cached.
-  pool.Run(0, requests.size(),
+  pool.Run(begin, end,
            [fd, &requests, &err](uint64_t i, size_t /*thread*/) {
              if (!IO::Read(fd, requests[i].offset, requests[i].size,
                            requests[i].data)) {
@@ -321,28 +384,94 @@ BlobError BlobReader::ReadAll(hwy::ThreadPool& pool) {
   return 0;
 }
 
+// Writes the requests in parallel, setting `err` on failure.
+static void WriteRequests(hwy::ThreadPool& pool, int fd,
+                          const std::vector<BlobIO>& requests,
+                          std::atomic_flag& err) {
+  pool.Run(0, requests.size(),
+           [fd, &requests, &err](uint64_t i, size_t /*thread*/) {
+             if (!IO::Write(requests[i].data, requests[i].size,
+                            requests[i].offset, fd)) {
+               err.test_and_set();
+             }
+           });
+}
+
 BlobError BlobWriter::WriteAll(hwy::ThreadPool& pool,
                                const char* filename) const {
   HWY_ASSERT(keys_.size() == blobs_.size());
 
   // Concatenate blobs in memory.
+  BlobStorePtr bs;
+  uint64_t total_size;
   std::vector<BlobIO> requests = BlobStore::PrepareWriteRequests(
-      keys_.data(), blobs_.data(), keys_.size());
+      keys_.data(), blobs_.data(), keys_.size(), alignment_, large_alignment_,
+      bs, total_size);
 
   // Create/replace existing file.
   const int fd = open(filename, O_CREAT | O_RDWR | O_TRUNC, 0644);
   if (fd < 0) return __LINE__;
 
   std::atomic_flag err = ATOMIC_FLAG_INIT;
-  pool.Run(0, requests.size(),
-           [fd, &requests, &err](uint64_t i, size_t /*thread*/) {
-             if (!IO::Write(requests[i].data, requests[i].size,
-                            requests[i].offset, fd)) {
-               err.test_and_set();
-             }
-           });
+  WriteRequests(pool, fd, requests, err);
+  // Extends the file to include the trailing padding, if any.
+  if (ftruncate(fd, static_cast<off_t>(total_size)) != 0) err.test_and_set();
+  if (close(fd) != 0) err.test_and_set();
   if (err.test_and_set()) return __LINE__;
   return 0;
 }
 
+BlobStreamWriter::~BlobStreamWriter() {
+  if (fd_ >= 0) {
+    HWY_ASSERT(close(fd_) != -1);
+  }
+}
+
+BlobError BlobStreamWriter::Open(const char* filename) {
+  HWY_ASSERT(fd_ < 0 && !keys_.empty());
+  bs_ = BlobStore::PrepareHeader(keys_.data(), sizes_.data(), keys_.size(),
+                                 alignment_, large_alignment_, total_size_);
+  written_.assign(keys_.size(), false);
+
+  // Create/replace existing file.
+  fd_ = open(filename, O_CREAT | O_RDWR | O_TRUNC, 0644);
+  if (fd_ < 0) return __LINE__;
+  return 0;
+}
+
+BlobError BlobStreamWriter::Write(hwy::ThreadPool& pool, hwy::uint128_t key,
+                                  const void* data, size_t size) {
+  HWY_ASSERT(fd_ >= 0);
+  const size_t idx = static_cast<size_t>(
+      std::find(keys_.begin(), keys_.end(), key) - keys_.begin());
+  if (idx == keys_.size() || written_[idx]) return __LINE__;
+  if (sizes_[idx] != size) return __LINE__;
+
+  // IO::Write does not modify the data.
+  std::vector<BlobIO> requests;
+  EnqueueChunkRequests(bs_->BlobOffset(idx), size,
+                       static_cast<uint8_t*>(const_cast<void*>(data)),
+                       requests);
+  std::atomic_flag err = ATOMIC_FLAG_INIT;
+  WriteRequests(pool, fd_, requests, err);
+  if (err.test_and_set()) return __LINE__;
+  written_[idx] = true;
+  bytes_written_ += size;
+  return 0;
+}
+
+BlobError BlobStreamWriter::Finish() {
+  HWY_ASSERT(fd_ >= 0);
+  const int fd = fd_;
+  fd_ = -1;
+  bool ok =
+      std::find(written_.begin(), written_.end(), false) == written_.end();
+  // Written last, so that the file is invalid until all blobs are present.
+  ok = ok && IO::Write(bs_.get(), bs_->PaddedHeaderSize(), 0, fd);
+  // Extends the file to include the trailing padding, if any.
+  ok = ok && ftruncate(fd, static_cast<off_t>(total_size_)) == 0;
+  ok = (close(fd) == 0) && ok;
+  return ok ? 0 : __LINE__;
+}
+
 }  // namespace gcpp
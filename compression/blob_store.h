@@ -19,6 +19,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <memory>
+#include <utility>
 #include <vector>
 
 #include "hwy/aligned_allocator.h"
@@ -40,6 +42,35 @@ using BlobStorePtr = hwy::AlignedFreeUniquePtr<BlobStore>;
 // 0 if successful, otherwise the line number of the failing check.
 using BlobError = int;
 
+// Blob offsets on disk and memory addresses are a multiple of this, because
+// we pad the header and each blob's size. This matches CUDA alignment and the
+// maximum SVE vector size, and exceeds typical x86 cache line sizes (64 or
+// 128), which can help performance.
+constexpr size_t kBlobAlign = 256;
+
+// Alignment of large blobs, e.g. tensors, in files that are likely to be
+// memory-mapped. Such blobs then start on a (transparent) huge page boundary.
+// The padding is written as file holes, so it does not occupy disk space.
+constexpr size_t kBlobAlignHugePage = 2 * 1024 * 1024;
+
+// Private (copy-on-write) mapping of an entire file, unmapped on destruction.
+// Until written, which blobs such as weights never are, pages are shared with
+// the OS page cache and thus with other processes mapping the same file.
+class MappedFile {
+ public:
+  MappedFile(uint8_t* data, uint64_t size) : data_(data), size_(size) {}
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  uint8_t* data() const { return data_; }
+  uint64_t size() const { return size_; }
+
+ private:
+  uint8_t* data_;
+  uint64_t size_;
+};
+
 struct BlobIO {
   BlobIO(uint64_t offset, size_t size, void* data, uint64_t padding)
       : offset(offset), size(size), data(data), padding(padding) {}
@@ -55,23 +86,52 @@ class BlobReader {
   BlobReader() { requests_.reserve(500); }
   ~BlobReader();
 
-  // Opens `filename` and reads its header.
-  BlobError Open(const char* filename);
+  // Opens `filename` and reads its header. If `map`, also memory-maps the
+  // entire file so that blobs can be accessed via `Map` without copying.
+  BlobError Open(const char* filename, bool map = false);
 
   // Enqueues read requests if `key` is found and its size matches `size`.
   BlobError Enqueue(hwy::uint128_t key, void* data, size_t size);
 
+  // Sets `size` to that of the blob `key`, if found.
+  BlobError BlobSize(hwy::uint128_t key, size_t& size) const;
+
   // Reads all enqueued requests.
-  BlobError ReadAll(hwy::ThreadPool& pool);
+  BlobError ReadAll(hwy::ThreadPool& pool) {
+    return ReadRange(pool, 0, requests_.size());
+  }
+
+  // Reads the enqueued requests [begin, end), e.g. one layer at a time.
+  // Tensors larger than 4 MiB are split into several requests.
+  BlobError ReadRange(hwy::ThreadPool& pool, size_t begin, size_t end);
+  size_t NumRequests() const { return requests_.size(); }
+
+  // Sets `data` to the blob within the mapping if `key` is found and its size
+  // matches `size`. Requires Open with `map`. The pointer is valid for as long
+  // as the MappedFile, see ReleaseMapping.
+  BlobError Map(hwy::uint128_t key, size_t size, uint8_t*& data) const;
+
+  // Transfers ownership of the mapping, e.g. to the owner of the weights that
+  // point into it. Returns nullptr if the file was not mapped.
+  std::unique_ptr<MappedFile> ReleaseMapping() { return std::move(mapping_); }
 
  private:
   BlobStorePtr blob_store_;  // holds header, not the entire file
   std::vector<BlobIO> requests_;
-  int fd_ = 0;
+  std::unique_ptr<MappedFile> mapping_;
+  int fd_ = -1;
 };
 
 class BlobWriter {
  public:
+  // `alignment` of each blob within the file must be a multiple of
+  // kBlobAlign. Blobs of at least `large_alignment` bytes are aligned to the
+  // larger of both, e.g. kBlobAlignHugePage for tensors that may be mapped,
+  // without padding the small blobs as much.
+  explicit BlobWriter(size_t alignment = kBlobAlign,
+                      size_t large_alignment = kBlobAlign)
+      : alignment_(alignment), large_alignment_(large_alignment) {}
+
   void Add(hwy::uint128_t key, void* data, size_t size) {
     keys_.push_back(key);
     blobs_.emplace_back(static_cast<uint8_t*>(data), size);
@@ -81,10 +141,60 @@ class BlobWriter {
   BlobError WriteAll(hwy::ThreadPool& pool, const char* filename) const;
 
  private:
+  size_t alignment_;
+  size_t large_alignment_;
   std::vector<hwy::uint128_t> keys_;
   std::vector<hwy::Span<uint8_t>> blobs_;
 };
 
+// Writes blobs one at a time, so that they need not all be in memory at once,
+// in the same format as BlobWriter. All keys and sizes must be declared up
+// front because they determine the file layout.
+class BlobStreamWriter {
+ public:
+  // As for BlobWriter.
+  explicit BlobStreamWriter(size_t alignment = kBlobAlign,
+                            size_t large_alignment = kBlobAlign)
+      : alignment_(alignment), large_alignment_(large_alignment) {}
+  ~BlobStreamWriter();
+  BlobStreamWriter(const BlobStreamWriter&) = delete;
+  BlobStreamWriter& operator=(const BlobStreamWriter&) = delete;
+
+  // Must be called for every blob before Open. Blobs are stored in this order.
+  void Declare(hwy::uint128_t key, size_t size) {
+    keys_.push_back(key);
+    sizes_.push_back(size);
+  }
+
+  // Creates or replaces `filename`.
+  BlobError Open(const char* filename);
+
+  // Writes the declared blob `key`, whose `size` must match the declaration.
+  // Blobs may be written in any order, but only once. `data` may be reused
+  // after this returns.
+  BlobError Write(hwy::ThreadPool& pool, hwy::uint128_t key, const void* data,
+                  size_t size);
+
+  // Writes the header and closes the file. Fails if any declared blob was not
+  // written. Until this succeeds, BlobReader considers the file invalid.
+  BlobError Finish();
+
+  size_t NumBlobs() const { return keys_.size(); }
+  uint64_t BytesWritten() const { return bytes_written_; }
+  uint64_t TotalSize() const { return total_size_; }  // valid after Open
+
+ private:
+  size_t alignment_;
+  size_t large_alignment_;
+  std::vector<hwy::uint128_t> keys_;
+  std::vector<uint64_t> sizes_;
+  std::vector<bool> written_;
+  BlobStorePtr bs_;
+  uint64_t total_size_ = 0;
+  uint64_t bytes_written_ = 0;
+  int fd_ = -1;
+};
+
 }  // namespace gcpp
 
 #endif  // THIRD_PARTY_GEMMA_CPP_COMPRESSION_BLOB_STORE_H_
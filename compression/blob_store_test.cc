@@ -0,0 +1,225 @@
+// Copyright 2024 Google LLC
+// SPDX-License-Identifier: Apache-2.0
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// copybara:import_next_line:gemma_cpp
+#include "compression/blob_store.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "hwy/base.h"
+#include "hwy/contrib/thread_pool/thread_pool.h"
+#include "hwy/tests/hwy_gtest.h"
+
+namespace gcpp {
+namespace {
+
+std::string TempPath(const char* name) {
+  const char* dir = getenv("TEST_TMPDIR");
+  return std::string(dir ? dir : "/tmp") + "/" + name;
+}
+
+// Writes two blobs with the given alignment, then reads and maps them back.
+void TestRoundTrip(size_t alignment) {
+  hwy::ThreadPool pool(0);
+  const std::string path = TempPath("blob_store_test.sbs");
+
+  std::vector<uint8_t> blob0(1000);
+  std::vector<uint8_t> blob1(3 * kBlobAlign);
+  for (size_t i = 0; i < blob0.size(); ++i) blob0[i] = i & 0xFF;
+  for (size_t i = 0; i < blob1.size(); ++i) blob1[i] = (i * 7) & 0xFF;
+  const hwy::uint128_t key0 = MakeKey("blob0");
+  const hwy::uint128_t key1 = MakeKey("blob1");
+
+  {
+    BlobWriter writer(alignment);
+    writer.Add(key0, blob0.data(), blob0.size());
+    writer.Add(key1, blob1.data(), blob1.size());
+    ASSERT_EQ(0, writer.WriteAll(pool, path.c_str()));
+  }
+
+  // Read into our own buffers.
+  {
+    BlobReader reader;
+    ASSERT_EQ(0, reader.Open(path.c_str()));
+    std::vector<uint8_t> read0(blob0.size());
+    std::vector<uint8_t> read1(blob1.size());
+    ASSERT_EQ(0, reader.Enqueue(key0, read0.data(), read0.size()));
+    ASSERT_EQ(0, reader.Enqueue(key1, read1.data(), read1.size()));
+    // Size mismatch and unknown key are errors.
+    EXPECT_NE(0, reader.Enqueue(key0, read0.data(), read0.size() - 1));
+    EXPECT_NE(0, reader.Enqueue(MakeKey("other"), read0.data(), 1));
+    ASSERT_EQ(0, reader.ReadAll(pool));
+    EXPECT_EQ(blob0, read0);
+    EXPECT_EQ(blob1, read1);
+
+    // Requests can also be read in separate ranges.
+    std::fill(read0.begin(), read0.end(), 0);
+    std::fill(read1.begin(), read1.end(), 0);
+    ASSERT_EQ(0, reader.ReadRange(pool, 0, 1));
+    EXPECT_EQ(blob0, read0);
+    EXPECT_NE(blob1, read1);
+    ASSERT_EQ(0, reader.ReadRange(pool, 1, reader.NumRequests()));
+    EXPECT_EQ(blob1, read1);
+
+    // Not opened for mapping.
+    uint8_t* mapped;
+    EXPECT_NE(0, reader.Map(key0, blob0.size(), mapped));
+    EXPECT_EQ(nullptr, reader.ReleaseMapping());
+  }
+
+  // Point into the mapping instead.
+  {
+    std::unique_ptr<MappedFile> mapping;
+    uint8_t* mapped0;
+    uint8_t* mapped1;
+    {
+      BlobReader reader;
+      ASSERT_EQ(0, reader.Open(path.c_str(), /*map=*/true));
+      ASSERT_EQ(0, reader.Map(key0, blob0.size(), mapped0));
+      ASSERT_EQ(0, reader.Map(key1, blob1.size(), mapped1));
+      EXPECT_NE(0, reader.Map(key1, blob1.size() + 1, mapped1));
+      mapping = reader.ReleaseMapping();
+    }
+    // The mapping outlives the reader.
+    ASSERT_NE(nullptr, mapping);
+    EXPECT_EQ(size_t{0}, (mapped0 - mapping->data()) % alignment);
+    EXPECT_EQ(size_t{0}, (mapped1 - mapping->data()) % alignment);
+    EXPECT_TRUE(std::equal(blob0.begin(), blob0.end(), mapped0));
+    EXPECT_TRUE(std::equal(blob1.begin(), blob1.end(), mapped1));
+  }
+
+  remove(path.c_str());
+}
+
+TEST(BlobStoreTest, TestRoundTripMinAlign) { TestRoundTrip(kBlobAlign); }
+TEST(BlobStoreTest, TestRoundTripHugePage) {
+  TestRoundTrip(kBlobAlignHugePage);
+}
+
+// Only blobs of at least `large_alignment` bytes are padded to it.
+TEST(BlobStoreTest, TestLargeAlignment) {
+  hwy::ThreadPool pool(0);
+  const std::string path = TempPath("blob_store_large_test.sbs");
+
+  std::vector<uint8_t> small0(1000, 1);
+  std::vector<uint8_t> large(kBlobAlignHugePage + 1, 2);
+  std::vector<uint8_t> small1(3 * kBlobAlign, 3);
+  const hwy::uint128_t keys[3] = {MakeKey("small0"), MakeKey("large"),
+                                  MakeKey("small1")};
+
+  {
+    BlobWriter writer(kBlobAlign, kBlobAlignHugePage);
+    writer.Add(keys[0], small0.data(), small0.size());
+    writer.Add(keys[1], large.data(), large.size());
+    writer.Add(keys[2], small1.data(), small1.size());
+    ASSERT_EQ(0, writer.WriteAll(pool, path.c_str()));
+  }
+
+  BlobReader reader;
+  ASSERT_EQ(0, reader.Open(path.c_str(), /*map=*/true));
+  uint8_t* mapped[3];
+  ASSERT_EQ(0, reader.Map(keys[0], small0.size(), mapped[0]));
+  ASSERT_EQ(0, reader.Map(keys[1], large.size(), mapped[1]));
+  ASSERT_EQ(0, reader.Map(keys[2], small1.size(), mapped[2]));
+  std::unique_ptr<MappedFile> mapping = reader.ReleaseMapping();
+  ASSERT_NE(nullptr, mapping);
+  const size_t offset0 = static_cast<size_t>(mapped[0] - mapping->data());
+  const size_t offset1 = static_cast<size_t>(mapped[1] - mapping->data());
+  const size_t offset2 = static_cast<size_t>(mapped[2] - mapping->data());
+  // The first small blob directly follows the header.
+  EXPECT_EQ(size_t{0}, offset0 % kBlobAlign);
+  EXPECT_LT(offset0, kBlobAlignHugePage);
+  EXPECT_EQ(kBlobAlignHugePage, offset1);
+  // The second small blob follows the large one with minimal padding.
+  EXPECT_EQ(hwy::RoundUpTo(offset1 + large.size(), kBlobAlign), offset2);
+  EXPECT_EQ(hwy::RoundUpTo(offset2 + small1.size(), kBlobAlign),
+            mapping->size());
+  EXPECT_TRUE(std::equal(small0.begin(), small0.end(), mapped[0]));
+  EXPECT_TRUE(std::equal(large.begin(), large.end(), mapped[1]));
+  EXPECT_TRUE(std::equal(small1.begin(), small1.end(), mapped[2]));
+
+  remove(path.c_str());
+}
+
+// Blobs written one at a time, in any order, read back like those of
+// BlobWriter.
+TEST(BlobStoreTest, TestStreamWriter) {
+  hwy::ThreadPool pool(0);
+  const std::string path = TempPath("blob_store_stream_test.sbs");
+
+  std::vector<uint8_t> blob0(1000);
+  std::vector<uint8_t> blob1(3 * kBlobAlign);
+  for (size_t i = 0; i < blob0.size(); ++i) blob0[i] = i & 0xFF;
+  for (size_t i = 0; i < blob1.size(); ++i) blob1[i] = (i * 7) & 0xFF;
+  const hwy::uint128_t key0 = MakeKey("blob0");
+  const hwy::uint128_t key1 = MakeKey("blob1");
+
+  {
+    BlobStreamWriter writer(kBlobAlign);
+    writer.Declare(key0, blob0.size());
+    writer.Declare(key1, blob1.size());
+    ASSERT_EQ(0, writer.Open(path.c_str()));
+    ASSERT_EQ(0, writer.Write(pool, key1, blob1.data(), blob1.size()));
+    // Wrong size, unknown key and writing twice are errors.
+    EXPECT_NE(0, writer.Write(pool, key0, blob0.data(), blob0.size() - 1));
+    EXPECT_NE(0, writer.Write(pool, MakeKey("other"), blob0.data(), 1));
+    EXPECT_NE(0, writer.Write(pool, key1, blob1.data(), blob1.size()));
+
+    // Not yet valid.
+    BlobReader reader;
+    EXPECT_NE(0, reader.Open(path.c_str()));
+
+    ASSERT_EQ(0, writer.Write(pool, key0, blob0.data(), blob0.size()));
+    EXPECT_EQ(blob0.size() + blob1.size(), writer.BytesWritten());
+    ASSERT_EQ(0, writer.Finish());
+  }
+
+  {
+    BlobReader reader;
+    ASSERT_EQ(0, reader.Open(path.c_str()));
+    std::vector<uint8_t> read0(blob0.size());
+    std::vector<uint8_t> read1(blob1.size());
+    ASSERT_EQ(0, reader.Enqueue(key0, read0.data(), read0.size()));
+    ASSERT_EQ(0, reader.Enqueue(key1, read1.data(), read1.size()));
+    ASSERT_EQ(0, reader.ReadAll(pool));
+    EXPECT_EQ(blob0, read0);
+    EXPECT_EQ(blob1, read1);
+  }
+
+  // Finish fails if a blob is missing, and the file remains invalid.
+  {
+    BlobStreamWriter writer(kBlobAlign);
+    writer.Declare(key0, blob0.size());
+    writer.Declare(key1, blob1.size());
+    ASSERT_EQ(0, writer.Open(path.c_str()));
+    ASSERT_EQ(0, writer.Write(pool, key0, blob0.data(), blob0.size()));
+    EXPECT_NE(0, writer.Finish());
+    BlobReader reader;
+    EXPECT_NE(0, reader.Open(path.c_str()));
+  }
+
+  remove(path.c_str());
+}
+
+}  // namespace
+}  // namespace gcpp
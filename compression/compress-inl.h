@@ -22,6 +22,8 @@
 #include <stdio.h>
 
 #include <array>
+#include <utility>
+#include <vector>
 
 // copybara:import_next_line:gemma_cpp
 #include "compression/blob_store.h"
@@ -44,6 +46,8 @@
 #define THIRD_PARTY_GEMMA_CPP_COMPRESS_TOGGLE
 #endif
 
+// copybara:import_next_line:gemma_cpp
+#include "compression/i8-inl.h"
 // copybara:import_next_line:gemma_cpp
 #include "compression/nuq-inl.h"
 // copybara:import_next_line:gemma_cpp
@@ -327,6 +331,42 @@ struct CompressTraits<NuqStream> {
   }
 };
 
+template <>
+struct CompressTraits<I8Stream> {
+  using MatT = I8Stream;
+
+  template <class DF, HWY_IF_F32_D(DF)>
+  static HWY_INLINE void Compress(DF df, const float* in, size_t num,
+                                  CompressPerThread& tls, size_t out_capacity,
+                                  MatT* out, size_t out_ofs) {
+    I8Codec::Enc(df, in, num, out_capacity, out, out_ofs);
+
+    if (COMPRESS_STATS) {
+      auto distorted = hwy::AllocateAligned<float>(num);
+      I8Codec::Dec(df, out_capacity, out, out_ofs, distorted.get(), num);
+      DistortionStats stats;
+      for (size_t i = 0; i < num; ++i) {
+        stats.Notify(in[i], distorted[i]);
+      }
+      tls.stats.Notify(stats);
+    }
+  }
+
+  template <class D, typename OutT>
+  static HWY_INLINE void Decompress(D d, size_t in_capacity, const MatT* in,
+                                    size_t in_ofs, OutT* out, size_t num) {
+    I8Codec::Dec(d, in_capacity, in, in_ofs, out, num);
+  }
+
+  template <class DF, typename VecT, HWY_IF_F32_D(DF)>
+  static HWY_INLINE float Dot(DF df, size_t in_capacity, const MatT* in,
+                              size_t in_ofs,
+                              const VecT* HWY_RESTRICT vec_aligned,
+                              size_t num) {
+    return I8Codec::Dot(df, in_capacity, in, in_ofs, vec_aligned, num);
+  }
+};
+
 // Compresses `num` inputs to `out` starting at `out_ofs`. This can be used for
 // compressing sub-regions of an array.
 template <typename MatT>
@@ -335,6 +375,9 @@ HWY_NOINLINE void Compress(const float* in, size_t num,
                            MatT* out, size_t out_ofs, hwy::ThreadPool& pool) {
   HWY_DASSERT(out_ofs + num <= out_capacity);
   work.tls.resize(pool.NumThreads());
+  for (auto& tls : work.tls) {
+    tls.buf.refine = work.refine_nuq;
+  }
   if (COMPRESS_STATS) {
     for (auto& tls : work.tls) {
       tls.stats.Reset();
@@ -429,6 +472,28 @@ HWY_INLINE float Dot(DF df, const CompressedArray<MatT, kCapacity>& compressed,
                      vec_aligned, num);
 }
 
+// Sets `out[r]` to the dot product with `vec_aligned` of the `num` values
+// starting at `compressed_ofs + r * stride`, for r in [0, 4). For NUQ, the
+// four rows are decoded together so that each load of `vec_aligned` is shared;
+// `compressed_ofs`, `stride` and `num` must then be multiples of `kGroupSize`.
+template <class DF, typename MatT, size_t kCapacity, typename VecT>
+HWY_INLINE void Dot4(DF df, const CompressedArray<MatT, kCapacity>& compressed,
+                     size_t compressed_ofs, size_t stride,
+                     const VecT* vec_aligned, size_t num,
+                     float* HWY_RESTRICT out) {
+  HWY_DASSERT(compressed_ofs + 3 * stride + num <= compressed.NumElements());
+  HWY_DASSERT(hn::IsAligned(df, vec_aligned));
+  if constexpr (hwy::IsSame<MatT, NuqStream>()) {
+    NuqCodec::Dot4(df, kCapacity, compressed.data(), compressed_ofs, stride,
+                   vec_aligned, num, out);
+  } else {
+    for (size_t r = 0; r < 4; ++r) {
+      out[r] = Dot(df, compressed, compressed_ofs + r * stride, vec_aligned,
+                   num);
+    }
+  }
+}
+
 // Callback used by ForeachTensor.
 class Compressor {
  public:
@@ -445,6 +510,12 @@ class Compressor {
                 compressed.CompressedSize());
   }
 
+  // Stores `size` bytes of `data` as is, e.g. metadata. `data` must remain
+  // valid until WriteAll.
+  void AddBlob(const char* name, void* data, size_t size) {
+    writer_.Add(MakeKey(name), data, size);
+  }
+
   void WriteAll(hwy::ThreadPool& pool, const char* blob_filename) {
     const BlobError err = writer_.WriteAll(pool, blob_filename);
     if (err != 0) {
@@ -456,7 +527,104 @@ class Compressor {
  private:
   CompressWorkingSet work_;
   hwy::ThreadPool& pool_;
-  BlobWriter writer_;
+  // Tensors may be memory-mapped, see CacheLoader.
+  BlobWriter writer_{kBlobAlign, kBlobAlignHugePage};
+};
+
+// Like Compressor, but writes each tensor to the file as soon as it is
+// compressed, so that the file contents need not all be in memory.
+//
+// Called twice for each tensor: first with null weights to declare its blob,
+// then, after Open, with its weights to compress and write it.
+class StreamingCompressor {
+ public:
+  // If `keep`, tensors are compressed into the CompressedArray, e.g. for use
+  // after compressing. Otherwise, into a buffer reused for every tensor, so
+  // that the CompressedArray storage is never touched.
+  StreamingCompressor(hwy::ThreadPool& pool, bool keep, bool refine_nuq)
+      : pool_(pool), keep_(keep) {
+    work_.refine_nuq = refine_nuq;
+  }
+
+  template <typename MatT, size_t kCapacity>
+  void operator()(const char* name, const float* weights,
+                  CompressedArray<MatT, kCapacity>& compressed) {
+    const size_t size = compressed.CompressedSize();
+    if (weights == nullptr) {
+      writer_.Declare(CacheKey<MatT>(name), size);
+      return;
+    }
+    // After an error, only compress if the caller will use the tensors.
+    if (err_ != 0 && !keep_) return;
+
+    MatT* out = compressed.data();
+    if (!keep_) {
+      if (scratch_size_ < size) {
+        scratch_ = hwy::AllocateAligned<uint8_t>(size);
+        scratch_size_ = size;
+      }
+      out = reinterpret_cast<MatT*>(scratch_.get());
+    }
+    const double t0 = hwy::platform::Now();
+    Compress(weights, kCapacity, work_, kCapacity, out, 0, pool_);
+    if (err_ != 0) return;
+    err_ = writer_.Write(pool_, CacheKey<MatT>(name), out, size);
+    if (err_ != 0) {
+      fprintf(stderr, "Failed to write %s (error %d)\n", name, err_);
+      return;
+    }
+    ++num_written_;
+    fprintf(stderr, "[%zu/%zu] %s (%zuM) in %.2f s, %.2f of %.2f GB\n",
+            num_written_, writer_.NumBlobs() - blobs_.size(), name,
+            kCapacity / (1000 * 1000),
+            hwy::platform::Now() - t0, writer_.BytesWritten() * 1E-9,
+            writer_.TotalSize() * 1E-9);
+  }
+
+  // Declares a blob of `size` bytes to store as is, e.g. metadata. `data`
+  // must remain valid until Finish.
+  void AddBlob(const char* name, void* data, size_t size) {
+    writer_.Declare(MakeKey(name), size);
+    blobs_.emplace_back(MakeKey(name),
+                        hwy::Span<uint8_t>(static_cast<uint8_t*>(data), size));
+  }
+
+  // Creates or replaces `blob_filename`. Call after declaring all blobs. If
+  // this or any write fails, tensors are still compressed if `keep`.
+  bool Open(const char* blob_filename) {
+    err_ = writer_.Open(blob_filename);
+    if (err_ != 0) {
+      fprintf(stderr, "Failed to create %s (error %d)\n", blob_filename,
+              err_);
+    }
+    return err_ == 0;
+  }
+
+  // Returns whether all tensors and blobs were successfully written.
+  bool Finish() {
+    for (const auto& key_blob : blobs_) {
+      if (err_ != 0) break;
+      err_ = writer_.Write(pool_, key_blob.first, key_blob.second.data(),
+                           key_blob.second.size());
+    }
+    if (err_ == 0) err_ = writer_.Finish();
+    if (err_ != 0) {
+      fprintf(stderr, "Failed to write all blobs (error %d)\n", err_);
+    }
+    return err_ == 0;
+  }
+
+ private:
+  CompressWorkingSet work_;
+  hwy::ThreadPool& pool_;
+  bool keep_;
+  // Tensors may be memory-mapped, see CacheLoader.
+  BlobStreamWriter writer_{kBlobAlign, kBlobAlignHugePage};
+  std::vector<std::pair<hwy::uint128_t, hwy::Span<uint8_t>>> blobs_;
+  hwy::AlignedFreeUniquePtr<uint8_t[]> scratch_;
+  size_t scratch_size_ = 0;
+  size_t num_written_ = 0;
+  BlobError err_ = 0;
 };
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -23,6 +23,7 @@
 #include <stdio.h>
 
 #include <array>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -30,6 +31,8 @@
 // copybara:import_next_line:gemma_cpp
 #include "compression/blob_store.h"
 // copybara:import_next_line:gemma_cpp
+#include "compression/i8.h"
+// copybara:import_next_line:gemma_cpp
 #include "compression/nuq.h"
 // copybara:import_next_line:gemma_cpp
 #include "compression/sfp.h"
@@ -50,7 +53,8 @@ static inline const char* TypeName(hwy::bfloat16_t) { return "b16"; }
 
 namespace detail {
 // How many MatT are required to store `capacity` weights. For all but
-// NuqStream, this is the same as `capacity`. For use by CompressedArray.
+// NuqStream and I8Stream, this is the same as `capacity`. For use by
+// CompressedArray.
 template <typename MatT>
 constexpr size_t CompressedArrayLen(size_t capacity) {
   return capacity;
@@ -59,6 +63,10 @@ template <>
 constexpr size_t CompressedArrayLen<NuqStream>(size_t capacity) {
   return NuqStream::PackedEnd(capacity);
 }
+template <>
+constexpr size_t CompressedArrayLen<I8Stream>(size_t capacity) {
+  return I8Stream::PackedEnd(capacity);
+}
 }  // namespace detail
 
 // Compressed representation of floating-point elements. The array length may
@@ -71,8 +79,8 @@ class CompressedArray {
   }
 
  public:
-  MatT* data() { return data_.data(); }
-  const MatT* data() const { return data_.data(); }
+  MatT* data() { return mapped_ ? mapped_ : data_.data(); }
+  const MatT* data() const { return mapped_ ? mapped_ : data_.data(); }
 
   constexpr size_t NumElements() const { return kCapacity; }
 
@@ -80,8 +88,14 @@ class CompressedArray {
     return NumCompressed() * sizeof(MatT);
   }
 
+  // Uses `mapped` (CompressedSize() bytes, typically within a memory-mapped
+  // file) instead of the inline storage, which is then never touched and thus
+  // need not be backed by memory. nullptr reverts to the inline storage.
+  void SetMapped(MatT* mapped) { mapped_ = mapped; }
+
  private:
-  std::array<MatT, NumCompressed()> data_;
+  MatT* mapped_ = nullptr;
+  alignas(HWY_ALIGNMENT) std::array<MatT, NumCompressed()> data_;
 };
 
 #if COMPRESS_STATS
@@ -146,6 +160,8 @@ struct CompressPerThread {
 
 struct CompressWorkingSet {
   std::vector<CompressPerThread> tls;
+  // See ClusterBuf::refine.
+  bool refine_nuq = false;
 };
 
 // Returns key for the given tensor name. Also encodes the type, so that
@@ -158,6 +174,7 @@ hwy::uint128_t CacheKey(const char* name) {
                       : hwy::IsSame<MatT, hwy::bfloat16_t>() ? 'B'
                       : hwy::IsSame<MatT, SfpStream>()       ? '$'
                       : hwy::IsSame<MatT, NuqStream>()       ? '2'
+                      : hwy::IsSame<MatT, I8Stream>()        ? 'i'
                                                              : '?';
 
   return MakeKey((std::string(1, prefix) + name).c_str());
@@ -165,8 +182,11 @@ hwy::uint128_t CacheKey(const char* name) {
 
 class CacheLoader {
  public:
-  explicit CacheLoader(const char* blob_filename) {
-    err_ = reader_.Open(blob_filename);
+  // If `map`, tensors point into a memory mapping of the file instead of
+  // being read into their own storage. See ReleaseMapping.
+  explicit CacheLoader(const char* blob_filename, bool map = false)
+      : map_(map) {
+    err_ = reader_.Open(blob_filename, map);
     if (err_ != 0) {
       fprintf(stderr,
               "Cached compressed weights does not exist yet (code %d), "
@@ -185,8 +205,15 @@ class CacheLoader {
     // everything because it's rare to update only a few tensors.
     if (err_ != 0) return;
 
-    err_ = reader_.Enqueue(CacheKey<MatT>(name), compressed.data(),
-                           compressed.CompressedSize());
+    if (map_) {
+      uint8_t* mapped;
+      err_ = reader_.Map(CacheKey<MatT>(name), compressed.CompressedSize(),
+                         mapped);
+      if (err_ == 0) compressed.SetMapped(reinterpret_cast<MatT*>(mapped));
+    } else {
+      err_ = reader_.Enqueue(CacheKey<MatT>(name), compressed.data(),
+                             compressed.CompressedSize());
+    }
     if (err_ != 0) {
       fprintf(stderr, "Failed to read cache %s (error %d)\n", name, err_);
     }
@@ -194,10 +221,19 @@ class CacheLoader {
 
   // Returns whether all tensors are successfully loaded from cache.
   bool ReadAll(hwy::ThreadPool& pool) {
+    return ReadRange(pool, 0, reader_.NumRequests());
+  }
+
+  // Number of read requests enqueued so far. Tensors enqueued after this call
+  // begin at this index.
+  size_t NumRequests() const { return reader_.NumRequests(); }
+
+  // Returns whether requests [begin, end) were successfully loaded.
+  bool ReadRange(hwy::ThreadPool& pool, size_t begin, size_t end) {
     // reader_ invalid or any Enqueue failed
     if (err_ != 0) return false;
 
-    err_ = reader_.ReadAll(pool);
+    err_ = reader_.ReadRange(pool, begin, end);
     if (err_ != 0) {
       fprintf(stderr, "Failed to read all tensors (error %d)\n", err_);
       return false;
@@ -206,9 +242,16 @@ class CacheLoader {
     return true;
   }
 
+  // Returns the mapping that tensors point into, which must outlive them, or
+  // nullptr if not mapped.
+  std::unique_ptr<MappedFile> ReleaseMapping() {
+    return reader_.ReleaseMapping();
+  }
+
  private:
   BlobReader reader_;
   BlobError err_ = 0;
+  bool map_;
 };
 
 }  // namespace gcpp
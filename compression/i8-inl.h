@@ -0,0 +1,284 @@
+// Copyright 2024 Google LLC
+// SPDX-License-Identifier: Apache-2.0
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Normal include guard.
+#ifndef THIRD_PARTY_GEMMA_CPP_COMPRESSION_I8_INL_H_
+#define THIRD_PARTY_GEMMA_CPP_COMPRESSION_I8_INL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// copybara:import_next_line:gemma_cpp
+#include "compression/i8.h"
+#include "hwy/base.h"
+
+#endif  // THIRD_PARTY_GEMMA_CPP_COMPRESSION_I8_INL_H_
+
+// Actual per-target include guard.
+#if defined(THIRD_PARTY_GEMMA_CPP_COMPRESSION_I8_INL_TOGGLE) == \
+    defined(HWY_TARGET_TOGGLE)
+#ifdef THIRD_PARTY_GEMMA_CPP_COMPRESSION_I8_INL_TOGGLE
+#undef THIRD_PARTY_GEMMA_CPP_COMPRESSION_I8_INL_TOGGLE
+#else
+#define THIRD_PARTY_GEMMA_CPP_COMPRESSION_I8_INL_TOGGLE
+#endif
+
+#include "hwy/highway.h"
+
+HWY_BEFORE_NAMESPACE();
+namespace gcpp {
+namespace HWY_NAMESPACE {
+namespace hn = hwy::HWY_NAMESPACE;
+
+// Encode/decode functions.
+class I8Codec {
+  // Loads Lanes(df) f32 or bf16 values from `p` as f32.
+  template <class DF, HWY_IF_F32_D(DF)>
+  static HWY_INLINE hn::Vec<DF> LoadF32(DF df, const float* HWY_RESTRICT p) {
+    return hn::LoadU(df, p);
+  }
+  template <class DF, HWY_IF_F32_D(DF)>
+  static HWY_INLINE hn::Vec<DF> LoadF32(DF df,
+                                        const hwy::bfloat16_t* HWY_RESTRICT p) {
+    const hn::Rebind<hwy::bfloat16_t, DF> dbfh;
+    return hn::PromoteTo(df, hn::LoadU(dbfh, p));
+  }
+
+  // Returns the maximum magnitude of `num` values, a multiple of Lanes(df).
+  template <class DF, typename T, HWY_IF_F32_D(DF)>
+  static HWY_INLINE float MaxAbs(DF df, const T* HWY_RESTRICT in, size_t num) {
+    const size_t NF = hn::Lanes(df);
+    hn::Vec<DF> vmax = hn::Zero(df);
+    for (size_t i = 0; i < num; i += NF) {
+      vmax = hn::Max(vmax, hn::Abs(LoadF32(df, in + i)));
+    }
+    return hn::GetLane(hn::MaxOfLanes(df, vmax));
+  }
+
+  // Rounds `num` values, a multiple of Lanes(df), times `inv_scale` to int8.
+  template <class DF, typename T, HWY_IF_F32_D(DF)>
+  static HWY_INLINE void Quantize(DF df, const T* HWY_RESTRICT in, size_t num,
+                                  float inv_scale, int8_t* HWY_RESTRICT out) {
+    const hn::Rebind<int8_t, DF> di8;
+    const size_t NF = hn::Lanes(df);
+    const hn::Vec<DF> vinv = hn::Set(df, inv_scale);
+    for (size_t i = 0; i < num; i += NF) {
+      const auto q = hn::NearestInt(hn::Mul(LoadF32(df, in + i), vinv));
+      hn::StoreU(hn::DemoteTo(di8, q), di8, out + i);
+    }
+  }
+
+  // Returns the scale that maps `max_abs` to 127.
+  static HWY_INLINE float ScaleFor(float max_abs) { return max_abs / 127.0f; }
+
+  static HWY_INLINE float GetScale(const uint8_t* scales, size_t group) {
+    float scale;
+    hwy::CopyBytes<sizeof(float)>(scales + group * sizeof(float), &scale);
+    return scale;
+  }
+
+ public:
+  // Encodes `num` floats starting from `in`. `out` points to compressed
+  // storage for `out_capacity` values and `out_ofs` indicates the destination
+  // offset within it, in units of float values, for parallel encoding by
+  // multiple threads. `num`, `out_capacity`, and `out_ofs` must all be
+  // multiples of `kI8GroupSize`.
+  template <class DF, HWY_IF_F32_D(DF)>
+  static HWY_INLINE void Enc(DF df, const float* HWY_RESTRICT in,
+                             const size_t num, const size_t out_capacity,
+                             I8Stream* const out, const size_t out_ofs) {
+    HWY_DASSERT(kI8GroupSize >= 2 * hn::Lanes(df));
+    HWY_DASSERT(out_ofs + num <= out_capacity);
+    HWY_DASSERT(out_capacity % kI8GroupSize == 0);
+    HWY_DASSERT(out_ofs % kI8GroupSize == 0);
+    HWY_DASSERT(num % kI8GroupSize == 0);
+    const size_t ofs_groups = out_ofs / kI8GroupSize;
+    const size_t num_groups = num / kI8GroupSize;
+    uint8_t* scales = &out->byte + ofs_groups * sizeof(float);
+    int8_t* values = reinterpret_cast<int8_t*>(
+        &out->byte + I8Stream::PackedStart(out_capacity) + out_ofs);
+
+    for (size_t g = 0; g < num_groups; ++g) {
+      const float* HWY_RESTRICT g_in = in + g * kI8GroupSize;
+      const float scale = ScaleFor(MaxAbs(df, g_in, kI8GroupSize));
+      hwy::CopyBytes<sizeof(float)>(&scale, scales + g * sizeof(float));
+      const float inv_scale = scale == 0.0f ? 0.0f : 1.0f / scale;
+      Quantize(df, g_in, kI8GroupSize, inv_scale, values + g * kI8GroupSize);
+    }
+  }
+
+  // Decodes `num` values from the stream `in`, starting at the offset `in_ofs`
+  // (in units of values), to f32 or bf16 in `out`. D is the tag of the output
+  // type. `in_capacity`, `in_ofs` and `num` must all be multiples of
+  // `kI8GroupSize`.
+  template <class D, typename OutT>
+  static HWY_INLINE void Dec(D d, const size_t in_capacity,
+                             const I8Stream* const in, const size_t in_ofs,
+                             OutT* HWY_RESTRICT out, const size_t num) {
+    const hn::Repartition<float, D> df;
+    const hn::RebindToSigned<decltype(df)> di32;
+    const hn::Rebind<int8_t, decltype(df)> di8;
+    const hn::Rebind<OutT, decltype(df)> d_out;
+    (void)d;
+    using VF = hn::Vec<decltype(df)>;
+    const size_t NF = hn::Lanes(df);
+
+    HWY_DASSERT(in_ofs + num <= in_capacity);
+    HWY_DASSERT(in_capacity % kI8GroupSize == 0);
+    HWY_DASSERT(in_ofs % kI8GroupSize == 0);
+    HWY_DASSERT(num % kI8GroupSize == 0);
+    const size_t ofs_groups = in_ofs / kI8GroupSize;
+    const size_t num_groups = num / kI8GroupSize;
+    const uint8_t* scales = &in->byte + ofs_groups * sizeof(float);
+    const int8_t* values = reinterpret_cast<const int8_t*>(
+        &in->byte + I8Stream::PackedStart(in_capacity) + in_ofs);
+
+    HWY_UNROLL(1)
+    for (size_t g = 0; g < num_groups; ++g) {
+      const VF vscale = hn::Set(df, GetScale(scales, g));
+      const int8_t* HWY_RESTRICT g_values = values + g * kI8GroupSize;
+      OutT* HWY_RESTRICT g_out = out + g * kI8GroupSize;
+      for (size_t i = 0; i < kI8GroupSize; i += NF) {
+        const VF f = hn::ConvertTo(
+            df, hn::PromoteTo(di32, hn::LoadU(di8, g_values + i)));
+        if constexpr (hwy::IsSame<OutT, float>()) {
+          hn::StoreU(hn::Mul(f, vscale), df, g_out + i);
+        } else {
+          hn::StoreU(hn::DemoteTo(d_out, hn::Mul(f, vscale)), d_out, g_out + i);
+        }
+      }
+    }
+  }
+
+  // Returns the dot product of decoded values with `num` f32 or bf16 from
+  // `vec_aligned`. `in_capacity`, `in_ofs` and `num` must all be multiples of
+  // `kI8GroupSize`.
+  template <class DF, typename VecT, HWY_IF_F32_D(DF)>
+  static HWY_INLINE float Dot(DF df, const size_t in_capacity,
+                              const I8Stream* const in, const size_t in_ofs,
+                              const VecT* HWY_RESTRICT vec_aligned,
+                              const size_t num) {
+    const hn::RebindToSigned<decltype(df)> di32;
+    const hn::Rebind<int8_t, decltype(df)> di8;
+    using VF = hn::Vec<decltype(df)>;
+    const size_t NF = hn::Lanes(df);
+    HWY_DASSERT(kI8GroupSize >= 2 * NF);
+
+    HWY_DASSERT(in_ofs + num <= in_capacity);
+    HWY_DASSERT(in_capacity % kI8GroupSize == 0);
+    HWY_DASSERT(in_ofs % kI8GroupSize == 0);
+    HWY_DASSERT(num % kI8GroupSize == 0);
+    const size_t ofs_groups = in_ofs / kI8GroupSize;
+    const size_t num_groups = num / kI8GroupSize;
+    const uint8_t* scales = &in->byte + ofs_groups * sizeof(float);
+    const int8_t* values = reinterpret_cast<const int8_t*>(
+        &in->byte + I8Stream::PackedStart(in_capacity) + in_ofs);
+
+    VF sum = hn::Zero(df);
+    HWY_UNROLL(1)
+    for (size_t g = 0; g < num_groups; ++g) {
+      const int8_t* HWY_RESTRICT g_values = values + g * kI8GroupSize;
+      const VecT* HWY_RESTRICT g_vec = vec_aligned + g * kI8GroupSize;
+      VF sum0 = hn::Zero(df);
+      VF sum1 = hn::Zero(df);
+      for (size_t i = 0; i < kI8GroupSize; i += 2 * NF) {
+        const VF w0 = hn::ConvertTo(
+            df, hn::PromoteTo(di32, hn::LoadU(di8, g_values + i)));
+        const VF w1 = hn::ConvertTo(
+            df, hn::PromoteTo(di32, hn::LoadU(di8, g_values + i + NF)));
+        sum0 = hn::MulAdd(w0, LoadF32(df, g_vec + i), sum0);
+        sum1 = hn::MulAdd(w1, LoadF32(df, g_vec + i + NF), sum1);
+      }
+      // Apply the group's scale once to its partial sums.
+      sum = hn::MulAdd(hn::Set(df, GetScale(scales, g)), hn::Add(sum0, sum1),
+                       sum);
+    }
+    return hn::ReduceSum(df, sum);
+  }
+
+  // Quantizes `num` f32 or bf16 from `in` to int8 in `out`, with one scale for
+  // all of them, which is returned. For activations that are multiplied with
+  // many rows via DotI8. `num` must be a multiple of Lanes(df).
+  template <class DF, typename T, HWY_IF_F32_D(DF)>
+  static HWY_INLINE float QuantizeVec(DF df, const T* HWY_RESTRICT in,
+                                      const size_t num,
+                                      int8_t* HWY_RESTRICT out) {
+    const float scale = ScaleFor(MaxAbs(df, in, num));
+    Quantize(df, in, num, scale == 0.0f ? 0.0f : 1.0f / scale, out);
+    return scale;
+  }
+
+  // Returns the dot product of decoded values with `num` int8 from `vec`, NOT
+  // yet multiplied by the scale of `vec` (see QuantizeVec). Products are
+  // accumulated as int32 within each group via widening multiply-add, which
+  // is a single instruction with AVX-512 VNNI. `in_capacity`, `in_ofs` and
+  // `num` must all be multiples of `kI8GroupSize`.
+  template <class DF, HWY_IF_F32_D(DF)>
+  static HWY_INLINE float DotI8(DF df, const size_t in_capacity,
+                                const I8Stream* const in, const size_t in_ofs,
+                                const int8_t* HWY_RESTRICT vec,
+                                const size_t num) {
+    const hn::RebindToSigned<decltype(df)> di32;
+    const hn::Repartition<int16_t, decltype(df)> di16;
+    const hn::Rebind<int8_t, decltype(di16)> di8;
+    using VF = hn::Vec<decltype(df)>;
+    using V32 = hn::Vec<decltype(di32)>;
+    using V16 = hn::Vec<decltype(di16)>;
+    const size_t N16 = hn::Lanes(di16);
+    HWY_DASSERT(kI8GroupSize >= 2 * N16);
+
+    HWY_DASSERT(in_ofs + num <= in_capacity);
+    HWY_DASSERT(in_capacity % kI8GroupSize == 0);
+    HWY_DASSERT(in_ofs % kI8GroupSize == 0);
+    HWY_DASSERT(num % kI8GroupSize == 0);
+    const size_t ofs_groups = in_ofs / kI8GroupSize;
+    const size_t num_groups = num / kI8GroupSize;
+    const uint8_t* scales = &in->byte + ofs_groups * sizeof(float);
+    const int8_t* values = reinterpret_cast<const int8_t*>(
+        &in->byte + I8Stream::PackedStart(in_capacity) + in_ofs);
+
+    VF sum = hn::Zero(df);
+    HWY_UNROLL(1)
+    for (size_t g = 0; g < num_groups; ++g) {
+      const int8_t* HWY_RESTRICT g_values = values + g * kI8GroupSize;
+      const int8_t* HWY_RESTRICT g_vec = vec + g * kI8GroupSize;
+      // At most 2 * 127^2 per int32 lane and product, so no overflow.
+      V32 sum0 = hn::Zero(di32);
+      V32 sum1 = hn::Zero(di32);
+      V32 sum2 = hn::Zero(di32);
+      V32 sum3 = hn::Zero(di32);
+      for (size_t i = 0; i < kI8GroupSize; i += 2 * N16) {
+        const V16 w0 = hn::PromoteTo(di16, hn::LoadU(di8, g_values + i));
+        const V16 w1 = hn::PromoteTo(di16, hn::LoadU(di8, g_values + i + N16));
+        const V16 v0 = hn::PromoteTo(di16, hn::LoadU(di8, g_vec + i));
+        const V16 v1 = hn::PromoteTo(di16, hn::LoadU(di8, g_vec + i + N16));
+        sum0 = hn::ReorderWidenMulAccumulate(di32, w0, v0, sum0, sum1);
+        sum2 = hn::ReorderWidenMulAccumulate(di32, w1, v1, sum2, sum3);
+      }
+      // The lane order does not matter because we only need the total.
+      const V32 isum = hn::Add(hn::Add(sum0, sum1), hn::Add(sum2, sum3));
+      sum = hn::MulAdd(hn::Set(df, GetScale(scales, g)),
+                       hn::ConvertTo(df, isum), sum);
+    }
+    return hn::ReduceSum(df, sum);
+  }
+};  // I8Codec
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace gcpp
+HWY_AFTER_NAMESPACE();
+
+#endif  // THIRD_PARTY_GEMMA_CPP_COMPRESSION_I8_INL_H_
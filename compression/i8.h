@@ -0,0 +1,68 @@
+// Copyright 2024 Google LLC
+// SPDX-License-Identifier: Apache-2.0
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THIRD_PARTY_GEMMA_CPP_COMPRESSION_I8_H_
+#define THIRD_PARTY_GEMMA_CPP_COMPRESSION_I8_H_
+
+// Symmetric int8 quantization with one scale per group: a compressed
+// representation of f32 inputs that supports seeking at a granularity of
+// kI8GroupSize, decoding to bf16/f32, and dot products with bf16/f32 or int8
+// vectors. The latter enables integer multiply-add instructions.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hwy/aligned_allocator.h"
+#include "hwy/base.h"  // HWY_INLINE
+
+namespace gcpp {
+
+// Number of weights that share a scale. Smaller = lower error, larger size
+// (4 bytes per group; 128 results in 8.25 bits per weight). This is the
+// minimum granularity for seeking/decoding in the stream, and must be at least
+// twice the number of int16 elements per vector.
+static constexpr size_t kI8GroupSize = 128;
+
+// Points to the *start* of an I8 stream. Layout: first one f32 scale per
+// group, in ascending order of group index, then one int8 per weight. Each
+// weight is its int8 times the scale of its group, which is the maximum
+// magnitude within the group divided by 127.
+//
+// As with NuqStream, offsets passed to I8Codec are in units of values, NOT
+// compressed bytes within the stream.
+#pragma pack(push, 1)
+struct I8Stream {
+  // Returns offset of the int8 values from the start of the stream. `capacity`
+  // is already a multiple of `kI8GroupSize`.
+  static constexpr size_t PackedStart(size_t capacity) {
+    // Round up to avoid cache-line splits when loading values.
+    return hwy::RoundUpTo((capacity / kI8GroupSize) * sizeof(float), 64);
+  }
+
+  // Returns number of I8Stream to allocate for the stream, which matches its
+  // size in bytes. `capacity` is already a multiple of `kI8GroupSize`.
+  static constexpr size_t PackedEnd(size_t capacity) {
+    return PackedStart(capacity) + capacity;  // one byte per value
+  }
+
+  uint8_t byte;
+};
+#pragma pack(pop)
+
+static inline const char* TypeName(I8Stream) { return "I8"; }
+
+}  // namespace gcpp
+
+#endif  // THIRD_PARTY_GEMMA_CPP_COMPRESSION_I8_H_
@@ -0,0 +1,203 @@
+// Copyright 2024 Google LLC
+// SPDX-License-Identifier: Apache-2.0
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <random>
+
+#include "hwy/aligned_allocator.h"
+#include "hwy/base.h"
+
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE \
+  "third_party/gemma_cpp/compression/i8_test.cc"  // NOLINT
+#include "hwy/foreach_target.h"  // IWYU pragma: keep
+// Other headers that include Highway must come after foreach_target.h
+// copybara:import_next_line:gemma_cpp
+#include "compression/i8-inl.h"
+// copybara:import_next_line:gemma_cpp
+#include "compression/i8.h"
+#include "hwy/highway.h"
+#include "hwy/tests/hwy_gtest.h"
+#include "hwy/tests/test_util-inl.h"
+#include "hwy/timer.h"
+
+HWY_BEFORE_NAMESPACE();
+namespace gcpp {
+namespace HWY_NAMESPACE {
+
+// Returns the scale of group `g`, as stored by I8Codec::Enc.
+float ScaleOfGroup(const float* in, size_t g) {
+  float max_abs = 0.0f;
+  for (size_t i = 0; i < kI8GroupSize; ++i) {
+    max_abs = HWY_MAX(max_abs, hwy::ScalarAbs(in[g * kI8GroupSize + i]));
+  }
+  return max_abs / 127.0f;
+}
+
+// Round trip: each decoded value is within half a step of its input.
+struct TestStream {
+  template <typename T, class D>
+  HWY_INLINE void operator()(T /*unused*/, D d) {
+    const hn::Repartition<float, D> df;
+    const size_t num = 4 * kI8GroupSize;
+    auto in = hwy::AllocateAligned<float>(num);
+    auto out = hwy::AllocateAligned<T>(num);
+    auto i8 = hwy::AllocateAligned<I8Stream>(I8Stream::PackedEnd(num));
+    HWY_ASSERT(in && out && i8);
+
+    std::mt19937 rng(123);
+    std::normal_distribution<float> dist{0.001f, 0.3f};
+    for (size_t i = 0; i < num; ++i) {
+      in[i] = dist(rng);
+    }
+    // One all-zero group, whose scale is zero.
+    for (size_t i = 0; i < kI8GroupSize; ++i) {
+      in[kI8GroupSize + i] = 0.0f;
+    }
+
+    double elapsed = hwy::HighestValue<double>();
+    for (size_t rep = 0; rep < 100; ++rep) {
+      const double t0 = hwy::platform::Now();
+      I8Codec::Enc(df, in.get(), num, num, i8.get(), 0);
+      const double t1 = hwy::platform::Now();
+      elapsed = HWY_MIN(elapsed, t1 - t0);
+    }
+    fprintf(stderr, "Vec %zu Enc %.2f MB/s\n", Lanes(d) * sizeof(T),
+            num * sizeof(float) * 1E-6 / elapsed);
+
+    elapsed = hwy::HighestValue<double>();
+    for (size_t rep = 0; rep < 100; ++rep) {
+      const double t0 = hwy::platform::Now();
+      I8Codec::Dec(d, num, i8.get(), 0, out.get(), num);
+      const double t1 = hwy::platform::Now();
+      elapsed = HWY_MIN(elapsed, t1 - t0);
+    }
+    fprintf(stderr, "Vec %zu Dec %.2f MB/s\n", Lanes(d) * sizeof(T),
+            num * sizeof(T) * 1E-6 / elapsed);
+
+    for (size_t g = 0; g < num / kI8GroupSize; ++g) {
+      const float scale = ScaleOfGroup(in.get(), g);
+      for (size_t i = g * kI8GroupSize; i < (g + 1) * kI8GroupSize; ++i) {
+        const float dec = hwy::ConvertScalarTo<float>(out[i]);
+        // bf16 has 8 significant bits.
+        const float rounding = sizeof(T) == 2 ? hwy::ScalarAbs(dec) / 128 : 0;
+        const float tolerance = 0.5f * scale * 1.001f + rounding;
+        HWY_ASSERT(hwy::ScalarAbs(dec - in[i]) <= tolerance);
+      }
+    }
+  }
+};
+
+void TestAllStreamF32() {
+  const hn::ForGEVectors<128, TestStream> test;
+  test(float());
+}
+void TestAllStreamBF16() {
+  const hn::ForGEVectors<128, TestStream> test;
+  test(hwy::bfloat16_t());
+}
+
+// Dot with f32/bf16 vectors matches the dot product of the decoded values, and
+// DotI8 that of the decoded values and the quantized vector.
+struct TestDot {
+  template <typename T, class D>
+  HWY_INLINE void operator()(T /*unused*/, D d) {
+    const hn::Repartition<float, D> df;
+    const size_t num = 8 * kI8GroupSize;
+    auto in = hwy::AllocateAligned<float>(num);
+    auto dec = hwy::AllocateAligned<float>(num);
+    auto vec = hwy::AllocateAligned<T>(num);
+    auto vec_i8 = hwy::AllocateAligned<int8_t>(num);
+    auto i8 = hwy::AllocateAligned<I8Stream>(I8Stream::PackedEnd(num));
+    HWY_ASSERT(in && dec && vec && vec_i8 && i8);
+
+    std::mt19937 rng(123);
+    std::normal_distribution<float> dist{0.001f, 0.3f};
+    for (size_t i = 0; i < num; ++i) {
+      in[i] = dist(rng);
+      vec[i] = hwy::ConvertScalarTo<T>(dist(rng));
+    }
+
+    I8Codec::Enc(df, in.get(), num, num, i8.get(), 0);
+    I8Codec::Dec(df, num, i8.get(), 0, dec.get(), num);
+    const float vec_scale = I8Codec::QuantizeVec(df, vec.get(), num,
+                                                 vec_i8.get());
+
+    float actual = 0.0f;
+    float actual_i8 = 0.0f;
+    double elapsed = hwy::HighestValue<double>();
+    double elapsed_i8 = hwy::HighestValue<double>();
+    for (size_t rep = 0; rep < 20; ++rep) {
+      const double t0 = hwy::platform::Now();
+      actual = I8Codec::Dot(df, num, i8.get(), 0, vec.get(), num);
+      const double t1 = hwy::platform::Now();
+      actual_i8 =
+          I8Codec::DotI8(df, num, i8.get(), 0, vec_i8.get(), num) * vec_scale;
+      const double t2 = hwy::platform::Now();
+      elapsed = HWY_MIN(elapsed, t1 - t0);
+      elapsed_i8 = HWY_MIN(elapsed_i8, t2 - t1);
+    }
+    fprintf(stderr, "Vec %zu Dot %.2f MB/s DotI8 %.2f MB/s\n",
+            Lanes(d) * sizeof(T), num * 1E-6 / elapsed,
+            num * 1E-6 / elapsed_i8);
+
+    double expected = 0.0;     // decoded values times vec
+    double expected_i8 = 0.0;  // decoded values times quantized vec
+    double sum_abs = 0.0;      // for the tolerance
+    // Quantizing the vector adds at most half a step of error per product.
+    double max_i8_error = 0.0;
+    for (size_t i = 0; i < num; ++i) {
+      const double v = hwy::ConvertScalarTo<double>(vec[i]);
+      expected += dec[i] * v;
+      expected_i8 += dec[i] * vec_i8[i] * static_cast<double>(vec_scale);
+      sum_abs += hwy::ScalarAbs(dec[i] * v);
+      max_i8_error += hwy::ScalarAbs(dec[i]) * 0.5 * vec_scale;
+    }
+    fprintf(stderr, "expected %.4f actual %.4f i8 %.4f (expected %.4f)\n",
+            expected, actual, actual_i8, expected_i8);
+    HWY_ASSERT(hwy::ScalarAbs(expected - actual) < 1E-5 * sum_abs);
+    HWY_ASSERT(hwy::ScalarAbs(expected_i8 - actual_i8) < 1E-5 * sum_abs);
+    HWY_ASSERT(hwy::ScalarAbs(expected - actual_i8) <= 1.001 * max_i8_error);
+  }
+};
+
+void TestAllDotF32() {
+  const hn::ForGEVectors<128, TestDot> test;
+  test(float());
+}
+void TestAllDotBF16() {
+  const hn::ForGEVectors<128, TestDot> test;
+  test(hwy::bfloat16_t());
+}
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace gcpp
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+
+namespace gcpp {
+HWY_BEFORE_TEST(I8Test);
+HWY_EXPORT_AND_TEST_P(I8Test, TestAllStreamF32);
+HWY_EXPORT_AND_TEST_P(I8Test, TestAllStreamBF16);
+HWY_EXPORT_AND_TEST_P(I8Test, TestAllDotF32);
+HWY_EXPORT_AND_TEST_P(I8Test, TestAllDotBF16);
+}  // namespace gcpp
+
+#endif
@@ -459,6 +459,36 @@ class NuqCodec {
     }
   }
 
+  // Dot4 helper: accumulates into `sum0/1` the products of one row's decoded
+  // values (2 * N16, looked up from its `tbl0/1`) with the bf16 `in0/1`.
+  template <class DF, class VBF, class V16>
+  static HWY_INLINE void MulAccRow(DF df, VBF in0, VBF in1, V16 tbl0, V16 tbl1,
+                                   const uint8_t* HWY_RESTRICT packed,
+                                   hn::Vec<DF>& sum0, hn::Vec<DF>& sum1) {
+    const hn::Repartition<hwy::bfloat16_t, DF> dbf;
+    const hn::RebindToUnsigned<decltype(dbf)> d16;
+    V16 c0, c1;
+    TableLookups(d16, tbl0, tbl1, packed, c0, c1);
+    sum0 = hn::ReorderWidenMulAccumulate(df, in0, BitCast(dbf, c0), sum0, sum1);
+    sum0 = hn::ReorderWidenMulAccumulate(df, in1, BitCast(dbf, c1), sum0, sum1);
+  }
+
+  // As above, but for the f32 `in0..3`.
+  template <class DF, class VF, class V16>
+  static HWY_INLINE void MulAccRow(DF df, VF in0, VF in1, VF in2, VF in3,
+                                   V16 tbl0, V16 tbl1,
+                                   const uint8_t* HWY_RESTRICT packed,
+                                   VF& sum0, VF& sum1) {
+    const hn::Repartition<hwy::bfloat16_t, DF> dbf;
+    const hn::RebindToUnsigned<decltype(dbf)> d16;
+    V16 c0, c1;
+    TableLookups(d16, tbl0, tbl1, packed, c0, c1);
+    sum0 = hn::MulAdd(in0, hn::PromoteLowerTo(df, BitCast(dbf, c0)), sum0);
+    sum1 = hn::MulAdd(in1, hn::PromoteUpperTo(df, BitCast(dbf, c0)), sum1);
+    sum0 = hn::MulAdd(in2, hn::PromoteLowerTo(df, BitCast(dbf, c1)), sum0);
+    sum1 = hn::MulAdd(in3, hn::PromoteUpperTo(df, BitCast(dbf, c1)), sum1);
+  }
+
  public:
   // Encodes `num` floats starting from `in`. `out` points to compressed
   // storage for `out_capacity` values and `out_ofs` indicates the destination
@@ -498,6 +528,28 @@ class NuqCodec {
     uint8_t* centers = &out->byte + ofs_groups * kClusters;
     SfpCodec::Enc(df, buf.centers.get(), num_groups * kClusters,
                   reinterpret_cast<SfpStream*>(centers));
+    if (buf.refine) {
+      // Rounding may have moved another center closer than the one chosen by
+      // ClusterExactL2; switching to it cannot increase the error.
+      SfpCodec::Dec(df, reinterpret_cast<const SfpStream*>(centers),
+                    num_groups * kClusters, buf.centers.get());
+      for (size_t g = 0; g < num_groups; ++g) {
+        const float* HWY_RESTRICT g_in = in + g * kGroupSize;
+        const float* HWY_RESTRICT g_centers =
+            buf.centers.get() + g * kClusters;
+        uint16_t* HWY_RESTRICT g_idx = buf.idx.get() + g * kGroupSize;
+        for (size_t i = 0; i < kGroupSize; ++i) {
+          float best = hwy::ScalarAbs(g_in[i] - g_centers[g_idx[i]]);
+          for (size_t k = 0; k < kClusters; ++k) {
+            const float dist = hwy::ScalarAbs(g_in[i] - g_centers[k]);
+            if (dist < best) {
+              best = dist;
+              g_idx[i] = static_cast<uint16_t>(k);
+            }
+          }
+        }
+      }
+    }
     uint8_t* packed_start = &out->byte + NuqStream::PackedStart(out_capacity) +
                             ofs_groups * kGroupSize / 2;
 
@@ -720,6 +772,152 @@ class NuqCodec {
       }
     }
   }
+  // Sets `out[r]` to the dot product of `num` bf16 from `vec_aligned` with the
+  // decoded values starting at `in_ofs + r * in_stride`, for r in [0, 4). The
+  // four rows share each load of `vec_aligned`, and their table lookups are
+  // independent, which hides their latency. `in_capacity`, `in_ofs`,
+  // `in_stride` and `num` must all be multiples of `kGroupSize`.
+  template <class DF, HWY_IF_F32_D(DF)>
+  static HWY_INLINE void Dot4(DF df, const size_t in_capacity,
+                              const NuqStream* const in, const size_t in_ofs,
+                              const size_t in_stride,
+                              const hwy::bfloat16_t* const vec_aligned,
+                              const size_t num, float* HWY_RESTRICT out) {
+    const hn::Repartition<hwy::bfloat16_t, DF> dbf;
+    const hn::RebindToUnsigned<decltype(dbf)> d16;
+    using VF = hn::Vec<decltype(df)>;
+    using VBF = hn::Vec<decltype(dbf)>;
+    using V16 = hn::Vec<decltype(d16)>;
+    const size_t N16 = hn::Lanes(d16);
+    HWY_DASSERT(kGroupSize >= 4 * N16);
+
+    HWY_DASSERT(in_ofs + 3 * in_stride + num <= in_capacity);
+    HWY_DASSERT(in_capacity % kGroupSize == 0);
+    HWY_DASSERT(in_ofs % kGroupSize == 0);
+    HWY_DASSERT(in_stride % kGroupSize == 0);
+    HWY_DASSERT(num % kGroupSize == 0);
+    const size_t ofs_groups = in_ofs / kGroupSize;
+    const size_t stride_groups = in_stride / kGroupSize;
+    const size_t num_groups = num / kGroupSize;
+    const uint8_t* tables = &in->byte + ofs_groups * kClusters;
+    const uint8_t* packed_start = &in->byte +
+                                  NuqStream::PackedStart(in_capacity) +
+                                  ofs_groups * kGroupSize / 2;
+    // Distance between rows, in bytes, of the tables and packed indices.
+    const size_t tables_stride = stride_groups * kClusters;
+    const size_t packed_stride = in_stride / 2;
+
+    VF sum00 = hn::Zero(df), sum01 = hn::Zero(df);
+    VF sum10 = hn::Zero(df), sum11 = hn::Zero(df);
+    VF sum20 = hn::Zero(df), sum21 = hn::Zero(df);
+    VF sum30 = hn::Zero(df), sum31 = hn::Zero(df);
+
+    HWY_UNROLL(1)
+    for (size_t g = 0; g < num_groups; ++g) {
+      const uint8_t* g_centers = tables + g * kClusters;
+      const uint8_t* HWY_RESTRICT p0 = packed_start + g * kGroupSize / 2;
+      const uint8_t* HWY_RESTRICT p1 = p0 + packed_stride;
+      const uint8_t* HWY_RESTRICT p2 = p1 + packed_stride;
+      const uint8_t* HWY_RESTRICT p3 = p2 + packed_stride;
+      const hwy::bfloat16_t* HWY_RESTRICT g_in = vec_aligned + g * kGroupSize;
+
+      V16 tbl01 = Zero(d16), tbl11 = Zero(d16);
+      V16 tbl21 = Zero(d16), tbl31 = Zero(d16);
+      const V16 tbl00 = LoadTable(d16, g_centers, &tbl01);
+      const V16 tbl10 = LoadTable(d16, g_centers + tables_stride, &tbl11);
+      const V16 tbl20 = LoadTable(d16, g_centers + 2 * tables_stride, &tbl21);
+      const V16 tbl30 = LoadTable(d16, g_centers + 3 * tables_stride, &tbl31);
+
+      HWY_UNROLL(1)
+      for (size_t i = 0; i < kGroupSize; i += 2 * N16) {
+        const VBF in0 = hn::Load(dbf, g_in + i + N16 * 0);
+        const VBF in1 = hn::Load(dbf, g_in + i + N16 * 1);
+        MulAccRow(df, in0, in1, tbl00, tbl01, p0 + i / 2, sum00, sum01);
+        MulAccRow(df, in0, in1, tbl10, tbl11, p1 + i / 2, sum10, sum11);
+        MulAccRow(df, in0, in1, tbl20, tbl21, p2 + i / 2, sum20, sum21);
+        MulAccRow(df, in0, in1, tbl30, tbl31, p3 + i / 2, sum30, sum31);
+      }
+    }
+
+    out[0] = hn::ReduceSum(df, hn::Add(sum00, sum01));
+    out[1] = hn::ReduceSum(df, hn::Add(sum10, sum11));
+    out[2] = hn::ReduceSum(df, hn::Add(sum20, sum21));
+    out[3] = hn::ReduceSum(df, hn::Add(sum30, sum31));
+  }
+
+  // As above, but for `num` f32 from `vec_aligned`.
+  template <class DF, HWY_IF_F32_D(DF)>
+  static HWY_INLINE void Dot4(DF df, const size_t in_capacity,
+                              const NuqStream* const in, const size_t in_ofs,
+                              const size_t in_stride,
+                              const float* const vec_aligned, const size_t num,
+                              float* HWY_RESTRICT out) {
+    const hn::Repartition<hwy::bfloat16_t, DF> dbf;
+    const hn::RebindToUnsigned<decltype(dbf)> d16;
+    using VF = hn::Vec<decltype(df)>;
+    using V16 = hn::Vec<decltype(d16)>;
+    const size_t NF = hn::Lanes(df);
+    HWY_DASSERT(kGroupSize >= 4 * NF);
+
+    HWY_DASSERT(in_ofs + 3 * in_stride + num <= in_capacity);
+    HWY_DASSERT(in_capacity % kGroupSize == 0);
+    HWY_DASSERT(in_ofs % kGroupSize == 0);
+    HWY_DASSERT(in_stride % kGroupSize == 0);
+    HWY_DASSERT(num % kGroupSize == 0);
+    const size_t ofs_groups = in_ofs / kGroupSize;
+    const size_t stride_groups = in_stride / kGroupSize;
+    const size_t num_groups = num / kGroupSize;
+    const uint8_t* tables = &in->byte + ofs_groups * kClusters;
+    const uint8_t* packed_start = &in->byte +
+                                  NuqStream::PackedStart(in_capacity) +
+                                  ofs_groups * kGroupSize / 2;
+    // Distance between rows, in bytes, of the tables and packed indices.
+    const size_t tables_stride = stride_groups * kClusters;
+    const size_t packed_stride = in_stride / 2;
+
+    VF sum00 = hn::Zero(df), sum01 = hn::Zero(df);
+    VF sum10 = hn::Zero(df), sum11 = hn::Zero(df);
+    VF sum20 = hn::Zero(df), sum21 = hn::Zero(df);
+    VF sum30 = hn::Zero(df), sum31 = hn::Zero(df);
+
+    HWY_UNROLL(1)
+    for (size_t g = 0; g < num_groups; ++g) {
+      const uint8_t* g_centers = tables + g * kClusters;
+      const uint8_t* HWY_RESTRICT p0 = packed_start + g * kGroupSize / 2;
+      const uint8_t* HWY_RESTRICT p1 = p0 + packed_stride;
+      const uint8_t* HWY_RESTRICT p2 = p1 + packed_stride;
+      const uint8_t* HWY_RESTRICT p3 = p2 + packed_stride;
+      const float* HWY_RESTRICT g_in = vec_aligned + g * kGroupSize;
+
+      V16 tbl01 = Zero(d16), tbl11 = Zero(d16);
+      V16 tbl21 = Zero(d16), tbl31 = Zero(d16);
+      const V16 tbl00 = LoadTable(d16, g_centers, &tbl01);
+      const V16 tbl10 = LoadTable(d16, g_centers + tables_stride, &tbl11);
+      const V16 tbl20 = LoadTable(d16, g_centers + 2 * tables_stride, &tbl21);
+      const V16 tbl30 = LoadTable(d16, g_centers + 3 * tables_stride, &tbl31);
+
+      HWY_UNROLL(1)
+      for (size_t i = 0; i < kGroupSize; i += 4 * NF) {
+        const VF in0 = hn::LoadU(df, g_in + i + NF * 0);
+        const VF in1 = hn::LoadU(df, g_in + i + NF * 1);
+        const VF in2 = hn::LoadU(df, g_in + i + NF * 2);
+        const VF in3 = hn::LoadU(df, g_in + i + NF * 3);
+        MulAccRow(df, in0, in1, in2, in3, tbl00, tbl01, p0 + i / 2, sum00,
+                  sum01);
+        MulAccRow(df, in0, in1, in2, in3, tbl10, tbl11, p1 + i / 2, sum10,
+                  sum11);
+        MulAccRow(df, in0, in1, in2, in3, tbl20, tbl21, p2 + i / 2, sum20,
+                  sum21);
+        MulAccRow(df, in0, in1, in2, in3, tbl30, tbl31, p3 + i / 2, sum30,
+                  sum31);
+      }
+    }
+
+    out[0] = hn::ReduceSum(df, hn::Add(sum00, sum01));
+    out[1] = hn::ReduceSum(df, hn::Add(sum10, sum11));
+    out[2] = hn::ReduceSum(df, hn::Add(sum20, sum21));
+    out[3] = hn::ReduceSum(df, hn::Add(sum30, sum31));
+  }
 };  // NuqCodec
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
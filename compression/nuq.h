@@ -110,6 +110,10 @@ struct ClusterBuf {
   size_t num = 0;
   hwy::AlignedFreeUniquePtr<float[]> centers;
   hwy::AlignedFreeUniquePtr<uint16_t[]> idx;
+
+  // If true, Enc reassigns each value to the nearest center after they are
+  // rounded to SFP. Slower, for offline compression.
+  bool refine = false;
 };
 
 }  // namespace gcpp
@@ -328,6 +328,42 @@ void TestAllStreamBF16() {
   test(hwy::bfloat16_t());
 }
 
+// Reassigning to the rounded centers never increases the error.
+struct TestRefine {
+  template <typename T, class DF>
+  HWY_INLINE void operator()(T /*unused*/, DF df) {
+    const size_t num = 4 * kGroupSize;
+    auto in = hwy::AllocateAligned<float>(num);
+    auto out = hwy::AllocateAligned<float>(num);
+    auto nuq = hwy::AllocateAligned<NuqStream>(NuqStream::PackedEnd(num));
+    HWY_ASSERT(in && out && nuq);
+
+    std::mt19937 rng(123);
+    std::normal_distribution<float> dist{0.001f, 0.3f};
+    for (size_t i = 0; i < num; ++i) {
+      in[i] = dist(rng);
+    }
+
+    double sum_sq[2];
+    for (int refine = 0; refine < 2; ++refine) {
+      ClusterBuf buf;
+      buf.refine = refine != 0;
+      NuqCodec::Enc(df, in.get(), num, buf, num, nuq.get(), 0);
+      NuqCodec::Dec(df, num, nuq.get(), 0, out.get(), num);
+      sum_sq[refine] = 0.0;
+      for (size_t i = 0; i < num; ++i) {
+        const double err = in[i] - out[i];
+        sum_sq[refine] += err * err;
+      }
+    }
+    fprintf(stderr, "Vec %zu refine: %.4E -> %.4E\n", Lanes(df) * 4,
+            sum_sq[0], sum_sq[1]);
+    HWY_ASSERT(sum_sq[1] <= sum_sq[0]);
+  }
+};
+
+void TestAllRefine() { hn::ForGEVectors<128, TestRefine>()(float()); }
+
 struct TestDot {
   template <typename T, class D>
   HWY_INLINE void operator()(T /*unused*/, D d) {
@@ -404,6 +440,74 @@ void TestAllDotBF16() {
   test(hwy::bfloat16_t());
 }
 
+// Dot4 must match four separate Dot; also compares their throughput.
+struct TestDot4 {
+  template <typename T, class D>
+  HWY_INLINE void operator()(T /*unused*/, D d) {
+    const hn::Repartition<float, D> df;
+    // Five rows; Dot4 starts at the second to exercise the offset.
+    const size_t cols = 4 * kGroupSize;
+    const size_t num = 5 * cols;
+    auto in = hwy::AllocateAligned<float>(num);
+    auto vec = hwy::AllocateAligned<T>(cols);
+    auto nuq = hwy::AllocateAligned<NuqStream>(NuqStream::PackedEnd(num));
+    HWY_ASSERT(in && vec && nuq);
+
+    std::mt19937 rng(123);
+    std::normal_distribution<float> dist{0.001f, 0.3f};
+    for (size_t i = 0; i < num; ++i) {
+      in[i] = dist(rng);
+    }
+    for (size_t i = 0; i < cols; ++i) {
+      vec[i] = hwy::ConvertScalarTo<T>(dist(rng));
+    }
+
+    ClusterBuf buf;
+    const size_t unused_clusters =
+        NuqCodec::Enc(df, in.get(), num, buf, num, nuq.get(), 0);
+    HWY_ASSERT(unused_clusters == 0);
+
+    float expected[4];
+    float actual[4];
+    double elapsed1 = hwy::HighestValue<double>();
+    double elapsed4 = hwy::HighestValue<double>();
+    for (size_t rep = 0; rep < 20; ++rep) {
+      const double t0 = hwy::platform::Now();
+      for (size_t r = 0; r < 4; ++r) {
+        hn::Vec<decltype(df)> sum0 = hn::Zero(df);
+        hn::Vec<decltype(df)> sum1 = hn::Zero(df);
+        hn::Vec<decltype(df)> sum2 = hn::Zero(df);
+        hn::Vec<decltype(df)> sum3 = hn::Zero(df);
+        NuqCodec::Dot(df, num, nuq.get(), (1 + r) * cols, vec.get(), cols,
+                      sum0, sum1, sum2, sum3);
+        sum0 = hn::Add(hn::Add(sum0, sum1), hn::Add(sum2, sum3));
+        expected[r] = hn::ReduceSum(df, sum0);
+      }
+      const double t1 = hwy::platform::Now();
+      NuqCodec::Dot4(df, num, nuq.get(), cols, cols, vec.get(), cols, actual);
+      const double t2 = hwy::platform::Now();
+      elapsed1 = HWY_MIN(elapsed1, t1 - t0);
+      elapsed4 = HWY_MIN(elapsed4, t2 - t1);
+    }
+
+    const double mb = 4 * cols * sizeof(in[0]) * 1E-6;
+    fprintf(stderr, "Vec %zu Dot %.2f MB/s Dot4 %.2f MB/s\n",
+            Lanes(d) * sizeof(T), mb / elapsed1, mb / elapsed4);
+    for (size_t r = 0; r < 4; ++r) {
+      HWY_ASSERT(hwy::ScalarAbs(expected[r] - actual[r]) < 1E-4f);
+    }
+  }
+};
+
+void TestAllDot4F32() {
+  const hn::ForGEVectors<128, TestDot4> test;
+  test(float());
+}
+void TestAllDot4BF16() {
+  const hn::ForGEVectors<128, TestDot4> test;
+  test(hwy::bfloat16_t());
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace gcpp
@@ -421,8 +525,11 @@ HWY_EXPORT_AND_TEST_P(NuqTest, TestAllOffsetF32);
 HWY_EXPORT_AND_TEST_P(NuqTest, TestAllOffsetBF16);
 HWY_EXPORT_AND_TEST_P(NuqTest, TestAllStreamF32);
 HWY_EXPORT_AND_TEST_P(NuqTest, TestAllStreamBF16);
+HWY_EXPORT_AND_TEST_P(NuqTest, TestAllRefine);
 HWY_EXPORT_AND_TEST_P(NuqTest, TestAllDotF32);
 HWY_EXPORT_AND_TEST_P(NuqTest, TestAllDotBF16);
+HWY_EXPORT_AND_TEST_P(NuqTest, TestAllDot4F32);
+HWY_EXPORT_AND_TEST_P(NuqTest, TestAllDot4BF16);
 }  // namespace gcpp
 
 #endif
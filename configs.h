@@ -24,7 +24,31 @@ namespace gcpp {
 
 static constexpr size_t kSeqLen = 7168;
 
+// Stands in for TWeight when the attention matrices use TAttn and the FFW
+// matrices, which are most of the bytes streamed per token, use TFFW.
+template <typename TAttn, typename TFFW>
+struct MixedWeights {};
+
+// Element types of the attention and FFW matrices for the given TWeight.
+template <typename TWeight>
+struct WeightTensorTypes {
+  using AttnT = TWeight;
+  using FFWT = TWeight;
+};
+
+template <typename TAttn, typename TFFW>
+struct WeightTensorTypes<MixedWeights<TAttn, TFFW>> {
+  using AttnT = TAttn;
+  using FFWT = TFFW;
+};
+
+// TWeight is the element type of the compressed weights: float,
+// hwy::bfloat16_t, SfpStream or NuqStream, or MixedWeights of two of these.
+template <typename TWeight>
 struct ConfigGemma7B {
+  using WeightT = TWeight;
+  using AttnWeightT = typename WeightTensorTypes<TWeight>::AttnT;
+  using FFWWeightT = typename WeightTensorTypes<TWeight>::FFWT;
   static constexpr int kSeqLen = gcpp::kSeqLen;
   static constexpr int kVocabSize = 256128;
   static constexpr int kLayers = 28;
@@ -36,14 +60,18 @@ struct ConfigGemma7B {
   static constexpr int kTopK = 1;
 };
 
+template <typename TWeight>
 struct ConfigGemma2B {
+  using WeightT = TWeight;
+  using AttnWeightT = typename WeightTensorTypes<TWeight>::AttnT;
+  using FFWWeightT = typename WeightTensorTypes<TWeight>::FFWT;
   static constexpr int kSeqLen = gcpp::kSeqLen;
   static constexpr int kVocabSize = 256128;
   static constexpr int kLayers = 18;
   static constexpr int kModelDim = 2048;
   static constexpr int kFFHiddenDim = 16 * 2048 / 2;  // = 16384
   static constexpr int kHeads = 8;
-  static constexpr int kKVHeads = 8;  // TODO(austinvhuang): add MQA support
+  static constexpr int kKVHeads = 1;  // MQA: all query heads share one KV head
   static constexpr int kQKVDim = 256;   // query size == key size == value size
   static constexpr int kTopK = 1;
 };
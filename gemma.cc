@@ -27,6 +27,8 @@
 #include "ops.h"
 // copybara:import_next_line:gemma_cpp
 #include "util/args.h"  // Path
+// copybara:import_next_line:gemma_cpp
+#include "util/topology.h"  // InterleaveAcrossNodes
 #include "hwy/contrib/matvec/matvec-inl.h"
 #include "hwy/highway.h"
 #include "hwy/profiler.h"
@@ -42,13 +44,20 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cmath>
+#include <condition_variable>  // NOLINT
 #include <cstdlib>
+#include <cstring>
 #include <filesystem>  // NOLINT
 #include <iostream>
 #include <memory>
+#include <mutex>  // NOLINT
 #include <random>
+#include <sstream>
 #include <string>
+#include <thread>  // NOLINT
+#include <utility>
 #include <vector>
 
 // copybara:import_next_line:gemma_cpp
@@ -65,16 +74,128 @@
 
 namespace gcpp {
 
+// Calls func(TConfig()) with the config of the given model and weight type.
+// Configs are empty structs, so the argument only conveys the type. Every
+// function reached from `func` is instantiated for all supported weights.
+template <template <typename> class TConfig, class Func>
+decltype(auto) CallForWeightType(WeightType weight_type, const Func& func) {
+  switch (weight_type) {
+    case WeightType::kF32:
+      return func(TConfig<float>());
+    case WeightType::kBF16:
+      return func(TConfig<hwy::bfloat16_t>());
+    case WeightType::kSFP:
+      return func(TConfig<SfpStream>());
+    case WeightType::kNUQ:
+      return func(TConfig<NuqStream>());
+    case WeightType::kBF16SFP:
+      return func(TConfig<MixedWeights<hwy::bfloat16_t, SfpStream>>());
+    case WeightType::kBF16NUQ:
+      return func(TConfig<MixedWeights<hwy::bfloat16_t, NuqStream>>());
+    case WeightType::kI8:
+      return func(TConfig<I8Stream>());
+  }
+  HWY_ABORT("Weight type %d unknown.", static_cast<int>(weight_type));
+}
+
+template <class Func>
+decltype(auto) CallForConfig(Model model, WeightType weight_type,
+                             const Func& func) {
+  switch (model) {
+    case Model::GEMMA_2B:
+      return CallForWeightType<ConfigGemma2B>(weight_type, func);
+    case Model::GEMMA_7B:
+      return CallForWeightType<ConfigGemma7B>(weight_type, func);
+  }
+  HWY_ABORT("Model type %d unknown.", static_cast<int>(model));
+}
+
+template <class TConfig>
+ModelHeader MakeModelHeader(Model model) {
+  ModelHeader header;
+  header.model = static_cast<uint32_t>(model);
+  header.weight_type =
+      static_cast<uint32_t>(WeightTypeOf<typename TConfig::WeightT>());
+  header.vocab_size = TConfig::kVocabSize;
+  header.layers = TConfig::kLayers;
+  header.model_dim = TConfig::kModelDim;
+  header.ff_hidden_dim = TConfig::kFFHiddenDim;
+  header.heads = TConfig::kHeads;
+  header.kv_heads = TConfig::kKVHeads;
+  header.qkv_dim = TConfig::kQKVDim;
+  header.seq_len = TConfig::kSeqLen;
+  return header;
+}
+
+// Blob key of the ModelHeader within the compressed weights file.
+static constexpr const char* kModelHeaderKey = "model_header";
+
+// First blob of a file written by SaveKVCache. It is followed by the keys and
+// then the values of each cached page, stored as `kv_type`.
+struct KVCacheHeader {
+  static constexpr uint32_t kVersion = 1;
+
+  uint32_t version = kVersion;
+  uint32_t kv_type;  // WeightType of the stored elements: kF32 or kBF16
+  uint32_t layers;
+  uint32_t kv_heads;
+  uint32_t qkv_dim;
+  uint32_t num_positions;
+  uint32_t num_pages;  // of kKVPagePositions, may be fewer than num_positions
+  uint32_t sink_pages;    // see KVCache::SetWindow
+  uint32_t window_pages;  // 0 if there is no window
+  uint32_t reserved = 0;
+};
+
+static constexpr const char* kKVCacheHeaderKey = "kv_header";
+
+// Blob key of the keys or values of page `page` for SaveKVCache.
+static hwy::uint128_t KVPageKey(const char* prefix, size_t page) {
+  char key[17];
+  snprintf(key, sizeof(key), "%s%zu", prefix, page);
+  return MakeKey(key);
+}
+
+// Calls func(T()) with the KV element type T that `kv_type` denotes.
+template <class Func>
+decltype(auto) CallForKVType(WeightType kv_type, const Func& func) {
+  switch (kv_type) {
+    case WeightType::kF32:
+      return func(float());
+    case WeightType::kBF16:
+      return func(hwy::bfloat16_t());
+    default:
+      break;
+  }
+  HWY_ABORT("KV type %d unknown.", static_cast<int>(kv_type));
+}
+
 template <class TConfig>
 struct Layer {
   Layer() = default;
   static constexpr size_t kHeads = TConfig::kHeads;
+  static constexpr size_t kKVHeads = TConfig::kKVHeads;
   static constexpr size_t kModelDim = TConfig::kModelDim;
   static constexpr size_t kQKVDim = TConfig::kQKVDim;
   static constexpr size_t kFFHiddenDim = TConfig::kFFHiddenDim;
+  static_assert(kKVHeads != 0 && kHeads % kKVHeads == 0,
+                "Each KV head must serve the same number of query heads");
   static constexpr size_t kAttVecEinsumWSize = kHeads * kQKVDim * kModelDim;
-  // 3x for (query, key, value)
-  static constexpr size_t kQKVEinsumWSize = 3 * kHeads * kQKVDim * kModelDim;
+  // One query per head, one key and value per KV head. If kKVHeads ==
+  // kHeads, the rows are [head][query, key, value]; otherwise (MQA/GQA) the
+  // queries of all heads come first, then [kv_head][key, value].
+  static constexpr size_t kQKVEinsumWSize =
+      (kHeads + 2 * kKVHeads) * kQKVDim * kModelDim;
+  // Offsets of the query, key and value rows within kQKVEinsumWSize / kModelDim
+  // outputs. The value follows the key.
+  static constexpr size_t kQKVStride = (kHeads + 2 * kKVHeads) * kQKVDim;
+  static constexpr size_t QOffset(size_t head) {
+    return kHeads == kKVHeads ? head * 3 * kQKVDim : head * kQKVDim;
+  }
+  static constexpr size_t KOffset(size_t kv_head) {
+    return kHeads == kKVHeads ? kv_head * 3 * kQKVDim + kQKVDim
+                              : (kHeads + kv_head * 2) * kQKVDim;
+  }
   // 2x for (gelu gating vector, gated vector)
   static constexpr size_t kGatingEinsumWSize = 2 * kFFHiddenDim * kModelDim;
 
@@ -98,48 +219,115 @@ struct Weights {
   std::array<float, TConfig::kModelDim> final_norm_scale;
 };
 
-// Only called if cached loading fails.
+// Reads the uncompressed weights file, which holds the global tensors and then
+// each layer in turn, one part at a time. Only used if cached loading fails.
 template <typename TConfig>
-hwy::AlignedUniquePtr<Weights<TConfig>> LoadWeights(const Path& checkpoint) {
-  PROFILER_ZONE("Startup.LoadWeights");
-  using TWeights = Weights<TConfig>;
-  hwy::AlignedUniquePtr<TWeights> weights = hwy::MakeUniqueAligned<TWeights>();
-  weights->layers =
-      hwy::MakeUniqueAlignedArray<Layer<TConfig>>(TConfig::kLayers);
-
-  FILE* fptr;
-  fptr = fopen(checkpoint.path.c_str(), "rb");
-  if (fptr == nullptr) {
-    HWY_ABORT("Failed to open model file %s - does it exist?",
-              checkpoint.path.c_str());
-  }
-  bool ok = true;
-  ok &= 1 == fread(&(weights->embedder_input_embedding),
-                   sizeof(weights->embedder_input_embedding), 1, fptr);
-  ok &= 1 == fread(&(weights->final_norm_scale),
-                   sizeof(weights->final_norm_scale), 1, fptr);
-  for (size_t layer = 0; layer < TConfig::kLayers; ++layer) {
-    Layer<TConfig>* layer_view = &weights->layers[layer];
-    ok &= 1 == fread(&layer_view->attn_vec_einsum_w,
-                     sizeof(layer_view->attn_vec_einsum_w), 1, fptr);
-    ok &= 1 == fread(&layer_view->qkv_einsum_w,
-                     sizeof(layer_view->qkv_einsum_w), 1, fptr);
-    ok &= 1 == fread(&layer_view->gating_einsum_w,
-                     sizeof(layer_view->gating_einsum_w), 1, fptr);
-    ok &= 1 ==
-          fread(&layer_view->linear_w, sizeof(layer_view->linear_w), 1, fptr);
-    ok &= 1 == fread(&layer_view->pre_attention_norm_scale,
-                     sizeof(layer_view->pre_attention_norm_scale), 1, fptr);
-    ok &= 1 == fread(&layer_view->pre_ffw_norm_scale,
-                     sizeof(layer_view->pre_ffw_norm_scale), 1, fptr);
+class WeightsReader {
+  using TLayer = Layer<TConfig>;
+  static constexpr size_t kHeads = TLayer::kHeads;
+  static constexpr size_t kKVHeads = TLayer::kKVHeads;
+  // Files written before configs.h used MQA/GQA have the kHeads == kKVHeads
+  // layout, i.e. the keys and values are replicated for each query head.
+  static constexpr size_t kReplicatedQKVSize =
+      3 * kHeads * TLayer::kQKVDim * TLayer::kModelDim;
+
+ public:
+  explicit WeightsReader(const Path& checkpoint) : path_(checkpoint.path) {
+    fptr_ = fopen(path_.c_str(), "rb");
+    if (fptr_ == nullptr) {
+      HWY_ABORT("Failed to open model file %s - does it exist?",
+                path_.c_str());
+    }
+    if constexpr (kKVHeads != kHeads) {
+      std::error_code ec;
+      const uint64_t file_size = std::filesystem::file_size(path_, ec);
+      if (!ec && file_size == ReplicatedKVFileSize()) {
+        fprintf(stderr,
+                "%s has the keys and values of each of the %zu query heads, "
+                "converting to %zu KV heads.\n",
+                path_.c_str(), kHeads, kKVHeads);
+        replicated_qkv_ = hwy::AllocateAligned<float>(kReplicatedQKVSize);
+        HWY_ASSERT(replicated_qkv_);
+      }
+    }
   }
-  if (!ok) {
-    HWY_ABORT("Failed to read from %s - might be a directory, or too small?",
-              checkpoint.path.c_str());
+  ~WeightsReader() { HWY_ASSERT(0 == fclose(fptr_)); }
+  WeightsReader(const WeightsReader&) = delete;
+  WeightsReader& operator=(const WeightsReader&) = delete;
+
+  // Must be called first. Does not touch `weights.layers`.
+  void ReadGlobals(Weights<TConfig>& weights) {
+    Read(weights.embedder_input_embedding);
+    Read(weights.final_norm_scale);
   }
-  HWY_ASSERT(0 == fclose(fptr));
-  return weights;
-}
+
+  // Reads the next layer.
+  void ReadLayer(Layer<TConfig>& layer) {
+    Read(layer.attn_vec_einsum_w);
+    if (replicated_qkv_) {
+      ReadReplicatedQKV(layer.qkv_einsum_w);
+    } else {
+      Read(layer.qkv_einsum_w);
+    }
+    Read(layer.gating_einsum_w);
+    Read(layer.linear_w);
+    Read(layer.pre_attention_norm_scale);
+    Read(layer.pre_ffw_norm_scale);
+  }
+
+ private:
+  static constexpr uint64_t ReplicatedKVFileSize() {
+    using TWeights = Weights<TConfig>;
+    constexpr size_t kExtra = kReplicatedQKVSize - TLayer::kQKVEinsumWSize;
+    return sizeof(TWeights::embedder_input_embedding) +
+           sizeof(TWeights::final_norm_scale) +
+           TConfig::kLayers * (sizeof(TLayer) + kExtra * sizeof(float));
+  }
+
+  template <size_t kNum>
+  void Read(std::array<float, kNum>& tensor) {
+    ReadBytes(tensor.data(), sizeof(tensor));
+  }
+
+  void ReadBytes(void* data, size_t size) {
+    if (1 != fread(data, size, 1, fptr_)) {
+      HWY_ABORT("Failed to read from %s - might be a directory, or too small?",
+                path_.c_str());
+    }
+  }
+
+  // Reads the [head][query, key, value] rows of a file with replicated keys
+  // and values and keeps those of the first query head of each KV head.
+  void ReadReplicatedQKV(
+      std::array<float, TLayer::kQKVEinsumWSize>& qkv_einsum_w) {
+    constexpr size_t kModelDim = TLayer::kModelDim;
+    constexpr size_t kSize = TLayer::kQKVDim * kModelDim;  // q, k or v
+    ReadBytes(replicated_qkv_.get(), kReplicatedQKVSize * sizeof(float));
+    const float* in = replicated_qkv_.get();
+    for (size_t head = 0; head < kHeads; ++head) {
+      const float* head_in = in + head * 3 * kSize;
+      hwy::CopyBytes(head_in, qkv_einsum_w.data() +
+                                  TLayer::QOffset(head) * kModelDim,
+                     kSize * sizeof(float));
+      const size_t kv_head = head / (kHeads / kKVHeads);
+      float* kv_out =
+          qkv_einsum_w.data() + TLayer::KOffset(kv_head) * kModelDim;
+      if (head % (kHeads / kKVHeads) == 0) {
+        hwy::CopyBytes(head_in + kSize, kv_out, 2 * kSize * sizeof(float));
+      } else if (memcmp(head_in + kSize, kv_out, 2 * kSize * sizeof(float)) !=
+                 0) {
+        HWY_ABORT("%s: keys and values of query head %zu differ from those "
+                  "of its KV head %zu, hence the file is of another model.",
+                  path_.c_str(), head, kv_head);
+      }
+    }
+  }
+
+  std::string path_;
+  FILE* fptr_;
+  // Only allocated for files with replicated keys and values.
+  hwy::AlignedFreeUniquePtr<float[]> replicated_qkv_;
+};
 
 template <class TConfig>
 struct CompressedLayer {
@@ -150,14 +338,30 @@ struct CompressedLayer {
   static constexpr size_t kModelDim = TConfig::kModelDim;
   static constexpr size_t kFFHiddenDim = TConfig::kFFHiddenDim;
 
+  // Each tensor's type is also encoded in its blob key (see CacheKey), and the
+  // kernels are instantiated for the type of the CompressedArray they are
+  // passed, so attention and FFW may differ.
+  using AttnWeightT = typename TConfig::AttnWeightT;
+  using FFWWeightT = typename TConfig::FFWWeightT;
+
+  // NUQ decodes whole groups, so every row and row offset must be a multiple.
+  static_assert((!hwy::IsSame<AttnWeightT, NuqStream>() &&
+                 !hwy::IsSame<FFWWeightT, NuqStream>()) ||
+                    (kModelDim % kGroupSize == 0 &&
+                     kFFHiddenDim % kGroupSize == 0 &&
+                     TConfig::kQKVDim % kGroupSize == 0),
+                "NuqStream requires dimensions that are multiples of "
+                "kGroupSize");
+
   // Compressed Parameters
   // We don't yet have an RMSNorm that accepts all WeightT.
   CompressedArray<hwy::bfloat16_t, kModelDim> c_pre_attention_norm_scale;
   CompressedArray<hwy::bfloat16_t, kModelDim> c_pre_ffw_norm_scale;
-  CompressedArray<WeightT, TLayer::kGatingEinsumWSize> c_gating_einsum_w;
-  CompressedArray<WeightT, kModelDim * kFFHiddenDim> c_linear_w;
-  CompressedArray<WeightT, TLayer::kQKVEinsumWSize> c_qkv_einsum_w;
-  CompressedArray<WeightT, TLayer::kAttVecEinsumWSize> c_attn_vec_einsum_w;
+  CompressedArray<FFWWeightT, TLayer::kGatingEinsumWSize> c_gating_einsum_w;
+  CompressedArray<FFWWeightT, kModelDim * kFFHiddenDim> c_linear_w;
+  CompressedArray<AttnWeightT, TLayer::kQKVEinsumWSize> c_qkv_einsum_w;
+  CompressedArray<AttnWeightT, TLayer::kAttVecEinsumWSize>
+      c_attn_vec_einsum_w;
 };
 
 // Array instead of single large allocation for parallel mem init. Split out of
@@ -168,6 +372,11 @@ struct CompressedLayerPointers {
   explicit CompressedLayerPointers(hwy::ThreadPool& pool) {
     pool.Run(0, TConfig::kLayers, [this](uint64_t task, size_t /*thread*/) {
       this->c_layers[task] = hwy::AllocateAligned<CompressedLayer<TConfig>>(1);
+      // Before first touch, so that the OS places the pages accordingly.
+      InterleaveAcrossNodes(this->c_layers[task].get(),
+                            sizeof(CompressedLayer<TConfig>));
+      // Default-init does not touch the (possibly unused) array storage.
+      new (this->c_layers[task].get()) CompressedLayer<TConfig>;
     });
   }
 
@@ -175,15 +384,89 @@ struct CompressedLayerPointers {
   std::array<hwy::AlignedFreeUniquePtr<CLayer[]>, TConfig::kLayers> c_layers;
 };
 
+// Lets inference wait for layers that are still being read in the background
+// (see AsyncWeightLoader).
+class LayerLoadProgress {
+ public:
+  // Called by the loading thread once all layers < `num_layers` are loaded.
+  void SetLayersReady(size_t num_layers) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      num_ready_.store(num_layers, std::memory_order_release);
+    }
+    cv_.notify_all();
+  }
+
+  // Blocks until `layer` is loaded.
+  void WaitForLayer(size_t layer) const {
+    if (layer < num_ready_.load(std::memory_order_acquire)) return;
+    PROFILER_ZONE("Gen.WaitForLayer");
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this, layer] {
+      return layer < num_ready_.load(std::memory_order_acquire);
+    });
+  }
+
+ private:
+  std::atomic<size_t> num_ready_{0};
+  mutable std::mutex mutex_;
+  mutable std::condition_variable cv_;
+};
+
+// Reads the layers' enqueued tensors in order on a background thread so that
+// inference can begin before the last layer is loaded. The destructor waits
+// for the thread.
+class AsyncWeightLoader {
+ public:
+  // `layer_end[i]` is the end of the read requests of layer i; layer 0 begins
+  // at `begin`.
+  AsyncWeightLoader(std::unique_ptr<CacheLoader> loader, size_t begin,
+                    std::vector<size_t> layer_end)
+      : loader_(std::move(loader)), layer_end_(std::move(layer_end)) {
+    thread_ = std::thread([this, begin]() {
+      // Separate from the inference pool, which may run concurrently.
+      hwy::ThreadPool io_pool(kIOThreads);
+      size_t layer_begin = begin;
+      for (size_t layer = 0; layer < layer_end_.size(); ++layer) {
+        if (!loader_->ReadRange(io_pool, layer_begin, layer_end_[layer])) {
+          HWY_ABORT("Failed to read layer %zu of the compressed weights.",
+                    layer);
+        }
+        layer_begin = layer_end_[layer];
+        progress_.SetLayersReady(layer + 1);
+      }
+    });
+  }
+
+  ~AsyncWeightLoader() { thread_.join(); }
+
+  const LayerLoadProgress& Progress() const { return progress_; }
+
+ private:
+  static constexpr size_t kIOThreads = 4;
+
+  std::unique_ptr<CacheLoader> loader_;
+  std::vector<size_t> layer_end_;
+  LayerLoadProgress progress_;
+  std::thread thread_;  // last, so it starts after the others are initialized
+};
+
 template <class TConfig>
 struct CompressedWeights {
-  // No ctor/dtor, allocated via AllocateAligned.
+  // Constructed via placement new into AllocateAligned memory. No dtor: the
+  // owner calls that of c_layer_ptrs.
+  explicit CompressedWeights(hwy::ThreadPool& pool) : c_layer_ptrs(pool) {}
 
   CompressedArray<EmbedderInputT, TConfig::kVocabSize * TConfig::kModelDim>
       c_embedder_input_embedding;
 
   CompressedArray<hwy::bfloat16_t, TConfig::kModelDim> c_final_norm_scale;
 
+  // Non-null if layers are still being loaded in the background.
+  const LayerLoadProgress* load_progress = nullptr;
+  // Set by GemmaImpl, which owns the table; unused by CompressWeights.
+  const RopeTable* rope = nullptr;
+
   // Must be last so that the other arrays remain aligned.
   CompressedLayerPointers<TConfig> c_layer_ptrs;
 
@@ -195,58 +478,180 @@ struct CompressedWeights {
   }
 };
 
-// Aligned.
-template <class TConfig, size_t TBatchSize>
+// Upper bound on the number of position ranges into which attention splits
+// each (token, head) pair, see AttentionSplits.
+constexpr size_t kMaxAttentionSplits = 8;
+
+// Scratch buffers for up to `batch_size` tokens, carved from one aligned
+// allocation. Each session creates them once and reuses them for prefill and
+// decode across all calls.
+template <class TConfig>
 struct Activations {
-  static constexpr size_t kBatchSize = TBatchSize;
   using LayerConfig = Layer<TConfig>;
   static constexpr size_t kModelDim = TConfig::kModelDim;
   static constexpr size_t kQKVDim = TConfig::kQKVDim;
   static constexpr size_t kHeads = TConfig::kHeads;
   static constexpr size_t kKVHeads = TConfig::kKVHeads;
-  static constexpr size_t kCachePosSize = TConfig::kLayers * kKVHeads * kQKVDim;
-  static constexpr size_t kCacheLayerSize = kKVHeads * kQKVDim;
-
-  std::array<float, kBatchSize * kModelDim> x;  // input
-  std::array<float, kBatchSize * kModelDim> pre_att_rms_out;
-  std::array<float, kBatchSize * kHeads * kQKVDim> q;  // query vector
-  std::array<float, kBatchSize * kHeads * TConfig::kSeqLen>
-      att;                                                   // attention vector
-  std::array<float, kBatchSize * kHeads * kQKVDim> att_out;  // attention output
-  std::array<float, kHeads * kBatchSize * kModelDim>
-      att_post1;  // attention output after linear transformation, per head
-  std::array<float, kBatchSize * kModelDim>
-      att_post2;  // accumulation of attention outputs over heads
-  std::array<hwy::bfloat16_t, kBatchSize * kModelDim> bf_pre_ffw_rms_out;
-  std::array<float, kBatchSize * TConfig::kFFHiddenDim * 2> ffw_hidden;
-  // bf_ version can't be used until GeluMulToBF16 issue in FFW() is resolved.
-  // std::array<hwy::bfloat16_t, kBatchSize * 2 * TConfig::kFFHiddenDim>
-  //     bf_ffw_hidden;
-  std::array<float, kBatchSize * kModelDim> ffw_out;
-  std::array<float, kBatchSize * TConfig::kVocabSize> logits;
+  // Whether the matmuls may use int8 activations, see UseInt8Activations.
+  static constexpr bool kI8 =
+      hwy::IsSame<typename TConfig::AttnWeightT, I8Stream>() ||
+      hwy::IsSame<typename TConfig::FFWWeightT, I8Stream>();
+  // Largest number of columns of the matrices.
+  static constexpr size_t kMaxCols =
+      HWY_MAX(HWY_MAX(kModelDim, kHeads * kQKVDim), TConfig::kFFHiddenDim);
+
+  explicit Activations(size_t batch_size)
+      : batch_size(batch_size) {
+    // The first pass computes the total size, the second assigns pointers.
+    for (int pass = 0; pass < 2; ++pass) {
+      size_t bytes = 0;
+      Carve(x, batch_size * kModelDim, bytes);
+      Carve(pre_att_rms_out, batch_size * kModelDim, bytes);
+      Carve(qkv, batch_size * LayerConfig::kQKVStride, bytes);
+      Carve(q_sink, batch_size * kHeads * kQKVDim, bytes);
+      Carve(rope_cos_sin, batch_size * 2 * kQKVDim, bytes);
+      Carve(att_out, batch_size * kHeads * kQKVDim, bytes);
+      Carve(att_partial, batch_size * kHeads * kMaxAttentionSplits * kQKVDim,
+            bytes);
+      Carve(att_partial_stats, batch_size * kHeads * kMaxAttentionSplits * 2,
+            bytes);
+      Carve(att_post2, batch_size * kModelDim, bytes);
+      Carve(bf_pre_ffw_rms_out, batch_size * kModelDim, bytes);
+      Carve(bf_ffw_hidden, batch_size * TConfig::kFFHiddenDim, bytes);
+      Carve(ffw_out, batch_size * kModelDim, bytes);
+      Carve(logits, batch_size * TConfig::kVocabSize, bytes);
+      if (kI8) {
+        Carve(int8.values, batch_size * kMaxCols, bytes);
+        Carve(int8.scales, batch_size, bytes);
+      }
+      if (pass == 0) {
+        arena = hwy::AllocateAligned<uint8_t>(bytes);
+        HWY_ASSERT(arena);
+        hwy::ZeroBytes(arena.get(), bytes);
+      }
+    }
+  }
+
+  const size_t batch_size;
+  float* x;  // input
+  float* pre_att_rms_out;
+  float* qkv;        // query, key and value vectors, see Layer::QOffset
+  float* q_sink;     // queries for the attention sinks, see AttentionBatch
+  float* rope_cos_sin;  // per token: RoPE table row for the query and sinks
+  float* att_out;    // attention output
+  // Per split: unnormalized weighted sum of values, and softmax (max, sum).
+  float* att_partial;
+  float* att_partial_stats;
+  float* att_post2;  // accumulation of attention outputs over heads
+  hwy::bfloat16_t* bf_pre_ffw_rms_out;
+  hwy::bfloat16_t* bf_ffw_hidden;  // gated GELU output
+  float* ffw_out;
+  float* logits;
+  Int8Scratch int8;  // null unless kI8
+
+ private:
+  // Points `ptr` at the next `num` elements of the arena (if allocated).
+  template <typename T>
+  void Carve(T*& ptr, size_t num, size_t& bytes) {
+    ptr = arena ? reinterpret_cast<T*>(arena.get() + bytes) : nullptr;
+    bytes += hwy::RoundUpTo(num * sizeof(T), HWY_ALIGNMENT);
+  }
+
+  hwy::AlignedFreeUniquePtr<uint8_t[]> arena;
+};
+
+// The mutable state of one Session. SessionImpl is a template because the
+// size of the activations depends on the config.
+struct SessionInterface {
+  SessionInterface(KVCache kv_cache, Model model, WeightType weight_type)
+      : kv_cache(std::move(kv_cache)), model(model), weight_type(weight_type) {}
+  virtual ~SessionInterface() = default;
+
+  KVCache kv_cache;
+  // Identify the SessionImpl specialization, as for GemmaInterface.
+  const Model model;
+  const WeightType weight_type;
+};
+
+template <class Config>
+struct SessionImpl : public SessionInterface {
+  SessionImpl(std::shared_ptr<KVPagePool> kv_pool, Model model,
+              WeightType weight_type);
+
+  // Shared by prefill and decode.
+  Activations<Config> activations;
 };
 
 // GemmaImpl is a template and thus cannot be exposed in gemma.h, hence we
-// define an abstract base class.
+// define an abstract base class. Its state is read-only after construction,
+// hence the const member functions may be called concurrently as long as each
+// caller passes its own session.
 struct GemmaInterface {
+  GemmaInterface(Model model, WeightType weight_type)
+      : model(model), weight_type(weight_type) {}
   virtual ~GemmaInterface() = default;
 
   virtual const sentencepiece::SentencePieceProcessor& Tokenizer() const = 0;
+  // Returns the SessionImpl matching this GemmaImpl.
+  virtual std::unique_ptr<SessionInterface> CreateSession(
+      std::shared_ptr<KVPagePool> kv_pool) const = 0;
 
   // TODO: group pool/callbacks into struct
-  virtual void Generate(const InferenceArgs& args,
+  virtual void Generate(SessionInterface& session, const InferenceArgs& args,
                         const std::vector<int>& prompt, size_t start_pos,
                         hwy::ThreadPool& pool, hwy::ThreadPool& inner_pool,
                         const StreamFunc& stream_token,
                         const AcceptFunc& accept_token, std::mt19937& gen,
-                        int verbosity) = 0;
+                        int verbosity, PrefixCache* prefix_cache,
+                        GenerationMetrics* metrics) const = 0;
+
+  virtual void GenerateBatch(SessionInterface& session,
+                             const InferenceArgs& args,
+                             std::vector<BatchSequence>& sequences,
+                             hwy::ThreadPool& pool, hwy::ThreadPool& inner_pool,
+                             const AcceptFunc& accept_token,
+                             int verbosity) const = 0;
+
+  // Building blocks for GenerateGemmaSpeculative, which steps two models.
+  // Runs `num_tokens` tokens at consecutive positions starting at `pos`
+  // through the model, using the KV cache of `session`. If `logits`, also
+  // computes the logits of each token, which requires
+  // num_tokens <= kPrefillBatchSize.
+  virtual void Forward(SessionInterface& session, const int* tokens,
+                       size_t num_tokens, size_t pos, bool logits,
+                       hwy::ThreadPool& pool) const = 0;
+  // As above, but for up to kPrefillBatchSize tokens each with their own
+  // position and KV cache (see TransformerBatch). Computes logits for the
+  // first `num_logits` tokens.
+  virtual void ForwardBatch(SessionInterface& session, const int* tokens,
+                            const size_t* positions, KVCache* const* kv_caches,
+                            size_t num_tokens, size_t num_logits,
+                            hwy::ThreadPool& pool) const = 0;
+  // Samples from the logits of token `token_idx` of the last Forward of
+  // `session` and sets `prob` to the probability of the returned token.
+  virtual int Sample(const SessionInterface& session, size_t token_idx,
+                     const InferenceArgs& args, const AcceptFunc& accept_token,
+                     std::mt19937& gen, float& prob) const = 0;
+
+  // Whether `session` is a SessionImpl of the same config, as the entry
+  // points expect. Sessions must not be passed to another model.
+  bool Matches(const SessionInterface& session) const {
+    return session.model == model && session.weight_type == weight_type;
+  }
+
+  // Identify the GemmaImpl specialization, see CallForConfig.
+  const Model model;
+  const WeightType weight_type;
 };
 
 template <class Config>
 struct GemmaImpl : public GemmaInterface {
-  GemmaImpl(const LoaderArgs& args, hwy::ThreadPool& pool);
+  GemmaImpl(const LoaderArgs& args, Model model, WeightType weight_type,
+            hwy::ThreadPool& pool);
 
   ~GemmaImpl() {
+    // Waits until the background load (if any) no longer writes the weights.
+    async_loader.reset();
     using CWeights = CompressedWeights<Config>;
     CWeights* c_weights = reinterpret_cast<CWeights*>(compressed_weights.get());
     c_weights->c_layer_ptrs.~CompressedLayerPointers<Config>();
@@ -255,19 +660,44 @@ struct GemmaImpl : public GemmaInterface {
   const sentencepiece::SentencePieceProcessor& Tokenizer() const {
     return tokenizer;
   }
+  std::unique_ptr<SessionInterface> CreateSession(
+      std::shared_ptr<KVPagePool> kv_pool) const {
+    return std::make_unique<SessionImpl<Config>>(std::move(kv_pool), model,
+                                                 weight_type);
+  }
 
-  void Generate(const InferenceArgs& args, const std::vector<int>& prompt,
-                size_t start_pos, hwy::ThreadPool& pool,
-                hwy::ThreadPool& inner_pool, const StreamFunc& stream_token,
-                const AcceptFunc& accept_token, std::mt19937&, int verbosity);
+  void Generate(SessionInterface& session, const InferenceArgs& args,
+                const std::vector<int>& prompt, size_t start_pos,
+                hwy::ThreadPool& pool, hwy::ThreadPool& inner_pool,
+                const StreamFunc& stream_token, const AcceptFunc& accept_token,
+                std::mt19937&, int verbosity, PrefixCache* prefix_cache,
+                GenerationMetrics* metrics) const;
+
+  void GenerateBatch(SessionInterface& session, const InferenceArgs& args,
+                     std::vector<BatchSequence>& sequences,
+                     hwy::ThreadPool& pool, hwy::ThreadPool& inner_pool,
+                     const AcceptFunc& accept_token, int verbosity) const;
+
+  void Forward(SessionInterface& session, const int* tokens, size_t num_tokens,
+               size_t pos, bool logits, hwy::ThreadPool& pool) const;
+  void ForwardBatch(SessionInterface& session, const int* tokens,
+                    const size_t* positions, KVCache* const* kv_caches,
+                    size_t num_tokens, size_t num_logits,
+                    hwy::ThreadPool& pool) const;
+  int Sample(const SessionInterface& session, size_t token_idx,
+             const InferenceArgs& args, const AcceptFunc& accept_token,
+             std::mt19937& gen, float& prob) const;
 
   sentencepiece::SentencePieceProcessor tokenizer;
 
+  // If non-null, compressed_weights point into this. Declared first because
+  // they are initialized as a side effect of loading compressed_weights.
+  std::unique_ptr<MappedFile> weights_mapping;
+  std::unique_ptr<AsyncWeightLoader> async_loader;
   // CompressedWeights<Config>
   hwy::AlignedFreeUniquePtr<uint8_t[]> compressed_weights;
-  hwy::AlignedUniquePtr<Activations<Config, kPrefillBatchSize>> prefill;
-  hwy::AlignedUniquePtr<Activations<Config, 1>> state;
-  KVCache kv_cache;
+  // Shared by all sessions, hence not part of Activations.
+  const RopeTable rope;
 };
 
 }  // namespace gcpp
@@ -278,239 +708,369 @@ HWY_BEFORE_NAMESPACE();
 namespace gcpp {
 namespace HWY_NAMESPACE {
 
-template <class TConfig, size_t kBatchSize>
-HWY_NOINLINE void Attention(size_t batch_start, size_t batch_idx, size_t layer,
-                            Activations<TConfig, kBatchSize>& activations,
-                            const CompressedLayer<TConfig>* c_layer,
-                            KVCache& kv_cache, hwy::ThreadPool& pool) {
-  PROFILER_ZONE("Gen.Attention");
-  const size_t pos = batch_start + batch_idx;
-  HWY_DASSERT(batch_idx < kBatchSize);
-  static constexpr size_t kQKVDim = gcpp::Activations<TConfig, 1>::kQKVDim;
-  static constexpr size_t kCachePosSize =
-      gcpp::Activations<TConfig, kBatchSize>::kCachePosSize;
-  static constexpr size_t kCacheLayerSize =
-      gcpp::Activations<TConfig, kBatchSize>::kCacheLayerSize;
+// Returns into how many position ranges to split each of the `num_tasks`
+// (token, head) pairs: enough for all threads to have work, but no more than
+// there are KV pages, because each range covers at least one page.
+HWY_INLINE size_t AttentionSplits(size_t num_tasks, size_t num_threads,
+                                  size_t num_pages) {
+  const size_t splits =
+      hwy::DivCeil(HWY_MAX(num_threads, size_t{1}), num_tasks);
+  return HWY_MIN(HWY_MIN(splits, num_pages), kMaxAttentionSplits);
+}
+
+// Attention for `num_tokens` tokens, each at its own position and with its own
+// KV cache. The tokens may also belong to the same sequence (then positions
+// must be consecutive), because all keys and values are written to the caches
+// before any token attends to them.
+//
+// If a cache with a window has evicted positions, tokens attend to its sinks
+// followed by [WindowBegin(), pos]. Keys keep the rotation of their absolute
+// position, hence the query for the window is rotated as usual. For the
+// sinks, a second query is rotated as if they directly preceded the window,
+// so that all relative positions stay within the window plus sinks, as in
+// training, however long the sequence.
+template <class TConfig>
+HWY_NOINLINE void AttentionBatch(const size_t* positions, size_t num_tokens,
+                                 size_t layer,
+                                 Activations<TConfig>& activations,
+                                 const CompressedLayer<TConfig>* c_layer,
+                                 const RopeTable& rope,
+                                 KVCache* const* kv_caches,
+                                 hwy::ThreadPool& pool) {
+  PROFILER_ZONE("Gen.AttentionBatch");
+  HWY_DASSERT(num_tokens <= activations.batch_size);
+  static constexpr size_t kQKVDim = gcpp::Activations<TConfig>::kQKVDim;
   static constexpr size_t kModelDim =
-      gcpp::Activations<TConfig, kBatchSize>::kModelDim;
+      gcpp::Activations<TConfig>::kModelDim;
   static constexpr size_t kHeads = TConfig::kHeads;
+  static constexpr size_t kKVHeads = TConfig::kKVHeads;
+  // Consecutive query heads share one KV head.
+  static constexpr size_t kHeadsPerKV = kHeads / kKVHeads;
+  using LayerConfig = Layer<TConfig>;
+  static constexpr size_t kQKVStride = LayerConfig::kQKVStride;
   const float kQueryScale = 1.0 / sqrtf(static_cast<float>(kQKVDim));
 
-  pool.Run(0, kHeads, [&](const uint64_t head, size_t /*thread*/) HWY_ATTR {
-    // linear projections to QKV
-    const size_t head_offset =
-        3 * kQKVDim * kModelDim;  // 3x for QKV dimensions
-    const size_t q_offset = head * head_offset + 0 * kQKVDim * kModelDim;
-    const size_t k_offset = head * head_offset + 1 * kQKVDim * kModelDim;
-    const size_t v_offset = head * head_offset + 2 * kQKVDim * kModelDim;
-
-    float* HWY_RESTRICT q =
-        activations.q.data() + head * kQKVDim + batch_idx * kHeads * kQKVDim;
-
-    const size_t batch_offset = batch_idx * kModelDim;
-
-    MatVecLoop<kQKVDim, kModelDim>(
-        c_layer->c_qkv_einsum_w, q_offset,
-        activations.pre_att_rms_out.data() + batch_offset, q);
-
-    const size_t kv_offset =
-        pos * kCachePosSize + layer * kCacheLayerSize + head * kQKVDim;
-
-    TwoOfsMatVecLoop<kQKVDim, kModelDim>(
-        c_layer->c_qkv_einsum_w, k_offset, v_offset,
-        activations.pre_att_rms_out.data() + batch_offset,
-        kv_cache.key_cache.get() + kv_offset,
-        kv_cache.value_cache.get() + kv_offset);
-
-    // Calculate scores
-    float* HWY_RESTRICT head_att = activations.att.data() +
-                                   head * TConfig::kSeqLen +
-                                   batch_idx * kHeads * kQKVDim;
-
-    Rope(q, kQKVDim, pos);
-    Rope(kv_cache.key_cache.get() + kv_offset, kQKVDim, pos);
-    MulByConst(kQueryScale, q, kQKVDim);
-    // Compute Q dot K scores
-    for (size_t pos2 = 0; pos2 <= pos; ++pos2) {
-      const size_t cache_offset =
-          pos2 * kCachePosSize + layer * kCacheLayerSize + head * kQKVDim;
-      const float* HWY_RESTRICT k2 = kv_cache.key_cache.get() + cache_offset;
-      const float score = Dot(q, k2, kQKVDim);
-      head_att[pos2] = score;
-    }
-    Softmax(head_att, pos + 1);
-
-    // Weighted summation
-    float* HWY_RESTRICT att_out = activations.att_out.data() + head * kQKVDim +
-                                  batch_idx * kHeads * kQKVDim;
-    hwy::ZeroBytes(att_out, kQKVDim * sizeof(*att_out));
-    for (size_t pos2 = 0; pos2 <= pos; ++pos2) {
-      const size_t cache_offset =
-          pos2 * kCachePosSize + layer * kCacheLayerSize + head * kQKVDim;
-      float* HWY_RESTRICT v2 = kv_cache.value_cache.get() + cache_offset;
-      MulByConstAndAdd(head_att[pos2], v2, att_out, kQKVDim);
-    }
-    // linear projection from kQKVDim back to kModelDim, sum projections
-    // across heads
-    float* HWY_RESTRICT head_out =
-        head == 0
-            ? activations.att_post2.data() + batch_idx * kModelDim
-            : activations.att_post1.data() + head * kBatchSize * kModelDim;
-    MatVecLoop<kModelDim, kQKVDim>(c_layer->c_attn_vec_einsum_w,
-                                   head * kModelDim * kQKVDim, att_out,
-                                   head_out);
-  });
+  // RoPE angles of each token, and for its sink query if any (see above).
+  for (size_t batch_idx = 0; batch_idx < num_tokens; ++batch_idx) {
+    const size_t pos = positions[batch_idx];
+    const KVCache& kv_cache = *kv_caches[batch_idx];
+    float* HWY_RESTRICT cos_sin =
+        activations.rope_cos_sin + 2 * batch_idx * kQKVDim;
+    rope.CosSin(pos, cos_sin);
+    const size_t window_begin = kv_cache.WindowBegin();
+    if (window_begin != 0) {
+      rope.CosSin(kv_cache.SinkPositions() + pos - window_begin,
+                  cos_sin + kQKVDim);
+    }
+  }
 
-  // accumulate output across all heads into att_post2. head 0 already wrote
-  // directly to att_post2.
-  for (size_t head = 1; head < kHeads; ++head) {
-    AddFrom(activations.att_post1.data() + head * kBatchSize * kModelDim,
-            activations.att_post2.data() + batch_idx * kModelDim, kModelDim);
+  // Linear projections to QKV for all heads and tokens. Keys and values are
+  // only computed once per KV head. The epilogue applies RoPE and the query
+  // scale, and stores keys and values to the KV caches, while the projections
+  // are still in L1. Each block of kQKVDim rows is the query, key or value of
+  // one head, see Layer::QOffset.
+  static constexpr size_t kHalf = kQKVDim / 2;
+  const auto epilogue = [&](size_t batch_idx, size_t block, size_t i,
+                            size_t num, float* HWY_RESTRICT lo,
+                            float* HWY_RESTRICT hi) HWY_ATTR {
+    size_t head;
+    size_t kind;  // 0 = query, 1 = key, 2 = value
+    if constexpr (kHeads == kKVHeads) {
+      head = block / 3;
+      kind = block % 3;
+    } else {
+      head = block < kHeads ? block : (block - kHeads) / 2;
+      kind = block < kHeads ? 0 : 1 + (block - kHeads) % 2;
+    }
+    const size_t pos = positions[batch_idx];
+    KVCache& kv_cache = *kv_caches[batch_idx];
+    const float* HWY_RESTRICT cos_sin =
+        activations.rope_cos_sin + 2 * batch_idx * kQKVDim;
+    if (kind == 0) {
+      if (kv_cache.WindowBegin() != 0) {
+        float* HWY_RESTRICT q_sink =
+            activations.q_sink + (batch_idx * kHeads + head) * kQKVDim;
+        hwy::CopyBytes(lo, q_sink + i, num * sizeof(*lo));
+        hwy::CopyBytes(hi, q_sink + kHalf + i, num * sizeof(*hi));
+        RotateAndMulBy(kQueryScale, cos_sin + kQKVDim + i, kHalf, q_sink + i,
+                       q_sink + kHalf + i, num);
+      }
+      RotateAndMulBy(kQueryScale, cos_sin + i, kHalf, lo, hi, num);
+      return;
+    }
+    KVT* HWY_RESTRICT kv = kind == 1 ? kv_cache.Keys(layer, head, pos)
+                                     : kv_cache.Values(layer, head, pos);
+    if (kind == 1) RotateAndMulBy(1.0f, cos_sin + i, kHalf, lo, hi, num);
+    // The KVT codecs are elementwise, hence parts can be stored separately.
+    CompressKV(lo, num, kv + i);
+    CompressKV(hi, num, kv + kHalf + i);
+  };
+  MatMulPairs<kQKVStride, kModelDim, kQKVDim>(
+      c_layer->c_qkv_einsum_w, 0, activations.pre_att_rms_out, kModelDim,
+      num_tokens, activations.qkv, kQKVStride, epilogue, pool,
+      activations.int8);
+
+  // Position ranges are indices into the sequence of attended positions: the
+  // sinks, if any were followed by evicted positions, then the window. Both
+  // are whole pages, hence page-sized tiles do not straddle them.
+  const auto sink_end = [&](size_t batch_idx) {
+    const KVCache& kv_cache = *kv_caches[batch_idx];
+    return kv_cache.WindowBegin() == 0 ? 0 : kv_cache.SinkPositions();
+  };
+  const auto num_attended = [&](size_t batch_idx) {
+    const size_t window_begin = kv_caches[batch_idx]->WindowBegin();
+    return sink_end(batch_idx) + positions[batch_idx] + 1 - window_begin;
+  };
+
+  // Decode only has kHeads tasks per token, too few for many-core. Then each
+  // (token, head) pair is also split into ranges of whole pages, whose partial
+  // results are merged afterwards.
+  size_t max_attended = 0;
+  for (size_t batch_idx = 0; batch_idx < num_tokens; ++batch_idx) {
+    max_attended = HWY_MAX(max_attended, num_attended(batch_idx));
+  }
+  const size_t num_pages = hwy::DivCeil(max_attended, kKVPagePositions);
+  const size_t num_splits =
+      AttentionSplits(num_tokens * kHeads, pool.NumThreads(), num_pages);
+  const size_t split_positions =
+      hwy::DivCeil(num_pages, num_splits) * kKVPagePositions;
+
+  // Scores and weighted sum of values for the attended positions [begin, end)
+  // in a single pass, one page-sized tile at a time. Leaves `out`
+  // unnormalized.
+  const auto attend = [&](size_t batch_idx, size_t head, size_t begin,
+                          size_t end, float* HWY_RESTRICT out,
+                          OnlineSoftmaxState& state) HWY_ATTR {
+    const size_t kv_head = head / kHeadsPerKV;
+    const KVCache& kv_cache = *kv_caches[batch_idx];
+    const size_t sinks = sink_end(batch_idx);
+    const size_t window_begin = kv_cache.WindowBegin();
+    const float* HWY_RESTRICT q_window = activations.qkv +
+                                         batch_idx * kQKVStride +
+                                         LayerConfig::QOffset(head);
+    const float* HWY_RESTRICT q_sink =
+        activations.q_sink + (batch_idx * kHeads + head) * kQKVDim;
+    hwy::ZeroBytes(out, kQKVDim * sizeof(*out));
+    HWY_ALIGN float scores[kKVPagePositions];
+    for (size_t start = begin; start < end; start += kKVPagePositions) {
+      const size_t num = HWY_MIN(kKVPagePositions, end - start);
+      const bool is_sink = start < sinks;
+      const float* HWY_RESTRICT q = is_sink ? q_sink : q_window;
+      const size_t first = is_sink ? start : start - sinks + window_begin;
+      AttendTile<kQKVDim>(
+          q, num,
+          [&](size_t i) { return kv_cache.Keys(layer, kv_head, first + i); },
+          [&](size_t i) { return kv_cache.Values(layer, kv_head, first + i); },
+          scores, state, out);
+    }
+  };
+
+  if (num_splits == 1) {
+    pool.Run(0, num_tokens * kHeads,
+             [&](const uint64_t task, size_t /*thread*/) HWY_ATTR {
+               const size_t head = task % kHeads;
+               const size_t batch_idx = task / kHeads;
+               float* HWY_RESTRICT att_out =
+                   activations.att_out + task * kQKVDim;
+               OnlineSoftmaxState state;
+               attend(batch_idx, head, 0, num_attended(batch_idx), att_out,
+                      state);
+               MulByConst(1.0f / state.sum, att_out, kQKVDim);
+             });
+  } else {
+    pool.Run(0, num_tokens * kHeads * num_splits,
+             [&](const uint64_t task, size_t /*thread*/) HWY_ATTR {
+               const size_t split = task % num_splits;
+               const size_t head = (task / num_splits) % kHeads;
+               const size_t batch_idx = task / num_splits / kHeads;
+               const size_t idx = (batch_idx * kHeads + head) *
+                                      kMaxAttentionSplits + split;
+               const size_t end = num_attended(batch_idx);
+               const size_t begin = HWY_MIN(split * split_positions, end);
+               OnlineSoftmaxState state;
+               if (begin != end) {
+                 attend(batch_idx, head, begin,
+                        HWY_MIN(begin + split_positions, end),
+                        activations.att_partial + idx * kQKVDim, state);
+               }
+               // sum == 0 marks an empty range.
+               activations.att_partial_stats[2 * idx + 0] = state.max;
+               activations.att_partial_stats[2 * idx + 1] = state.sum;
+             });
+
+    // Rescale each partial sum to the common max, then normalize.
+    pool.Run(0, num_tokens * kHeads,
+             [&](const uint64_t task, size_t /*thread*/) HWY_ATTR {
+               const size_t idx0 = task * kMaxAttentionSplits;
+               MergeOnlineSoftmax(activations.att_partial + idx0 * kQKVDim,
+                                  activations.att_partial_stats + 2 * idx0,
+                                  num_splits, kQKVDim,
+                                  activations.att_out + task * kQKVDim);
+             });
   }
+
+  // Linear projection from kQKVDim back to kModelDim, summed across heads.
+  MatMulSum<kHeads, kModelDim, kQKVDim>(
+      c_layer->c_attn_vec_einsum_w, 0, activations.att_out,
+      kHeads * kQKVDim, num_tokens, activations.att_post2, kModelDim, pool,
+      activations.int8);
 }
 
-template <typename TConfig, size_t kBatchSize>
-HWY_NOINLINE void FFW(Activations<TConfig, kBatchSize>& activations,
-                      size_t batch_idx, const CompressedLayer<TConfig>* c_layer,
-                      hwy::ThreadPool& pool) {
-  HWY_DASSERT(batch_idx < kBatchSize);
+template <typename TConfig>
+HWY_NOINLINE void FFWBatch(Activations<TConfig>& activations,
+                           size_t num_tokens,
+                           const CompressedLayer<TConfig>* c_layer,
+                           hwy::ThreadPool& pool) {
+  HWY_DASSERT(num_tokens <= activations.batch_size);
   static constexpr size_t kModelDim = TConfig::kModelDim;
   static constexpr size_t kFFHiddenDim = TConfig::kFFHiddenDim;
-  const size_t hidden_offset = batch_idx * kFFHiddenDim * 2;
 
   {
-    PROFILER_ZONE("Gen.FFW.GatedGELU");
-    const hwy::bfloat16_t* HWY_RESTRICT vec =
-        activations.bf_pre_ffw_rms_out.data() + batch_idx * kModelDim;
-    float* HWY_RESTRICT out = activations.ffw_hidden.data() + hidden_offset;
-    float* HWY_RESTRICT out_mul = out + kFFHiddenDim;
-
-    // Same matrix, first and second half of rows. Could fuse into one MatVec,
-    // but separating them could help on NUMA e.g. multiple sockets.
-    MatVec<kFFHiddenDim, kModelDim>(c_layer->c_gating_einsum_w,
-                                    kFFHiddenDim * kModelDim, vec, out_mul,
-                                    pool);
-
-    // Gate, will go through the nonlinearity.
-    MatVec<kFFHiddenDim, kModelDim>(c_layer->c_gating_einsum_w, 0, vec, out,
-                                    pool);
-
-    namespace hn = hwy::HWY_NAMESPACE;
-    using DF = hn::ScalableTag<float>;
-    using VF = hn::Vec<DF>;
-    hn::Transform1(DF(), out, kFFHiddenDim, out_mul,
-                   [](DF df, VF v, VF mul)
-                       HWY_ATTR { return hn::Mul(mul, Gelu(df, v)); });
+    PROFILER_ZONE("Gen.FFWBatch.GatedGELU");
+    // Both halves of the gating matrix at once: per token, the first
+    // kFFHiddenDim outputs go through the nonlinearity and are multiplied
+    // with the second kFFHiddenDim, in the epilogue of the matmul.
+    MatMulGatedGelu<kFFHiddenDim, kModelDim>(
+        c_layer->c_gating_einsum_w, 0, activations.bf_pre_ffw_rms_out,
+        kModelDim, num_tokens, activations.bf_ffw_hidden, kFFHiddenDim, pool,
+        activations.int8);
   }
 
-  PROFILER_ZONE("Gen.FFW\\GatedGELU");
-  MatVec<kModelDim, kFFHiddenDim>(
-      c_layer->c_linear_w, 0, activations.ffw_hidden.data() + hidden_offset,
-      activations.ffw_out.data() + batch_idx * kModelDim, pool);
+  PROFILER_ZONE("Gen.FFWBatch\\GatedGELU");
+  MatMul<kModelDim, kFFHiddenDim>(
+      c_layer->c_linear_w, 0, activations.bf_ffw_hidden, kFFHiddenDim,
+      num_tokens, activations.ffw_out, kModelDim, pool, activations.int8);
 }
 
-template <typename TConfig, size_t kBatchSize>
-HWY_NOINLINE void Prefill(const int* tokens, size_t num_tokens, size_t pos,
-                          const CompressedWeights<TConfig>& c_weights,
-                          Activations<TConfig, kBatchSize>& activations,
-                          KVCache& kv_cache, hwy::ThreadPool& pool,
-                          hwy::ThreadPool& inner_pool) {
-  PROFILER_ZONE("Gen.Prefill\\Att\\FFW");
+// Runs the transformer for `num_tokens` tokens, each at its own position and
+// with its own KV cache, and leaves their final activations in
+// `activations.x`. If `metrics` requests layer_times, adds to them.
+template <class TConfig>
+HWY_NOINLINE void TransformerBatch(const int* tokens, const size_t* positions,
+                                   size_t num_tokens,
+                                   const CompressedWeights<TConfig>& c_weights,
+                                   Activations<TConfig>& activations,
+                                   KVCache* const* kv_caches,
+                                   hwy::ThreadPool& pool,
+                                   GenerationMetrics* metrics = nullptr) {
+  PROFILER_ZONE("Gen.TransformerBatch");
   static constexpr size_t kModelDim = TConfig::kModelDim;
   static const float kEmbScaling = sqrtf(static_cast<float>(kModelDim));
 
+  // Grow the page tables (and copy shared pages) before the layers write keys
+  // and values.
+  for (size_t token_idx = 0; token_idx < num_tokens; ++token_idx) {
+    kv_caches[token_idx]->Reserve(positions[token_idx] + 1);
+    kv_caches[token_idx]->PrepareWrite(positions[token_idx]);
+  }
+
   pool.Run(
       0, num_tokens, [&](const uint64_t token_idx, size_t /*thread*/) HWY_ATTR {
         const int token = tokens[token_idx];
         Decompress(c_weights.c_embedder_input_embedding, token * kModelDim,
-                   activations.x.data() + token_idx * kModelDim, kModelDim);
-        MulByConst(kEmbScaling, activations.x.data() + token_idx * kModelDim,
+                   activations.x + token_idx * kModelDim, kModelDim);
+        MulByConst(kEmbScaling, activations.x + token_idx * kModelDim,
                    kModelDim);
       });
 
+  const bool layer_times = metrics != nullptr && metrics->layer_times;
+  if (layer_times) {
+    metrics->attention_seconds.resize(TConfig::kLayers);
+    metrics->ffw_seconds.resize(TConfig::kLayers);
+  }
+
   for (size_t layer = 0; layer < TConfig::kLayers; ++layer) {
+    if (c_weights.load_progress) c_weights.load_progress->WaitForLayer(layer);
     const CompressedLayer<TConfig>* c_layer = c_weights.CLayer(layer);
 
+    const double t0 = layer_times ? hwy::platform::Now() : 0.0;
     for (size_t token_idx = 0; token_idx < num_tokens; ++token_idx) {
-      RMSNorm(activations.x.data() + token_idx * kModelDim,
+      RMSNorm(activations.x + token_idx * kModelDim,
               c_layer->c_pre_attention_norm_scale.data(),
-              activations.pre_att_rms_out.data() + token_idx * kModelDim,
+              activations.pre_att_rms_out + token_idx * kModelDim,
               kModelDim);
-      Attention<TConfig, kBatchSize>(pos, token_idx, layer, activations,
-                                     c_layer, kv_cache, pool);
-    }
-
-    // TODO: sink the loop into these functions, i.e. make them matmuls.
-    pool.Run(
-        0, num_tokens,
-        [&](const uint64_t token_idx, size_t thread_id) HWY_ATTR {
-          AddFrom(activations.att_post2.data() + token_idx * kModelDim,
-                  activations.x.data() + token_idx * kModelDim, kModelDim);
-          RMSNorm(activations.x.data() + token_idx * kModelDim,
-                  c_layer->c_pre_ffw_norm_scale.data(),
-                  activations.bf_pre_ffw_rms_out.data() + token_idx * kModelDim,
-                  kModelDim);
-          FFW<TConfig, kBatchSize>(activations, token_idx, c_layer, inner_pool);
-          AddFrom(activations.ffw_out.data() + token_idx * kModelDim,
-                  activations.x.data() + token_idx * kModelDim, kModelDim);
-        });
+    }
+    AttentionBatch<TConfig>(positions, num_tokens, layer, activations, c_layer,
+                            *c_weights.rope, kv_caches, pool);
+    const double t1 = layer_times ? hwy::platform::Now() : 0.0;
+
+    for (size_t token_idx = 0; token_idx < num_tokens; ++token_idx) {
+      AddFrom(activations.att_post2 + token_idx * kModelDim,
+              activations.x + token_idx * kModelDim, kModelDim);
+      RMSNorm(activations.x + token_idx * kModelDim,
+              c_layer->c_pre_ffw_norm_scale.data(),
+              activations.bf_pre_ffw_rms_out + token_idx * kModelDim,
+              kModelDim);
+    }
+    FFWBatch<TConfig>(activations, num_tokens, c_layer, pool);
+
+    for (size_t token_idx = 0; token_idx < num_tokens; ++token_idx) {
+      AddFrom(activations.ffw_out + token_idx * kModelDim,
+              activations.x + token_idx * kModelDim, kModelDim);
+    }
+    if (layer_times) {
+      const double t2 = hwy::platform::Now();
+      metrics->attention_seconds[layer] += t1 - t0;
+      metrics->ffw_seconds[layer] += t2 - t1;
+    }
   }  // foreach layer
 
-  pool.Run(
-      0, num_tokens, [&](const uint64_t token_idx, size_t /*thread*/) HWY_ATTR {
-        RMSNormInplace(c_weights.c_final_norm_scale.data(),
-                       activations.x.data() + token_idx * kModelDim, kModelDim);
-      });
+  for (size_t token_idx = 0; token_idx < num_tokens; ++token_idx) {
+    RMSNormInplace(c_weights.c_final_norm_scale.data(),
+                   activations.x + token_idx * kModelDim, kModelDim);
+  }
+}
+
+template <class TConfig>
+HWY_NOINLINE void Prefill(const int* tokens, size_t num_tokens, size_t pos,
+                          const CompressedWeights<TConfig>& c_weights,
+                          Activations<TConfig>& activations,
+                          KVCache& kv_cache, hwy::ThreadPool& pool,
+                          hwy::ThreadPool& /*inner_pool*/,
+                          GenerationMetrics* metrics = nullptr) {
+  PROFILER_ZONE("Gen.Prefill\\Att\\FFW");
+  HWY_DASSERT(num_tokens <= activations.batch_size &&
+              num_tokens <= kPrefillBatchSize);
+  // All tokens are from the same sequence, at consecutive positions.
+  size_t positions[kPrefillBatchSize];
+  KVCache* kv_caches[kPrefillBatchSize];
+  for (size_t token_idx = 0; token_idx < num_tokens; ++token_idx) {
+    positions[token_idx] = pos + token_idx;
+    kv_caches[token_idx] = &kv_cache;
+  }
+  TransformerBatch<TConfig>(tokens, positions, num_tokens, c_weights,
+                            activations, kv_caches, pool, metrics);
 }
 
-// n = 1 specialization
+// Single token.
 template <class TConfig>
 void Transformer(int token, size_t pos,
                  const CompressedWeights<TConfig>& c_weights,
-                 Activations<TConfig, 1>& activations, KVCache& kv_cache,
-                 hwy::ThreadPool& pool, hwy::ThreadPool& inner_pool) {
-  static constexpr size_t kLayers = TConfig::kLayers;
-  static constexpr size_t kModelDim = TConfig::kModelDim;
-
-  static const float kEmbScaling = sqrtf(static_cast<float>(kModelDim));
-
-  Decompress(c_weights.c_embedder_input_embedding, token * kModelDim,
-             activations.x.data(), kModelDim);
-
-  MulByConst(kEmbScaling, activations.x.data(), kModelDim);
-
-  for (size_t layer = 0; layer < kLayers; ++layer) {
-    const CompressedLayer<TConfig>* c_layer = c_weights.CLayer(layer);
-    RMSNorm(activations.x.data(), c_layer->c_pre_attention_norm_scale.data(),
-            activations.pre_att_rms_out.data(), kModelDim);
-    Attention<TConfig, 1>(pos, 0, layer, activations, c_layer, kv_cache, pool);
-    AddFrom(activations.att_post2.data(), activations.x.data(), kModelDim);
-    RMSNorm(activations.x.data(), c_layer->c_pre_ffw_norm_scale.data(),
-            activations.bf_pre_ffw_rms_out.data(), kModelDim);
-    FFW<TConfig, 1>(activations, /* batch_idx = */ 0, c_layer, pool);
-    AddFrom(activations.ffw_out.data(), activations.x.data(), kModelDim);
-  }
-  RMSNormInplace(c_weights.c_final_norm_scale.data(), activations.x.data(),
-                 kModelDim);
+                 Activations<TConfig>& activations, KVCache& kv_cache,
+                 hwy::ThreadPool& pool, hwy::ThreadPool& /*inner_pool*/,
+                 GenerationMetrics* metrics = nullptr) {
+  KVCache* kv_caches[1] = {&kv_cache};
+  TransformerBatch<TConfig>(&token, &pos, 1, c_weights, activations, kv_caches,
+                            pool, metrics);
 }
 
 template <class TConfig>
-void GenerateImpl(GemmaImpl<TConfig>& gemma, const InferenceArgs& args,
+void GenerateImpl(const GemmaImpl<TConfig>& gemma,
+                  SessionImpl<TConfig>& session, const InferenceArgs& args,
                   const std::vector<int>& prompt, size_t pos,
                   hwy::ThreadPool& pool, hwy::ThreadPool& inner_pool,
                   const StreamFunc& stream_token,
                   const AcceptFunc& accept_token, std::mt19937& gen,
-                  int verbosity) {
+                  int verbosity, PrefixCache* prefix_cache,
+                  GenerationMetrics* metrics) {
   static constexpr size_t kModelDim = TConfig::kModelDim;
   static constexpr size_t kVocabSize = TConfig::kVocabSize;
   static constexpr size_t kTopK = TConfig::kTopK;
-  Activations<TConfig, 1>& activations = *gemma.state.get();
-  Activations<TConfig, kPrefillBatchSize>& prefill_activations =
-      *gemma.prefill.get();
+  Activations<TConfig>& activations = session.activations;
   const CompressedWeights<TConfig>& c_weights =
-      *reinterpret_cast<CompressedWeights<TConfig>*>(
+      *reinterpret_cast<const CompressedWeights<TConfig>*>(
           gemma.compressed_weights.get());
-  KVCache& kv_cache = gemma.kv_cache;
+  KVCache& kv_cache = session.kv_cache;
   int token;
 
   // pos indexes the KV cache. In the first turn of a chat, pos = 0.
@@ -526,6 +1086,27 @@ void GenerateImpl(GemmaImpl<TConfig>& gemma, const InferenceArgs& args,
   // always equal.
   size_t pos_offset = 0;  // offset relative to pos
   double prefill_start = hwy::platform::Now();
+  if (metrics != nullptr) {
+    const bool layer_times = metrics->layer_times;
+    *metrics = GenerationMetrics();
+    metrics->layer_times = layer_times;
+    metrics->prompt_tokens = prompt.size();
+  }
+
+  // A new conversation must not see the window of the previous one, which
+  // would also mark its first positions as evicted.
+  if (pos == 0 && kv_cache.WindowBegin() != 0) kv_cache.Release();
+
+  // A new conversation can skip the prefill of a cached prefix. Its tokens are
+  // still streamed so that callers see every prompt token.
+  if (prefix_cache != nullptr && pos == 0) {
+    pos_offset = prefix_cache->Restore(prompt, kv_cache);
+    for (size_t idx = 0; idx < pos_offset; ++idx) {
+      stream_token(prompt[idx], 0.0);
+    }
+    pos = pos_offset;
+    if (metrics != nullptr) metrics->restored_tokens = pos_offset;
+  }
 
   // Prefill stops before prompt.size() - 1 since the last prompt token is the
   // first input token for generation.
@@ -534,9 +1115,8 @@ void GenerateImpl(GemmaImpl<TConfig>& gemma, const InferenceArgs& args,
         std::min(kPrefillBatchSize, prompt.size() - 1 - pos_offset);
     HWY_DASSERT(end_offset < prompt.size());
     const int* batch_tokens = prompt.data() + pos_offset;
-    Prefill<TConfig, kPrefillBatchSize>(batch_tokens, end_offset, pos,
-                                        c_weights, prefill_activations,
-                                        kv_cache, pool, inner_pool);
+    Prefill<TConfig>(batch_tokens, end_offset, pos, c_weights, activations,
+                     kv_cache, pool, inner_pool, metrics);
     for (size_t idx = 0; idx < end_offset; ++idx) {
       stream_token(batch_tokens[idx], 0.0);
     }
@@ -544,6 +1124,15 @@ void GenerateImpl(GemmaImpl<TConfig>& gemma, const InferenceArgs& args,
     pos_offset += end_offset;
   }
 
+  if (prefix_cache != nullptr && pos == pos_offset &&
+      pos_offset >= kKVPagePositions) {
+    // Cache positions [0, pos) for later prompts that begin with these tokens.
+    // Shorter prompts are cheap to prefill and would only evict entries.
+    prefix_cache->Insert(std::vector<int>(prompt.begin(),
+                                          prompt.begin() + pos_offset),
+                         kv_cache);
+  }
+
   if (verbosity >= 2) {
     // in the future this output should not occur in GenerateImpl but instead
     // should be available as observable state for frontend code to handle I/O.
@@ -553,6 +1142,7 @@ void GenerateImpl(GemmaImpl<TConfig>& gemma, const InferenceArgs& args,
   }
 
   double gen_start = hwy::platform::Now();
+  if (metrics != nullptr) metrics->prefill_seconds = gen_start - prefill_start;
 
   HWY_DASSERT(pos_offset == prompt.size() - 1);
 
@@ -572,20 +1162,32 @@ void GenerateImpl(GemmaImpl<TConfig>& gemma, const InferenceArgs& args,
   size_t generate_pos = 0;
   for (; pos < args.max_tokens && generate_pos < args.max_generated_tokens;
        ++pos, ++pos_offset, ++generate_pos) {
-    Transformer(token, pos, c_weights, activations, kv_cache, pool, inner_pool);
-    float* final_activation = activations.x.data();
+    const double step_start = hwy::platform::Now();
+    Transformer(token, pos, c_weights, activations, kv_cache, pool, inner_pool,
+                metrics);
+    float* final_activation = activations.x;
+    float prob = 0.0f;
     if (pos_offset >= prompt.size()) {
       PROFILER_ZONE("Gen.Embedding");
-      // Generation phase
-      MatVec<kVocabSize, kModelDim>(c_weights.c_embedder_input_embedding, 0,
-                                    final_activation, activations.logits.data(),
-                                    pool);
-      // Barrier: must have all logits so we can subtract max.
-      Softmax(activations.logits.data(), kVocabSize);
-      token = SampleTopK<kTopK>(activations.logits.data(), kVocabSize, gen,
-                                args.temperature, accept_token);
-    }
-    if (!stream_token(token, activations.logits[token])) {
+      // Generation phase. Only the top-k logits are computed and retained.
+      // Gemma does not soft-cap its logits.
+      std::array<float, kTopK> top_k;
+      std::array<int, kTopK> indices;
+      const size_t found = MatVecTopK<kTopK, kVocabSize, kModelDim>(
+          c_weights.c_embedder_input_embedding, 0, final_activation,
+          /*cap=*/0.0f, accept_token, top_k, indices, pool);
+      token = SampleCandidates<kTopK>(top_k, indices, found, gen,
+                                      args.temperature, prob, args.top_p,
+                                      args.min_p);
+      if (metrics != nullptr) {
+        const double step_end = hwy::platform::Now();
+        if (metrics->generated_tokens++ == 0) {
+          metrics->time_to_first_token = step_end - prefill_start;
+        }
+        metrics->AddDecodeLatency(step_end - step_start);
+      }
+    }
+    if (!stream_token(token, prob)) {
       token = EOS_ID;
     }
     if (token == EOS_ID) {
@@ -598,24 +1200,312 @@ void GenerateImpl(GemmaImpl<TConfig>& gemma, const InferenceArgs& args,
       break;
     }
   }
+  if (metrics != nullptr) metrics->kv_cache_bytes = kv_cache.Bytes();
 }
 
-void Generate2B(GemmaImpl<ConfigGemma2B>& gemma, const InferenceArgs& args,
-                const std::vector<int>& prompt, size_t start_pos,
-                hwy::ThreadPool& pool, hwy::ThreadPool& inner_pool,
-                const StreamFunc& stream_token, const AcceptFunc& accept_token,
-                std::mt19937& gen, int verbosity) {
-  GenerateImpl(gemma, args, prompt, start_pos, pool, inner_pool, stream_token,
-               accept_token, gen, verbosity);
+template <class TConfig>
+void GenerateBatchImpl(const GemmaImpl<TConfig>& gemma,
+                       SessionImpl<TConfig>& session, const InferenceArgs& args,
+                       std::vector<BatchSequence>& sequences,
+                       hwy::ThreadPool& pool, hwy::ThreadPool& inner_pool,
+                       const AcceptFunc& accept_token, int verbosity) {
+  static constexpr size_t kModelDim = TConfig::kModelDim;
+  static constexpr size_t kVocabSize = TConfig::kVocabSize;
+  static constexpr size_t kTopK = TConfig::kTopK;
+  // Prefill and decode run one after the other; they share the activations.
+  static constexpr size_t kBatchSize = kPrefillBatchSize;
+  Activations<TConfig>& activations = session.activations;
+  HWY_ASSERT(activations.batch_size >= kBatchSize);
+  const CompressedWeights<TConfig>& c_weights =
+      *reinterpret_cast<const CompressedWeights<TConfig>*>(
+          gemma.compressed_weights.get());
+
+  // Same meaning as in GenerateImpl, but per sequence.
+  const size_t num_sequences = sequences.size();
+  std::vector<size_t> pos(num_sequences);
+  std::vector<size_t> pos_offset(num_sequences, 0);
+  std::vector<size_t> generate_pos(num_sequences, 0);
+  std::vector<int> token(num_sequences);
+  std::vector<bool> done(num_sequences, false);
+
+  double prefill_start = hwy::platform::Now();
+  size_t num_prefilled = 0;
+  for (size_t seq_idx = 0; seq_idx < num_sequences; ++seq_idx) {
+    BatchSequence& seq = sequences[seq_idx];
+    HWY_ASSERT(!seq.prompt.empty() && seq.kv_cache && seq.gen);
+    pos[seq_idx] = seq.start_pos;
+    // Prefill stops before prompt.size() - 1 since the last prompt token is
+    // the first input token for generation.
+    while (pos_offset[seq_idx] < seq.prompt.size() - 1) {
+      const size_t end_offset = std::min(
+          kPrefillBatchSize, seq.prompt.size() - 1 - pos_offset[seq_idx]);
+      const int* batch_tokens = seq.prompt.data() + pos_offset[seq_idx];
+      Prefill<TConfig>(batch_tokens, end_offset, pos[seq_idx], c_weights,
+                       activations, *seq.kv_cache, pool, inner_pool);
+      for (size_t idx = 0; idx < end_offset; ++idx) {
+        seq.stream_token(batch_tokens[idx], 0.0f);
+      }
+      pos[seq_idx] += end_offset;
+      pos_offset[seq_idx] += end_offset;
+      num_prefilled += end_offset;
+    }
+    token[seq_idx] = seq.prompt.at(pos_offset[seq_idx]);
+  }
+
+  if (verbosity >= 2) {
+    double prefill_end = hwy::platform::Now();
+    const double prefill_tok_sec =
+        num_prefilled / (prefill_end - prefill_start);
+    std::cout << "\n[ Prefill tokens / sec = " << prefill_tok_sec << " ]\n";
+  }
+
+  double gen_start = hwy::platform::Now();
+  size_t num_generated = 0;
+  std::vector<size_t> active;
+  active.reserve(num_sequences);
+  for (;;) {
+    active.clear();
+    for (size_t seq_idx = 0; seq_idx < num_sequences; ++seq_idx) {
+      if (!done[seq_idx] && pos[seq_idx] < args.max_tokens &&
+          generate_pos[seq_idx] < args.max_generated_tokens) {
+        active.push_back(seq_idx);
+      }
+    }
+    if (active.empty()) break;
+
+    // One decode step for all active sequences, kBatchSize at a time.
+    for (size_t begin = 0; begin < active.size(); begin += kBatchSize) {
+      const size_t num = std::min(kBatchSize, active.size() - begin);
+      int tokens[kBatchSize];
+      size_t positions[kBatchSize];
+      KVCache* kv_caches[kBatchSize];
+      bool any_sampled = false;
+      for (size_t b = 0; b < num; ++b) {
+        const size_t seq_idx = active[begin + b];
+        tokens[b] = token[seq_idx];
+        positions[b] = pos[seq_idx];
+        kv_caches[b] = sequences[seq_idx].kv_cache;
+        any_sampled |=
+            pos_offset[seq_idx] >= sequences[seq_idx].prompt.size();
+      }
+
+      TransformerBatch<TConfig>(tokens, positions, num, c_weights, activations,
+                                kv_caches, pool);
+      if (any_sampled) {
+        PROFILER_ZONE("Gen.Embedding");
+        MatMul<kVocabSize, kModelDim>(c_weights.c_embedder_input_embedding, 0,
+                                      activations.x, kModelDim, num,
+                                      activations.logits, kVocabSize,
+                                      pool);
+      }
+
+      for (size_t b = 0; b < num; ++b) {
+        const size_t seq_idx = active[begin + b];
+        BatchSequence& seq = sequences[seq_idx];
+        float prob = 0.0f;
+        if (pos_offset[seq_idx] >= seq.prompt.size()) {
+          const float* HWY_RESTRICT logits =
+              activations.logits + b * kVocabSize;
+          token[seq_idx] = SampleLogits<kTopK>(
+              logits, kVocabSize, *seq.gen, args.temperature, accept_token,
+              prob, args.top_p, args.min_p);
+          ++num_generated;
+        }
+        if (!seq.stream_token(token[seq_idx], prob)) {
+          token[seq_idx] = EOS_ID;
+        }
+        if (token[seq_idx] == EOS_ID) {
+          done[seq_idx] = true;
+        }
+        ++pos[seq_idx];
+        ++pos_offset[seq_idx];
+        ++generate_pos[seq_idx];
+      }
+    }
+  }
+
+  if (verbosity >= 2) {
+    double gen_end = hwy::platform::Now();
+    const double gen_tok_sec = num_generated / (gen_end - gen_start);
+    std::cout << "\n[ Generation tokens / sec = " << gen_tok_sec << " ]\n";
+  }
 }
 
-void Generate7B(GemmaImpl<ConfigGemma7B>& gemma, const InferenceArgs& args,
-                const std::vector<int>& prompt, size_t start_pos,
-                hwy::ThreadPool& pool, hwy::ThreadPool& inner_pool,
-                const StreamFunc& stream_token, const AcceptFunc& accept_token,
-                std::mt19937& gen, int verbosity) {
-  GenerateImpl(gemma, args, prompt, start_pos, pool, inner_pool, stream_token,
-               accept_token, gen, verbosity);
+template <class TConfig>
+void ForwardImpl(const GemmaImpl<TConfig>& gemma,
+                 SessionImpl<TConfig>& session, const int* tokens,
+                 size_t num_tokens, size_t pos, bool logits,
+                 hwy::ThreadPool& pool) {
+  static constexpr size_t kModelDim = TConfig::kModelDim;
+  static constexpr size_t kVocabSize = TConfig::kVocabSize;
+  Activations<TConfig>& activations = session.activations;
+  const CompressedWeights<TConfig>& c_weights =
+      *reinterpret_cast<const CompressedWeights<TConfig>*>(
+          gemma.compressed_weights.get());
+  HWY_ASSERT(!logits || num_tokens <= kPrefillBatchSize);
+
+  for (size_t offset = 0; offset < num_tokens; offset += kPrefillBatchSize) {
+    const size_t num = std::min(kPrefillBatchSize, num_tokens - offset);
+    Prefill<TConfig>(tokens + offset, num, pos + offset, c_weights,
+                     activations, session.kv_cache, pool, pool);
+  }
+  if (logits && num_tokens != 0) {
+    PROFILER_ZONE("Gen.Embedding");
+    MatMul<kVocabSize, kModelDim>(c_weights.c_embedder_input_embedding, 0,
+                                  activations.x, kModelDim, num_tokens,
+                                  activations.logits, kVocabSize, pool);
+  }
+}
+
+template <class TConfig>
+void ForwardBatchImpl(const GemmaImpl<TConfig>& gemma,
+                      SessionImpl<TConfig>& session, const int* tokens,
+                      const size_t* positions, KVCache* const* kv_caches,
+                      size_t num_tokens, size_t num_logits,
+                      hwy::ThreadPool& pool) {
+  static constexpr size_t kModelDim = TConfig::kModelDim;
+  static constexpr size_t kVocabSize = TConfig::kVocabSize;
+  Activations<TConfig>& activations = session.activations;
+  const CompressedWeights<TConfig>& c_weights =
+      *reinterpret_cast<const CompressedWeights<TConfig>*>(
+          gemma.compressed_weights.get());
+  HWY_ASSERT(num_tokens <= activations.batch_size &&
+             num_logits <= num_tokens);
+
+  TransformerBatch<TConfig>(tokens, positions, num_tokens, c_weights,
+                            activations, kv_caches, pool);
+  if (num_logits != 0) {
+    PROFILER_ZONE("Gen.Embedding");
+    MatMul<kVocabSize, kModelDim>(c_weights.c_embedder_input_embedding, 0,
+                                  activations.x, kModelDim, num_logits,
+                                  activations.logits, kVocabSize, pool);
+  }
+}
+
+template <class TConfig>
+int SampleImpl(const SessionImpl<TConfig>& session, size_t token_idx,
+               const InferenceArgs& args, const AcceptFunc& accept_token,
+               std::mt19937& gen, float& prob) {
+  static constexpr size_t kVocabSize = TConfig::kVocabSize;
+  const float* HWY_RESTRICT logits =
+      session.activations.logits + token_idx * kVocabSize;
+  return SampleLogits<TConfig::kTopK>(logits, kVocabSize, gen,
+                                      args.temperature, accept_token, prob,
+                                      args.top_p, args.min_p);
+}
+
+// Entry points for HWY_EXPORT, which requires non-template functions. Each
+// casts `gemma` and `session` to the specializations they were created as.
+void ForwardT(const GemmaInterface& gemma, SessionInterface& session,
+              const int* tokens, size_t num_tokens, size_t pos, bool logits,
+              hwy::ThreadPool& pool) {
+  HWY_ASSERT(gemma.Matches(session));
+  CallForConfig(gemma.model, gemma.weight_type, [&](auto config) HWY_ATTR {
+    using TConfig = decltype(config);
+    ForwardImpl(static_cast<const GemmaImpl<TConfig>&>(gemma),
+                static_cast<SessionImpl<TConfig>&>(session), tokens,
+                num_tokens, pos, logits, pool);
+  });
+}
+
+void ForwardBatchT(const GemmaInterface& gemma, SessionInterface& session,
+                   const int* tokens, const size_t* positions,
+                   KVCache* const* kv_caches, size_t num_tokens,
+                   size_t num_logits, hwy::ThreadPool& pool) {
+  HWY_ASSERT(gemma.Matches(session));
+  CallForConfig(gemma.model, gemma.weight_type, [&](auto config) HWY_ATTR {
+    using TConfig = decltype(config);
+    ForwardBatchImpl(static_cast<const GemmaImpl<TConfig>&>(gemma),
+                     static_cast<SessionImpl<TConfig>&>(session), tokens,
+                     positions, kv_caches, num_tokens, num_logits, pool);
+  });
+}
+
+int SampleT(const GemmaInterface& gemma, const SessionInterface& session,
+            size_t token_idx, const InferenceArgs& args,
+            const AcceptFunc& accept_token, std::mt19937& gen, float& prob) {
+  HWY_ASSERT(gemma.Matches(session));
+  return CallForConfig(
+      gemma.model, gemma.weight_type, [&](auto config) HWY_ATTR {
+        using TConfig = decltype(config);
+        return SampleImpl(static_cast<const SessionImpl<TConfig>&>(session),
+                          token_idx, args, accept_token, gen, prob);
+      });
+}
+
+void GenerateT(const GemmaInterface& gemma, SessionInterface& session,
+               const InferenceArgs& args, const std::vector<int>& prompt,
+               size_t start_pos, hwy::ThreadPool& pool,
+               hwy::ThreadPool& inner_pool, const StreamFunc& stream_token,
+               const AcceptFunc& accept_token, std::mt19937& gen,
+               int verbosity, PrefixCache* prefix_cache,
+               GenerationMetrics* metrics) {
+  HWY_ASSERT(gemma.Matches(session));
+  CallForConfig(gemma.model, gemma.weight_type, [&](auto config) HWY_ATTR {
+    using TConfig = decltype(config);
+    GenerateImpl(static_cast<const GemmaImpl<TConfig>&>(gemma),
+                 static_cast<SessionImpl<TConfig>&>(session), args, prompt,
+                 start_pos, pool, inner_pool, stream_token, accept_token, gen,
+                 verbosity, prefix_cache, metrics);
+  });
+}
+
+void GenerateBatchT(const GemmaInterface& gemma, SessionInterface& session,
+                    const InferenceArgs& args,
+                    std::vector<BatchSequence>& sequences,
+                    hwy::ThreadPool& pool, hwy::ThreadPool& inner_pool,
+                    const AcceptFunc& accept_token, int verbosity) {
+  HWY_ASSERT(gemma.Matches(session));
+  CallForConfig(gemma.model, gemma.weight_type, [&](auto config) HWY_ATTR {
+    using TConfig = decltype(config);
+    GenerateBatchImpl(static_cast<const GemmaImpl<TConfig>&>(gemma),
+                      static_cast<SessionImpl<TConfig>&>(session), args,
+                      sequences, pool, inner_pool, accept_token, verbosity);
+  });
+}
+
+// Calls func(name, float*, CompressedArray&) for each tensor of the given
+// layer, whose uncompressed weights are `layer`. float* is null if `layer` is.
+template <class TConfig, class Func>
+void ForEachLayerTensor(const Layer<TConfig>* layer,
+                        CompressedWeights<TConfig>& c_weights,
+                        size_t layer_idx, Func& func) {
+  char name[16];
+  CompressedLayer<TConfig>* c_layer = c_weights.CLayer(layer_idx);
+
+  snprintf(name, sizeof(name), "pre_ff_ns_%lu", layer_idx);
+  func(name, layer ? layer->pre_ffw_norm_scale.data() : nullptr,
+       c_layer->c_pre_ffw_norm_scale);
+
+  snprintf(name, sizeof(name), "gating_ein_%lu", layer_idx);
+  func(name, layer ? layer->gating_einsum_w.data() : nullptr,
+       c_layer->c_gating_einsum_w);
+
+  snprintf(name, sizeof(name), "linear_w_%lu", layer_idx);
+  func(name, layer ? layer->linear_w.data() : nullptr, c_layer->c_linear_w);
+  snprintf(name, sizeof(name), "qkv_ein_%lu", layer_idx);
+
+  func(name, layer ? layer->qkv_einsum_w.data() : nullptr,
+       c_layer->c_qkv_einsum_w);
+  snprintf(name, sizeof(name), "att_ein_%lu", layer_idx);
+
+  func(name, layer ? layer->attn_vec_einsum_w.data() : nullptr,
+       c_layer->c_attn_vec_einsum_w);
+
+  snprintf(name, sizeof(name), "pre_att_ns_%lu", layer_idx);
+  func(name, layer ? layer->pre_attention_norm_scale.data() : nullptr,
+       c_layer->c_pre_attention_norm_scale);
+}
+
+// As above, for the tensors that are not part of a layer.
+template <class TConfig, class Func>
+void ForEachGlobalTensor(const Weights<TConfig>* weights,
+                         CompressedWeights<TConfig>& c_weights, Func& func) {
+  func("c_embedding",
+       weights ? weights->embedder_input_embedding.data() : nullptr,
+       c_weights.c_embedder_input_embedding);
+  func("c_final_norm", weights ? weights->final_norm_scale.data() : nullptr,
+       c_weights.c_final_norm_scale);
 }
 
 // Calls func(name, float*, CompressedArray&) for each tensor. float* is null
@@ -626,45 +1516,87 @@ void Generate7B(GemmaImpl<ConfigGemma7B>& gemma, const InferenceArgs& args,
 template <class TConfig, class Func>
 void ForEachTensor(const Weights<TConfig>* weights,
                    CompressedWeights<TConfig>& c_weights, Func& func) {
-  func("c_embedding",
-       weights ? weights->embedder_input_embedding.data() : nullptr,
-       c_weights.c_embedder_input_embedding);
-  func("c_final_norm", weights ? weights->final_norm_scale.data() : nullptr,
-       c_weights.c_final_norm_scale);
-
-  char name[16];
+  ForEachGlobalTensor<TConfig>(weights, c_weights, func);
   for (size_t layer_idx = 0; layer_idx < TConfig::kLayers; ++layer_idx) {
-    Layer<TConfig>* layer = weights ? &weights->layers[layer_idx] : nullptr;
-    CompressedLayer<TConfig>* c_layer = c_weights.CLayer(layer_idx);
-
-    snprintf(name, sizeof(name), "pre_ff_ns_%lu", layer_idx);
-    func(name, layer ? layer->pre_ffw_norm_scale.data() : nullptr,
-         c_layer->c_pre_ffw_norm_scale);
-
-    snprintf(name, sizeof(name), "gating_ein_%lu", layer_idx);
-    func(name, layer ? layer->gating_einsum_w.data() : nullptr,
-         c_layer->c_gating_einsum_w);
-
-    snprintf(name, sizeof(name), "linear_w_%lu", layer_idx);
-    func(name, layer ? layer->linear_w.data() : nullptr, c_layer->c_linear_w);
-    snprintf(name, sizeof(name), "qkv_ein_%lu", layer_idx);
-
-    func(name, layer ? layer->qkv_einsum_w.data() : nullptr,
-         c_layer->c_qkv_einsum_w);
-    snprintf(name, sizeof(name), "att_ein_%lu", layer_idx);
+    ForEachLayerTensor<TConfig>(weights ? &weights->layers[layer_idx] : nullptr,
+                                c_weights, layer_idx, func);
+  }
+}
 
-    func(name, layer ? layer->attn_vec_einsum_w.data() : nullptr,
-         c_layer->c_attn_vec_einsum_w);
+// Reads the uncompressed weights at `model` and writes them, compressed, to
+// `cache`. Each tensor is written as soon as it is compressed, and only the
+// global tensors or one layer are in memory at a time. If `keep`, `c_weights`
+// receives the compressed tensors; otherwise, its storage is not touched.
+// Returns whether `cache` was written.
+template <class TConfig>
+bool CompressWeightsStreaming(Model model_type, const Path& model,
+                              const Path& cache,
+                              CompressedWeights<TConfig>& c_weights, bool keep,
+                              bool refine_nuq, hwy::ThreadPool& pool) {
+  PROFILER_ZONE("Startup.CompressWeights");
+  StreamingCompressor compressor(pool, keep, refine_nuq);
+  ForEachTensor<TConfig>(nullptr, c_weights, compressor);
+  ModelHeader header = MakeModelHeader<TConfig>(model_type);
+  compressor.AddBlob(kModelHeaderKey, &header, sizeof(header));
+
+  WeightsReader<TConfig> reader(model);
+  // Without the file, there is nothing to do unless we keep the tensors.
+  if (!compressor.Open(cache.path.c_str()) && !keep) return false;
+  {
+    // The embedding is larger than a layer, so also reading the other global
+    // tensors does not raise the peak memory.
+    hwy::AlignedUniquePtr<Weights<TConfig>> weights =
+        hwy::MakeUniqueAligned<Weights<TConfig>>();
+    reader.ReadGlobals(*weights);
+    ForEachGlobalTensor<TConfig>(weights.get(), c_weights, compressor);
+  }
+  hwy::AlignedUniquePtr<Layer<TConfig>> layer =
+      hwy::MakeUniqueAligned<Layer<TConfig>>();
+  for (size_t layer_idx = 0; layer_idx < TConfig::kLayers; ++layer_idx) {
+    reader.ReadLayer(*layer);
+    ForEachLayerTensor<TConfig>(layer.get(), c_weights, layer_idx, compressor);
+  }
+  return compressor.Finish();
+}
 
-    snprintf(name, sizeof(name), "pre_att_ns_%lu", layer_idx);
-    func(name, layer ? layer->pre_attention_norm_scale.data() : nullptr,
-         c_layer->c_pre_attention_norm_scale);
+// Aborts if the compressed weights at `cache` have the layout of a file written
+// before configs.h used MQA/GQA for TConfig, i.e. with the keys and values
+// replicated for each query head. Their size would otherwise only cause a
+// "Failed to read cache" error. Unlike the uncompressed weights, compressed
+// tensors are not converted because that would compress them twice.
+template <class TConfig>
+void CheckReplicatedKV(const Path& cache) {
+  using TLayer = Layer<TConfig>;
+  if constexpr (TLayer::kKVHeads != TLayer::kHeads) {
+    using MatT = typename TConfig::AttnWeightT;
+    constexpr size_t kReplicatedQKVSize =
+        3 * TLayer::kHeads * TLayer::kQKVDim * TLayer::kModelDim;
+    BlobReader reader;
+    size_t size;
+    if (reader.Open(cache.path.c_str()) != 0 ||
+        reader.BlobSize(CacheKey<MatT>("qkv_ein_0"), size) != 0) {
+      return;
+    }
+    if (size == detail::CompressedArrayLen<MatT>(kReplicatedQKVSize) *
+                    sizeof(MatT)) {
+      HWY_ABORT(
+          "%s has the keys and values of each of the %zu query heads, but "
+          "this model has %zu KV heads. Please recreate it from the "
+          "uncompressed weights via compress_weights, which converts them.",
+          cache.path.c_str(), TLayer::kHeads, TLayer::kKVHeads);
+    }
   }
 }
 
+// If `map`, the tensors point into `mapping` instead of being read. Otherwise,
+// if `async`, only the global tensors are read before returning and the layers
+// are read in the background by `async_loader`.
 template <class TConfig>
 hwy::AlignedFreeUniquePtr<uint8_t[]> GetCompressedWeights(
-    const Path& model, const Path& cache, hwy::ThreadPool& pool) {
+    Model model_type, const Path& model, const Path& cache, bool map,
+    bool async,
+    hwy::ThreadPool& pool, std::unique_ptr<MappedFile>& mapping,
+    std::unique_ptr<AsyncWeightLoader>& async_loader) {
   PROFILER_ZONE("Startup.LoadCache");
 
   if (!std::filesystem::exists(model.path) &&
@@ -674,38 +1606,237 @@ hwy::AlignedFreeUniquePtr<uint8_t[]> GetCompressedWeights(
         "(--compressed_weights) must exist.");
   }
 
+  CheckReplicatedKV<TConfig>(cache);
+
   // Allocate compressed weights.
   using CWeights = CompressedWeights<TConfig>;
   hwy::AlignedFreeUniquePtr<uint8_t[]> c_weights_u8 =
       hwy::AllocateAligned<uint8_t>(sizeof(CWeights));
-  CWeights* c_weights = reinterpret_cast<CWeights*>(c_weights_u8.get());
-  new (&c_weights->c_layer_ptrs) CompressedLayerPointers<TConfig>(pool);
+  // Every thread reads all weights, so spread them over all memory nodes.
+  InterleaveAcrossNodes(c_weights_u8.get(), sizeof(CWeights));
+  CWeights* c_weights = new (c_weights_u8.get()) CWeights(pool);
+
+  // First attempt to load them from cache, without requiring weights. Record
+  // where each layer's requests end so that they can be read separately.
+  auto loader = std::make_unique<CacheLoader>(cache.path.c_str(), map);
+  ForEachGlobalTensor<TConfig>(nullptr, *c_weights, *loader);
+  const size_t global_end = loader->NumRequests();
+  std::vector<size_t> layer_end(TConfig::kLayers);
+  for (size_t layer_idx = 0; layer_idx < TConfig::kLayers; ++layer_idx) {
+    ForEachLayerTensor<TConfig>(nullptr, *c_weights, layer_idx, *loader);
+    layer_end[layer_idx] = loader->NumRequests();
+  }
+
+  if (async && !map) {
+    if (loader->ReadRange(pool, 0, global_end)) {
+      async_loader = std::make_unique<AsyncWeightLoader>(
+          std::move(loader), global_end, std::move(layer_end));
+      c_weights->load_progress = &async_loader->Progress();
+      return c_weights_u8;
+    }
+  } else if (loader->ReadAll(pool)) {
+    mapping = loader->ReleaseMapping();
+    return c_weights_u8;
+  }
 
-  // First attempt to load them from cache, without requiring weights.
-  CacheLoader loader(cache.path.c_str());
-  ForEachTensor<TConfig>(nullptr, *c_weights, loader);
-  if (loader.ReadAll(pool)) return c_weights_u8;
+  // Some tensors may already point into the mapping, which goes away with
+  // `loader`.
+  auto unmap = [](const char*, const float*, auto& compressed) {
+    compressed.SetMapped(nullptr);
+  };
+  ForEachTensor<TConfig>(nullptr, *c_weights, unmap);
+  loader.reset();
 
   // Get weights, compress, and store in cache.
-  hwy::AlignedUniquePtr<Weights<TConfig>> weights = LoadWeights<TConfig>(model);
-  Compressor compressor(pool);
-  ForEachTensor<TConfig>(weights.get(), *c_weights, compressor);
-  compressor.WriteAll(pool, cache.path.c_str());
-
+  CompressWeightsStreaming<TConfig>(model_type, model, cache, *c_weights,
+                                    /*keep=*/true, /*refine_nuq=*/false, pool);
   return c_weights_u8;
 }
 
 // Type-erased because this function is called via a function pointer.
 hwy::AlignedFreeUniquePtr<uint8_t[]> GetCompressedWeightsT(
-    const LoaderArgs& args, hwy::ThreadPool& pool) {
-  switch (args.ModelType()) {
-    case Model::GEMMA_2B:
-      return GetCompressedWeights<ConfigGemma2B>(args.model, args.cache, pool);
-    case Model::GEMMA_7B:
-      return GetCompressedWeights<ConfigGemma7B>(args.model, args.cache, pool);
-    default:
-      HWY_ABORT("Model type %d unknown.", static_cast<int>(args.ModelType()));
+    Model model, WeightType weight_type, const LoaderArgs& args,
+    hwy::ThreadPool& pool, std::unique_ptr<MappedFile>& mapping,
+    std::unique_ptr<AsyncWeightLoader>& async_loader) {
+  return CallForConfig(model, weight_type, [&](auto config) HWY_ATTR {
+    return GetCompressedWeights<decltype(config)>(
+        model, args.model, args.cache, args.map_weights, args.async_load, pool,
+        mapping, async_loader);
+  });
+}
+
+// For the standalone tool: writes `compressed` without keeping the tensors.
+bool CompressWeightsT(Model model, WeightType weight_type, const Path& weights,
+                      const Path& compressed, bool refine_nuq,
+                      hwy::ThreadPool& pool) {
+  return CallForConfig(model, weight_type, [&](auto config) HWY_ATTR {
+    using TConfig = decltype(config);
+    using CWeights = CompressedWeights<TConfig>;
+    // Only the storage of the tensors, which is never touched, is large.
+    hwy::AlignedFreeUniquePtr<uint8_t[]> c_weights_u8 =
+        hwy::AllocateAligned<uint8_t>(sizeof(CWeights));
+    CWeights* c_weights = new (c_weights_u8.get()) CWeights(pool);
+    const bool ok = CompressWeightsStreaming<TConfig>(
+        model, weights, compressed, *c_weights, /*keep=*/false, refine_nuq,
+        pool);
+    c_weights->c_layer_ptrs.~CompressedLayerPointers<TConfig>();
+    return ok;
+  });
+}
+
+bool UsesInt8ActivationsT() { return UseInt8Activations<I8Stream>(); }
+
+// Converts `num` keys or values from TIn to TOut via f32 in `buf`, which is
+// unused if the types match.
+template <typename TIn, typename TOut>
+void ConvertKV(const TIn* HWY_RESTRICT in, size_t num, float* HWY_RESTRICT buf,
+               TOut* HWY_RESTRICT out) {
+  if constexpr (hwy::IsSame<TIn, TOut>()) {
+    hwy::CopyBytes(in, out, num * sizeof(TIn));
+  } else {
+    const hn::ScalableTag<float> df;
+    CompressTraits<TIn>::Decompress(df, num, in, 0, buf, num);
+    // The KV codecs only use this for statistics.
+    static thread_local CompressPerThread tls;
+    CompressTraits<TOut>::Compress(df, buf, num, tls, num, out, 0);
+  }
+}
+
+// Returns the pages among the first `num_pages` of `kv_cache` that are cached,
+// i.e. all unless its window evicted some. SaveKVCache stores these.
+std::vector<size_t> CachedPages(const KVCache& kv_cache, size_t num_pages) {
+  std::vector<size_t> pages;
+  for (size_t page = 0; page < num_pages; ++page) {
+    if (kv_cache.Contains(page * kKVPagePositions)) pages.push_back(page);
+  }
+  return pages;
+}
+
+// Converts the keys and values of the given pages of `kv_cache` from
+// `stored`, which holds them in the order of the blobs.
+template <typename TStored>
+void ConvertPages(const TStored* stored, const std::vector<size_t>& pages,
+                  KVCache& kv_cache, hwy::ThreadPool& pool) {
+  const size_t page_size = kKVPagePositions * kv_cache.Pool().SizeCachePos();
+  pool.Run(0, 2 * pages.size(), [&](uint64_t task, size_t /*thread*/) HWY_ATTR {
+    const size_t pos = pages[task >> 1] * kKVPagePositions;
+    KVT* kv = (task & 1) ? kv_cache.Values(0, 0, pos)
+                         : kv_cache.Keys(0, 0, pos);
+    auto buf = hwy::AllocateAligned<float>(page_size);
+    HWY_ASSERT(buf);
+    ConvertKV(stored + task * page_size, page_size, buf.get(), kv);
+  });
+}
+
+bool SaveKVCacheT(const KVCache& kv_cache, size_t num_positions,
+                  const Path& path, hwy::ThreadPool& pool) {
+  const KVPagePool& kv_pool = kv_cache.Pool();
+  KVCacheHeader header;
+  header.kv_type = static_cast<uint32_t>(WeightTypeOf<KVT>());
+  header.layers = static_cast<uint32_t>(kv_pool.Layers());
+  header.kv_heads = static_cast<uint32_t>(kv_pool.KVHeads());
+  header.qkv_dim = static_cast<uint32_t>(kv_pool.QKVDim());
+  header.num_positions = static_cast<uint32_t>(num_positions);
+  header.num_pages = static_cast<uint32_t>(hwy::DivCeil(
+      HWY_MIN(num_positions, kv_cache.Capacity()), kKVPagePositions));
+  header.sink_pages =
+      static_cast<uint32_t>(kv_cache.SinkPositions() / kKVPagePositions);
+  header.window_pages =
+      static_cast<uint32_t>(kv_cache.WindowPositions() / kKVPagePositions);
+  const std::vector<size_t> pages = CachedPages(kv_cache, header.num_pages);
+
+  const size_t page_size = kKVPagePositions * kv_pool.SizeCachePos();
+  // Pages are only read, hence the const_cast for BlobWriter::Add.
+  KVCache& mutable_cache = const_cast<KVCache&>(kv_cache);
+  BlobWriter writer;
+  writer.Add(MakeKey(kKVCacheHeaderKey), &header, sizeof(header));
+  for (size_t page : pages) {
+    const size_t pos = page * kKVPagePositions;
+    writer.Add(KVPageKey("k", page), mutable_cache.Keys(0, 0, pos),
+               page_size * sizeof(KVT));
+    writer.Add(KVPageKey("v", page), mutable_cache.Values(0, 0, pos),
+               page_size * sizeof(KVT));
+  }
+  if (writer.WriteAll(pool, path.path.c_str()) != 0) {
+    fprintf(stderr, "Failed to write KV cache to %s.\n", path.path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool LoadKVCacheT(const Path& path, KVCache& kv_cache, size_t& num_positions,
+                  hwy::ThreadPool& pool) {
+  kv_cache.Release();
+  BlobReader reader;
+  KVCacheHeader header;
+  if (reader.Open(path.path.c_str()) != 0 ||
+      reader.Enqueue(MakeKey(kKVCacheHeaderKey), &header, sizeof(header)) !=
+          0 ||
+      reader.ReadAll(pool) != 0 || header.version != KVCacheHeader::kVersion) {
+    fprintf(stderr, "%s is not a KV cache file.\n", path.path.c_str());
+    return false;
+  }
+  const KVPagePool& kv_pool = kv_cache.Pool();
+  if (header.layers != kv_pool.Layers() ||
+      header.kv_heads != kv_pool.KVHeads() ||
+      header.qkv_dim != kv_pool.QKVDim() ||
+      header.window_pages == 1 ||
+      header.num_pages > hwy::DivCeil(header.num_positions, kKVPagePositions) ||
+      (header.kv_type != static_cast<uint32_t>(WeightType::kF32) &&
+       header.kv_type != static_cast<uint32_t>(WeightType::kBF16))) {
+    fprintf(stderr, "KV cache %s does not match the model.\n",
+            path.path.c_str());
+    return false;
+  }
+  // The file's window, or lack thereof, replaces that of `kv_cache`.
+  // Reserving the same pages as the saved cache also evicts the same ones.
+  if (header.window_pages != 0) {
+    kv_cache.SetWindow(header.sink_pages * kKVPagePositions,
+                       (header.window_pages - 1) * kKVPagePositions);
+  } else {
+    kv_cache.ClearWindow();
+  }
+  if (header.num_positions > kv_cache.MaxPositions()) {
+    fprintf(stderr, "KV cache %s has more than the maximum of %zu positions.\n",
+            path.path.c_str(), kv_cache.MaxPositions());
+    return false;
+  }
+  kv_cache.Reserve(header.num_pages * kKVPagePositions);
+  const std::vector<size_t> pages = CachedPages(kv_cache, header.num_pages);
+
+  const size_t page_size = kKVPagePositions * kv_pool.SizeCachePos();
+  const WeightType kv_type = static_cast<WeightType>(header.kv_type);
+  const bool ok = CallForKVType(kv_type, [&](auto stored_tag) HWY_ATTR {
+    using TStored = decltype(stored_tag);
+    // Read directly into the pages if possible, otherwise convert after.
+    hwy::AlignedFreeUniquePtr<TStored[]> stored;
+    if constexpr (!hwy::IsSame<TStored, KVT>()) {
+      stored = hwy::AllocateAligned<TStored>(2 * pages.size() * page_size);
+      HWY_ASSERT(stored);
+    }
+    for (size_t task = 0; task < 2 * pages.size(); ++task) {
+      const size_t pos = pages[task >> 1] * kKVPagePositions;
+      void* blob = (task & 1) ? static_cast<void*>(kv_cache.Values(0, 0, pos))
+                              : static_cast<void*>(kv_cache.Keys(0, 0, pos));
+      if (stored) blob = stored.get() + task * page_size;
+      if (reader.Enqueue(KVPageKey((task & 1) ? "v" : "k", pages[task >> 1]),
+                         blob, page_size * sizeof(TStored)) != 0) {
+        return false;
+      }
+    }
+    if (reader.ReadRange(pool, 1, reader.NumRequests()) != 0) return false;
+    if (stored) {
+      ConvertPages(stored.get(), pages, kv_cache, pool);
+    }
+    return true;
+  });
+  if (!ok) {
+    fprintf(stderr, "Failed to read KV cache from %s.\n", path.path.c_str());
+    kv_cache.Release();
+    return false;
   }
+  num_positions = header.num_positions;
+  return true;
 }
 
 }  // namespace HWY_NAMESPACE
@@ -716,68 +1847,353 @@ HWY_AFTER_NAMESPACE();
 namespace gcpp {
 
 HWY_EXPORT(GetCompressedWeightsT);
-HWY_EXPORT(Generate2B);
-HWY_EXPORT(Generate7B);
+HWY_EXPORT(CompressWeightsT);
+HWY_EXPORT(UsesInt8ActivationsT);
+HWY_EXPORT(SaveKVCacheT);
+HWY_EXPORT(LoadKVCacheT);
+HWY_EXPORT(GenerateT);
+HWY_EXPORT(GenerateBatchT);
+HWY_EXPORT(ForwardT);
+HWY_EXPORT(ForwardBatchT);
+HWY_EXPORT(SampleT);
+
+KVPage* KVPagePool::Allocate() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++num_in_use_;
+  if (!free_pages_.empty()) {
+    KVPage* page = free_pages_.back();
+    free_pages_.pop_back();
+    page->ref_count = 1;
+    return page;
+  }
+  // Rare, hence allocating while holding the lock is acceptable.
+  auto page = std::make_unique<KVPage>();
+  page->key_cache =
+      hwy::AllocateAligned<KVT>(kKVPagePositions * SizeCachePos());
+  page->value_cache =
+      hwy::AllocateAligned<KVT>(kKVPagePositions * SizeCachePos());
+  HWY_ASSERT(page->key_cache && page->value_cache);
+  page->ref_count = 1;
+  pages_.push_back(std::move(page));
+  return pages_.back().get();
+}
+
+void KVPagePool::AddRef(KVPage* page) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  HWY_DASSERT(page->ref_count != 0);
+  ++page->ref_count;
+}
 
-KVCache CreateKVCache(size_t size_cache_pos, size_t kSeqLen) {
-  KVCache kv_cache = {};
-  kv_cache.key_cache = hwy::AllocateAligned<float>(kSeqLen * size_cache_pos);
-  kv_cache.value_cache = hwy::AllocateAligned<float>(kSeqLen * size_cache_pos);
-  return kv_cache;
+void KVPagePool::Free(KVPage* page) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  HWY_DASSERT(page->ref_count != 0 && num_in_use_ != 0);
+  if (--page->ref_count == 0) {
+    --num_in_use_;
+    free_pages_.push_back(page);
+  }
+}
+
+bool KVPagePool::IsShared(const KVPage* page) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return page->ref_count > 1;
+}
+
+size_t KVPagePool::NumInUse() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_in_use_;
+}
+
+KVCache& KVCache::operator=(KVCache&& other) {
+  if (this != &other) {
+    Release();
+    pool_ = std::move(other.pool_);
+    pages_ = std::move(other.pages_);
+    other.pages_.clear();
+    num_pages_ = other.num_pages_;
+    other.num_pages_ = 0;
+    max_positions_ = other.max_positions_;
+    sink_pages_ = other.sink_pages_;
+    window_pages_ = other.window_pages_;
+  }
+  return *this;
+}
+
+void KVCache::SetWindow(size_t sink_positions, size_t window_positions) {
+  HWY_ASSERT(pages_.empty() && window_positions != 0);
+  sink_pages_ = hwy::DivCeil(sink_positions, kKVPagePositions);
+  // One more page for the current position, so that at least
+  // window_positions precede it.
+  window_pages_ = hwy::DivCeil(window_positions, kKVPagePositions) + 1;
+}
+
+void KVCache::ClearWindow() {
+  HWY_ASSERT(pages_.empty());
+  sink_pages_ = 0;
+  window_pages_ = 0;
+}
+
+void KVCache::Reserve(size_t num_positions) {
+  if (num_positions > MaxPositions()) {
+    HWY_ABORT("KV cache position %zu exceeds the maximum of %zu.",
+              num_positions, MaxPositions());
+  }
+  while (Capacity() < num_positions) {
+    const size_t slot = Slot(num_pages_++);
+    if (slot == pages_.size()) {
+      pages_.push_back(pool_->Allocate());
+    } else if (pool_->IsShared(pages_[slot])) {
+      // Evicted, but still referenced by another cache: use a new page
+      // rather than copying one whose contents are about to be replaced.
+      pool_->Free(pages_[slot]);
+      pages_[slot] = pool_->Allocate();
+    }
+  }
+}
+
+void KVCache::PrepareWrite(size_t pos) {
+  HWY_DASSERT(pos < Capacity() && Contains(pos));
+  KVPage*& page = pages_[Slot(pos / kKVPagePositions)];
+  if (!pool_->IsShared(page)) return;
+
+  // Copy on write. The other owners may be reading, but not writing, `page`.
+  KVPage* copy = pool_->Allocate();
+  const size_t bytes = kKVPagePositions * pool_->SizeCachePos() * sizeof(KVT);
+  hwy::CopyBytes(page->key_cache.get(), copy->key_cache.get(), bytes);
+  hwy::CopyBytes(page->value_cache.get(), copy->value_cache.get(), bytes);
+  pool_->Free(page);
+  page = copy;
+}
+
+void KVCache::Release() {
+  for (KVPage* page : pages_) {
+    pool_->Free(page);
+  }
+  pages_.clear();
+  num_pages_ = 0;
+}
+
+KVCache KVCache::Share(size_t num_positions) const {
+  HWY_ASSERT(num_positions <= Capacity() && WindowBegin() == 0);
+  KVCache shared(pool_, max_positions_);
+  shared.sink_pages_ = sink_pages_;
+  shared.window_pages_ = window_pages_;
+  // Without evictions, each page is in the slot of the same index.
+  const size_t num_pages = hwy::DivCeil(num_positions, kKVPagePositions);
+  shared.pages_.reserve(num_pages);
+  for (size_t i = 0; i < num_pages; ++i) {
+    pool_->AddRef(pages_[i]);
+    shared.pages_.push_back(pages_[i]);
+  }
+  shared.num_pages_ = num_pages;
+  return shared;
+}
+
+void PrefixCache::Insert(const std::vector<int>& tokens,
+                         const KVCache& kv_cache) {
+  // Evicted positions cannot be shared.
+  if (tokens.empty() || max_entries_ == 0 || kv_cache.WindowBegin() != 0) {
+    return;
+  }
+  const auto is_prefix_of = [](const std::vector<int>& prefix,
+                               const std::vector<int>& sequence) {
+    return prefix.size() <= sequence.size() &&
+           std::equal(prefix.begin(), prefix.end(), sequence.begin());
+  };
+  for (size_t i = 0; i < entries_.size();) {
+    if (is_prefix_of(tokens, entries_[i].tokens)) {
+      // Already covered by a longer (or equal) entry.
+      entries_[i].last_use = ++num_uses_;
+      return;
+    }
+    if (is_prefix_of(entries_[i].tokens, tokens)) {
+      entries_.erase(entries_.begin() + i);
+    } else {
+      ++i;
+    }
+  }
+
+  if (entries_.size() == max_entries_) {
+    const auto lru = std::min_element(
+        entries_.begin(), entries_.end(),
+        [](const Entry& a, const Entry& b) { return a.last_use < b.last_use; });
+    entries_.erase(lru);
+  }
+  entries_.push_back(
+      Entry{tokens, kv_cache.Share(tokens.size()), ++num_uses_});
+}
+
+size_t PrefixCache::Restore(const std::vector<int>& prompt,
+                            KVCache& kv_cache) {
+  if (prompt.size() < 2) return 0;
+  Entry* best = nullptr;
+  size_t best_len = 0;
+  for (Entry& entry : entries_) {
+    const size_t max_len = std::min(entry.tokens.size(), prompt.size() - 1);
+    const size_t len =
+        std::mismatch(entry.tokens.begin(), entry.tokens.begin() + max_len,
+                      prompt.begin())
+            .first -
+        entry.tokens.begin();
+    if (len > best_len) {
+      best = &entry;
+      best_len = len;
+    }
+  }
+  if (best == nullptr) return 0;
+
+  best->last_use = ++num_uses_;
+  kv_cache = best->kv_cache.Share(best_len);
+  return best_len;
+}
+
+template <class Config>
+std::shared_ptr<KVPagePool> CreateKVPagePool() {
+  return std::make_shared<KVPagePool>(Config::kLayers, Config::kKVHeads,
+                                      Config::kQKVDim);
+}
+
+// The KV cache does not depend on the weight type.
+std::shared_ptr<KVPagePool> CreateKVPagePool(Model type) {
+  return CallForConfig(type, WeightTypeOf<WeightT>(), [](auto config) {
+    return CreateKVPagePool<decltype(config)>();
+  });
 }
 
 template <class Config>
-GemmaImpl<Config>::GemmaImpl(const LoaderArgs& args, hwy::ThreadPool& pool)
-    : compressed_weights(
-          HWY_DYNAMIC_DISPATCH(GetCompressedWeightsT)(args, pool)),
-      prefill(hwy::MakeUniqueAligned<Activations<Config, kPrefillBatchSize>>()),
-      state(hwy::MakeUniqueAligned<Activations<Config, 1>>()),
-      kv_cache(
-          CreateKVCache(Config::kLayers * Config::kKVHeads * Config::kQKVDim,
-                        Config::kSeqLen)) {
+KVCache CreateKVCache(std::shared_ptr<KVPagePool> pool, size_t max_positions) {
+  if (!pool) pool = CreateKVPagePool<Config>();
+  HWY_ASSERT(pool->Layers() == Config::kLayers &&
+             pool->KVHeads() == Config::kKVHeads &&
+             pool->QKVDim() == Config::kQKVDim);
+  HWY_ASSERT(max_positions <= static_cast<size_t>(Config::kSeqLen));
+  return KVCache(std::move(pool),
+                 max_positions == 0 ? static_cast<size_t>(Config::kSeqLen)
+                                    : max_positions);
+}
+
+KVCache CreateKVCache(Model type, std::shared_ptr<KVPagePool> pool,
+                      size_t max_positions) {
+  return CallForConfig(type, WeightTypeOf<WeightT>(), [&](auto config) {
+    return CreateKVCache<decltype(config)>(std::move(pool), max_positions);
+  });
+}
+
+template <class Config>
+SessionImpl<Config>::SessionImpl(std::shared_ptr<KVPagePool> kv_pool,
+                                 Model model, WeightType weight_type)
+    : SessionInterface(CreateKVCache<Config>(std::move(kv_pool), 0), model,
+                       weight_type),
+      activations(kPrefillBatchSize) {}
+
+template <class Config>
+GemmaImpl<Config>::GemmaImpl(const LoaderArgs& args, Model model,
+                             WeightType weight_type, hwy::ThreadPool& pool)
+    : GemmaInterface(model, weight_type),
+      compressed_weights(HWY_DYNAMIC_DISPATCH(GetCompressedWeightsT)(
+          model, weight_type, args, pool, weights_mapping, async_loader)),
+      rope(Config::kQKVDim, Config::kSeqLen) {
+  reinterpret_cast<CompressedWeights<Config>*>(compressed_weights.get())
+      ->rope = &rope;
+
   PROFILER_ZONE("Startup.tokenizer");
 
   HWY_ASSERT(tokenizer.Load(args.tokenizer.path).ok());
 }
 
-template <>
-void GemmaImpl<ConfigGemma2B>::Generate(const InferenceArgs& args,
-                                        const std::vector<int>& prompt,
-                                        size_t start_pos, hwy::ThreadPool& pool,
-                                        hwy::ThreadPool& inner_pool,
-                                        const StreamFunc& stream_token,
-                                        const AcceptFunc& accept_token,
-                                        std::mt19937& gen, int verbosity) {
-  HWY_DYNAMIC_DISPATCH(Generate2B)
-  (*this, args, prompt, start_pos, pool, inner_pool, stream_token, accept_token,
-   gen, verbosity);
-}
-template <>
-void GemmaImpl<ConfigGemma7B>::Generate(const InferenceArgs& args,
-                                        const std::vector<int>& prompt,
-                                        size_t start_pos, hwy::ThreadPool& pool,
-                                        hwy::ThreadPool& inner_pool,
-                                        const StreamFunc& stream_token,
-                                        const AcceptFunc& accept_token,
-                                        std::mt19937& gen, int verbosity) {
-  HWY_DYNAMIC_DISPATCH(Generate7B)
-  (*this, args, prompt, start_pos, pool, inner_pool, stream_token, accept_token,
-   gen, verbosity);
+template <class Config>
+void GemmaImpl<Config>::Generate(
+    SessionInterface& session, const InferenceArgs& args,
+    const std::vector<int>& prompt, size_t start_pos, hwy::ThreadPool& pool,
+    hwy::ThreadPool& inner_pool, const StreamFunc& stream_token,
+    const AcceptFunc& accept_token, std::mt19937& gen, int verbosity,
+    PrefixCache* prefix_cache, GenerationMetrics* metrics) const {
+  HWY_DYNAMIC_DISPATCH(GenerateT)
+  (*this, session, args, prompt, start_pos, pool, inner_pool, stream_token,
+   accept_token, gen, verbosity, prefix_cache, metrics);
+}
+
+template <class Config>
+void GemmaImpl<Config>::GenerateBatch(
+    SessionInterface& session, const InferenceArgs& args,
+    std::vector<BatchSequence>& sequences, hwy::ThreadPool& pool,
+    hwy::ThreadPool& inner_pool, const AcceptFunc& accept_token,
+    int verbosity) const {
+  HWY_DYNAMIC_DISPATCH(GenerateBatchT)
+  (*this, session, args, sequences, pool, inner_pool, accept_token, verbosity);
+}
+
+template <class Config>
+void GemmaImpl<Config>::Forward(SessionInterface& session, const int* tokens,
+                                size_t num_tokens, size_t pos, bool logits,
+                                hwy::ThreadPool& pool) const {
+  HWY_DYNAMIC_DISPATCH(ForwardT)
+  (*this, session, tokens, num_tokens, pos, logits, pool);
+}
+
+template <class Config>
+void GemmaImpl<Config>::ForwardBatch(SessionInterface& session,
+                                     const int* tokens,
+                                     const size_t* positions,
+                                     KVCache* const* kv_caches,
+                                     size_t num_tokens, size_t num_logits,
+                                     hwy::ThreadPool& pool) const {
+  HWY_DYNAMIC_DISPATCH(ForwardBatchT)
+  (*this, session, tokens, positions, kv_caches, num_tokens, num_logits, pool);
+}
+
+template <class Config>
+int GemmaImpl<Config>::Sample(const SessionInterface& session,
+                              size_t token_idx, const InferenceArgs& args,
+                              const AcceptFunc& accept_token,
+                              std::mt19937& gen, float& prob) const {
+  return HWY_DYNAMIC_DISPATCH(SampleT)(*this, session, token_idx, args,
+                                       accept_token, gen, prob);
+}
+
+// Returns false if the file does not exist or has no (current) ModelHeader.
+static bool ReadModelHeader(const Path& cache, ModelHeader& header) {
+  BlobReader reader;
+  if (reader.Open(cache.path.c_str()) != 0) return false;
+  if (reader.Enqueue(MakeKey(kModelHeaderKey), &header, sizeof(header)) != 0) {
+    return false;
+  }
+  hwy::ThreadPool pool(0);
+  return reader.ReadAll(pool) == 0 && header.version == ModelHeader::kVersion;
 }
 
 Gemma::Gemma(const LoaderArgs& args, hwy::ThreadPool& pool) {
-  const Model model_type = args.ModelType();
+  model_type = args.ModelType();
   model_training = args.ModelTraining();
-  switch (model_type) {
-    case Model::GEMMA_2B:
-      impl_.reset(new GemmaImpl<ConfigGemma2B>(args, pool));
-      break;
-    case Model::GEMMA_7B:
-      impl_.reset(new GemmaImpl<ConfigGemma7B>(args, pool));
-      break;
-    default:
-      HWY_ABORT("Model type %d unknown.", static_cast<int>(model_type));
+  weight_type = args.WeightType();
+
+  // The file, if it records them, overrides the model and weight type.
+  ModelHeader header;
+  if (ReadModelHeader(args.cache, header)) {
+    if (header.model > static_cast<uint32_t>(Model::GEMMA_7B) ||
+        header.weight_type > static_cast<uint32_t>(WeightType::kI8)) {
+      HWY_ABORT("%s: unsupported model %u or weight type %u.",
+                args.cache.path.c_str(), header.model, header.weight_type);
+    }
+    if (header.model != static_cast<uint32_t>(model_type)) {
+      fprintf(stderr, "Warning: --model does not match %s, which is used.\n",
+              args.cache.path.c_str());
+    }
+    model_type = static_cast<Model>(header.model);
+    weight_type = static_cast<WeightType>(header.weight_type);
+    const ModelHeader expected = CallForConfig(
+        model_type, weight_type, [&](auto config) {
+          return MakeModelHeader<decltype(config)>(model_type);
+        });
+    if (memcmp(&header, &expected, sizeof(header)) != 0) {
+      HWY_ABORT("%s: model dimensions do not match those of configs.h.",
+                args.cache.path.c_str());
+    }
   }
+
+  CallForConfig(model_type, weight_type, [&](auto config) {
+    impl_.reset(
+        new GemmaImpl<decltype(config)>(args, model_type, weight_type, pool));
+  });
 }
 Gemma::~Gemma() = default;  // after GemmaInterface is defined
 
@@ -785,17 +2201,521 @@ const sentencepiece::SentencePieceProcessor& Gemma::Tokenizer() const {
   return impl_->Tokenizer();
 }
 
+Session& Gemma::DefaultSession() {
+  if (!session_) session_ = std::make_unique<Session>(*this);
+  return *session_;
+}
+
+KVCache& Gemma::GetKVCache() { return DefaultSession().GetKVCache(); }
+
+Session::Session(const Gemma& gemma, std::shared_ptr<KVPagePool> kv_pool)
+    : impl_(gemma.impl_->CreateSession(std::move(kv_pool))) {}
+Session::Session(Session&& other) = default;
+Session& Session::operator=(Session&& other) = default;
+Session::~Session() = default;  // after SessionInterface is defined
+
+KVCache& Session::GetKVCache() { return impl_->kv_cache; }
+
+void GenerateGemma(const Gemma& gemma, Session& session,
+                   const InferenceArgs& args, const std::vector<int>& prompt,
+                   size_t start_pos, hwy::ThreadPool& pool,
+                   hwy::ThreadPool& inner_pool, const StreamFunc& stream_token,
+                   const AcceptFunc& accept_token, std::mt19937& gen,
+                   int verbosity, PrefixCache* prefix_cache,
+                   GenerationMetrics* metrics) {
+  pool.SetWaitMode(hwy::PoolWaitMode::kSpin);
+  gemma.impl_->Generate(*session.impl_, args, prompt, start_pos, pool,
+                        inner_pool, stream_token, accept_token, gen, verbosity,
+                        prefix_cache, metrics);
+  pool.SetWaitMode(hwy::PoolWaitMode::kBlock);
+}
+
 void GenerateGemma(Gemma& gemma, const InferenceArgs& args,
                    const std::vector<int>& prompt, size_t start_pos,
                    hwy::ThreadPool& pool, hwy::ThreadPool& inner_pool,
                    const StreamFunc& stream_token,
                    const AcceptFunc& accept_token, std::mt19937& gen,
-                   int verbosity) {
+                   int verbosity, PrefixCache* prefix_cache,
+                   GenerationMetrics* metrics) {
+  GenerateGemma(gemma, gemma.DefaultSession(), args, prompt, start_pos, pool,
+                inner_pool, stream_token, accept_token, gen, verbosity,
+                prefix_cache, metrics);
+}
+
+bool CompressWeights(Model model, WeightType weight_type, const Path& weights,
+                     const Path& compressed, bool refine_nuq,
+                     hwy::ThreadPool& pool) {
+  if (!std::filesystem::exists(weights.path)) {
+    fprintf(stderr, "Model weights %s do not exist.\n", weights.path.c_str());
+    return false;
+  }
+  return HWY_DYNAMIC_DISPATCH(CompressWeightsT)(model, weight_type, weights,
+                                                compressed, refine_nuq, pool);
+}
+
+bool UsesInt8Activations() {
+  return HWY_DYNAMIC_DISPATCH(UsesInt8ActivationsT)();
+}
+
+bool SaveKVCache(const KVCache& kv_cache, size_t num_positions,
+                 const Path& path, hwy::ThreadPool& pool) {
+  return HWY_DYNAMIC_DISPATCH(SaveKVCacheT)(kv_cache, num_positions, path,
+                                            pool);
+}
+
+bool LoadKVCache(const Path& path, KVCache& kv_cache, size_t& num_positions,
+                 hwy::ThreadPool& pool) {
+  return HWY_DYNAMIC_DISPATCH(LoadKVCacheT)(path, kv_cache, num_positions,
+                                            pool);
+}
+
+std::string GenerationMetrics::ToJSON() const {
+  std::ostringstream out;
+  const auto list = [&out](const char* name, const auto& values) {
+    out << ",\"" << name << "\":[";
+    for (size_t i = 0; i < values.size(); ++i) {
+      out << (i == 0 ? "" : ",") << values[i];
+    }
+    out << "]";
+  };
+  out << "{\"prompt_tokens\":" << prompt_tokens
+      << ",\"restored_tokens\":" << restored_tokens
+      << ",\"generated_tokens\":" << generated_tokens
+      << ",\"prefill_seconds\":" << prefill_seconds
+      << ",\"prefill_tokens_per_second\":" << PrefillTokensPerSecond()
+      << ",\"time_to_first_token\":" << time_to_first_token
+      << ",\"decode_seconds\":" << decode_seconds
+      << ",\"decode_tokens_per_second\":" << DecodeTokensPerSecond()
+      << ",\"decode_latency_p50\":" << DecodeLatencyQuantile(0.5)
+      << ",\"decode_latency_p99\":" << DecodeLatencyQuantile(0.99)
+      << ",\"kv_cache_bytes\":" << kv_cache_bytes;
+  list("decode_latency_histogram_us_log2", decode_latency_histogram);
+  if (layer_times) {
+    list("attention_seconds", attention_seconds);
+    list("ffw_seconds", ffw_seconds);
+  }
+  out << "}";
+  return out.str();
+}
+
+void GenerateGemmaBatch(const Gemma& gemma, Session& session,
+                        const InferenceArgs& args,
+                        std::vector<BatchSequence>& sequences,
+                        hwy::ThreadPool& pool, hwy::ThreadPool& inner_pool,
+                        const AcceptFunc& accept_token, int verbosity) {
   pool.SetWaitMode(hwy::PoolWaitMode::kSpin);
-  gemma.impl_->Generate(args, prompt, start_pos, pool, inner_pool, stream_token,
-                        accept_token, gen, verbosity);
+  gemma.impl_->GenerateBatch(*session.impl_, args, sequences, pool, inner_pool,
+                             accept_token, verbosity);
+  pool.SetWaitMode(hwy::PoolWaitMode::kBlock);
+}
+
+void GenerateGemmaBatch(Gemma& gemma, const InferenceArgs& args,
+                        std::vector<BatchSequence>& sequences,
+                        hwy::ThreadPool& pool, hwy::ThreadPool& inner_pool,
+                        const AcceptFunc& accept_token, int verbosity) {
+  GenerateGemmaBatch(gemma, gemma.DefaultSession(), args, sequences, pool,
+                     inner_pool, accept_token, verbosity);
+}
+
+bool PrefillChunk(const Gemma& gemma, Session& session,
+                  const std::vector<int>& prompt, size_t start_pos,
+                  size_t& num_prefilled, KVCache& kv_cache, size_t max_tokens,
+                  hwy::ThreadPool& pool) {
+  HWY_ASSERT(!prompt.empty() && num_prefilled < prompt.size());
+  const size_t end = std::min(prompt.size() - 1, num_prefilled + max_tokens);
+  size_t positions[kPrefillBatchSize];
+  KVCache* kv_caches[kPrefillBatchSize];
+  std::fill(kv_caches, kv_caches + kPrefillBatchSize, &kv_cache);
+  while (num_prefilled < end) {
+    const size_t num = std::min(kPrefillBatchSize, end - num_prefilled);
+    for (size_t i = 0; i < num; ++i) {
+      positions[i] = start_pos + num_prefilled + i;
+    }
+    gemma.impl_->ForwardBatch(*session.impl_, prompt.data() + num_prefilled,
+                              positions, kv_caches, num, /*num_logits=*/0,
+                              pool);
+    num_prefilled += num;
+  }
+  return num_prefilled + 1 == prompt.size();
+}
+
+bool PrefillChunk(Gemma& gemma, const std::vector<int>& prompt,
+                  size_t start_pos, size_t& num_prefilled, KVCache& kv_cache,
+                  size_t max_tokens, hwy::ThreadPool& pool) {
+  return PrefillChunk(gemma, gemma.DefaultSession(), prompt, start_pos,
+                      num_prefilled, kv_cache, max_tokens, pool);
+}
+
+void GenerateGemmaSpeculative(const Gemma& gemma, Session& session,
+                              const Gemma& draft, Session& draft_session,
+                              size_t num_draft, const InferenceArgs& args,
+                              const std::vector<int>& prompt, size_t start_pos,
+                              hwy::ThreadPool& pool,
+                              hwy::ThreadPool& /*inner_pool*/,
+                              const StreamFunc& stream_token,
+                              const AcceptFunc& accept_token,
+                              std::mt19937& gen, int verbosity) {
+  // The verifier processes the last committed token plus the drafts at once.
+  HWY_ASSERT(!prompt.empty() && num_draft + 1 <= kPrefillBatchSize);
+  const GemmaInterface& verifier = *gemma.impl_;
+  const GemmaInterface& drafter = *draft.impl_;
+  SessionInterface& verifier_session = *session.impl_;
+  SessionInterface& drafter_session = *draft_session.impl_;
+  pool.SetWaitMode(hwy::PoolWaitMode::kSpin);
+
+  // Both models prefill the prompt except for its last token, which is the
+  // first input for generation.
+  size_t pos = start_pos;
+  const double prefill_start = hwy::platform::Now();
+  const size_t num_prefill = prompt.size() - 1;
+  verifier.Forward(verifier_session, prompt.data(), num_prefill, pos,
+                   /*logits=*/false, pool);
+  drafter.Forward(drafter_session, prompt.data(), num_prefill, pos,
+                  /*logits=*/false, pool);
+  for (size_t i = 0; i < prompt.size(); ++i) {
+    stream_token(prompt[i], 0.0f);
+  }
+  pos += num_prefill;
+  if (verbosity >= 2) {
+    const double prefill_end = hwy::platform::Now();
+    const double prefill_tok_sec = num_prefill / (prefill_end - prefill_start);
+    std::cout << "\n[ Prefill tokens / sec = " << prefill_tok_sec << " ]\n";
+  }
+
+  const double gen_start = hwy::platform::Now();
+  // Committed tokens that the drafter has not yet processed. The last of them
+  // is at `pos` and has not been processed by either model.
+  std::vector<int> pending = {prompt.back()};
+  // Input to the verifier: the last committed token, then the drafts.
+  std::vector<int> candidates(num_draft + 1);
+  // Tokens at positions pos.. after verification.
+  std::vector<int> committed;
+  committed.reserve(num_draft + 2);
+  size_t generate_pos = 0;
+  size_t num_drafted = 0;
+  size_t num_accepted = 0;
+  bool done = false;
+  while (!done && pos < args.max_tokens &&
+         generate_pos < args.max_generated_tokens) {
+    // Neither process nor commit tokens beyond the limits.
+    const size_t max_new = std::min(args.max_tokens - pos,
+                                    args.max_generated_tokens - generate_pos);
+    const size_t k = std::min(num_draft, max_new - 1);
+
+    // Draft autoregressively, first catching up on the pending tokens.
+    candidates[0] = pending.back();
+    for (size_t i = 0; i < k; ++i) {
+      const int* tokens = i == 0 ? pending.data() : &candidates[i];
+      const size_t num_tokens = i == 0 ? pending.size() : 1;
+      drafter.Forward(drafter_session, tokens, num_tokens,
+                      pos + i + 1 - num_tokens, /*logits=*/true, pool);
+      float prob;
+      candidates[i + 1] =
+          drafter.Sample(drafter_session, num_tokens - 1, args, accept_token,
+                         gen, prob);
+    }
+    num_drafted += k;
+
+    // Verify all drafts in one batch. Logits of candidate i predict the token
+    // after it, so the verifier's samples are exactly the tokens it would
+    // generate on its own, as long as they match the drafts. Committing the
+    // sampled rather than the drafted token means later drafts are only used
+    // to decide whether the next logits are valid.
+    verifier.Forward(verifier_session, candidates.data(), k + 1, pos,
+                     /*logits=*/true, pool);
+    committed.assign(1, candidates[0]);
+    for (size_t i = 0; i <= k; ++i) {
+      float prob;
+      int token =
+          verifier.Sample(verifier_session, i, args, accept_token, gen, prob);
+      ++generate_pos;
+      if (!stream_token(token, prob)) token = EOS_ID;
+      committed.push_back(token);
+      if (token == EOS_ID) {
+        done = true;
+        break;
+      }
+      if (i == k || token != candidates[i + 1]) break;
+      ++num_accepted;
+    }
+
+    // Positions after the last matching draft are overwritten later, which
+    // rewinds both caches. The drafter has processed candidates [0, k), which
+    // are valid up to the first mismatch.
+    const size_t num_new = committed.size() - 1;
+    const size_t drafter_valid = std::min(k, num_new);
+    if (k == 0) {
+      pending.insert(pending.end(), committed.begin() + 1, committed.end());
+    } else {
+      pending.assign(committed.begin() + drafter_valid, committed.end());
+    }
+    pos += num_new;
+  }
+
+  // Like the verifier, the drafter has now processed all but the last token.
+  drafter.Forward(drafter_session, pending.data(), pending.size() - 1,
+                  pos + 1 - pending.size(), /*logits=*/false, pool);
+
+  if (verbosity >= 2) {
+    const double gen_end = hwy::platform::Now();
+    const double gen_tok_sec = generate_pos / (gen_end - gen_start);
+    std::cout << "\n[ Generation tokens / sec = " << gen_tok_sec
+              << ", accepted " << num_accepted << " of " << num_drafted
+              << " drafts ]\n";
+  }
   pool.SetWaitMode(hwy::PoolWaitMode::kBlock);
 }
 
+void GenerateGemmaSpeculative(Gemma& gemma, Gemma& draft, size_t num_draft,
+                              const InferenceArgs& args,
+                              const std::vector<int>& prompt, size_t start_pos,
+                              hwy::ThreadPool& pool,
+                              hwy::ThreadPool& inner_pool,
+                              const StreamFunc& stream_token,
+                              const AcceptFunc& accept_token,
+                              std::mt19937& gen, int verbosity) {
+  GenerateGemmaSpeculative(gemma, gemma.DefaultSession(), draft,
+                           draft.DefaultSession(), num_draft, args, prompt,
+                           start_pos, pool, inner_pool, stream_token,
+                           accept_token, gen, verbosity);
+}
+
+struct Scheduler::Request {
+  RequestId id;
+  std::vector<int> prompt;
+  StreamFunc stream_token;
+  std::mt19937 gen;
+  KVCache kv_cache;
+  size_t pos = 0;  // next position to process
+  // Prefill processes prompt[0, prompt.size() - 1); afterwards, `token` (the
+  // last prompt token, then the sampled ones) is the input of each decode step.
+  int token = 0;
+  size_t num_generated = 0;
+
+  bool Prefilled() const { return pos + 1 >= prompt.size(); }
+};
+
+Scheduler::Scheduler(const Gemma& gemma, const InferenceArgs& args,
+                     hwy::ThreadPool& pool, const AcceptFunc& accept_token,
+                     PrefixCache* prefix_cache)
+    : gemma_(gemma),
+      args_(args),
+      pool_(pool),
+      accept_token_(accept_token),
+      prefix_cache_(prefix_cache),
+      kv_pool_(CreateKVPagePool(gemma.model_type)),
+      session_(gemma, kv_pool_) {}
+
+Scheduler::~Scheduler() = default;
+
+Scheduler::RequestId Scheduler::Submit(std::vector<int> prompt,
+                                       StreamFunc stream_token,
+                                       uint32_t seed) {
+  HWY_ASSERT(!prompt.empty());
+  auto request = std::make_unique<Request>();
+  request->prompt = std::move(prompt);
+  request->stream_token = std::move(stream_token);
+  request->gen.seed(seed);
+  request->kv_cache = CreateKVCache(gemma_.model_type, kv_pool_);
+  request->token = request->prompt.back();
+  RequestId id;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    id = next_id_++;
+    request->id = id;
+    queued_.push_back(std::move(request));
+  }
+  cv_.notify_one();
+  return id;
+}
+
+void Scheduler::Cancel(RequestId id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  cancelled_.push_back(id);
+}
+
+void Scheduler::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+}
+
+size_t Scheduler::NumRequests() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return queued_.size() + num_running_;
+}
+
+void Scheduler::Admit() {
+  std::vector<std::unique_ptr<Request>> admitted;
+  std::vector<RequestId> cancelled;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    admitted.swap(queued_);
+    cancelled.swap(cancelled_);
+    num_running_ = running_.size() + admitted.size();
+  }
+
+  for (std::unique_ptr<Request>& request : admitted) {
+    if (prefix_cache_ != nullptr) {
+      request->pos = prefix_cache_->Restore(request->prompt, request->kv_cache);
+    }
+    running_.push_back(std::move(request));
+  }
+
+  if (!cancelled.empty()) {
+    const auto is_cancelled = [&cancelled](const std::unique_ptr<Request>& r) {
+      return std::find(cancelled.begin(), cancelled.end(), r->id) !=
+             cancelled.end();
+    };
+    running_.erase(
+        std::remove_if(running_.begin(), running_.end(), is_cancelled),
+        running_.end());
+  }
+}
+
+std::vector<SchedulerRow> PlanSchedulerStep(
+    const std::vector<size_t>& positions,
+    const std::vector<size_t>& prompt_sizes, size_t prefill_tokens_per_step,
+    size_t& num_decode) {
+  HWY_ASSERT(positions.size() == prompt_sizes.size());
+  const auto prefilled = [&](size_t i) {
+    return positions[i] + 1 >= prompt_sizes[i];
+  };
+  // Decode rows come first because only they require logits.
+  std::vector<SchedulerRow> rows;
+  for (size_t i = 0; i < positions.size(); ++i) {
+    if (prefilled(i)) rows.push_back(SchedulerRow{i, positions[i]});
+  }
+  num_decode = rows.size();
+
+  // Bounds the extra latency of this step for the requests that are decoding.
+  size_t prefill_budget = prefill_tokens_per_step;
+  if (prefill_budget == 0) {
+    prefill_budget =
+        hwy::RoundUpTo(num_decode, kPrefillBatchSize) - num_decode;
+    if (prefill_budget == 0) prefill_budget = kPrefillBatchSize;
+  }
+  for (size_t i = 0; i < positions.size() && prefill_budget != 0; ++i) {
+    if (prefilled(i)) continue;
+    // Prefill ends before the last prompt token, which is decoded.
+    const size_t end =
+        std::min(prompt_sizes[i] - 1, positions[i] + prefill_budget);
+    for (size_t pos = positions[i]; pos < end; ++pos) {
+      rows.push_back(SchedulerRow{i, pos});
+    }
+    prefill_budget -= end - positions[i];
+  }
+  return rows;
+}
+
+bool Scheduler::Step() {
+  PROFILER_ZONE("Gen.SchedulerStep");
+  Admit();
+  if (running_.empty()) return false;
+
+  // Rows of the forward passes: one decode token per prefilled request, then
+  // prefill tokens filling up the last batch.
+  static constexpr size_t kBatchSize = kPrefillBatchSize;
+  std::vector<size_t> positions;
+  std::vector<size_t> prompt_sizes;
+  positions.reserve(running_.size());
+  prompt_sizes.reserve(running_.size());
+  for (const std::unique_ptr<Request>& request : running_) {
+    positions.push_back(request->pos);
+    prompt_sizes.push_back(request->prompt.size());
+  }
+  size_t num_decode;
+  const std::vector<SchedulerRow> rows = PlanSchedulerStep(
+      positions, prompt_sizes, args_.prefill_tokens_per_step, num_decode);
+
+  std::vector<Request*> row_request(rows.size());
+  std::vector<int> row_token(rows.size());
+  std::vector<size_t> row_pos(rows.size());
+  for (size_t row = 0; row < rows.size(); ++row) {
+    Request& r = *running_[rows[row].request];
+    row_request[row] = &r;
+    row_pos[row] = rows[row].pos;
+    if (row < num_decode) {
+      row_token[row] = r.token;
+    } else {
+      row_token[row] = r.prompt[rows[row].pos];
+      r.pos = rows[row].pos + 1;
+    }
+  }
+
+  const GemmaInterface& model = *gemma_.impl_;
+  SessionInterface& session = *session_.impl_;
+  std::vector<KVCache*> row_cache(row_request.size());
+  for (size_t row = 0; row < row_request.size(); ++row) {
+    row_cache[row] = &row_request[row]->kv_cache;
+  }
+  for (size_t begin = 0; begin < row_request.size(); begin += kBatchSize) {
+    const size_t num = std::min(kBatchSize, row_request.size() - begin);
+    const size_t num_logits =
+        begin < num_decode ? std::min(num, num_decode - begin) : 0;
+    model.ForwardBatch(session, &row_token[begin], &row_pos[begin],
+                       &row_cache[begin], num, num_logits, pool_);
+
+    // Sample before the next batch overwrites the logits.
+    for (size_t b = 0; b < num_logits; ++b) {
+      Request& r = *row_request[begin + b];
+      float prob;
+      r.token = model.Sample(session, b, args_, accept_token_, r.gen, prob);
+      ++r.pos;
+      ++r.num_generated;
+      if (!r.stream_token(r.token, prob) || r.token == EOS_ID ||
+          r.pos >= args_.max_tokens ||
+          r.num_generated >= args_.max_generated_tokens) {
+        r.token = EOS_ID;  // marks the request as finished
+      }
+    }
+  }
+
+  // Requests whose prefill just completed can now be used for later prompts.
+  if (prefix_cache_ != nullptr) {
+    for (size_t row = num_decode; row < row_request.size(); ++row) {
+      const Request& r = *row_request[row];
+      if (r.Prefilled() && row_pos[row] + 2 == r.prompt.size() &&
+          r.pos >= kKVPagePositions) {
+        prefix_cache_->Insert(
+            std::vector<int>(r.prompt.begin(), r.prompt.begin() + r.pos),
+            r.kv_cache);
+      }
+    }
+  }
+
+  // Finished requests release their KV pages.
+  running_.erase(std::remove_if(running_.begin(), running_.end(),
+                                [](const std::unique_ptr<Request>& r) {
+                                  return r->Prefilled() &&
+                                         r->num_generated != 0 &&
+                                         r->token == EOS_ID;
+                                }),
+                 running_.end());
+  std::lock_guard<std::mutex> lock(mutex_);
+  num_running_ = running_.size();
+  return true;
+}
+
+void Scheduler::Run() {
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (running_.empty()) {
+        cv_.wait(lock, [this] { return stop_ || !queued_.empty(); });
+      }
+      if (stop_) {
+        stop_ = false;
+        return;
+      }
+    }
+    pool_.SetWaitMode(hwy::PoolWaitMode::kSpin);
+    Step();
+    pool_.SetWaitMode(hwy::PoolWaitMode::kBlock);
+  }
+}
+
 }  // namespace gcpp
 #endif  // HWY_ONCE
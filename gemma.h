@@ -16,12 +16,19 @@
 #ifndef THIRD_PARTY_GEMMA_CPP_GEMMA_H_
 #define THIRD_PARTY_GEMMA_CPP_GEMMA_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <algorithm>
+#include <array>
 #include <cctype>
+#include <condition_variable>  // NOLINT
 #include <functional>
 #include <memory>
+#include <mutex>  // NOLINT
 #include <random>
 #include <string>
+#include <utility>
 #include <vector>
 
 // copybara:import_next_line:gemma_cpp
@@ -38,28 +45,369 @@
 
 namespace gcpp {
 
-// Allowable types for GEMMA_WEIGHT_T (can be specified at compilation time):
-// float, hwy::bfloat16_t, SfpStream, NuqStream
+// Default weight type, used when compressing weights or if the compressed
+// weights file predates ModelHeader and --weight_type is not given. Allowable
+// types for GEMMA_WEIGHT_T (can be specified at compilation time): float,
+// hwy::bfloat16_t, SfpStream, NuqStream, I8Stream. Files of any of these types
+// can be loaded. NuqStream (4.5 bits per weight) requires all matrix
+// dimensions to be multiples of its group size, which is checked by
+// CompressedLayer.
 #ifndef GEMMA_WEIGHT_T
 #define GEMMA_WEIGHT_T SfpStream
 #endif  // !GEMMA_WEIGHT_T
 using WeightT = GEMMA_WEIGHT_T;
+static_assert(hwy::IsSame<WeightT, float>() ||
+                  hwy::IsSame<WeightT, hwy::bfloat16_t>() ||
+                  hwy::IsSame<WeightT, SfpStream>() ||
+                  hwy::IsSame<WeightT, NuqStream>() ||
+                  hwy::IsSame<WeightT, I8Stream>(),
+              "GEMMA_WEIGHT_T must be float, hwy::bfloat16_t, SfpStream, "
+              "NuqStream or I8Stream");
+
+// Allowable types for GEMMA_KV_T, the element type of the KV cache: float,
+// hwy::bfloat16_t. The latter halves KV memory and bandwidth. SfpStream is not
+// allowed because it only represents magnitudes below 2, which keys and values
+// often exceed after RoPE.
+#ifndef GEMMA_KV_T
+#define GEMMA_KV_T float
+#endif  // !GEMMA_KV_T
+using KVT = GEMMA_KV_T;
+static_assert(hwy::IsSame<KVT, float>() ||
+                  hwy::IsSame<KVT, hwy::bfloat16_t>(),
+              "GEMMA_KV_T must be float or hwy::bfloat16_t");
 
 using EmbedderInputT = hwy::bfloat16_t;
 constexpr size_t kPrefillBatchSize = 16;
 constexpr bool kSystemPrompt = false;
 
-struct KVCache {
-  hwy::AlignedFreeUniquePtr<float[]>
-      key_cache;  // batch_size * kSeqLen * kLayers * kKVHeads * kQKVDim
-  hwy::AlignedFreeUniquePtr<float[]>
-      value_cache;  // batch_size * kSeqLen * kLayers * kKVHeads * kQKVDim
+// Number of consecutive positions whose keys and values share one KVPage.
+constexpr size_t kKVPagePositions = 64;
+
+// Keys and values of all layers for kKVPagePositions consecutive positions.
+// The layout is [layer][kv_head][position within page][kQKVDim], so that the
+// attention loops over positions stream contiguous memory.
+struct KVPage {
+  hwy::AlignedFreeUniquePtr<KVT[]>
+      key_cache;  // kKVPagePositions * kLayers * kKVHeads * kQKVDim
+  hwy::AlignedFreeUniquePtr<KVT[]>
+      value_cache;  // kKVPagePositions * kLayers * kKVHeads * kQKVDim
+  size_t ref_count = 0;  // number of page tables; guarded by the pool's mutex
+};
+
+// Source of pages for the KV caches of one model type. Pages released by one
+// cache are reused by the next, so the total memory is bounded by the number
+// of tokens in flight rather than sessions * kSeqLen. Pages may be shared by
+// several caches (see KVCache::Share); they are reused once the last of them
+// frees the page. Thread-safe.
+class KVPagePool {
+ public:
+  KVPagePool(size_t layers, size_t kv_heads, size_t qkv_dim)
+      : layers_(layers), kv_heads_(kv_heads), qkv_dim_(qkv_dim) {}
+
+  size_t Layers() const { return layers_; }
+  size_t KVHeads() const { return kv_heads_; }
+  size_t QKVDim() const { return qkv_dim_; }
+  // Number of elements per position, i.e. kLayers * kKVHeads * kQKVDim.
+  size_t SizeCachePos() const { return layers_ * kv_heads_ * qkv_dim_; }
+
+  // Returns a free page with a reference count of one, or allocates one if
+  // there is none. The pool retains ownership.
+  KVPage* Allocate();
+  // Adds a reference to a page returned by Allocate.
+  void AddRef(KVPage* page);
+  // Removes a reference; the page becomes free when none remain.
+  void Free(KVPage* page);
+  // Returns whether more than one page table references `page`.
+  bool IsShared(const KVPage* page) const;
+
+  // Number of pages currently owned by KV caches.
+  size_t NumInUse() const;
+
+ private:
+  size_t layers_;
+  size_t kv_heads_;
+  size_t qkv_dim_;
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<KVPage>> pages_;  // all allocated
+  std::vector<KVPage*> free_pages_;
+  size_t num_in_use_ = 0;
+};
+
+// KV cache of one sequence. Its page table only grows as `Reserve` is called
+// for later positions, and all pages go back to the pool on destruction.
+// Pages obtained via `Share` are copied before they are first written.
+//
+// After `SetWindow`, the page table is a ring buffer instead: only the first
+// pages (the attention sinks, e.g. BOS and a system prompt) and the most
+// recent ones are kept, and attention only considers their positions. Memory
+// and the cost per token are then constant however long the sequence grows.
+class KVCache {
+ public:
+  KVCache() = default;
+  KVCache(std::shared_ptr<KVPagePool> pool, size_t max_positions)
+      : pool_(std::move(pool)), max_positions_(max_positions) {}
+  ~KVCache() { Release(); }
+
+  KVCache(KVCache&& other) = default;
+  KVCache& operator=(KVCache&& other);
+
+  // Keeps positions [0, sink_positions) and at least the last
+  // `window_positions` before the current one, both rounded up to whole
+  // pages; older pages are reused for later positions. Positions are then
+  // unbounded. Requires an empty cache, e.g. after Release, which keeps the
+  // window.
+  void SetWindow(size_t sink_positions, size_t window_positions);
+  // Undoes SetWindow: all positions are kept, up to the `max_positions` passed
+  // to the ctor. Requires an empty cache.
+  void ClearWindow();
+
+  // Ensures that positions [0, num_positions) are backed by pages, except for
+  // those evicted by the window.
+  void Reserve(size_t num_positions);
+  // Ensures the page backing `pos` (< Capacity()) is not shared, so that
+  // keys and values at `pos` can be written without affecting other caches.
+  void PrepareWrite(size_t pos);
+  // Returns all pages to the pool, e.g. before starting a new conversation.
+  void Release();
+
+  // Returns a cache for the same pool and window whose positions
+  // [0, num_positions) (<= Capacity()) share this cache's pages, none of which
+  // may have been evicted. Cheap because no keys or values are copied until
+  // either cache writes to a shared page.
+  KVCache Share(size_t num_positions) const;
+
+  // Number of positions reserved so far; with a window, only [0,
+  // SinkPositions()) and [WindowBegin(), Capacity()) of them are cached.
+  size_t Capacity() const { return num_pages_ * kKVPagePositions; }
+  bool HasWindow() const { return window_pages_ != 0; }
+  size_t SinkPositions() const { return sink_pages_ * kKVPagePositions; }
+  size_t WindowPositions() const { return window_pages_ * kKVPagePositions; }
+  // First cached position after the sinks, or 0 if none were evicted.
+  size_t WindowBegin() const {
+    return num_pages_ > sink_pages_ + window_pages_ && HasWindow()
+               ? (num_pages_ - window_pages_) * kKVPagePositions
+               : 0;
+  }
+  // Returns whether the keys and values of `pos` (< Capacity()) are cached.
+  bool Contains(size_t pos) const {
+    return pos < SinkPositions() || pos >= WindowBegin();
+  }
+  // Bytes of keys and values in those pages, some of which may be shared.
+  size_t Bytes() const {
+    return pool_ ? pages_.size() * 2 * kKVPagePositions *
+                       pool_->SizeCachePos() * sizeof(KVT)
+                 : 0;
+  }
+  size_t MaxPositions() const {
+    return HasWindow() ? ~size_t{0} : max_positions_;
+  }
+  const KVPagePool& Pool() const { return *pool_; }
+
+  // The kQKVDim keys resp. values of `layer` and `kv_head` at `pos`, for
+  // which Contains must be true. Consecutive positions within a page are
+  // adjacent.
+  KVT* Keys(size_t layer, size_t kv_head, size_t pos) {
+    return PagePos(layer, kv_head, pos, &KVPage::key_cache);
+  }
+  const KVT* Keys(size_t layer, size_t kv_head, size_t pos) const {
+    return PagePos(layer, kv_head, pos, &KVPage::key_cache);
+  }
+  KVT* Values(size_t layer, size_t kv_head, size_t pos) {
+    return PagePos(layer, kv_head, pos, &KVPage::value_cache);
+  }
+  const KVT* Values(size_t layer, size_t kv_head, size_t pos) const {
+    return PagePos(layer, kv_head, pos, &KVPage::value_cache);
+  }
+
+ private:
+  using PageMember = hwy::AlignedFreeUniquePtr<KVT[]> KVPage::*;
+  KVT* PagePos(size_t layer, size_t kv_head, size_t pos,
+               PageMember member) const {
+    HWY_DASSERT(pos < Capacity() && Contains(pos));
+    HWY_DASSERT(layer < pool_->Layers() && kv_head < pool_->KVHeads());
+    const KVPage& page = *pages_[Slot(pos / kKVPagePositions)];
+    const size_t row = (layer * pool_->KVHeads() + kv_head) * kKVPagePositions +
+                       pos % kKVPagePositions;
+    return (page.*member).get() + row * pool_->QKVDim();
+  }
+
+  // Index within pages_ of the page holding positions starting at
+  // page * kKVPagePositions.
+  size_t Slot(size_t page) const {
+    return page < sink_pages_ || !HasWindow()
+               ? page
+               : sink_pages_ + (page - sink_pages_) % window_pages_;
+  }
+
+  std::shared_ptr<KVPagePool> pool_;
+  std::vector<KVPage*> pages_;  // page table, references owned by pool_
+  size_t num_pages_ = 0;        // reserved, including evicted ones
+  size_t max_positions_ = 0;  // without a window
+  size_t sink_pages_ = 0;
+  size_t window_pages_ = 0;  // 0 if there is no window
+};
+
+// Remembers the KV caches of recent prompts so that a later prompt starting
+// with the same tokens, e.g. a shared system prompt or few-shot preamble,
+// only has to prefill the remainder. Entries share pages with the caches they
+// were inserted from, hence each costs little memory beyond what those caches
+// already use. A handful of entries suffice for a few common preambles, so
+// lookups compare against each entry. Not thread-safe.
+class PrefixCache {
+ public:
+  explicit PrefixCache(size_t max_entries = 8) : max_entries_(max_entries) {}
+
+  // Records that positions [0, tokens.size()) of `kv_cache` hold the keys and
+  // values of `tokens`. Replaces entries that are a prefix of `tokens`, and
+  // evicts the least recently used entry if there are already max_entries.
+  // Has no effect if the window of `kv_cache` has evicted positions.
+  void Insert(const std::vector<int>& tokens, const KVCache& kv_cache);
+
+  // If an entry shares a prefix with `prompt`, replaces `kv_cache` by a cache
+  // sharing that entry's pages and returns the number of positions restored.
+  // This is less than prompt.size() because the last prompt token must still
+  // be processed to obtain logits. Returns 0 and leaves `kv_cache` unchanged
+  // if there is no match.
+  size_t Restore(const std::vector<int>& prompt, KVCache& kv_cache);
+
+  size_t NumEntries() const { return entries_.size(); }
+
+ private:
+  struct Entry {
+    std::vector<int> tokens;
+    KVCache kv_cache;
+    uint64_t last_use;
+  };
+
+  size_t max_entries_;
+  uint64_t num_uses_ = 0;
+  std::vector<Entry> entries_;
 };
 
 // Model variants: see configs.h for details.
 enum class Model { GEMMA_2B, GEMMA_7B };
 enum class ModelTraining { GEMMA_IT, GEMMA_PT };
 
+// Element type of the compressed weights. Kernels for each are compiled in,
+// and the one matching the weights file is chosen at load time. The kBF16*
+// mixed types keep the attention matrices in bf16 and compress only the FFW
+// matrices, which are most of the bytes streamed per token. Embeddings and
+// norm scales are always bf16. kI8 enables int8 activations for prefill on
+// CPUs with int8 dot products, see UsesInt8Activations. Values are stored in
+// ModelHeader, so new types must be appended.
+enum class WeightType : uint32_t {
+  kF32,
+  kBF16,
+  kSFP,
+  kNUQ,
+  kBF16SFP,
+  kBF16NUQ,
+  kI8,
+};
+
+template <typename TWeight>
+constexpr WeightType WeightTypeOf() {
+  using BF16SFP = MixedWeights<hwy::bfloat16_t, SfpStream>;
+  return hwy::IsSame<TWeight, float>()             ? WeightType::kF32
+         : hwy::IsSame<TWeight, hwy::bfloat16_t>() ? WeightType::kBF16
+         : hwy::IsSame<TWeight, SfpStream>()       ? WeightType::kSFP
+         : hwy::IsSame<TWeight, NuqStream>()       ? WeightType::kNUQ
+         : hwy::IsSame<TWeight, BF16SFP>()         ? WeightType::kBF16SFP
+         : hwy::IsSame<TWeight, I8Stream>()        ? WeightType::kI8
+                                                   : WeightType::kBF16NUQ;
+}
+
+// Sets `type` from its lower-case --weight_type flag value and returns true,
+// or returns false if the name is unknown.
+static inline bool ParseWeightType(const std::string& name, WeightType& type) {
+  if (name == "f32") {
+    type = WeightType::kF32;
+  } else if (name == "bf16") {
+    type = WeightType::kBF16;
+  } else if (name == "sfp") {
+    type = WeightType::kSFP;
+  } else if (name == "nuq") {
+    type = WeightType::kNUQ;
+  } else if (name == "bf16-sfp") {
+    type = WeightType::kBF16SFP;
+  } else if (name == "bf16-nuq") {
+    type = WeightType::kBF16NUQ;
+  } else if (name == "i8") {
+    type = WeightType::kI8;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static inline const char* WeightTypeName(WeightType type) {
+  switch (type) {
+    case WeightType::kF32:
+      return TypeName(float());
+    case WeightType::kBF16:
+      return TypeName(hwy::bfloat16_t());
+    case WeightType::kSFP:
+      return TypeName(SfpStream());
+    case WeightType::kNUQ:
+      return TypeName(NuqStream());
+    case WeightType::kBF16SFP:
+      return "b16+SFP";
+    case WeightType::kBF16NUQ:
+      return "b16+NUQ";
+    case WeightType::kI8:
+      return TypeName(I8Stream());
+  }
+  return "?";
+}
+
+// Stored as a blob in the compressed weights file, so that the model and
+// weight type are known before any tensor is read, and a file does not have
+// to match the binary's compile-time defaults. Only the model and weight type
+// select the kernels; the dimensions guard against mismatched files.
+struct ModelHeader {
+  static constexpr uint32_t kVersion = 1;
+
+  uint32_t version = kVersion;
+  uint32_t model;        // Model
+  uint32_t weight_type;  // WeightType
+  uint32_t vocab_size;
+  uint32_t layers;
+  uint32_t model_dim;
+  uint32_t ff_hidden_dim;
+  uint32_t heads;
+  uint32_t kv_heads;
+  uint32_t qkv_dim;
+  uint32_t seq_len;  // maximum context
+  uint32_t reserved = 0;
+};
+
+// Writes the keys and values of positions [0, num_positions) of `kv_cache` to
+// `path` in the blob store format, one blob per page, so that a session can
+// be resumed by another process via LoadKVCache instead of prefilling its
+// tokens again. Positions beyond Capacity() were never written and are
+// skipped. They are stored as KVT. Returns false and prints the reason on
+// failure.
+bool SaveKVCache(const KVCache& kv_cache, size_t num_positions,
+                 const Path& path, hwy::ThreadPool& pool);
+
+// Replaces the contents and window of `kv_cache`, whose model must match that
+// of the file, by those written by SaveKVCache, and sets `num_positions`, i.e.
+// the position of the next token. The pages are read in parallel and converted
+// to KVT if the file uses another type. Returns false and prints the reason
+// on failure, in which case `kv_cache` is empty.
+bool LoadKVCache(const Path& path, KVCache& kv_cache, size_t& num_positions,
+                 hwy::ThreadPool& pool);
+
+// Returns a page pool for KV caches of the given model.
+std::shared_ptr<KVPagePool> CreateKVPagePool(Model type);
+
+// Returns an empty KV cache for up to `max_positions` positions of the given
+// model, or its full kSeqLen if 0. Memory is only used for positions actually
+// written. Its pages come from `pool` if non-null, otherwise from a private
+// pool.
+KVCache CreateKVCache(Model type, std::shared_ptr<KVPagePool> pool = nullptr,
+                      size_t max_positions = 0);
+
 struct LoaderArgs : public ArgsBase<LoaderArgs> {
   LoaderArgs(int argc, char* argv[]) { InitAndParse(argc, argv); }
 
@@ -79,6 +427,13 @@ struct LoaderArgs : public ArgsBase<LoaderArgs> {
     }
   }
 
+  // Weight type for compressing, or for files without a ModelHeader.
+  gcpp::WeightType WeightType() const {
+    gcpp::WeightType type;
+    if (ParseWeightType(ToLower(weight_type), type)) return type;
+    return WeightTypeOf<WeightT>();
+  }
+
   gcpp::ModelTraining ModelTraining() const {
     const std::string model_type_lc = ToLower(model_type);
     if (model_type_lc == "7b-pt" || model_type_lc == "2b-pt") {
@@ -96,6 +451,11 @@ struct LoaderArgs : public ArgsBase<LoaderArgs> {
       return "Model type must be 2b-pt, 7b-pt, 2b-it, or "
              "7b-it.";
     }
+    gcpp::WeightType type;
+    if (!weight_type.empty() && !ParseWeightType(ToLower(weight_type), type)) {
+      return "Weight type must be f32, bf16, sfp, nuq, bf16-sfp, bf16-nuq or "
+             "i8.";
+    }
     if (tokenizer.path.empty()) {
       return "Missing --tokenizer flag, a file for the tokenizer is required.";
     }
@@ -114,6 +474,9 @@ struct LoaderArgs : public ArgsBase<LoaderArgs> {
   Path model;  // uncompressed weights OR
   Path cache;  // compressed weights
   std::string model_type;
+  std::string weight_type;
+  bool map_weights;
+  bool async_load;
 
   template <class Visitor>
   void ForEach(const Visitor& visitor) {
@@ -133,26 +496,104 @@ struct LoaderArgs : public ArgsBase<LoaderArgs> {
             "Path name of model weights (.sbs) file. Only required if "
             "compressed_weights file is not present and needs to be "
             "regenerated. Otherwise, not needed");
+    visitor(weight_type, "weight_type", std::string(),
+            "Weight type (f32, bf16, sfp, nuq, bf16-sfp, bf16-nuq or i8) "
+            "when compressing `--weights`, or for older compressed weights "
+            "files that do not record it. bf16-* keep attention in bf16. "
+            "Defaults to the type chosen at compile time.",
+            2);
+    visitor(map_weights, "map_weights", false,
+            "Memory-map the compressed weights file instead of reading it, "
+            "which lets processes share one copy in the OS page cache.",
+            2);
+    visitor(async_load, "async_load", false,
+            "Read the layers of the compressed weights in the background, "
+            "so that inference can begin before they are all loaded. Has no "
+            "effect with --map_weights.",
+            2);
   }
 };
 
 struct GemmaInterface;
+struct SessionInterface;
+class Session;
 
+// The weights and tokenizer of a model, which are read-only after
+// construction and can thus be shared by any number of Sessions, including
+// sessions that generate concurrently on different threads or pools. The
+// overloads of GenerateGemma etc. without a Session use a default session
+// owned by Gemma and must not be called concurrently.
 struct Gemma {
   Gemma(const LoaderArgs& args, hwy::ThreadPool& pool);
   ~Gemma();  // must be defined after GemmaInterface's dtor is defined.
 
   const sentencepiece::SentencePieceProcessor& Tokenizer() const;
+  // Returns the default session, which is created on first use so that
+  // callers with their own Sessions do not pay for it.
+  Session& DefaultSession();
+  // The KV cache of the default session, e.g. for SaveKVCache.
+  KVCache& GetKVCache();
 
   std::unique_ptr<GemmaInterface> impl_;
+  std::unique_ptr<Session> session_;  // see DefaultSession
+  gcpp::Model model_type;
   gcpp::ModelTraining model_training;
+  gcpp::WeightType weight_type;
+};
+
+// The mutable state of one conversation with a Gemma model: its KV cache and
+// the activations used by prefill and decode. Costs no weights, hence one per
+// user or thread is cheap. Not thread-safe, but different sessions of the same
+// Gemma may be used concurrently, each with its own thread pool. Must not
+// outlive its Gemma.
+class Session {
+ public:
+  // `kv_pool`, e.g. one shared by several sessions, supplies the pages of the
+  // KV cache; if null, a private pool is created (see CreateKVCache).
+  explicit Session(const Gemma& gemma,
+                   std::shared_ptr<KVPagePool> kv_pool = nullptr);
+  Session(Session&& other);
+  Session& operator=(Session&& other);
+  ~Session();  // must be defined after SessionInterface's dtor is defined.
+
+  // The KV cache used by GenerateGemma, e.g. for SaveKVCache or SetWindow.
+  KVCache& GetKVCache();
+
+  std::unique_ptr<SessionInterface> impl_;
 };
 
+// Compresses the uncompressed `weights` file to `compressed`, which Gemma can
+// then load. Unlike the fallback in the Gemma ctor, which keeps the
+// compressed model in memory, this only holds one layer or the embedding at a
+// time. `refine_nuq` improves the accuracy of NuqStream tensors at the cost
+// of slower compression. Returns false and prints the reason on failure.
+bool CompressWeights(Model model, WeightType weight_type, const Path& weights,
+                     const Path& compressed, bool refine_nuq,
+                     hwy::ThreadPool& pool);
+
+// Returns whether WeightType::kI8 weights are multiplied with int8 activations
+// during prefill, which requires the target chosen by HWY_DYNAMIC_DISPATCH to
+// have VNNI (x86) or SVE (Arm). Otherwise, they are multiplied with the
+// f32/bf16 activations like other weight types.
+bool UsesInt8Activations();
+
 // StreamFunc is called with (token, probability). For prompt tokens,
 // probability is 0.0f.
 using StreamFunc = std::function<bool(int, float)>;
+// AcceptFunc returns whether a token may be sampled. It is only called for
+// likely candidates, possibly concurrently from threads of the pool.
 using AcceptFunc = std::function<bool(int)>;
 
+// One of the sequences passed to GenerateGemmaBatch. Each has its own KV cache
+// and sampling state, so unrelated conversations can be stepped together.
+struct BatchSequence {
+  std::vector<int> prompt;
+  size_t start_pos = 0;  // position of prompt[0] within kv_cache
+  KVCache* kv_cache = nullptr;  // from CreateKVCache
+  std::mt19937* gen = nullptr;
+  StreamFunc stream_token;
+};
+
 struct InferenceArgs : public ArgsBase<InferenceArgs> {
   InferenceArgs(int argc, char* argv[]) { InitAndParse(argc, argv); }
 
@@ -160,19 +601,37 @@ struct InferenceArgs : public ArgsBase<InferenceArgs> {
   size_t max_generated_tokens;
 
   float temperature;
+  float top_p;
+  float min_p;
+  size_t prefill_tokens_per_step;
   bool deterministic;
   bool multiturn;
+  Path kv_cache_file;
+  size_t kv_window;
+  size_t kv_sinks;
 
   // Returns error string or nullptr if OK.
   const char* Validate() const {
-    if (max_tokens > gcpp::kSeqLen) {
+    if (kv_window == 0 && max_tokens > gcpp::kSeqLen) {
       return "max_tokens is larger than the maximum sequence length (see "
-             "configs.h).";
+             "configs.h). Use --kv_window for longer conversations.";
+    }
+    // The extra page is for the current position, see KVCache::SetWindow.
+    if (kv_window != 0 &&
+        hwy::RoundUpTo(kv_sinks, kKVPagePositions) +
+                hwy::RoundUpTo(kv_window, kKVPagePositions) +
+                kKVPagePositions >
+            gcpp::kSeqLen) {
+      return "kv_window plus kv_sinks, rounded up to pages, must be less "
+             "than the maximum sequence length (see configs.h).";
     }
     if (max_generated_tokens > max_tokens) {
       return "Maximum number of generated tokens is larger than the maximum "
              "total tokens.";
     }
+    if (!(top_p > 0.0f && top_p <= 1.0f) || !(min_p >= 0.0f && min_p <= 1.0f)) {
+      return "top_p must be in (0, 1] and min_p in [0, 1].";
+    }
     return nullptr;
   }
 
@@ -184,21 +643,276 @@ struct InferenceArgs : public ArgsBase<InferenceArgs> {
             "Maximum number of tokens to generate.");
 
     visitor(temperature, "temperature", 1.0f, "Temperature for top-K", 2);
+    visitor(top_p, "top_p", 1.0f,
+            "Sample only from the most likely of the top-K tokens whose "
+            "probabilities sum to at least top_p",
+            2);
+    visitor(min_p, "min_p", 0.0f,
+            "Exclude top-K tokens less likely than min_p times the most "
+            "likely one",
+            2);
+    visitor(prefill_tokens_per_step, "prefill_tokens_per_step", size_t{0},
+            "Maximum number of prompt tokens that Scheduler prefills per "
+            "decode step; 0 fills the remainder of the decode batch",
+            2);
     visitor(deterministic, "deterministic", false,
             "Make top-k sampling deterministic", 2);
     visitor(multiturn, "multiturn", true,
             "Multiturn mode (if 0, this clears the KV cache after every "
             "interaction without quitting)",
             2);
+    visitor(kv_cache_file, "kv_cache_file", Path(),
+            "If set, the multiturn session is restored from this file at "
+            "startup, if it exists, and saved to it after each turn",
+            2);
+    visitor(kv_window, "kv_window", size_t{0},
+            "If nonzero, the KV cache only keeps the first --kv_sinks and the "
+            "last kv_window positions, so that conversations may exceed the "
+            "sequence length (also raise --max_tokens) at constant memory and "
+            "cost per token",
+            2);
+    visitor(kv_sinks, "kv_sinks", size_t{64},
+            "Number of initial positions (attention sinks) that --kv_window "
+            "always keeps",
+            2);
   }
 };
 
+// Performance of one GenerateGemma call. Collecting them costs a few clock
+// reads per token (per layer if `layer_times`), so they can be left enabled.
+// Times are in seconds.
+struct GenerationMetrics {
+  // Input: whether to also fill attention_seconds and ffw_seconds.
+  bool layer_times = false;
+
+  size_t prompt_tokens = 0;
+  size_t restored_tokens = 0;  // from the PrefixCache, thus not prefilled
+  size_t generated_tokens = 0;
+
+  double prefill_seconds = 0.0;
+  // From the start of the call until the first generated token is sampled.
+  double time_to_first_token = 0.0;
+  double decode_seconds = 0.0;  // sum of the per-token latencies
+
+  // Bucket i counts decode steps whose latency is in [2^i, 2^(i+1))
+  // microseconds; the last bucket also counts all slower ones.
+  static constexpr size_t kLatencyBuckets = 24;
+  std::array<uint32_t, kLatencyBuckets> decode_latency_histogram{};
+
+  // Bytes of KV pages referenced by the cache at the end, including any
+  // shared with other caches.
+  size_t kv_cache_bytes = 0;
+
+  // Per layer, summed over all prefill and decode steps.
+  std::vector<double> attention_seconds;
+  std::vector<double> ffw_seconds;
+
+  void AddDecodeLatency(double seconds) {
+    decode_seconds += seconds;
+    size_t bucket = 0;
+    for (double us = seconds * 1E6; us >= 2.0 && bucket + 1 < kLatencyBuckets;
+         us *= 0.5) {
+      ++bucket;
+    }
+    ++decode_latency_histogram[bucket];
+  }
+
+  double PrefillTokensPerSecond() const {
+    // The last prompt token is the first input of decode, not prefilled.
+    const size_t prefilled =
+        prompt_tokens == 0 ? 0 : prompt_tokens - 1 - restored_tokens;
+    return prefill_seconds == 0.0 ? 0.0 : prefilled / prefill_seconds;
+  }
+  double DecodeTokensPerSecond() const {
+    return decode_seconds == 0.0 ? 0.0 : generated_tokens / decode_seconds;
+  }
+
+  // Returns the upper bound, in seconds, of the histogram bucket containing
+  // the `quantile` (in [0, 1]) decode latency, or 0 if nothing was decoded.
+  double DecodeLatencyQuantile(double quantile) const {
+    uint64_t total = 0;
+    for (uint32_t count : decode_latency_histogram) total += count;
+    if (total == 0) return 0.0;
+    const double rank = quantile * static_cast<double>(total);
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < kLatencyBuckets; ++bucket) {
+      seen += decode_latency_histogram[bucket];
+      if (static_cast<double>(seen) >= rank) return (2ULL << bucket) * 1E-6;
+    }
+    return (2ULL << (kLatencyBuckets - 1)) * 1E-6;
+  }
+
+  // Returns a single-line JSON object, e.g. for logging to a monitoring
+  // system.
+  std::string ToJSON() const;
+};
+
+// Generates with the KV cache and activations of `session`, which must have
+// been created for `gemma`. Calls with different sessions may run
+// concurrently. If `prefix_cache` is non-null and start_pos is 0, the prefill
+// begins after the longest prefix of `prompt` found in `prefix_cache`, and the
+// prompt is then added to it; PrefixCache is not thread-safe, hence concurrent
+// callers need separate ones. If `metrics` is non-null, it is overwritten with
+// timings of this call.
+void GenerateGemma(const Gemma& gemma, Session& session,
+                   const InferenceArgs& args, const std::vector<int>& prompt,
+                   size_t start_pos, hwy::ThreadPool& pool,
+                   hwy::ThreadPool& inner_pool, const StreamFunc& stream_token,
+                   const AcceptFunc& accept_token, std::mt19937& g,
+                   int verbosity, PrefixCache* prefix_cache = nullptr,
+                   GenerationMetrics* metrics = nullptr);
+
+// As above, with the default session of `gemma`.
 void GenerateGemma(Gemma& gemma, const InferenceArgs& args,
                    const std::vector<int>& prompt, size_t start_pos,
                    hwy::ThreadPool& pool, hwy::ThreadPool& inner_pool,
                    const StreamFunc& stream_token,
                    const AcceptFunc& accept_token, std::mt19937& g,
-                   int verbosity);
+                   int verbosity, PrefixCache* prefix_cache = nullptr,
+                   GenerationMetrics* metrics = nullptr);
+
+// Generates for all `sequences` at once. Prompts are prefilled one after the
+// other, then each decode step advances every unfinished sequence by one token
+// so that each decompressed weight row is reused for the whole batch. A
+// sequence finishes after EOS, or when it reaches `args.max_tokens` or
+// `args.max_generated_tokens`. Only the activations of `session` are used.
+void GenerateGemmaBatch(const Gemma& gemma, Session& session,
+                        const InferenceArgs& args,
+                        std::vector<BatchSequence>& sequences,
+                        hwy::ThreadPool& pool, hwy::ThreadPool& inner_pool,
+                        const AcceptFunc& accept_token, int verbosity);
+// As above, with the default session of `gemma`.
+void GenerateGemmaBatch(Gemma& gemma, const InferenceArgs& args,
+                        std::vector<BatchSequence>& sequences,
+                        hwy::ThreadPool& pool, hwy::ThreadPool& inner_pool,
+                        const AcceptFunc& accept_token, int verbosity);
+
+// Resumable prefill, e.g. for interleaving a long prompt with decode steps of
+// other sequences. Processes up to `max_tokens` further tokens of `prompt`,
+// whose first token is at `start_pos`, into `kv_cache` and advances
+// `num_prefilled` (initially 0) accordingly. Returns true once all but the last
+// prompt token, which is the first input for decoding, have been processed.
+// Uses the activations of `session`, which must have been created for `gemma`;
+// calls with different sessions may run concurrently.
+bool PrefillChunk(const Gemma& gemma, Session& session,
+                  const std::vector<int>& prompt, size_t start_pos,
+                  size_t& num_prefilled, KVCache& kv_cache, size_t max_tokens,
+                  hwy::ThreadPool& pool);
+// As above, with the default session of `gemma`.
+bool PrefillChunk(Gemma& gemma, const std::vector<int>& prompt,
+                  size_t start_pos, size_t& num_prefilled, KVCache& kv_cache,
+                  size_t max_tokens, hwy::ThreadPool& pool);
+
+// Speculative decoding: `draft`, typically a smaller model with the same
+// vocabulary, proposes `num_draft` (< kPrefillBatchSize) tokens one at a time,
+// and `gemma` verifies them in a single batch. Accepted tokens are streamed
+// and rejected ones are discarded, so the output matches what `gemma` would
+// generate from the same samples, while each pass over its weights yields up
+// to num_draft + 1 tokens. Both models' KV caches advance over the prompt and
+// all streamed tokens, so multiturn use works as with GenerateGemma. Uses
+// `session`, created for `gemma`, and `draft_session`, created for `draft`;
+// calls with different sessions may run concurrently.
+void GenerateGemmaSpeculative(const Gemma& gemma, Session& session,
+                              const Gemma& draft, Session& draft_session,
+                              size_t num_draft, const InferenceArgs& args,
+                              const std::vector<int>& prompt, size_t start_pos,
+                              hwy::ThreadPool& pool,
+                              hwy::ThreadPool& inner_pool,
+                              const StreamFunc& stream_token,
+                              const AcceptFunc& accept_token,
+                              std::mt19937& gen, int verbosity);
+// As above, with the default sessions of both models.
+void GenerateGemmaSpeculative(Gemma& gemma, Gemma& draft, size_t num_draft,
+                              const InferenceArgs& args,
+                              const std::vector<int>& prompt, size_t start_pos,
+                              hwy::ThreadPool& pool,
+                              hwy::ThreadPool& inner_pool,
+                              const StreamFunc& stream_token,
+                              const AcceptFunc& accept_token,
+                              std::mt19937& gen, int verbosity);
+
+// A row of the forward passes of one Scheduler step: the token at `pos` of
+// the request with index `request`.
+struct SchedulerRow {
+  size_t request;
+  size_t pos;
+};
+
+// Returns the rows of one Scheduler step, given that request i has processed
+// positions [0, positions[i]) of a prompt of prompt_sizes[i] tokens. The
+// requests that finished prefill, i.e. positions[i] + 1 >= prompt_sizes[i],
+// first each get a decode row; their number is stored in `num_decode`. The
+// others then get prefill rows for their next positions in order, up to
+// `prefill_tokens_per_step` in total, or if 0, as many as fill the last batch
+// of kPrefillBatchSize rows. Independent of the model, hence testable.
+std::vector<SchedulerRow> PlanSchedulerStep(
+    const std::vector<size_t>& positions,
+    const std::vector<size_t>& prompt_sizes, size_t prefill_tokens_per_step,
+    size_t& num_decode);
+
+// Serves many concurrent requests with one model via continuous batching:
+// each Step runs one decode token of every running request plus prefill
+// chunks of newly admitted ones through the same batched forward passes, so
+// requests join and leave the batch between steps instead of waiting for
+// each other. Submit and Cancel may be called from any thread; Step/Run must
+// only be called from one thread at a time, which also invokes the callbacks.
+// Each Scheduler has its own Session, hence several may share one Gemma.
+class Scheduler {
+ public:
+  using RequestId = uint64_t;
+
+  // `args` limits the length of each request and, via
+  // prefill_tokens_per_step, the prefill work per step. If `prefix_cache` is
+  // non-null, prompts reuse and extend it (see PrefixCache).
+  Scheduler(const Gemma& gemma, const InferenceArgs& args,
+            hwy::ThreadPool& pool, const AcceptFunc& accept_token,
+            PrefixCache* prefix_cache = nullptr);
+  ~Scheduler();
+
+  // Queues a request. `stream_token` is called with each generated token
+  // (not the prompt tokens) until it returns false, or after EOS or the
+  // limits of `args`; the request is then finished.
+  RequestId Submit(std::vector<int> prompt, StreamFunc stream_token,
+                   uint32_t seed = 42);
+  // Finishes the request before the next step; `stream_token` is not called
+  // again. Has no effect if the request has already finished.
+  void Cancel(RequestId id);
+
+  // Admits queued requests and runs one decode step for all running ones.
+  // Returns false if there was nothing to do.
+  bool Step();
+  // Calls Step until Stop, blocking while there are no requests.
+  void Run();
+  // Causes Run to return; thread-safe.
+  void Stop();
+
+  // Number of requests that are queued or running.
+  size_t NumRequests() const;
+
+ private:
+  struct Request;
+
+  // Moves queued requests into running_ and drops cancelled ones.
+  void Admit();
+
+  const Gemma& gemma_;
+  const InferenceArgs& args_;
+  hwy::ThreadPool& pool_;
+  AcceptFunc accept_token_;
+  PrefixCache* prefix_cache_;
+  std::shared_ptr<KVPagePool> kv_pool_;  // shared by all requests
+  Session session_;  // only for its activations; requests have own KV caches
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;  // signaled by Submit and Stop
+  std::vector<std::unique_ptr<Request>> queued_;  // guarded by mutex_
+  std::vector<RequestId> cancelled_;              // guarded by mutex_
+  RequestId next_id_ = 1;                         // guarded by mutex_
+  bool stop_ = false;                             // guarded by mutex_
+  size_t num_running_ = 0;                        // guarded by mutex_
+
+  std::vector<std::unique_ptr<Request>> running_;  // owned by Step
+};
 
 constexpr int EOS_ID = 1;
 
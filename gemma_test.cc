@@ -0,0 +1,315 @@
+// Copyright 2024 Google LLC
+// SPDX-License-Identifier: Apache-2.0
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests of the parts of gemma.h that do not require a model.
+
+// copybara:import_next_line:gemma_cpp
+#include "gemma.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "hwy/base.h"
+#include "hwy/tests/hwy_gtest.h"
+
+namespace gcpp {
+namespace {
+
+TEST(GenerationMetricsTest, TestHistogramBuckets) {
+  GenerationMetrics metrics;
+  metrics.AddDecodeLatency(0.5E-6);  // below 2 us: first bucket
+  metrics.AddDecodeLatency(1.9E-6);
+  metrics.AddDecodeLatency(2.5E-6);  // [2, 4) us
+  metrics.AddDecodeLatency(3.9E-6);
+  metrics.AddDecodeLatency(1E-3);    // [512, 1024) us
+  metrics.AddDecodeLatency(1E3);     // clamped to the last bucket
+
+  const auto& histogram = metrics.decode_latency_histogram;
+  EXPECT_EQ(2u, histogram[0]);
+  EXPECT_EQ(2u, histogram[1]);
+  EXPECT_EQ(1u, histogram[9]);
+  EXPECT_EQ(1u, histogram[GenerationMetrics::kLatencyBuckets - 1]);
+  size_t total = 0;
+  for (uint32_t count : histogram) total += count;
+  EXPECT_EQ(6u, total);
+  EXPECT_NEAR(1E3 + 1E-3 + 8.8E-6, metrics.decode_seconds, 1E-9);
+}
+
+TEST(GenerationMetricsTest, TestLatencyQuantile) {
+  GenerationMetrics metrics;
+  EXPECT_EQ(0.0, metrics.DecodeLatencyQuantile(0.5));
+
+  for (int i = 0; i < 3; ++i) metrics.AddDecodeLatency(3E-6);
+  metrics.AddDecodeLatency(1E-3);
+  // Upper bounds of the buckets containing the median and the slowest.
+  EXPECT_DOUBLE_EQ(4E-6, metrics.DecodeLatencyQuantile(0.5));
+  EXPECT_DOUBLE_EQ(4E-6, metrics.DecodeLatencyQuantile(0.75));
+  EXPECT_DOUBLE_EQ(1024E-6, metrics.DecodeLatencyQuantile(0.99));
+  EXPECT_DOUBLE_EQ(1024E-6, metrics.DecodeLatencyQuantile(1.0));
+}
+
+TEST(GenerationMetricsTest, TestTokensPerSecond) {
+  GenerationMetrics metrics;
+  EXPECT_EQ(0.0, metrics.PrefillTokensPerSecond());
+  EXPECT_EQ(0.0, metrics.DecodeTokensPerSecond());
+
+  // Of 11 prompt tokens, 2 are restored and the last is decoded.
+  metrics.prompt_tokens = 11;
+  metrics.restored_tokens = 2;
+  metrics.prefill_seconds = 2.0;
+  metrics.generated_tokens = 6;
+  metrics.decode_seconds = 3.0;
+  EXPECT_DOUBLE_EQ(4.0, metrics.PrefillTokensPerSecond());
+  EXPECT_DOUBLE_EQ(2.0, metrics.DecodeTokensPerSecond());
+}
+
+TEST(GenerationMetricsTest, TestToJSON) {
+  GenerationMetrics metrics;
+  metrics.prompt_tokens = 5;
+  metrics.generated_tokens = 3;
+  metrics.kv_cache_bytes = 4096;
+  metrics.AddDecodeLatency(3E-6);
+
+  std::string json = metrics.ToJSON();
+  EXPECT_EQ('{', json.front());
+  EXPECT_EQ('}', json.back());
+  EXPECT_NE(std::string::npos, json.find("\"prompt_tokens\":5,"));
+  EXPECT_NE(std::string::npos, json.find("\"generated_tokens\":3,"));
+  EXPECT_NE(std::string::npos, json.find("\"kv_cache_bytes\":4096"));
+  EXPECT_NE(std::string::npos,
+            json.find("\"decode_latency_histogram_us_log2\":[0,1,0,"));
+  EXPECT_EQ(std::string::npos, json.find("attention_seconds"));
+
+  metrics.layer_times = true;
+  metrics.attention_seconds = {0.5, 0.25};
+  metrics.ffw_seconds = {1, 2};
+  json = metrics.ToJSON();
+  EXPECT_NE(std::string::npos, json.find("\"attention_seconds\":[0.5,0.25]"));
+  EXPECT_NE(std::string::npos, json.find("\"ffw_seconds\":[1,2]}"));
+}
+
+// A small pool suffices because the cache only depends on the number of
+// elements per position.
+std::shared_ptr<KVPagePool> TestPool() {
+  return std::make_shared<KVPagePool>(/*layers=*/2, /*kv_heads=*/1,
+                                      /*qkv_dim=*/4);
+}
+
+float KeyAt(const KVCache& kv_cache, size_t pos) {
+  return hwy::ConvertScalarTo<float>(*kv_cache.Keys(1, 0, pos));
+}
+
+void SetKey(KVCache& kv_cache, size_t pos, float value) {
+  *kv_cache.Keys(1, 0, pos) = hwy::ConvertScalarTo<KVT>(value);
+}
+
+TEST(KVCacheTest, TestReserve) {
+  const std::shared_ptr<KVPagePool> pool = TestPool();
+  KVCache kv_cache(pool, 4 * kKVPagePositions);
+  EXPECT_EQ(0u, kv_cache.Capacity());
+  EXPECT_EQ(0u, kv_cache.Bytes());
+
+  kv_cache.Reserve(1);
+  EXPECT_EQ(kKVPagePositions, kv_cache.Capacity());
+  EXPECT_EQ(1u, pool->NumInUse());
+  kv_cache.Reserve(kKVPagePositions + 1);
+  EXPECT_EQ(2 * kKVPagePositions, kv_cache.Capacity());
+  EXPECT_EQ(2u, pool->NumInUse());
+  kv_cache.Reserve(3);  // does not shrink
+  EXPECT_EQ(2 * kKVPagePositions, kv_cache.Capacity());
+  EXPECT_EQ(2 * 2 * kKVPagePositions * pool->SizeCachePos() * sizeof(KVT),
+            kv_cache.Bytes());
+
+  // Positions are adjacent within a page.
+  EXPECT_EQ(kv_cache.Keys(1, 0, 0) + pool->QKVDim(), kv_cache.Keys(1, 0, 1));
+
+  kv_cache.Release();
+  EXPECT_EQ(0u, kv_cache.Capacity());
+  EXPECT_EQ(0u, pool->NumInUse());
+  // Reuses the freed pages.
+  kv_cache.Reserve(2 * kKVPagePositions);
+  EXPECT_EQ(2u, pool->NumInUse());
+}
+
+TEST(KVCacheTest, TestShareCopiesOnWrite) {
+  const std::shared_ptr<KVPagePool> pool = TestPool();
+  {
+    KVCache kv_cache(pool, 4 * kKVPagePositions);
+    kv_cache.Reserve(2 * kKVPagePositions);
+    const size_t pos1 = kKVPagePositions + 5;  // in the second page
+    SetKey(kv_cache, 0, 1.0f);
+    SetKey(kv_cache, pos1, 2.0f);
+
+    KVCache shared = kv_cache.Share(pos1 + 1);
+    EXPECT_EQ(2 * kKVPagePositions, shared.Capacity());
+    EXPECT_EQ(2u, pool->NumInUse());
+    EXPECT_EQ(kv_cache.Keys(1, 0, 0), shared.Keys(1, 0, 0));
+
+    // Writing to a shared page copies it first.
+    shared.PrepareWrite(0);
+    EXPECT_EQ(3u, pool->NumInUse());
+    EXPECT_NE(kv_cache.Keys(1, 0, 0), shared.Keys(1, 0, 0));
+    EXPECT_EQ(1.0f, KeyAt(shared, 0));
+    SetKey(shared, 0, 3.0f);
+    EXPECT_EQ(1.0f, KeyAt(kv_cache, 0));
+    EXPECT_EQ(3.0f, KeyAt(shared, 0));
+    // The other page is still shared.
+    EXPECT_EQ(kv_cache.Keys(1, 0, pos1), shared.Keys(1, 0, pos1));
+
+    // The first page of kv_cache is no longer shared, hence not copied.
+    const KVT* keys0 = kv_cache.Keys(1, 0, 0);
+    kv_cache.PrepareWrite(0);
+    EXPECT_EQ(keys0, kv_cache.Keys(1, 0, 0));
+    EXPECT_EQ(3u, pool->NumInUse());
+
+    shared.Release();
+    EXPECT_EQ(2u, pool->NumInUse());
+    EXPECT_EQ(2.0f, KeyAt(kv_cache, pos1));
+  }
+  // All references have been returned.
+  EXPECT_EQ(0u, pool->NumInUse());
+}
+
+TEST(PrefixCacheTest, TestRestore) {
+  const std::shared_ptr<KVPagePool> pool = TestPool();
+  const size_t max_positions = 4 * kKVPagePositions;
+  const size_t num_tokens = kKVPagePositions + 36;  // two pages
+  std::vector<int> tokens(num_tokens);
+  {
+    PrefixCache prefix_cache;
+    {
+      KVCache kv_cache(pool, max_positions);
+      kv_cache.Reserve(num_tokens);
+      for (size_t pos = 0; pos < num_tokens; ++pos) {
+        tokens[pos] = static_cast<int>(pos) + 10;
+        SetKey(kv_cache, pos, static_cast<float>(pos));
+      }
+      prefix_cache.Insert(tokens, kv_cache);
+      // A prefix of an entry is already covered.
+      prefix_cache.Insert({10, 11}, kv_cache);
+      EXPECT_EQ(1u, prefix_cache.NumEntries());
+    }
+    // The entry keeps the pages of the released cache.
+    EXPECT_EQ(2u, pool->NumInUse());
+
+    KVCache restored(pool, max_positions);
+    EXPECT_EQ(0u, prefix_cache.Restore({1, 2, 3}, restored));
+    EXPECT_EQ(0u, restored.Capacity());
+
+    // The last prompt token is not restored because it yields the logits.
+    std::vector<int> prompt = tokens;
+    EXPECT_EQ(num_tokens - 1, prefix_cache.Restore(prompt, restored));
+    // Diverges after kKVPagePositions + 2 tokens.
+    prompt.resize(kKVPagePositions + 2);
+    prompt.push_back(-1);
+    prompt.push_back(-2);
+    EXPECT_EQ(kKVPagePositions + 2, prefix_cache.Restore(prompt, restored));
+    EXPECT_EQ(2 * kKVPagePositions, restored.Capacity());
+    EXPECT_EQ(2u, pool->NumInUse());
+    for (size_t pos = 0; pos < kKVPagePositions + 2; ++pos) {
+      EXPECT_EQ(static_cast<float>(pos), KeyAt(restored, pos));
+    }
+
+    // Prefilling the rest of the prompt does not change the entry.
+    const size_t pos = kKVPagePositions + 2;
+    restored.Reserve(prompt.size());
+    restored.PrepareWrite(pos);
+    SetKey(restored, pos, -1.0f);
+    EXPECT_EQ(3u, pool->NumInUse());
+    KVCache other(pool, max_positions);
+    EXPECT_EQ(num_tokens - 1, prefix_cache.Restore(tokens, other));
+    EXPECT_EQ(static_cast<float>(pos), KeyAt(other, pos));
+    EXPECT_EQ(-1.0f, KeyAt(restored, pos));
+  }
+  // All references have been returned.
+  EXPECT_EQ(0u, pool->NumInUse());
+}
+
+// Returns the positions of the rows of `request`.
+std::vector<size_t> RowPositions(const std::vector<SchedulerRow>& rows,
+                                 size_t request) {
+  std::vector<size_t> positions;
+  for (const SchedulerRow& row : rows) {
+    if (row.request == request) positions.push_back(row.pos);
+  }
+  return positions;
+}
+
+std::vector<size_t> Range(size_t begin, size_t end) {
+  std::vector<size_t> range;
+  for (size_t pos = begin; pos < end; ++pos) range.push_back(pos);
+  return range;
+}
+
+TEST(SchedulerTest, TestPlanFillsDecodeBatch) {
+  // Request 1 and 3 are decoding, 0 and 2 prefilling.
+  const std::vector<size_t> positions = {0, 5, 3, 2};
+  const std::vector<size_t> prompt_sizes = {40, 3, 10, 1};
+  size_t num_decode;
+  const std::vector<SchedulerRow> rows =
+      PlanSchedulerStep(positions, prompt_sizes, 0, num_decode);
+  ASSERT_EQ(2u, num_decode);
+  ASSERT_EQ(kPrefillBatchSize, rows.size());
+  // Decode rows come first, in the order of the requests.
+  EXPECT_EQ(1u, rows[0].request);
+  EXPECT_EQ(5u, rows[0].pos);
+  EXPECT_EQ(3u, rows[1].request);
+  EXPECT_EQ(2u, rows[1].pos);
+  // The remainder of the batch prefills the first request.
+  EXPECT_EQ(Range(0, kPrefillBatchSize - 2), RowPositions(rows, 0));
+  EXPECT_TRUE(RowPositions(rows, 2).empty());
+}
+
+TEST(SchedulerTest, TestPlanPrefillBudget) {
+  const std::vector<size_t> positions = {4, 0, 1};
+  const std::vector<size_t> prompt_sizes = {20, 10, 100};
+  size_t num_decode;
+  // Prefill stops before the last prompt token and continues with the next
+  // request.
+  std::vector<SchedulerRow> rows =
+      PlanSchedulerStep(positions, prompt_sizes, 30, num_decode);
+  EXPECT_EQ(0u, num_decode);
+  EXPECT_EQ(30u, rows.size());
+  EXPECT_EQ(Range(4, 19), RowPositions(rows, 0));
+  EXPECT_EQ(Range(0, 9), RowPositions(rows, 1));
+  EXPECT_EQ(Range(1, 7), RowPositions(rows, 2));
+
+  // Without decode rows, a budget of 0 prefills one batch.
+  rows = PlanSchedulerStep(positions, prompt_sizes, 0, num_decode);
+  EXPECT_EQ(kPrefillBatchSize, rows.size());
+  EXPECT_EQ(Range(4, 19), RowPositions(rows, 0));
+  EXPECT_EQ(Range(0, 1), RowPositions(rows, 1));
+}
+
+TEST(SchedulerTest, TestPlanFullDecodeBatch) {
+  // A full batch of decode rows leaves room for another batch of prefill.
+  std::vector<size_t> positions(kPrefillBatchSize, 7);
+  std::vector<size_t> prompt_sizes(kPrefillBatchSize, 2);
+  positions.push_back(0);
+  prompt_sizes.push_back(100);
+  size_t num_decode;
+  const std::vector<SchedulerRow> rows =
+      PlanSchedulerStep(positions, prompt_sizes, 0, num_decode);
+  EXPECT_EQ(kPrefillBatchSize, num_decode);
+  EXPECT_EQ(Range(0, kPrefillBatchSize),
+            RowPositions(rows, kPrefillBatchSize));
+}
+
+}  // namespace
+}  // namespace gcpp
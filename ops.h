@@ -25,10 +25,81 @@
 
 // copybara:import_next_line:gemma_cpp
 #include "compression/compress.h"
+#include "hwy/aligned_allocator.h"
 #include "hwy/base.h"
 #include "hwy/contrib/thread_pool/thread_pool.h"
 #include "hwy/profiler.h"
 
+namespace gcpp {
+
+// Cosines and sines of the rotary position embedding (RoPE) angles, which
+// rotate each pair of elements (i, i + dim_qkv / 2) of a query or key by
+// pos / 10000^(2i / dim_qkv). Computed once for positions [0, max_pos) so that
+// RoPE needs no transcendental functions; positions beyond, which only occur
+// with a KV cache window, are computed on demand.
+class RopeTable {
+ public:
+  RopeTable(size_t dim_qkv, size_t max_pos)
+      : half_dim_(dim_qkv / 2),
+        max_pos_(max_pos),
+        timescales_(hwy::AllocateAligned<float>(half_dim_)),
+        table_(hwy::AllocateAligned<float>(max_pos * dim_qkv)) {
+    HWY_ASSERT(dim_qkv % 2 == 0 && timescales_ && table_);
+    for (size_t i = 0; i < half_dim_; ++i) {
+      const float freq_exponents =
+          static_cast<float>(2 * static_cast<int>(i)) /
+          static_cast<float>(dim_qkv);
+      // Replacing with expf(ln(1E4) * freq_exponents) changes results
+      // noticeably.
+      timescales_[i] = powf(10000.0f, freq_exponents);
+    }
+    for (size_t pos = 0; pos < max_pos_; ++pos) {
+      Compute(pos, table_.get() + pos * 2 * half_dim_);
+    }
+  }
+
+  // Sets cos_sin[i] and cos_sin[dim_qkv / 2 + i] to the cosine resp. sine of
+  // the angle of pair i at `pos`.
+  void CosSin(size_t pos, float* HWY_RESTRICT cos_sin) const {
+    if (pos < max_pos_) {
+      hwy::CopyBytes(table_.get() + pos * 2 * half_dim_, cos_sin,
+                     2 * half_dim_ * sizeof(float));
+    } else {
+      Compute(pos, cos_sin);
+    }
+  }
+
+ private:
+  void Compute(size_t pos, float* HWY_RESTRICT cos_sin) const {
+    // In double and modulo 2 pi because large positions would otherwise lose
+    // the fraction.
+    constexpr double kTwoPi = 6.283185307179586;
+    for (size_t i = 0; i < half_dim_; ++i) {
+      const float theta = static_cast<float>(
+          std::fmod(static_cast<double>(pos) / timescales_[i], kTwoPi));
+      cos_sin[i] = cosf(theta);
+      cos_sin[half_dim_ + i] = sinf(theta);
+    }
+  }
+
+  size_t half_dim_;
+  size_t max_pos_;
+  hwy::AlignedFreeUniquePtr<float[]> timescales_;
+  hwy::AlignedFreeUniquePtr<float[]> table_;  // [max_pos][cos, sin][half_dim]
+};
+
+// Caller-provided storage, e.g. from Activations, for the int8 copies of the
+// vectors that are multiplied with I8Stream weights (see UseInt8Activations).
+// `values` has room for the number of vectors times the number of columns,
+// and `scales` for one float per vector. If null, as by default, I8Stream
+// weights are multiplied with the f32/bf16 vectors.
+struct Int8Scratch {
+  int8_t* values = nullptr;
+  float* scales = nullptr;
+};
+
+}  // namespace gcpp
+
 #endif  // THIRD_PARTY_GEMMA_CPP_OPS_H_
 
 // Include guard for (potentially) SIMD code.
@@ -112,7 +183,14 @@ HWY_INLINE void AccumulatePartialDotProducts(
     DF df, const CompressedArray<MatT, kCapacity>& mat, size_t mat_ofs,
     size_t mat_stride, size_t r0, size_t c0, size_t num_rows, size_t num_cols,
     const VecT* HWY_RESTRICT vec_aligned, float* HWY_RESTRICT out) {
-  for (size_t idx_row = 0; idx_row < num_rows; ++idx_row) {
+  size_t idx_row = 0;
+  for (; idx_row + 4 <= num_rows; idx_row += 4) {
+    const size_t row_ofs = mat_ofs + (r0 + idx_row) * mat_stride;
+    float dots[4];
+    Dot4(df, mat, row_ofs + c0, mat_stride, vec_aligned + c0, num_cols, dots);
+    for (size_t i = 0; i < 4; ++i) out[idx_row + i] += dots[i];
+  }
+  for (; idx_row < num_rows; ++idx_row) {
     const size_t row_ofs = mat_ofs + (r0 + idx_row) * mat_stride;
     out[idx_row] += Dot(df, mat, row_ofs + c0, vec_aligned + c0, num_cols);
   }
@@ -125,7 +203,13 @@ HWY_INLINE void SetFirstPartialDotProducts(
     DF df, const CompressedArray<MatT, kCapacity>& mat, size_t mat_ofs,
     size_t mat_stride, size_t r0, size_t c0, size_t num_rows, size_t num_cols,
     const VecT* HWY_RESTRICT vec_aligned, float* HWY_RESTRICT out) {
-  for (size_t idx_row = 0; idx_row < num_rows; ++idx_row) {
+  size_t idx_row = 0;
+  for (; idx_row + 4 <= num_rows; idx_row += 4) {
+    const size_t row_ofs = mat_ofs + (r0 + idx_row) * mat_stride;
+    Dot4(df, mat, row_ofs + c0, mat_stride, vec_aligned + c0, num_cols,
+         out + idx_row);
+  }
+  for (; idx_row < num_rows; ++idx_row) {
     const size_t row_ofs = mat_ofs + (r0 + idx_row) * mat_stride;
     out[idx_row] = Dot(df, mat, row_ofs + c0, vec_aligned + c0, num_cols);
   }
@@ -228,22 +312,22 @@ static HWY_NOINLINE HWY_MAYBE_UNUSED void GeluMulToBF16(
   using VF = hn::Vec<decltype(df)>;
 
   size_t i = 0;
-  if (size >= 2 * NF) {
-    for (; i < size - 2 * NF; i += 2 * NF) {
-      const VF mul0 = hn::LoadU(df, mul + i);
-      const VF mul1 = hn::LoadU(df, mul + i + NF);
-      const VF g0 = hn::Mul(mul0, Gelu(df, hn::LoadU(df, gelu_in + i)));
-      const VF g1 = hn::Mul(mul1, Gelu(df, hn::LoadU(df, gelu_in + i + NF)));
-      const hn::Vec<decltype(dbf)> bf = hn::OrderedDemote2To(dbf, g0, g1);
-      hn::StoreU(bf, dbf, out + i);
-    }
+  for (; i + 2 * NF <= size; i += 2 * NF) {
+    const VF mul0 = hn::LoadU(df, mul + i);
+    const VF mul1 = hn::LoadU(df, mul + i + NF);
+    const VF g0 = hn::Mul(mul0, Gelu(df, hn::LoadU(df, gelu_in + i)));
+    const VF g1 = hn::Mul(mul1, Gelu(df, hn::LoadU(df, gelu_in + i + NF)));
+    const hn::Vec<decltype(dbf)> bf = hn::OrderedDemote2To(dbf, g0, g1);
+    hn::StoreU(bf, dbf, out + i);
   }
-  if (i != size) {
-    const size_t remaining = size - i;
+  // Fewer than 2 * NF remain, which is more than a single (partial) vector
+  // can hold, hence one full and one partial vector.
+  const hn::Half<decltype(dbf)> dbfh;
+  for (; i < size; i += NF) {
+    const size_t remaining = HWY_MIN(NF, size - i);
     const VF mul0 = hn::LoadN(df, mul + i, remaining);
     const VF g0 =
         hn::Mul(mul0, Gelu(df, hn::LoadN(df, gelu_in + i, remaining)));
-    const hn::Half<decltype(dbf)> dbfh;
     const hn::Vec<decltype(dbfh)> bfh = hn::DemoteTo(dbfh, g0);
     hn::StoreN(bfh, dbfh, out + i, remaining);
   }
@@ -302,16 +386,419 @@ HWY_NOINLINE void TwoMatVec(const CompressedArray<MatT, kCapacity>& mat0,
   hwy::FlushStream();
 }
 
-// Baseline Naive MatMul
-template <size_t kOuter, size_t kInner, size_t kBatchSize, typename MatT,
+// Whether the current target has instructions that make int8 activations
+// worthwhile: VNNI on x86 and SVE on Arm, for the widening multiply-adds of
+// I8Codec::DotI8. gemma.cc is compiled for each target and chosen via
+// HWY_DYNAMIC_DISPATCH, so this reflects the CPU we are running on.
+HWY_INLINE constexpr bool HaveInt8Dot() {
+#if HWY_TARGET == HWY_AVX3_DL || HWY_TARGET == HWY_AVX3_ZEN4 || \
+    HWY_TARGET == HWY_AVX3_SPR || HWY_TARGET == HWY_SVE ||     \
+    HWY_TARGET == HWY_SVE_256 || HWY_TARGET == HWY_SVE2 ||     \
+    HWY_TARGET == HWY_SVE2_128
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Whether MatMulSum and MatMulGatedGelu may quantize the activations to int8
+// and use integer dot products, which they do for batches of several vectors
+// given an Int8Scratch. Otherwise, I8Stream weights are decoded and
+// multiplied with f32/bf16 activations like the other types.
+template <typename MatT>
+HWY_INLINE constexpr bool UseInt8Activations() {
+  return hwy::IsSame<MatT, I8Stream>() && HaveInt8Dot();
+}
+
+HWY_INLINE constexpr size_t MatMulTileCols() {
+  // A tile of four decompressed f32 rows then occupies 16 KiB, which leaves
+  // room in L1 for the vector chunks it is multiplied with. Must be a multiple
+  // of the NUQ group size.
+  return 1024;
+}
+
+namespace detail {
+
+// Decompresses `num_rows` rows of `num_cols` values, the first starting at
+// `ofs` and the others at multiples of `mat_stride` after it, into `tile`.
+template <typename MatT, size_t kCapacity>
+HWY_INLINE void DecompressTile(const CompressedArray<MatT, kCapacity>& mat,
+                               size_t ofs, size_t mat_stride, size_t num_rows,
+                               size_t num_cols, float* HWY_RESTRICT tile) {
+  for (size_t idx_row = 0; idx_row < num_rows; ++idx_row) {
+    Decompress(mat, ofs + idx_row * mat_stride, tile + idx_row * num_cols,
+               num_cols);
+  }
+}
+
+// Loads 2 * Lanes(df) f32 or bf16 values from `p` as two f32 vectors.
+template <class DF, HWY_IF_F32_D(DF)>
+HWY_INLINE void LoadTwoF32(DF df, const float* HWY_RESTRICT p, hn::Vec<DF>& v0,
+                           hn::Vec<DF>& v1) {
+  v0 = hn::LoadU(df, p);
+  v1 = hn::LoadU(df, p + hn::Lanes(df));
+}
+
+template <class DF, HWY_IF_F32_D(DF)>
+HWY_INLINE void LoadTwoF32(DF df, const hwy::bfloat16_t* HWY_RESTRICT p,
+                           hn::Vec<DF>& v0, hn::Vec<DF>& v1) {
+  const hn::Repartition<hwy::bfloat16_t, DF> dbf;
+  const hn::Vec<decltype(dbf)> v = hn::LoadU(dbf, p);
+  v0 = hn::PromoteLowerTo(df, v);
+  v1 = hn::PromoteUpperTo(df, v);
+}
+
+// Dot products of `kRows` consecutive rows of `tile`, each `num_cols` wide,
+// with `vec`. Stores them to out[0, kRows), or adds to it if `add`. Each
+// vector of `vec` is loaded once and multiplied with all rows.
+template <size_t kRows, class DF, typename VecT>
+HWY_INLINE void TileRowDots(DF df, const float* HWY_RESTRICT tile,
+                            size_t num_cols, const VecT* HWY_RESTRICT vec,
+                            bool add, float* HWY_RESTRICT out) {
+  static_assert(kRows == 1 || kRows == 4, "Add accumulators");
+  using VF = hn::Vec<DF>;
+  const size_t NF = hn::Lanes(df);
+  HWY_DASSERT(num_cols % (2 * NF) == 0);
+
+  VF sum0 = hn::Zero(df);
+  VF sum1 = hn::Zero(df);
+  VF sum2 = hn::Zero(df);
+  VF sum3 = hn::Zero(df);
+  for (size_t i = 0; i < num_cols; i += 2 * NF) {
+    VF v0, v1;
+    LoadTwoF32(df, vec + i, v0, v1);
+    sum0 = hn::MulAdd(hn::Load(df, tile + i), v0, sum0);
+    sum0 = hn::MulAdd(hn::Load(df, tile + i + NF), v1, sum0);
+    if (kRows == 4) {
+      const float* HWY_RESTRICT row1 = tile + 1 * num_cols;
+      const float* HWY_RESTRICT row2 = tile + 2 * num_cols;
+      const float* HWY_RESTRICT row3 = tile + 3 * num_cols;
+      sum1 = hn::MulAdd(hn::Load(df, row1 + i), v0, sum1);
+      sum1 = hn::MulAdd(hn::Load(df, row1 + i + NF), v1, sum1);
+      sum2 = hn::MulAdd(hn::Load(df, row2 + i), v0, sum2);
+      sum2 = hn::MulAdd(hn::Load(df, row2 + i + NF), v1, sum2);
+      sum3 = hn::MulAdd(hn::Load(df, row3 + i), v0, sum3);
+      sum3 = hn::MulAdd(hn::Load(df, row3 + i + NF), v1, sum3);
+    }
+  }
+
+  const float dots[4] = {hn::ReduceSum(df, sum0), hn::ReduceSum(df, sum1),
+                         hn::ReduceSum(df, sum2), hn::ReduceSum(df, sum3)};
+  for (size_t r = 0; r < kRows; ++r) {
+    out[r] = add ? out[r] + dots[r] : dots[r];
+  }
+}
+
+// For each of the `num_vecs` vectors b, sets out[b * out_stride + r] for rows
+// r in [r0, r0 + num_rows) to the sum over k < kNumMats of the dot product of
+// row r of the k-th matrix with vec[b * vec_stride + k * kInner, +kInner).
+// The matrices are stored back to back starting at `mat_ofs`.
+//
+// Each tile of the matrix is decompressed once and then multiplied with all
+// vectors, so the decode cost is amortized over the batch.
+template <size_t kNumMats, size_t kOuter, size_t kInner, typename MatT,
           size_t kCapacity, typename VecT>
+HWY_INLINE void MatMulStrip(const CompressedArray<MatT, kCapacity>& mat,
+                            size_t mat_ofs, size_t r0, size_t num_rows,
+                            const VecT* HWY_RESTRICT vec_aligned,
+                            size_t vec_stride, size_t num_vecs,
+                            float* HWY_RESTRICT out, size_t out_stride) {
+  const hn::ScalableTag<float> df;
+
+  // Single vector: fused decode and dot product, no need for a tile.
+  if (num_vecs == 1) {
+    size_t r = r0;
+    for (; r + 4 <= r0 + num_rows; r += 4) {
+      float sums[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+      for (size_t k = 0; k < kNumMats; ++k) {
+        float dots[4];
+        Dot4(df, mat, mat_ofs + (k * kOuter + r) * kInner, kInner,
+             vec_aligned + k * kInner, kInner, dots);
+        for (size_t i = 0; i < 4; ++i) sums[i] += dots[i];
+      }
+      for (size_t i = 0; i < 4; ++i) out[r + i] = sums[i];
+    }
+    for (; r < r0 + num_rows; ++r) {
+      float sum = 0.0f;
+      for (size_t k = 0; k < kNumMats; ++k) {
+        sum += Dot(df, mat, mat_ofs + (k * kOuter + r) * kInner,
+                   vec_aligned + k * kInner, kInner);
+      }
+      out[r] = sum;
+    }
+    return;
+  }
+
+  constexpr size_t kTileCols = HWY_MIN(kInner, MatMulTileCols());
+  HWY_ALIGN float tile[4 * kTileCols];
+
+  size_t r = r0;
+  for (; r + 4 <= r0 + num_rows; r += 4) {
+    for (size_t k = 0; k < kNumMats; ++k) {
+      for (size_t c0 = 0; c0 < kInner; c0 += kTileCols) {
+        const size_t num_cols = HWY_MIN(kTileCols, kInner - c0);
+        DecompressTile(mat, mat_ofs + (k * kOuter + r) * kInner + c0, kInner,
+                       4, num_cols, tile);
+        const bool add = k != 0 || c0 != 0;
+        for (size_t b = 0; b < num_vecs; ++b) {
+          TileRowDots<4>(df, tile, num_cols,
+                         vec_aligned + b * vec_stride + k * kInner + c0, add,
+                         out + b * out_stride + r);
+        }
+      }
+    }
+  }
+
+  // Remaining rows, one at a time.
+  for (; r < r0 + num_rows; ++r) {
+    for (size_t k = 0; k < kNumMats; ++k) {
+      for (size_t c0 = 0; c0 < kInner; c0 += kTileCols) {
+        const size_t num_cols = HWY_MIN(kTileCols, kInner - c0);
+        DecompressTile(mat, mat_ofs + (k * kOuter + r) * kInner + c0, kInner,
+                       1, num_cols, tile);
+        const bool add = k != 0 || c0 != 0;
+        for (size_t b = 0; b < num_vecs; ++b) {
+          TileRowDots<1>(df, tile, num_cols,
+                         vec_aligned + b * vec_stride + k * kInner + c0, add,
+                         out + b * out_stride + r);
+        }
+      }
+    }
+  }
+}
+
+// Int8 copies of `num_vecs` f32 or bf16 vectors of `num` values, each with
+// one scale, once Quantize has been called. Quantizing once per token
+// amortizes the cost over all rows.
+class QuantizedVecs {
+ public:
+  // Quantizes into `scratch` if MatT permits int8 activations, the scratch is
+  // non-null and there are several vectors. A single vector, as in decode,
+  // is multiplied in f32/bf16 as for the other weight types.
+  template <typename MatT, typename VecT>
+  void Quantize(const Int8Scratch& scratch, const VecT* HWY_RESTRICT vec,
+                size_t vec_stride, size_t num_vecs, size_t num) {
+    if (!UseInt8Activations<MatT>() || scratch.values == nullptr ||
+        num_vecs < 2) {
+      return;
+    }
+    num_ = num;
+    values_ = scratch.values;
+    scales_ = scratch.scales;
+    const hn::ScalableTag<float> df;
+    for (size_t b = 0; b < num_vecs; ++b) {
+      scales_[b] = I8Codec::QuantizeVec(df, vec + b * vec_stride, num,
+                                        values_ + b * num);
+    }
+  }
+
+  // Whether Quantize did, and thus MatMulStripI8 is applicable.
+  bool Active() const { return values_ != nullptr; }
+  const int8_t* Vec(size_t b) const { return values_ + b * num_; }
+  float Scale(size_t b) const { return scales_[b]; }
+
+ private:
+  size_t num_ = 0;
+  int8_t* values_ = nullptr;
+  float* scales_ = nullptr;
+};
+
+// As MatMulStrip, but for I8Stream weights and the quantized vectors
+// [b0, b0 + num_vecs) of `vecs`, whose results go to out[(b - b0) *
+// out_stride]. Each row is multiplied with all vectors while in L1.
+template <size_t kNumMats, size_t kOuter, size_t kInner, size_t kCapacity>
+HWY_INLINE void MatMulStripI8(const CompressedArray<I8Stream, kCapacity>& mat,
+                              size_t mat_ofs, size_t r0, size_t num_rows,
+                              const QuantizedVecs& vecs, size_t b0,
+                              size_t num_vecs, float* HWY_RESTRICT out,
+                              size_t out_stride) {
+  const hn::ScalableTag<float> df;
+  for (size_t r = r0; r < r0 + num_rows; ++r) {
+    for (size_t b = 0; b < num_vecs; ++b) {
+      const int8_t* HWY_RESTRICT vec = vecs.Vec(b0 + b);
+      float sum = 0.0f;
+      for (size_t k = 0; k < kNumMats; ++k) {
+        sum += I8Codec::DotI8(df, kCapacity, mat.data(),
+                              mat_ofs + (k * kOuter + r) * kInner,
+                              vec + k * kInner, kInner);
+      }
+      out[b * out_stride + r] = sum * vecs.Scale(b0 + b);
+    }
+  }
+}
+
+// MatMulStripI8 if `vecs` are Active, otherwise MatMulStrip with the vectors
+// [b0, b0 + num_vecs) of `vec_aligned`.
+template <size_t kNumMats, size_t kOuter, size_t kInner, typename MatT,
+          size_t kCapacity, typename VecT>
+HWY_INLINE void MatMulStripMaybeI8(const CompressedArray<MatT, kCapacity>& mat,
+                                   size_t mat_ofs, size_t r0, size_t num_rows,
+                                   const VecT* HWY_RESTRICT vec_aligned,
+                                   size_t vec_stride, const QuantizedVecs& vecs,
+                                   size_t b0, size_t num_vecs,
+                                   float* HWY_RESTRICT out, size_t out_stride) {
+  if constexpr (UseInt8Activations<MatT>()) {
+    if (vecs.Active()) {
+      MatMulStripI8<kNumMats, kOuter, kInner>(mat, mat_ofs, r0, num_rows, vecs,
+                                              b0, num_vecs, out, out_stride);
+      return;
+    }
+  }
+  MatMulStrip<kNumMats, kOuter, kInner>(mat, mat_ofs, r0, num_rows,
+                                        vec_aligned + b0 * vec_stride,
+                                        vec_stride, num_vecs, out, out_stride);
+}
+
+}  // namespace detail
+
+// Sum of kNumMats matrix products: for each of the `num_vecs` vectors b and
+// each row r < kOuter, out[b * out_stride + r] = sum over k < kNumMats of
+// Dot(row r of matrix k, vec[b * vec_stride + k * kInner, +kInner)). Matrix k
+// starts at mat_ofs + k * kOuter * kInner. This is used for projections whose
+// input is split across heads. `int8` holds num_vecs * kNumMats * kInner
+// values, see Int8Scratch.
+template <size_t kNumMats, size_t kOuter, size_t kInner, typename MatT,
+          size_t kCapacity, typename VecT>
+HWY_NOINLINE void MatMulSum(const CompressedArray<MatT, kCapacity>& mat,
+                            const size_t mat_ofs,
+                            const VecT* HWY_RESTRICT vec_aligned,
+                            const size_t vec_stride, const size_t num_vecs,
+                            float* HWY_RESTRICT out, const size_t out_stride,
+                            hwy::ThreadPool& pool,
+                            const Int8Scratch& int8 = Int8Scratch()) {
+  PROFILER_ZONE("MatMulSum");
+  constexpr size_t kRowsPerStrip = RowsPerStrip<kOuter>();
+  constexpr size_t kNumStrips = kOuter / kRowsPerStrip;
+  detail::QuantizedVecs vecs;
+  vecs.Quantize<MatT>(int8, vec_aligned, vec_stride, num_vecs,
+                      kNumMats * kInner);
+
+  pool.Run(0, kNumStrips, [&](const uint64_t strip, size_t thread) HWY_ATTR {
+    PROFILER_ZONE("MatMulSum.lambda");
+    detail::MatMulStripMaybeI8<kNumMats, kOuter, kInner>(
+        mat, mat_ofs, strip * kRowsPerStrip, kRowsPerStrip, vec_aligned,
+        vec_stride, vecs, 0, num_vecs, out, out_stride);
+  });
+
+  // Remaining rows
+  const size_t r0 = kNumStrips * kRowsPerStrip;
+  if (r0 < kOuter) {
+    PROFILER_ZONE("MatMulSum remainder");
+    detail::MatMulStripMaybeI8<kNumMats, kOuter, kInner>(
+        mat, mat_ofs, r0, kOuter - r0, vec_aligned, vec_stride, vecs, 0,
+        num_vecs, out, out_stride);
+  }
+}
+
+// Multiplies the matrix with `num_vecs` vectors: out[b * out_stride + r] =
+// Dot(row r, vec[b * vec_stride, +kInner)). Each decompressed row is reused for
+// the whole batch, which is much cheaper than one MatVec per vector.
+template <size_t kOuter, size_t kInner, typename MatT, size_t kCapacity,
+          typename VecT>
 HWY_NOINLINE void MatMul(const CompressedArray<MatT, kCapacity>& mat,
-                         const size_t mat_ofs, const VecT* HWY_RESTRICT vec,
-                         float* HWY_RESTRICT out, hwy::ThreadPool& pool) {
-  for (size_t i = 0; i < kBatchSize; ++i) {
-    MatVec<kOuter, kInner, MatT, kCapacity, VecT>(
-        mat, mat_ofs, vec + i * kInner, out + i * kOuter, pool);
+                         const size_t mat_ofs,
+                         const VecT* HWY_RESTRICT vec_aligned,
+                         const size_t vec_stride, const size_t num_vecs,
+                         float* HWY_RESTRICT out, const size_t out_stride,
+                         hwy::ThreadPool& pool,
+                         const Int8Scratch& int8 = Int8Scratch()) {
+  if (num_vecs == 1) {
+    MatVec<kOuter, kInner>(mat, mat_ofs, vec_aligned, out, pool);
+    return;
   }
+  MatMulSum<1, kOuter, kInner>(mat, mat_ofs, vec_aligned, vec_stride, num_vecs,
+                               out, out_stride, pool, int8);
+}
+
+// As MatMul, but the rows form blocks of kBlock, e.g. the query, key or value
+// of one head, and each task computes rows r and r + kBlock / 2 of a block
+// together. Once they are in `out`, and thus still in L1, it calls
+// epilogue(b, block, i, num, lo, hi) for each vector b, where lo and hi point
+// to the results of rows i and kBlock / 2 + i of the block, for `num` such
+// pairs. This lets the epilogue apply rotary position embeddings.
+template <size_t kOuter, size_t kInner, size_t kBlock, typename MatT,
+          size_t kCapacity, typename VecT, class Epilogue>
+HWY_NOINLINE void MatMulPairs(const CompressedArray<MatT, kCapacity>& mat,
+                              const size_t mat_ofs,
+                              const VecT* HWY_RESTRICT vec_aligned,
+                              const size_t vec_stride, const size_t num_vecs,
+                              float* HWY_RESTRICT out, const size_t out_stride,
+                              const Epilogue& epilogue, hwy::ThreadPool& pool,
+                              const Int8Scratch& int8 = Int8Scratch()) {
+  PROFILER_ZONE("MatMulPairs");
+  constexpr size_t kHalf = kBlock / 2;
+  // As RowsPerStrip, but counting pairs of rows and within one block.
+  constexpr size_t kPairs = HWY_MIN(kHalf, RowsPerStrip<kOuter / 2>());
+  static_assert(kOuter % kBlock == 0 && kHalf % kPairs == 0);
+  constexpr size_t kTasksPerBlock = kHalf / kPairs;
+  constexpr size_t kNumTasks = kOuter / kBlock * kTasksPerBlock;
+  detail::QuantizedVecs vecs;
+  vecs.Quantize<MatT>(int8, vec_aligned, vec_stride, num_vecs, kInner);
+
+  pool.Run(0, kNumTasks, [&](const uint64_t task, size_t thread) HWY_ATTR {
+    PROFILER_ZONE("MatMulPairs.lambda");
+    const size_t block = task / kTasksPerBlock;
+    const size_t i = (task % kTasksPerBlock) * kPairs;
+    const size_t r_lo = block * kBlock + i;
+    const size_t r_hi = r_lo + kHalf;
+    detail::MatMulStripMaybeI8<1, kOuter, kInner>(
+        mat, mat_ofs, r_lo, kPairs, vec_aligned, vec_stride, vecs, 0, num_vecs,
+        out, out_stride);
+    detail::MatMulStripMaybeI8<1, kOuter, kInner>(
+        mat, mat_ofs, r_hi, kPairs, vec_aligned, vec_stride, vecs, 0, num_vecs,
+        out, out_stride);
+    for (size_t b = 0; b < num_vecs; ++b) {
+      epilogue(b, block, i, kPairs, out + b * out_stride + r_lo,
+               out + b * out_stride + r_hi);
+    }
+  });
+}
+
+// Gated GELU projection with a matrix of 2 * kHidden rows: for each of the
+// `num_vecs` vectors b and each row r < kHidden, out[b * out_stride + r] =
+// BF16(Gelu(Dot(row r, vec_b)) * Dot(row kHidden + r, vec_b)). The dot
+// products only live in per-strip buffers, so the fp32 hidden activations are
+// never written to memory, and the bf16 result is half their size.
+template <size_t kHidden, size_t kInner, typename MatT, size_t kCapacity,
+          typename VecT>
+HWY_NOINLINE void MatMulGatedGelu(const CompressedArray<MatT, kCapacity>& mat,
+                                  const size_t mat_ofs,
+                                  const VecT* HWY_RESTRICT vec_aligned,
+                                  const size_t vec_stride,
+                                  const size_t num_vecs,
+                                  hwy::bfloat16_t* HWY_RESTRICT out,
+                                  const size_t out_stride,
+                                  hwy::ThreadPool& pool,
+                                  const Int8Scratch& int8 = Int8Scratch()) {
+  PROFILER_ZONE("MatMulGatedGelu");
+  constexpr size_t kRowsPerStrip = RowsPerStrip<kHidden>();
+  constexpr size_t kNumStrips = hwy::DivCeil(kHidden, kRowsPerStrip);
+  // Bounds the size of the buffers; larger batches are processed in groups.
+  constexpr size_t kMaxVecs = 16;
+  detail::QuantizedVecs vecs;
+  vecs.Quantize<MatT>(int8, vec_aligned, vec_stride, num_vecs, kInner);
+
+  pool.Run(0, kNumStrips, [&](const uint64_t strip, size_t thread) HWY_ATTR {
+    PROFILER_ZONE("MatMulGatedGelu.lambda");
+    const size_t r0 = strip * kRowsPerStrip;
+    const size_t num_rows = HWY_MIN(kRowsPerStrip, kHidden - r0);
+    HWY_ALIGN float gate[kMaxVecs * kRowsPerStrip];
+    HWY_ALIGN float up[kMaxVecs * kRowsPerStrip];
+    for (size_t b0 = 0; b0 < num_vecs; b0 += kMaxVecs) {
+      const size_t group = HWY_MIN(kMaxVecs, num_vecs - b0);
+      // Rows are relative to the strip so that they index the buffers.
+      detail::MatMulStripMaybeI8<1, kHidden, kInner>(
+          mat, mat_ofs + r0 * kInner, 0, num_rows, vec_aligned, vec_stride,
+          vecs, b0, group, gate, kRowsPerStrip);
+      detail::MatMulStripMaybeI8<1, kHidden, kInner>(
+          mat, mat_ofs + (kHidden + r0) * kInner, 0, num_rows, vec_aligned,
+          vec_stride, vecs, b0, group, up, kRowsPerStrip);
+      for (size_t b = 0; b < group; ++b) {
+        GeluMulToBF16(gate + b * kRowsPerStrip, up + b * kRowsPerStrip,
+                      out + (b0 + b) * out_stride + r0, num_rows);
+      }
+    }
+  });
 }
 
 static HWY_NOINLINE HWY_MAYBE_UNUSED float Dot(const float* HWY_RESTRICT a,
@@ -469,43 +956,31 @@ static HWY_NOINLINE HWY_MAYBE_UNUSED void AddAbsolutePositionalEmbeddings(
   }
 }
 
-static HWY_NOINLINE HWY_MAYBE_UNUSED void Rope(float* HWY_RESTRICT x,
-                                               size_t dim_qkv, size_t pos) {
-  HWY_DASSERT(dim_qkv % 2 == 0);
-  const size_t half_dim_qkv = dim_qkv / 2;
-  for (size_t dim = 0; dim < half_dim_qkv; ++dim) {
-    const float freq_exponents = static_cast<float>(2 * static_cast<int>(dim)) /
-                                 static_cast<float>(dim_qkv);
-    // Replacing with expf(ln(1E4) * freq_exponents) changes results noticeably.
-    const float timescale = powf(10000.0f, freq_exponents);
-    const float theta = pos / timescale;
-    const float cos_val = cosf(theta);
-    const float sin_val = sinf(theta);
-    const float x0 = x[dim];
-    const float x1 = x[dim + half_dim_qkv];
-    x[dim] = x0 * cos_val - x1 * sin_val;
-    x[dim + half_dim_qkv] = x0 * sin_val + x1 * cos_val;
-  }
-}
-
-static HWY_NOINLINE HWY_MAYBE_UNUSED void RopeAndMulBy(const float mul,
-                                                       float* HWY_RESTRICT x,
-                                                       size_t dim_qkv,
-                                                       size_t pos) {
-  HWY_DASSERT(dim_qkv % 2 == 0);
-  const size_t half_dim_qkv = dim_qkv / 2;
-  for (size_t dim = 0; dim < half_dim_qkv; ++dim) {
-    const float freq_exponents = static_cast<float>(2 * static_cast<int>(dim)) /
-                                 static_cast<float>(dim_qkv);
-    // Replacing with expf(ln(1E4) * freq_exponents) changes results noticeably.
-    const float timescale = powf(10000.0f, freq_exponents);
-    const float theta = pos / timescale;
-    const float cos_val = cosf(theta);
-    const float sin_val = sinf(theta);
-    const float x0 = x[dim];
-    const float x1 = x[dim + half_dim_qkv];
-    x[dim] = mul * (x0 * cos_val - x1 * sin_val);
-    x[dim + half_dim_qkv] = mul * (x0 * sin_val + x1 * cos_val);
+// Rotates each pair (lo[i], hi[i]) for i < num by the angle whose cosine is
+// cos_sin[i] and sine is cos_sin[half_dim + i] (see RopeTable), and multiplies
+// both by `mul`, e.g. the query scale.
+static HWY_INLINE HWY_MAYBE_UNUSED void RotateAndMulBy(
+    const float mul, const float* HWY_RESTRICT cos_sin, size_t half_dim,
+    float* HWY_RESTRICT lo, float* HWY_RESTRICT hi, size_t num) {
+  const hn::ScalableTag<float> df;
+  using VF = hn::Vec<decltype(df)>;
+  const size_t N = hn::Lanes(df);
+  const VF vmul = hn::Set(df, mul);
+  const float* HWY_RESTRICT sin = cos_sin + half_dim;
+  size_t i = 0;
+  for (; i + N <= num; i += N) {
+    const VF vcos = hn::Mul(hn::LoadU(df, cos_sin + i), vmul);
+    const VF vsin = hn::Mul(hn::LoadU(df, sin + i), vmul);
+    const VF x0 = hn::LoadU(df, lo + i);
+    const VF x1 = hn::LoadU(df, hi + i);
+    hn::StoreU(hn::MulSub(x0, vcos, hn::Mul(x1, vsin)), df, lo + i);
+    hn::StoreU(hn::MulAdd(x0, vsin, hn::Mul(x1, vcos)), df, hi + i);
+  }
+  for (; i < num; ++i) {
+    const float x0 = lo[i];
+    const float x1 = hi[i];
+    lo[i] = mul * (x0 * cos_sin[i] - x1 * sin[i]);
+    hi[i] = mul * (x0 * sin[i] + x1 * cos_sin[i]);
   }
 }
 
@@ -594,6 +1069,128 @@ static HWY_INLINE HWY_MAYBE_UNUSED void Softmax(float* HWY_RESTRICT x,
   Softmax(x, size, size);
 }
 
+// Running max and sum of exponentials for a single-pass ("online") softmax
+// over tiles of scores, as in FlashAttention.
+struct OnlineSoftmaxState {
+  float max = hwy::LowestValue<float>();
+  float sum = 0.0f;
+};
+
+// Folds a tile of `num` scores into `state` and replaces each score with its
+// unnormalized weight exp(score - state.max). If the running max increases,
+// the weighted sum accumulated so far in out[0, out_size) is rescaled. After
+// all tiles, the caller divides `out` by `state.sum`.
+static HWY_NOINLINE HWY_MAYBE_UNUSED void OnlineSoftmaxTile(
+    float* HWY_RESTRICT scores, size_t num, OnlineSoftmaxState& state,
+    float* HWY_RESTRICT out, size_t out_size) {
+  HWY_DASSERT(num != 0);
+
+  namespace hn = hwy::HWY_NAMESPACE;
+  using D = hn::ScalableTag<float>;
+  const D d;
+  using V = hn::Vec<D>;
+
+  const V vmin = hn::Set(d, hwy::LowestValue<float>());
+  V vmax = vmin;
+  hn::Foreach(d, scores, num, vmin,
+              [&vmax](D d, V v) HWY_ATTR { vmax = hn::Max(vmax, v); });
+  const float tile_max = hn::GetLane(hn::MaxOfLanes(d, vmax));
+  if (tile_max > state.max) {
+    if (state.sum != 0.0f) {
+      const float scale = std::exp(state.max - tile_max);
+      state.sum *= scale;
+      MulByConst(scale, out, out_size);
+    }
+    state.max = tile_max;
+  }
+
+  const V max = hn::Set(d, state.max);
+  hn::Transform(d, scores, num, [max](D d, V v) HWY_ATTR {
+    return hn::Exp(d, hn::Sub(v, max));
+  });
+  // Separate pass because Foreach pads a partial last vector with zeros.
+  V sum = hn::Zero(d);
+  hn::Foreach(d, scores, num, hn::Zero(d),
+              [&sum](D d, V v) HWY_ATTR { sum = hn::Add(sum, v); });
+  state.sum += hn::ReduceSum(d, sum);
+}
+
+// Stores `num` floats, e.g. a key or value vector, as TKV (float or bf16, see
+// GEMMA_KV_T).
+template <typename TKV>
+HWY_INLINE void CompressKV(const float* HWY_RESTRICT in, size_t num,
+                           TKV* HWY_RESTRICT out) {
+  // The KV codecs only use this for statistics.
+  static thread_local CompressPerThread tls;
+  const hn::ScalableTag<float> df;
+  CompressTraits<TKV>::Compress(df, in, num, tls, num, out, 0);
+}
+
+// Returns the dot product of `num` TKV with `vec_aligned`, decoding on the fly.
+template <typename TKV>
+HWY_INLINE float DotKV(const TKV* HWY_RESTRICT kv,
+                       const float* HWY_RESTRICT vec_aligned, size_t num) {
+  const hn::ScalableTag<float> df;
+  return CompressTraits<TKV>::Dot(df, num, kv, 0, vec_aligned, num);
+}
+
+// out[i] += c * kv[i] for i < kNum.
+template <size_t kNum, typename TKV>
+HWY_INLINE void MulByConstAndAddKV(float c, const TKV* HWY_RESTRICT kv,
+                                   float* HWY_RESTRICT out) {
+  if constexpr (hwy::IsSame<TKV, float>()) {
+    MulByConstAndAdd(c, kv, out, kNum);
+  } else {
+    HWY_ALIGN float decoded[kNum];
+    const hn::ScalableTag<float> df;
+    CompressTraits<TKV>::Decompress(df, kNum, kv, 0, decoded, kNum);
+    MulByConstAndAdd(c, decoded, out, kNum);
+  }
+}
+
+// Attention of the query `q` to `num` positions, whose kQKVDim keys and
+// values are key(i) and value(i) for i < num, e.g. one KV page: folds their
+// scores into `state` and adds the values weighted by them to `out`, see
+// OnlineSoftmaxTile. `scores` receives `num` floats.
+template <size_t kQKVDim, class KeyFunc, class ValueFunc>
+HWY_INLINE void AttendTile(const float* HWY_RESTRICT q, size_t num,
+                           const KeyFunc& key, const ValueFunc& value,
+                           float* HWY_RESTRICT scores,
+                           OnlineSoftmaxState& state, float* HWY_RESTRICT out) {
+  for (size_t i = 0; i < num; ++i) {
+    scores[i] = DotKV(key(i), q, kQKVDim);
+  }
+  OnlineSoftmaxTile(scores, num, state, out, kQKVDim);
+  for (size_t i = 0; i < num; ++i) {
+    MulByConstAndAddKV<kQKVDim>(scores[i], value(i), out);
+  }
+}
+
+// Combines the results of AttendTile for `num_splits` disjoint ranges of
+// positions: the unnormalized partial[split * size, +size) and the max and
+// sum of their state in stats[2 * split + 0] and [2 * split + 1]. A sum of
+// zero marks an empty range. Rescales each to the common max and writes the
+// normalized sum to out[0, size).
+static HWY_NOINLINE HWY_MAYBE_UNUSED void MergeOnlineSoftmax(
+    const float* HWY_RESTRICT partial, const float* HWY_RESTRICT stats,
+    size_t num_splits, size_t size, float* HWY_RESTRICT out) {
+  float max = hwy::LowestValue<float>();
+  for (size_t split = 0; split < num_splits; ++split) {
+    if (stats[2 * split + 1] != 0.0f) {
+      max = HWY_MAX(max, stats[2 * split]);
+    }
+  }
+  hwy::ZeroBytes(out, size * sizeof(*out));
+  float sum = 0.0f;
+  for (size_t split = 0; split < num_splits; ++split) {
+    if (stats[2 * split + 1] == 0.0f) continue;
+    const float scale = std::exp(stats[2 * split] - max);
+    sum += stats[2 * split + 1] * scale;
+    MulByConstAndAdd(scale, partial + split * size, out, size);
+  }
+  MulByConst(1.0f / sum, out, size);
+}
+
 static HWY_NOINLINE void LogitsSoftCap(const float cap, float* HWY_RESTRICT x,
                                        size_t size, size_t max_pos) {
   HWY_DASSERT(max_pos <= size);
@@ -646,32 +1243,185 @@ create_distribution(std::array<float, k>& top_k, float temperature) {
   return std::discrete_distribution<int>(std::begin(top_k), std::end(top_k));
 }
 
+// Finds the (up to) k largest `values` for which accept_token returns true and
+// stores them and their indices in decreasing order. Returns how many were
+// found. Most vectors contain no value larger than the current k-th largest,
+// which a SIMD comparison rules out, so accept_token is only called for the
+// few candidates.
+template <size_t k, typename TAcceptToken>
+static HWY_NOINLINE HWY_MAYBE_UNUSED size_t
+TopK(const float* HWY_RESTRICT values, size_t num, TAcceptToken& accept_token,
+     std::array<float, k>& top_k, std::array<int, k>& indices) {
+  static_assert(k != 0, "");
+  namespace hn = hwy::HWY_NAMESPACE;
+  using D = hn::ScalableTag<float>;
+  const D d;
+  const size_t N = hn::Lanes(d);
+
+  size_t found = 0;
+  auto threshold = hn::Set(d, hwy::LowestValue<float>());
+  const auto insert = [&](size_t i) {
+    const float value = values[i];
+    if (found == k && !(value > top_k[k - 1])) return;
+    if (!accept_token(static_cast<int>(i))) return;
+    size_t j = found == k ? k - 1 : found++;
+    // Shift smaller elements by 1 to make room.
+    for (; j != 0 && top_k[j - 1] < value; --j) {
+      top_k[j] = top_k[j - 1];
+      indices[j] = indices[j - 1];
+    }
+    top_k[j] = value;
+    indices[j] = static_cast<int>(i);
+    if (found == k) threshold = hn::Set(d, top_k[k - 1]);
+  };
+
+  size_t i = 0;
+  if (num >= N) {
+    for (; i <= num - N; i += N) {
+      const auto v = hn::LoadU(d, values + i);
+      if (hn::AllFalse(d, hn::Gt(v, threshold))) continue;
+      for (size_t lane = 0; lane < N; ++lane) insert(i + lane);
+    }
+  }
+  for (; i < num; ++i) insert(i);
+  return found;
+}
+
 template <size_t k, typename TAcceptToken>
 static HWY_NOINLINE HWY_MAYBE_UNUSED int SampleTopK(
     const float* HWY_RESTRICT probabilities, size_t vocab_size,
     std::mt19937& gen, float temperature, TAcceptToken& accept_token) {
-  static_assert(k != 0, "");
-  // TODO(austinvhuang): Optimize this implementation.
   std::array<float, k> top_k{};  // sorted from highest [0], to lowest [k-1]
   std::array<int, k> indices{};
-  for (size_t i = 0; i < vocab_size; ++i) {
-    if (probabilities[i] < top_k[k - 1] && accept_token(static_cast<int>(i))) {
-      continue;
-    }
-    for (size_t j = 0; j < k; ++j) {
-      if (probabilities[i] > top_k[j] && accept_token(static_cast<int>(i))) {
-        // shift elements by 1, insert the new value, move on to next value
-        for (size_t idx = k - 1; idx > j; --idx) {
-          top_k[idx] = top_k[idx - 1];
-          indices[idx] = indices[idx - 1];
-        }
-        top_k[j] = probabilities[i];
-        indices[j] = static_cast<int>(i);
+  TopK<k>(probabilities, vocab_size, accept_token, top_k, indices);
+  return indices[create_distribution<k>(top_k, temperature)(gen)];
+}
+
+// Samples one of the `found` candidates, sorted by decreasing logit as
+// returned by TopK. min_p drops those whose probability is below min_p times
+// that of the most likely, and top_p then keeps the smallest prefix whose
+// probabilities sum to at least top_p. Sets `prob` to the probability of the
+// returned token within the final candidates. temperature <= 0 selects the
+// largest logit.
+template <size_t k>
+static HWY_NOINLINE HWY_MAYBE_UNUSED int SampleCandidates(
+    std::array<float, k>& top_k, const std::array<int, k>& indices,
+    size_t found, std::mt19937& gen, float temperature, float& prob,
+    float top_p = 1.0f, float min_p = 0.0f) {
+  HWY_ASSERT(found != 0);
+  if (found == 1 || temperature <= 0.0f) {
+    prob = 1.0f;
+    return indices[0];
+  }
+
+  // Relative to the most likely candidate, which avoids overflow and lets
+  // min_p compare directly.
+  const float inv_temperature = 1.0f / temperature;
+  for (size_t i = 0; i < found; ++i) {
+    top_k[i] = expf((top_k[i] - top_k[0]) * inv_temperature);
+  }
+  size_t num = found;
+  while (num > 1 && top_k[num - 1] < min_p) --num;
+  float sum = 0.0f;
+  for (size_t i = 0; i < num; ++i) sum += top_k[i];
+  if (top_p < 1.0f) {
+    const float bound = top_p * sum;
+    float cumulative = 0.0f;
+    for (size_t i = 0; i < num; ++i) {
+      cumulative += top_k[i];
+      if (cumulative >= bound) {
+        num = i + 1;
+        sum = cumulative;
         break;
       }
     }
   }
-  return indices[create_distribution<k>(top_k, temperature)(gen)];
+
+  const int idx = std::discrete_distribution<int>(top_k.begin(),
+                                                  top_k.begin() + num)(gen);
+  prob = top_k[idx] / sum;
+  return indices[idx];
+}
+
+// Samples a token directly from unnormalized logits, without a Softmax over the
+// whole vocabulary: the candidates are the k largest accepted logits, and only
+// these are exponentiated. See SampleCandidates for the other arguments.
+template <size_t k, typename TAcceptToken>
+static HWY_NOINLINE HWY_MAYBE_UNUSED int SampleLogits(
+    const float* HWY_RESTRICT logits, size_t vocab_size, std::mt19937& gen,
+    float temperature, TAcceptToken& accept_token, float& prob,
+    float top_p = 1.0f, float min_p = 0.0f) {
+  std::array<float, k> top_k{};
+  std::array<int, k> indices{};
+  const size_t found =
+      TopK<k>(logits, vocab_size, accept_token, top_k, indices);
+  return SampleCandidates<k>(top_k, indices, found, gen, temperature, prob,
+                             top_p, min_p);
+}
+
+// Rows of the vocabulary projection handled by one task of MatVecTopK. Their
+// logits (4 KiB) stay in L1 until the shard's top-k has been selected.
+HWY_INLINE constexpr size_t VocabShardRows() { return 1024; }
+
+// Equivalent to MatVec followed by LogitsSoftCap (if cap > 0) and TopK, but
+// each pool task computes the logits of one shard of rows into a local buffer
+// and only retains its top-k, so the kOuter logits are never written to
+// memory nor read again. accept_token may be called concurrently. Returns the
+// number of candidates, which are sorted by decreasing logit.
+template <size_t k, size_t kOuter, size_t kInner, typename MatT,
+          size_t kCapacity, typename VecT, typename TAcceptToken>
+HWY_NOINLINE size_t MatVecTopK(const CompressedArray<MatT, kCapacity>& mat,
+                               const size_t mat_ofs,
+                               const VecT* HWY_RESTRICT const vec_aligned,
+                               float cap, TAcceptToken& accept_token,
+                               std::array<float, k>& top_k,
+                               std::array<int, k>& indices,
+                               hwy::ThreadPool& pool) {
+  PROFILER_ZONE("MatVecTopK");
+  constexpr size_t kShardRows = VocabShardRows();
+  constexpr size_t kNumShards = hwy::DivCeil(kOuter, kShardRows);
+  // Candidates of all shards, concatenated.
+  std::array<float, kNumShards * k> shard_top;
+  std::array<int, kNumShards * k> shard_indices;
+  std::array<size_t, kNumShards> shard_found;
+  shard_top.fill(hwy::LowestValue<float>());  // unused slots
+
+  const hn::ScalableTag<float> df;
+  pool.Run(0, kNumShards,
+           [&](const uint64_t shard, size_t /*thread*/) HWY_ATTR {
+             const size_t r0 = shard * kShardRows;
+             const size_t num_rows = HWY_MIN(kShardRows, kOuter - r0);
+             HWY_ALIGN float logits[kShardRows];
+             detail::FullDotProductsForStrip(df, mat, mat_ofs, kInner, r0,
+                                             num_rows, vec_aligned, logits);
+             if (cap > 0.0f) LogitsSoftCap(cap, logits, num_rows);
+
+             const auto accept_row = [&accept_token, r0](int row) {
+               return accept_token(static_cast<int>(r0) + row);
+             };
+             std::array<float, k> local_top;
+             std::array<int, k> local_indices;
+             const size_t found = TopK<k>(logits, num_rows, accept_row,
+                                          local_top, local_indices);
+             for (size_t i = 0; i < found; ++i) {
+               shard_top[shard * k + i] = local_top[i];
+               shard_indices[shard * k + i] =
+                   static_cast<int>(r0) + local_indices[i];
+             }
+             shard_found[shard] = found;
+           });
+
+  // Merge. Unused slots are also excluded via the shard's count.
+  const auto accept_slot = [&shard_found](int slot) {
+    return static_cast<size_t>(slot) % k < shard_found[slot / k];
+  };
+  std::array<int, k> slots;
+  const size_t found = TopK<k>(shard_top.data(), shard_top.size(),
+                               accept_slot, top_k, slots);
+  for (size_t i = 0; i < found; ++i) {
+    indices[i] = shard_indices[slots[i]];
+  }
+  return found;
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
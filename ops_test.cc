@@ -0,0 +1,721 @@
+// Copyright 2024 Google LLC
+// SPDX-License-Identifier: Apache-2.0
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests of the kernels of ops.h against scalar references: the batched matrix
+// kernels for each weight type, computed from the decompressed weights,
+// attention and sampling.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "hwy/aligned_allocator.h"
+#include "hwy/base.h"
+#include "hwy/contrib/thread_pool/thread_pool.h"
+
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "third_party/gemma_cpp/ops_test.cc"  // NOLINT
+#include "hwy/foreach_target.h"  // IWYU pragma: keep
+// Other headers that include Highway must come after foreach_target.h
+// copybara:import_next_line:gemma_cpp
+#include "compression/compress-inl.h"
+// copybara:import_next_line:gemma_cpp
+#include "ops.h"
+#include "hwy/highway.h"
+#include "hwy/tests/hwy_gtest.h"
+#include "hwy/tests/test_util-inl.h"
+
+HWY_BEFORE_NAMESPACE();
+namespace gcpp {
+namespace HWY_NAMESPACE {
+
+// Columns of MatMul and MatMulSum: one full and one partial tile of
+// MatMulTileCols, and a multiple of the NUQ and I8 group sizes.
+constexpr size_t kCols = 1280;
+// Neither a multiple of RowsPerStrip nor of the four rows that MatMulStrip
+// handles together, so that all remainder paths run.
+constexpr size_t kRows = 301;
+// Written to the padding of the outputs, which the kernels must not touch.
+constexpr float kSentinel = 1234.5f;
+
+// Random weights and their decompressed values, which the reference uses so
+// that only the kernels, not the codecs, are under test.
+template <typename MatT, size_t kCapacity>
+struct TestMatrix {
+  TestMatrix(uint32_t seed, hwy::ThreadPool& pool)
+      : compressed(std::make_unique<CompressedArray<MatT, kCapacity>>()),
+        decompressed(hwy::AllocateAligned<float>(kCapacity)) {
+    HWY_ASSERT(decompressed);
+    std::mt19937 gen(seed);
+    // Well within the range of SfpStream.
+    std::normal_distribution<float> dist(0.0f, 0.1f);
+    for (size_t i = 0; i < kCapacity; ++i) decompressed[i] = dist(gen);
+    CompressWorkingSet work;
+    Compress(decompressed.get(), kCapacity, work, kCapacity,
+             compressed->data(), 0, pool);
+    Decompress(*compressed, 0, decompressed.get(), kCapacity);
+  }
+
+  std::unique_ptr<CompressedArray<MatT, kCapacity>> compressed;
+  hwy::AlignedFreeUniquePtr<float[]> decompressed;
+};
+
+// `num_vecs` random vectors of `num` VecT. Their stride includes padding, so
+// that kernels which ignore vec_stride fail. Also keeps their values as float
+// for the reference.
+template <typename VecT>
+class TestVecs {
+ public:
+  TestVecs(size_t num_vecs, size_t num, uint32_t seed)
+      : num_(num),
+        stride_(num + 128),
+        vecs_(hwy::AllocateAligned<VecT>(num_vecs * stride_)),
+        floats_(num_vecs * stride_) {
+    HWY_ASSERT(vecs_);
+    std::mt19937 gen(seed);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    for (size_t i = 0; i < num_vecs * stride_; ++i) {
+      vecs_[i] = hwy::ConvertScalarTo<VecT>(dist(gen));
+      floats_[i] = hwy::ConvertScalarTo<float>(vecs_[i]);
+    }
+  }
+
+  const VecT* get() const { return vecs_.get(); }
+  size_t Stride() const { return stride_; }
+  const float* Floats(size_t b) const { return floats_.data() + b * stride_; }
+
+  // Returns the step of the int8 copy of vector b, see I8Codec::QuantizeVec.
+  float Int8Step(size_t b) const {
+    float max_abs = 0.0f;
+    for (size_t i = 0; i < num_; ++i) {
+      max_abs = HWY_MAX(max_abs, hwy::ScalarAbs(Floats(b)[i]));
+    }
+    return max_abs / 127.0f;
+  }
+
+ private:
+  size_t num_;
+  size_t stride_;
+  hwy::AlignedFreeUniquePtr<VecT[]> vecs_;
+  std::vector<float> floats_;
+};
+
+// Storage for an Int8Scratch of `num_vecs` vectors of `num` values, or a null
+// Int8Scratch if !enabled.
+class TestInt8 {
+ public:
+  TestInt8(bool enabled, size_t num_vecs, size_t num) {
+    if (!enabled) return;
+    values_ = hwy::AllocateAligned<int8_t>(num_vecs * num);
+    scales_ = hwy::AllocateAligned<float>(num_vecs);
+    HWY_ASSERT(values_ && scales_);
+    scratch_.values = values_.get();
+    scratch_.scales = scales_.get();
+  }
+
+  const Int8Scratch& Get() const { return scratch_; }
+
+ private:
+  hwy::AlignedFreeUniquePtr<int8_t[]> values_;
+  hwy::AlignedFreeUniquePtr<float[]> scales_;
+  Int8Scratch scratch_;
+};
+
+// Returns the step of the int8 copy of vector b, or zero if the kernels
+// multiply the f32/bf16 vectors, see detail::QuantizedVecs.
+template <typename MatT, typename VecT>
+float Int8Step(const TestVecs<VecT>& vecs, size_t b, size_t num_vecs,
+               const Int8Scratch& int8) {
+  const bool quantized =
+      UseInt8Activations<MatT>() && int8.values != nullptr && num_vecs >= 2;
+  return quantized ? vecs.Int8Step(b) : 0.0f;
+}
+
+// Expected value of one output and a bound on its error.
+struct Reference {
+  double value = 0.0;
+  double tolerance = 0.0;
+};
+
+// Adds to `ref` the dot product of `num` weights and vector values, and to
+// its tolerance a bound on the rounding errors of float accumulation plus,
+// if the vector was quantized with step `int8_step`, half a step per product.
+void AddDot(const float* w, const float* v, size_t num, float int8_step,
+            Reference& ref) {
+  double sum_abs = 0.0;
+  double sum_abs_w = 0.0;
+  for (size_t i = 0; i < num; ++i) {
+    ref.value += static_cast<double>(w[i]) * v[i];
+    sum_abs += hwy::ScalarAbs(static_cast<double>(w[i]) * v[i]);
+    sum_abs_w += hwy::ScalarAbs(w[i]);
+  }
+  ref.tolerance += 1E-4 * sum_abs + 0.501 * int8_step * sum_abs_w;
+}
+
+double ReferenceGelu(double x) {
+  const double arg = 0.797884560804236 * (x + 0.044715 * x * x * x);
+  return 0.5 * x * (1.0 + std::tanh(arg));
+}
+
+// Returns `num_vecs` rows of `stride` OutT, all set to kSentinel.
+template <typename OutT>
+hwy::AlignedFreeUniquePtr<OutT[]> SentinelOutputs(size_t num_vecs,
+                                                  size_t stride) {
+  hwy::AlignedFreeUniquePtr<OutT[]> out =
+      hwy::AllocateAligned<OutT>(num_vecs * stride);
+  HWY_ASSERT(out);
+  for (size_t i = 0; i < num_vecs * stride; ++i) {
+    out[i] = hwy::ConvertScalarTo<OutT>(kSentinel);
+  }
+  return out;
+}
+
+// Checks out[b * stride + r] against ref(b, r) for r < num, and that the
+// padding up to `stride` is unchanged.
+template <typename OutT, class RefFunc>
+void CheckOutputs(const char* kernel, const char* types, size_t num_vecs,
+                  const OutT* out, size_t num, size_t stride,
+                  const RefFunc& ref) {
+  const float sentinel =
+      hwy::ConvertScalarTo<float>(hwy::ConvertScalarTo<OutT>(kSentinel));
+  for (size_t b = 0; b < num_vecs; ++b) {
+    for (size_t r = 0; r < stride; ++r) {
+      const float actual = hwy::ConvertScalarTo<float>(out[b * stride + r]);
+      if (r >= num) {
+        HWY_ASSERT(actual == sentinel);
+        continue;
+      }
+      const Reference expected = ref(b, r);
+      if (!(hwy::ScalarAbs(expected.value - actual) <=
+            expected.tolerance + 1E-6)) {
+        fprintf(stderr, "%s %s vecs %zu: b %zu r %zu expected %f actual %f\n",
+                kernel, types, num_vecs, b, r, expected.value, actual);
+        HWY_ASSERT(false);
+      }
+    }
+  }
+}
+
+template <typename MatT, typename VecT>
+const char* TypeNames() {
+  static char names[32];
+  snprintf(names, sizeof(names), "%s*%s", TypeName(MatT()),
+           TypeName(VecT()));
+  return names;
+}
+
+// MatMul at a nonzero offset matches the reference for a single vector, which
+// uses MatVec, and for batches with and without int8 activations.
+template <typename MatT, typename VecT>
+void TestMatMul(const TestMatrix<MatT, (kRows + 1) * kCols>& mat,
+                hwy::ThreadPool& pool) {
+  // Skips the first row.
+  const size_t mat_ofs = kCols;
+  const float* rows = mat.decompressed.get() + mat_ofs;
+  const size_t out_stride = kRows + 3;
+  for (size_t num_vecs : {1, 3, 5}) {
+    for (bool with_int8 : {false, true}) {
+      const TestVecs<VecT> vecs(num_vecs, kCols, 2);
+      const TestInt8 int8(with_int8, num_vecs, kCols);
+      auto out = SentinelOutputs<float>(num_vecs, out_stride);
+      MatMul<kRows, kCols>(*mat.compressed, mat_ofs, vecs.get(), vecs.Stride(),
+                           num_vecs, out.get(), out_stride, pool, int8.Get());
+      CheckOutputs("MatMul", TypeNames<MatT, VecT>(), num_vecs, out.get(),
+                   kRows, out_stride, [&](size_t b, size_t r) {
+                     Reference ref;
+                     AddDot(rows + r * kCols, vecs.Floats(b), kCols,
+                            Int8Step<MatT>(vecs, b, num_vecs, int8.Get()),
+                            ref);
+                     return ref;
+                   });
+    }
+  }
+}
+
+template <typename MatT>
+void TestMatMulForVecs(hwy::ThreadPool& pool) {
+  const TestMatrix<MatT, (kRows + 1) * kCols> mat(1, pool);
+  TestMatMul<MatT, float>(mat, pool);
+  TestMatMul<MatT, hwy::bfloat16_t>(mat, pool);
+}
+
+void TestAllMatMul() {
+  hwy::ThreadPool pool(3);
+  TestMatMulForVecs<float>(pool);
+  TestMatMulForVecs<hwy::bfloat16_t>(pool);
+  TestMatMulForVecs<SfpStream>(pool);
+  TestMatMulForVecs<NuqStream>(pool);
+  TestMatMulForVecs<I8Stream>(pool);
+}
+
+// MatMulSum of two matrices, each multiplied with its half of the vectors.
+template <typename MatT, typename VecT>
+void TestMatMulSum(const TestMatrix<MatT, 2 * kRows * kCols>& mat,
+                   hwy::ThreadPool& pool) {
+  constexpr size_t kNumMats = 2;
+  const size_t out_stride = kRows + 3;
+  for (size_t num_vecs : {1, 3, 5}) {
+    for (bool with_int8 : {false, true}) {
+      const TestVecs<VecT> vecs(num_vecs, kNumMats * kCols, 3);
+      const TestInt8 int8(with_int8, num_vecs, kNumMats * kCols);
+      auto out = SentinelOutputs<float>(num_vecs, out_stride);
+      MatMulSum<kNumMats, kRows, kCols>(*mat.compressed, 0, vecs.get(),
+                                        vecs.Stride(), num_vecs, out.get(),
+                                        out_stride, pool, int8.Get());
+      CheckOutputs("MatMulSum", TypeNames<MatT, VecT>(), num_vecs, out.get(),
+                   kRows, out_stride, [&](size_t b, size_t r) {
+                     // Vectors are quantized as a whole.
+                     const float int8_step =
+                         Int8Step<MatT>(vecs, b, num_vecs, int8.Get());
+                     Reference ref;
+                     for (size_t k = 0; k < kNumMats; ++k) {
+                       AddDot(mat.decompressed.get() + (k * kRows + r) * kCols,
+                              vecs.Floats(b) + k * kCols, kCols, int8_step,
+                              ref);
+                     }
+                     return ref;
+                   });
+    }
+  }
+}
+
+template <typename MatT>
+void TestMatMulSumForVecs(hwy::ThreadPool& pool) {
+  const TestMatrix<MatT, 2 * kRows * kCols> mat(4, pool);
+  TestMatMulSum<MatT, float>(mat, pool);
+  TestMatMulSum<MatT, hwy::bfloat16_t>(mat, pool);
+}
+
+void TestAllMatMulSum() {
+  hwy::ThreadPool pool(3);
+  TestMatMulSumForVecs<float>(pool);
+  TestMatMulSumForVecs<hwy::bfloat16_t>(pool);
+  TestMatMulSumForVecs<SfpStream>(pool);
+  TestMatMulSumForVecs<NuqStream>(pool);
+  TestMatMulSumForVecs<I8Stream>(pool);
+}
+
+// The epilogue of MatMulPairs is called once for each row of the first half
+// of each block and vector, with pointers to the finished results of both
+// rows. It swaps them, so the output only matches if it ran last.
+template <typename MatT, typename VecT>
+void TestMatMulPairs(hwy::ThreadPool& pool) {
+  constexpr size_t kOuter = 512;
+  constexpr size_t kInner = 256;
+  constexpr size_t kBlock = 64;
+  constexpr size_t kHalf = kBlock / 2;
+  const TestMatrix<MatT, kOuter * kInner> mat(5, pool);
+  const size_t out_stride = kOuter + 3;
+  for (size_t num_vecs : {1, 3}) {
+    for (bool with_int8 : {false, true}) {
+      const TestVecs<VecT> vecs(num_vecs, kInner, 6);
+      const TestInt8 int8(with_int8, num_vecs, kInner);
+      auto out = SentinelOutputs<float>(num_vecs, out_stride);
+      // Distinct calls write distinct elements, hence no data race.
+      std::vector<size_t> calls(num_vecs * kOuter);
+      const auto epilogue = [&](size_t b, size_t block, size_t i, size_t num,
+                                float* lo, float* hi) {
+        float* out_b = out.get() + b * out_stride;
+        HWY_ASSERT(lo == out_b + block * kBlock + i);
+        HWY_ASSERT(hi == lo + kHalf);
+        for (size_t j = 0; j < num; ++j) {
+          ++calls[b * kOuter + block * kBlock + i + j];
+          const float tmp = lo[j];
+          lo[j] = hi[j];
+          hi[j] = tmp;
+        }
+      };
+      MatMulPairs<kOuter, kInner, kBlock>(*mat.compressed, 0, vecs.get(),
+                                          vecs.Stride(), num_vecs, out.get(),
+                                          out_stride, epilogue, pool,
+                                          int8.Get());
+      for (size_t b = 0; b < num_vecs; ++b) {
+        for (size_t r = 0; r < kOuter; ++r) {
+          const bool is_lo = r % kBlock < kHalf;
+          HWY_ASSERT(calls[b * kOuter + r] == (is_lo ? 1 : 0));
+        }
+      }
+      CheckOutputs("MatMulPairs", TypeNames<MatT, VecT>(), num_vecs,
+                   out.get(), kOuter, out_stride, [&](size_t b, size_t r) {
+                     const size_t swapped =
+                         r % kBlock < kHalf ? r + kHalf : r - kHalf;
+                     Reference ref;
+                     AddDot(mat.decompressed.get() + swapped * kInner,
+                            vecs.Floats(b), kInner,
+                            Int8Step<MatT>(vecs, b, num_vecs, int8.Get()),
+                            ref);
+                     return ref;
+                   });
+    }
+  }
+}
+
+void TestAllMatMulPairs() {
+  hwy::ThreadPool pool(3);
+  TestMatMulPairs<float, float>(pool);
+  TestMatMulPairs<hwy::bfloat16_t, float>(pool);
+  TestMatMulPairs<SfpStream, float>(pool);
+  TestMatMulPairs<NuqStream, float>(pool);
+  TestMatMulPairs<I8Stream, float>(pool);
+}
+
+// MatMulGatedGelu, also for more vectors than one group of the per-strip
+// buffers (kMaxVecs).
+template <typename MatT, typename VecT>
+void TestMatMulGatedGelu(const TestMatrix<MatT, 2 * kRows * kCols>& mat,
+                         hwy::ThreadPool& pool) {
+  constexpr size_t kHidden = kRows;
+  const size_t out_stride = kHidden + 3;
+  for (size_t num_vecs : {1, 3, 18}) {
+    for (bool with_int8 : {false, true}) {
+      const TestVecs<VecT> vecs(num_vecs, kCols, 7);
+      const TestInt8 int8(with_int8, num_vecs, kCols);
+      auto out = SentinelOutputs<hwy::bfloat16_t>(num_vecs, out_stride);
+      MatMulGatedGelu<kHidden, kCols>(*mat.compressed, 0, vecs.get(),
+                                      vecs.Stride(), num_vecs, out.get(),
+                                      out_stride, pool, int8.Get());
+      CheckOutputs(
+          "MatMulGatedGelu", TypeNames<MatT, VecT>(), num_vecs, out.get(),
+          kHidden, out_stride, [&](size_t b, size_t r) {
+            const float int8_step =
+                Int8Step<MatT>(vecs, b, num_vecs, int8.Get());
+            Reference gate;
+            Reference up;
+            AddDot(mat.decompressed.get() + r * kCols, vecs.Floats(b), kCols,
+                   int8_step, gate);
+            AddDot(mat.decompressed.get() + (kHidden + r) * kCols,
+                   vecs.Floats(b), kCols, int8_step, up);
+            const double gelu = ReferenceGelu(gate.value);
+            Reference ref;
+            ref.value = gelu * up.value;
+            // The derivative of GELU is at most 1.13. bf16 has 8 significant
+            // bits, and hn::Tanh is approximate.
+            ref.tolerance = 1.2 * gate.tolerance * hwy::ScalarAbs(up.value) +
+                            hwy::ScalarAbs(gelu) * up.tolerance +
+                            hwy::ScalarAbs(ref.value) / 128 + 1E-5;
+            return ref;
+          });
+    }
+  }
+}
+
+template <typename MatT>
+void TestMatMulGatedGeluForVecs(hwy::ThreadPool& pool) {
+  const TestMatrix<MatT, 2 * kRows * kCols> mat(8, pool);
+  TestMatMulGatedGelu<MatT, float>(mat, pool);
+  TestMatMulGatedGelu<MatT, hwy::bfloat16_t>(mat, pool);
+}
+
+void TestAllMatMulGatedGelu() {
+  hwy::ThreadPool pool(3);
+  TestMatMulGatedGeluForVecs<float>(pool);
+  TestMatMulGatedGeluForVecs<hwy::bfloat16_t>(pool);
+  TestMatMulGatedGeluForVecs<SfpStream>(pool);
+  TestMatMulGatedGeluForVecs<NuqStream>(pool);
+  TestMatMulGatedGeluForVecs<I8Stream>(pool);
+}
+
+// Random queries, keys and values for the attention tests.
+class TestAttention {
+ public:
+  static constexpr size_t kQKVDim = 128;
+
+  TestAttention(size_t num_positions, uint32_t seed)
+      : num_positions_(num_positions),
+        q_(hwy::AllocateAligned<float>(kQKVDim)),
+        keys_(hwy::AllocateAligned<float>(num_positions * kQKVDim)),
+        values_(hwy::AllocateAligned<float>(num_positions * kQKVDim)) {
+    HWY_ASSERT(q_ && keys_ && values_);
+    std::mt19937 gen(seed);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    for (size_t i = 0; i < kQKVDim; ++i) q_[i] = 0.5f * dist(gen);
+    for (size_t i = 0; i < num_positions * kQKVDim; ++i) {
+      keys_[i] = dist(gen);
+      values_[i] = dist(gen);
+    }
+    // Larger scores in the last positions, so that the max increases from
+    // tile to tile and the sums are rescaled.
+    for (size_t pos = num_positions / 2; pos < num_positions; ++pos) {
+      for (size_t i = 0; i < kQKVDim; ++i) keys_[pos * kQKVDim + i] *= 2.0f;
+    }
+  }
+
+  const float* Query() const { return q_.get(); }
+  const float* Key(size_t pos) const { return keys_.get() + pos * kQKVDim; }
+  const float* Value(size_t pos) const {
+    return values_.get() + pos * kQKVDim;
+  }
+
+  // As in AttentionBatch: calls AttendTile for page-sized tiles of the
+  // positions [begin, end), and leaves `out` unnormalized.
+  void Attend(size_t begin, size_t end, OnlineSoftmaxState& state,
+              float* HWY_RESTRICT out) const {
+    hwy::ZeroBytes(out, kQKVDim * sizeof(*out));
+    constexpr size_t kTile = 64;
+    HWY_ALIGN float scores[kTile];
+    for (size_t start = begin; start < end; start += kTile) {
+      const size_t num = HWY_MIN(kTile, end - start);
+      AttendTile<kQKVDim>(
+          Query(), num, [&](size_t i) { return Key(start + i); },
+          [&](size_t i) { return Value(start + i); }, scores, state, out);
+    }
+  }
+
+  // Checks `out` against a softmax over the scores of all positions,
+  // followed by the weighted sum of values.
+  void CheckOutput(const float* out) const {
+    std::vector<double> scores(num_positions_);
+    double max = -1E30;
+    for (size_t pos = 0; pos < num_positions_; ++pos) {
+      double score = 0.0;
+      for (size_t i = 0; i < kQKVDim; ++i) {
+        score += static_cast<double>(q_[i]) * Key(pos)[i];
+      }
+      scores[pos] = score;
+      max = HWY_MAX(max, score);
+    }
+    double sum = 0.0;
+    for (double& score : scores) {
+      score = std::exp(score - max);
+      sum += score;
+    }
+    for (size_t i = 0; i < kQKVDim; ++i) {
+      double expected = 0.0;
+      for (size_t pos = 0; pos < num_positions_; ++pos) {
+        expected += scores[pos] / sum * Value(pos)[i];
+      }
+      if (!(hwy::ScalarAbs(expected - out[i]) <= 1E-4)) {
+        fprintf(stderr, "Attention %zu: i %zu expected %f actual %f\n",
+                num_positions_, i, expected, out[i]);
+        HWY_ASSERT(false);
+      }
+    }
+  }
+
+ private:
+  size_t num_positions_;
+  hwy::AlignedFreeUniquePtr<float[]> q_;
+  hwy::AlignedFreeUniquePtr<float[]> keys_;
+  hwy::AlignedFreeUniquePtr<float[]> values_;
+};
+
+// A single pass over tiles, including a partial one, matches the softmax
+// over all scores.
+void TestAllOnlineSoftmax() {
+  for (size_t num_positions : {1, 64, 150}) {
+    const TestAttention attention(num_positions, 9);
+    OnlineSoftmaxState state;
+    auto out = hwy::AllocateAligned<float>(TestAttention::kQKVDim);
+    HWY_ASSERT(out);
+    attention.Attend(0, num_positions, state, out.get());
+    MulByConst(1.0f / state.sum, out.get(), TestAttention::kQKVDim);
+    attention.CheckOutput(out.get());
+  }
+}
+
+// Splitting the positions into ranges of whole pages, as AttentionBatch does
+// for decode, and merging their partial results matches the softmax over all
+// positions. Ranges beyond the end are empty.
+void TestAllMergeOnlineSoftmax() {
+  constexpr size_t kQKVDim = TestAttention::kQKVDim;
+  constexpr size_t kPositions = 150;
+  const TestAttention attention(kPositions, 10);
+  for (size_t split_positions : {64, 128, 192}) {
+    constexpr size_t kNumSplits = 3;
+    auto partial = hwy::AllocateAligned<float>(kNumSplits * kQKVDim);
+    auto out = hwy::AllocateAligned<float>(kQKVDim);
+    HWY_ASSERT(partial && out);
+    float stats[2 * kNumSplits];
+    for (size_t split = 0; split < kNumSplits; ++split) {
+      const size_t begin = HWY_MIN(split * split_positions, kPositions);
+      const size_t end = HWY_MIN(begin + split_positions, kPositions);
+      OnlineSoftmaxState state;
+      if (begin != end) {
+        attention.Attend(begin, end, state, partial.get() + split * kQKVDim);
+      }
+      stats[2 * split + 0] = state.max;
+      stats[2 * split + 1] = state.sum;
+    }
+    MergeOnlineSoftmax(partial.get(), stats, kNumSplits, kQKVDim, out.get());
+    attention.CheckOutput(out.get());
+  }
+}
+
+// TopK returns the k largest accepted values in decreasing order, also if
+// fewer than k are accepted.
+void TestAllTopK() {
+  constexpr size_t k = 8;
+  constexpr size_t kNum = 1003;  // not a multiple of the vector size
+  std::mt19937 gen(12);
+  std::normal_distribution<float> dist(0.0f, 1.0f);
+  std::vector<float> values(kNum);
+  for (float& value : values) value = dist(gen);
+
+  // Every other token, or only three.
+  for (int modulo : {2, 500}) {
+    const auto accept_token = [modulo](int token) {
+      return token % modulo == 1;
+    };
+    std::vector<std::pair<float, int>> accepted;
+    for (size_t i = 0; i < kNum; ++i) {
+      if (accept_token(static_cast<int>(i))) {
+        accepted.push_back({values[i], static_cast<int>(i)});
+      }
+    }
+    std::sort(accepted.begin(), accepted.end(),
+              std::greater<std::pair<float, int>>());
+
+    std::array<float, k> top_k{};
+    std::array<int, k> indices{};
+    const size_t found =
+        TopK<k>(values.data(), kNum, accept_token, top_k, indices);
+    HWY_ASSERT(found == HWY_MIN(k, accepted.size()));
+    for (size_t i = 0; i < found; ++i) {
+      HWY_ASSERT(top_k[i] == accepted[i].first);
+      HWY_ASSERT(indices[i] == accepted[i].second);
+    }
+  }
+}
+
+// Naive reference for SampleCandidates: sets `probs` to those of the `found`
+// candidates, which are sorted by decreasing logit, after a softmax with
+// `temperature`, dropping those below min_p times the most likely and then
+// all after the shortest prefix whose probabilities sum to at least top_p.
+// Returns false if a probability is too close to either threshold for the
+// result to be independent of rounding.
+bool ReferenceCandidates(const float* logits, size_t found, float temperature,
+                         float top_p, float min_p, std::vector<double>& probs) {
+  constexpr double kMargin = 1E-4;
+  const auto normalize = [&probs]() {
+    double sum = 0.0;
+    for (double prob : probs) sum += prob;
+    for (double& prob : probs) prob /= sum;
+  };
+
+  probs.resize(found);
+  for (size_t i = 0; i < found; ++i) {
+    probs[i] = std::exp(static_cast<double>(logits[i]) / temperature);
+  }
+  normalize();
+
+  if (min_p > 0.0f) {
+    const double min_prob = min_p * probs[0];
+    for (double& prob : probs) {
+      if (hwy::ScalarAbs(prob - min_prob) < kMargin * probs[0]) return false;
+      if (prob < min_prob) prob = 0.0;
+    }
+    normalize();
+  }
+
+  if (top_p < 1.0f) {
+    double cumulative = 0.0;
+    for (double& prob : probs) {
+      if (cumulative >= top_p) {
+        prob = 0.0;
+        continue;
+      }
+      cumulative += prob;
+      if (hwy::ScalarAbs(cumulative - top_p) < kMargin) return false;
+    }
+    normalize();
+  }
+  return true;
+}
+
+// SampleCandidates only returns candidates that survive min_p and top_p, with
+// their probability, and at the expected frequencies.
+void TestAllSampleCandidates() {
+  constexpr size_t k = 8;
+  constexpr size_t kSamples = 2000;
+  std::mt19937 gen(13);
+  std::normal_distribution<float> logit_dist(0.0f, 2.0f);
+  std::uniform_real_distribution<float> unit_dist(0.0f, 1.0f);
+  std::array<int, k> indices;
+  for (size_t i = 0; i < k; ++i) indices[i] = static_cast<int>(100 + i);
+
+  size_t num_checked = 0;
+  for (size_t rep = 0; rep < 200; ++rep) {
+    const size_t found = 1 + rep % k;
+    std::array<float, k> logits{};
+    for (size_t i = 0; i < found; ++i) logits[i] = logit_dist(gen);
+    std::sort(logits.begin(), logits.begin() + found, std::greater<float>());
+    const float temperature = 0.5f + 1.5f * unit_dist(gen);
+    const float top_p = rep % 3 == 0 ? 1.0f : 0.3f + 0.6f * unit_dist(gen);
+    const float min_p = rep % 2 == 0 ? 0.0f : 0.2f * unit_dist(gen);
+    std::vector<double> expected;
+    if (!ReferenceCandidates(logits.data(), found, temperature, top_p, min_p,
+                             expected)) {
+      continue;
+    }
+    ++num_checked;
+
+    std::vector<size_t> counts(found);
+    for (size_t sample = 0; sample < kSamples; ++sample) {
+      std::array<float, k> top_k = logits;  // overwritten
+      float prob;
+      const int token = SampleCandidates<k>(top_k, indices, found, gen,
+                                            temperature, prob, top_p, min_p);
+      HWY_ASSERT(token >= indices[0]);
+      const size_t i = static_cast<size_t>(token - indices[0]);
+      HWY_ASSERT(i < found);
+      HWY_ASSERT(expected[i] != 0.0);
+      HWY_ASSERT(hwy::ScalarAbs(prob - expected[i]) < 1E-5);
+      ++counts[i];
+    }
+    for (size_t i = 0; i < found; ++i) {
+      const double frequency = static_cast<double>(counts[i]) / kSamples;
+      HWY_ASSERT(hwy::ScalarAbs(frequency - expected[i]) < 0.06);
+    }
+  }
+  // Only few are too close to a threshold.
+  HWY_ASSERT(num_checked > 150);
+
+  // Greedy: temperature zero selects the largest logit.
+  std::array<float, k> top_k = {3.0f, 2.0f, 1.0f};
+  float prob = 0.0f;
+  HWY_ASSERT(SampleCandidates<k>(top_k, indices, 3, gen, 0.0f, prob) ==
+             indices[0]);
+  HWY_ASSERT(prob == 1.0f);
+}
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace gcpp
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+
+namespace gcpp {
+HWY_BEFORE_TEST(OpsTest);
+HWY_EXPORT_AND_TEST_P(OpsTest, TestAllMatMul);
+HWY_EXPORT_AND_TEST_P(OpsTest, TestAllMatMulSum);
+HWY_EXPORT_AND_TEST_P(OpsTest, TestAllMatMulPairs);
+HWY_EXPORT_AND_TEST_P(OpsTest, TestAllMatMulGatedGelu);
+HWY_EXPORT_AND_TEST_P(OpsTest, TestAllOnlineSoftmax);
+HWY_EXPORT_AND_TEST_P(OpsTest, TestAllMergeOnlineSoftmax);
+HWY_EXPORT_AND_TEST_P(OpsTest, TestAllTopK);
+HWY_EXPORT_AND_TEST_P(OpsTest, TestAllSampleCandidates);
+}  // namespace gcpp
+
+#endif
@@ -16,6 +16,7 @@
 // Command line text interface to gemma.
 
 #include <ctime>
+#include <filesystem>  // NOLINT
 #include <iostream>
 #include <random>
 #include <string>
@@ -30,6 +31,8 @@
 #include "util/app.h"
 // copybara:import_next_line:gemma_cpp
 #include "util/args.h"  // HasHelp
+// copybara:import_next_line:gemma_cpp
+#include "util/topology.h"  // CPUForThread
 #include "hwy/base.h"
 #include "hwy/contrib/thread_pool/thread_pool.h"
 #include "hwy/highway.h"
@@ -54,7 +57,8 @@ void ShowHelp(gcpp::LoaderArgs& loader, gcpp::InferenceArgs& inference,
   fprintf(stderr, "\n\n");
 }
 
-void ShowConfig(LoaderArgs& loader, InferenceArgs& inference, AppArgs& app) {
+void ShowConfig(LoaderArgs& loader, InferenceArgs& inference, AppArgs& app,
+                const gcpp::Gemma& model) {
   loader.Print(app.verbosity);
   inference.Print(app.verbosity);
   app.Print(app.verbosity);
@@ -71,9 +75,15 @@ void ShowConfig(LoaderArgs& loader, InferenceArgs& inference, AppArgs& app) {
               << hwy::TargetName(hwy::DispatchedTarget()) << " ("
               << hwy::VectorBytes() * 8 << " bits)" << "\n"
               << "Weight Type                   : "
-              << gcpp::TypeName(gcpp::WeightT()) << "\n"
+              << gcpp::WeightTypeName(model.weight_type) << "\n"
               << "EmbedderInput Type            : "
-              << gcpp::TypeName(gcpp::EmbedderInputT()) << "\n";
+              << gcpp::TypeName(gcpp::EmbedderInputT()) << "\n"
+              << "Int8 Activations              : "
+              << (model.weight_type == gcpp::WeightType::kI8 &&
+                          gcpp::UsesInt8Activations()
+                      ? "yes"
+                      : "no")
+              << "\n";
   }
 }
 
@@ -81,19 +91,23 @@ void ShowConfig(LoaderArgs& loader, InferenceArgs& inference, AppArgs& app) {
  * @brief 执行Gemma REPL循环。(read-eval-print loop)
  * 
  * @param model Gemma模型对象。
+ * @param session 会话对象，持有KV缓存和激活值。
  * @param pool 线程池对象。
  * @param inner_pool 内部线程池对象。
  * @param args 推理参数对象。
  * @param verbosity 详细程度。
  * @param accept_token 接受令牌的函数。
  */
-void ReplGemma(gcpp::Gemma& model, hwy::ThreadPool& pool,
-               hwy::ThreadPool& inner_pool, const InferenceArgs& args,
-               int verbosity, const gcpp::AcceptFunc& accept_token) {
+void ReplGemma(const gcpp::Gemma& model, gcpp::Session& session,
+               hwy::ThreadPool& pool, hwy::ThreadPool& inner_pool,
+               const InferenceArgs& args, int verbosity,
+               const gcpp::AcceptFunc& accept_token) {
   PROFILER_ZONE("Gen.misc");
   int abs_pos = 0;      // absolute token index over all turns
   int current_pos = 0;  // token index within the current turn
   int prompt_size{};
+  // Lets new conversations (abs_pos = 0) reuse the prefill of earlier ones.
+  gcpp::PrefixCache prefix_cache;
 
   std::mt19937 gen;
   if (args.deterministic) {
@@ -103,6 +117,21 @@ void ReplGemma(gcpp::Gemma& model, hwy::ThreadPool& pool,
     gen.seed(rd());
   }
 
+  // Resume the session saved by an earlier process instead of prefilling it.
+  const gcpp::Path& kv_cache_file = args.kv_cache_file;
+  if (!kv_cache_file.path.empty() &&
+      std::filesystem::exists(kv_cache_file.path)) {
+    size_t num_positions = 0;
+    if (gcpp::LoadKVCache(kv_cache_file, session.GetKVCache(), num_positions,
+                          pool)) {
+      abs_pos = static_cast<int>(num_positions);
+      if (verbosity >= 1) {
+        std::cout << "[ Restored " << abs_pos << " tokens from "
+                  << kv_cache_file.path << " ]" << std::endl;
+      }
+    }
+  }
+
   // callback function invoked for each generated token.
   auto stream_token = [&abs_pos, &current_pos, &args, &gen, &prompt_size,
                        tokenizer = &model.Tokenizer(),
@@ -183,14 +212,21 @@ void ReplGemma(gcpp::Gemma& model, hwy::ThreadPool& pool,
     std::cerr << std::endl << "[ Reading prompt ] " << std::flush;
 
     const double time_start = hwy::platform::Now();
-    GenerateGemma(model, args, prompt, abs_pos, pool, inner_pool, stream_token,
-                  accept_token, gen, verbosity);
+    gcpp::GenerationMetrics metrics;
+    metrics.layer_times = verbosity >= 3;
+    GenerateGemma(model, session, args, prompt, abs_pos, pool, inner_pool,
+                  stream_token, accept_token, gen, verbosity, &prefix_cache,
+                  &metrics);
     const double time_end = hwy::platform::Now();
     const double tok_sec = current_pos / (time_end - time_start);
     if (verbosity >= 2) {
       std::cout << current_pos << " tokens (" << abs_pos << " total tokens)"
                 << std::endl
-                << tok_sec << " tokens / sec" << std::endl;
+                << tok_sec << " tokens / sec" << std::endl
+                << "[ Metrics ] " << metrics.ToJSON() << std::endl;
+    }
+    if (!kv_cache_file.path.empty()) {
+      gcpp::SaveKVCache(session.GetKVCache(), abs_pos, kv_cache_file, pool);
     }
     std::cout << std::endl << std::endl;
   }
@@ -205,20 +241,28 @@ void Run(LoaderArgs& loader, InferenceArgs& inference, AppArgs& app) {
 
   hwy::ThreadPool inner_pool(0);
   hwy::ThreadPool pool(app.num_threads);
-  // For many-core, pinning threads to cores helps.
+  // For many-core, pinning threads to cores helps. Neighboring threads are
+  // kept on the same NUMA node.
   if (app.num_threads > 10) {
-    PinThreadToCore(app.num_threads - 1);  // Main thread
+    const size_t num_threads = app.num_threads;
+    PinThreadToCore(CPUForThread(num_threads - 1, num_threads));  // Main
 
     pool.Run(0, pool.NumThreads(),
-             [](uint64_t /*task*/, size_t thread) { PinThreadToCore(thread); });
+             [num_threads](uint64_t /*task*/, size_t thread) {
+               PinThreadToCore(CPUForThread(thread, num_threads));
+             });
   }
 
   gcpp::Gemma model(loader, pool);
+  gcpp::Session session(model);
 
   if (const char* error = inference.Validate()) {
     ShowHelp(loader, inference, app);
     HWY_ABORT("\nInvalid args: %s", error);
   }
+  if (inference.kv_window != 0) {
+    session.GetKVCache().SetWindow(inference.kv_sinks, inference.kv_window);
+  }
 
   if (app.verbosity >= 1) {
     static const std::string banner_ascii_art =
@@ -241,11 +285,11 @@ void Run(LoaderArgs& loader, InferenceArgs& inference, AppArgs& app) {
 
     std::cout << "\033[2J\033[1;1H"  // clear screen
               << banner_ascii_art << "\n\n";
-    ShowConfig(loader, inference, app);
+    ShowConfig(loader, inference, app, model);
     std::cout << "\n" << instructions << "\n";
   }
 
-  ReplGemma(model, pool, inner_pool, inference, app.verbosity,
+  ReplGemma(model, session, pool, inner_pool, inference, app.verbosity,
             /*accept_token=*/[](int) { return true; });
 }
 
@@ -69,7 +69,8 @@ class AppArgs : public ArgsBase<AppArgs> {
     visitor(verbosity, "verbosity", 1,
             "Show verbose developer information\n   0 = only print generation "
             "output\n   1 = standard user-facing terminal ui\n   2 = show "
-            "developer/debug info).\n   Default = 1.",
+            "developer/debug info)\n   3 = also time each layer.\n"
+            "   Default = 1.",
             2);
     visitor(num_threads, "num_threads",
             kDefaultNumThreads,  // see ChooseNumThreads
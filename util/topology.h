@@ -0,0 +1,153 @@
+// Copyright 2024 Google LLC
+// SPDX-License-Identifier: Apache-2.0
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// NUMA topology: which logical CPUs belong to which memory node, and placing
+// memory across nodes. Linux only; elsewhere there is a single node.
+
+#ifndef THIRD_PARTY_GEMMA_CPP_UTIL_TOPOLOGY_H_
+#define THIRD_PARTY_GEMMA_CPP_UTIL_TOPOLOGY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "hwy/base.h"
+
+#if HWY_OS_LINUX
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace gcpp {
+
+struct NUMATopology {
+  std::vector<size_t> node_ids;            // as used by the OS
+  std::vector<std::vector<size_t>> cpus;  // logical CPUs of each node
+};
+
+namespace detail {
+
+// Parses lists such as "0-15,32-47\n" as used by sysfs. Returns false if the
+// file cannot be read.
+static inline bool ReadIndexList(const std::string& path,
+                                 std::vector<size_t>& indices) {
+  FILE* f = fopen(path.c_str(), "r");
+  if (f == nullptr) return false;
+  char buf[4096];
+  const size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[len] = '\0';
+
+  indices.clear();
+  const char* p = buf;
+  while (*p >= '0' && *p <= '9') {
+    char* end;
+    const size_t first = strtoul(p, &end, 10);
+    size_t last = first;
+    if (*end == '-') last = strtoul(end + 1, &end, 10);
+    for (size_t i = first; i <= last; ++i) indices.push_back(i);
+    p = (*end == ',') ? end + 1 : end;
+  }
+  return !indices.empty();
+}
+
+static inline NUMATopology DetectTopology() {
+  NUMATopology topology;
+  const std::string kNodes = "/sys/devices/system/node/";
+  std::vector<size_t> node_ids;
+  if (ReadIndexList(kNodes + "online", node_ids)) {
+    for (size_t node : node_ids) {
+      std::vector<size_t> cpus;
+      if (!ReadIndexList(kNodes + "node" + std::to_string(node) + "/cpulist",
+                         cpus)) {
+        continue;  // memory-only node
+      }
+      topology.node_ids.push_back(node);
+      topology.cpus.push_back(std::move(cpus));
+    }
+  }
+  if (topology.cpus.empty()) {
+    const size_t num_cpus =
+        HWY_MAX(1u, static_cast<size_t>(std::thread::hardware_concurrency()));
+    topology.node_ids.push_back(0);
+    topology.cpus.emplace_back(num_cpus);
+    for (size_t i = 0; i < num_cpus; ++i) topology.cpus[0][i] = i;
+  }
+  return topology;
+}
+
+}  // namespace detail
+
+// Detected once, then cached.
+static inline const NUMATopology& Topology() {
+  static const NUMATopology topology = detail::DetectTopology();
+  return topology;
+}
+
+// Returns the logical CPU for `thread` of `num_threads` threads. Threads are
+// divided evenly among the nodes, each node receiving a contiguous range, so
+// that threads with nearby indices share a node and its caches.
+static inline size_t CPUForThread(size_t thread, size_t num_threads) {
+  const NUMATopology& topology = Topology();
+  const size_t num_nodes = topology.cpus.size();
+  const size_t node = HWY_MIN(thread * num_nodes / num_threads, num_nodes - 1);
+  // First thread assigned to `node`: the smallest t with
+  // t * num_nodes / num_threads == node.
+  const size_t first = hwy::DivCeil(node * num_threads, num_nodes);
+  const std::vector<size_t>& cpus = topology.cpus[node];
+  return cpus[(thread - first) % cpus.size()];
+}
+
+// Asks the OS to spread the pages of [ptr, ptr + bytes) round-robin across all
+// nodes, so that every memory controller contributes bandwidth no matter which
+// thread reads them. Only affects pages not yet touched, and only whole pages
+// within the range, so that neighboring allocations keep their policy.
+// Best-effort, and a no-op on single-node systems.
+static inline void InterleaveAcrossNodes(void* ptr, size_t bytes) {
+#if HWY_OS_LINUX && defined(SYS_mbind)
+  const NUMATopology& topology = Topology();
+  if (topology.node_ids.size() < 2 || bytes == 0) return;
+  constexpr size_t kBitsPerWord = 64;
+  const size_t max_node = topology.node_ids.back();
+  std::vector<uint64_t> mask(max_node / kBitsPerWord + 1);
+  for (size_t node : topology.node_ids) {
+    mask[node / kBitsPerWord] |= 1ULL << (node % kBitsPerWord);
+  }
+  // mbind requires a page-aligned start and applies to entire pages, so
+  // round the start up and the end down.
+  const uintptr_t page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+  const uintptr_t begin =
+      (reinterpret_cast<uintptr_t>(ptr) + page_size - 1) & ~(page_size - 1);
+  const uintptr_t end =
+      (reinterpret_cast<uintptr_t>(ptr) + bytes) & ~(page_size - 1);
+  if (end <= begin) return;
+  constexpr int kMpolInterleave = 3;  // MPOL_INTERLEAVE in linux/mempolicy.h
+  (void)syscall(SYS_mbind, begin, end - begin, kMpolInterleave, mask.data(),
+                mask.size() * kBitsPerWord, 0u);
+#else
+  (void)ptr;
+  (void)bytes;
+#endif
+}
+
+}  // namespace gcpp
+
+#endif  // THIRD_PARTY_GEMMA_CPP_UTIL_TOPOLOGY_H_